@@ -0,0 +1,295 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Asynchronous read benchmark: 1, 8 and 64 emulated CD devices, each on
+   its own bulk-only transport, issue random reads against an image whose
+   pages were dropped from the page cache. The reads are served once from
+   the mapping, blocking the main loop on every page fault, and once
+   through the shared #SpiceCdAio, which keeps a read of every device in
+   flight. Reports throughput, the longest main loop stall and how the
+   reads were batched.
+
+   usage: bench-cd-aio [IMAGE]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, a 256 MiB image is generated
+   without one. SPICE_CD_AIO_THREADS=1 measures the thread pool fallback
+   where io_uring is available.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cd-usb-bulk-msd.h"
+#include "bench-util.h"
+
+#define TRANSFER_SIZE     (64 * 1024)
+#define BENCH_READ_BLOCKS 16      /* 32 KiB, as a guest paging in files */
+#define BENCH_READS       4096    /* per pass, over all the devices */
+
+typedef struct {
+    SpiceCdScsiLunState state;
+    SpiceCdUsbBulkMsd *msd;
+    guint32 tag;
+    gboolean waiting;   /* for the ready function */
+} BenchDevice;
+
+typedef struct {
+    GRand *rand;        /* one sequence of reads, whatever device gets them */
+    guint64 n_blocks;
+    guint issued;
+    guint completed;
+    guint64 bytes;
+    gint64 max_stall;   /* longest call into the emulation, us */
+    guint64 sink;
+} BenchPass;
+
+static inline void put_le32(guint8 *p, guint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_be32(guint8 *p, guint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static gboolean bench_get_lun(gpointer user_data, guint lun, SpiceCdScsiLunState *state)
+{
+    BenchDevice *dev = user_data;
+
+    if (lun != 0) {
+        return FALSE;
+    }
+    *state = dev->state;
+    return TRUE;
+}
+
+static const SpiceCdScsiTargetOps bench_ops = {
+    .get_lun = bench_get_lun,
+};
+
+/* send the data-in phase and the status of the command in progress */
+static void bench_drain(BenchDevice *dev, BenchPass *pass)
+{
+    GOutputVector vector;
+    gboolean csw = FALSE;
+
+    while (!csw && spice_cd_usb_bulk_msd_read(dev->msd, TRANSFER_SIZE, &vector)) {
+        const guint8 *p = vector.buffer;
+
+        if (vector.size == SPICE_CD_USB_BULK_MSD_CSW_SIZE && memcmp(p, "USBS", 4) == 0) {
+            if (p[12] != 0) {
+                g_error("READ failed");
+            }
+            csw = TRUE;
+        } else if (vector.size > 0) {
+            pass->sink += p[0] + p[vector.size - 1];
+            pass->bytes += vector.size;
+        }
+    }
+    if (!csw) {
+        g_error("no CSW");
+    }
+    pass->completed++;
+}
+
+/* READ(10) of a random range, FALSE if it has to wait for its data */
+static gboolean bench_issue(BenchDevice *dev, BenchPass *pass)
+{
+    guint8 cbw[SPICE_CD_USB_BULK_MSD_CBW_SIZE] = { 'U', 'S', 'B', 'C' };
+    guint32 lba = g_rand_int_range(pass->rand, 0, pass->n_blocks - BENCH_READ_BLOCKS);
+    GError *err = NULL;
+    gint64 start;
+
+    put_le32(cbw + 4, ++dev->tag);
+    put_le32(cbw + 8, BENCH_READ_BLOCKS * SPICE_CD_IMAGE_BLOCK_SIZE);
+    cbw[12] = 0x80;
+    cbw[14] = 10;
+    cbw[15] = 0x28;
+    put_be32(cbw + 17, lba);
+    cbw[23] = BENCH_READ_BLOCKS;
+    pass->issued++;
+
+    start = g_get_monotonic_time();
+    if (!spice_cd_usb_bulk_msd_write(dev->msd, cbw, sizeof(cbw), &err)) {
+        g_error("CBW rejected: %s", err->message);
+    }
+    dev->waiting = dev->state.aio != NULL;
+    if (!dev->waiting) {
+        bench_drain(dev, pass);
+    }
+    pass->max_stall = MAX(pass->max_stall, g_get_monotonic_time() - start);
+    return !dev->waiting;
+}
+
+static BenchPass *current_pass;
+
+static void bench_ready(SpiceCdUsbBulkMsd *msd, gpointer user_data)
+{
+    BenchDevice *dev = user_data;
+    gint64 start = g_get_monotonic_time();
+
+    g_assert(dev->msd == msd && dev->waiting);
+    dev->waiting = FALSE;
+    bench_drain(dev, current_pass);
+    if (current_pass->issued < BENCH_READS) {
+        bench_issue(dev, current_pass);
+    }
+    current_pass->max_stall = MAX(current_pass->max_stall, g_get_monotonic_time() - start);
+}
+
+/* the pages of a file still mapped would stay */
+/* random data, as compressed files */
+static void fill_random(guint8 *block, guint64 lba, gpointer user_data)
+{
+    gsize i;
+
+    for (i = 0; i < SPICE_CD_IMAGE_BLOCK_SIZE; i += sizeof(guint32)) {
+        *(guint32 *)(block + i) = g_rand_int(user_data);
+    }
+}
+
+static SpiceCdImage *open_cold(const gchar *path)
+{
+    GError *err = NULL;
+    SpiceCdImage *image;
+    gint fd = open(path, O_RDONLY);
+
+    if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+        g_warning("page cache of %s not dropped", path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_error("%s", err->message);
+    }
+    return image;
+}
+
+static void run(const gchar *path, guint n_devices, SpiceCdAio *aio)
+{
+    SpiceCdImage *image = open_cold(path);
+    BenchDevice *devs = g_new0(BenchDevice, n_devices);
+    BenchPass pass = {
+        .rand = g_rand_new_with_seed(1),
+        .n_blocks = spice_cd_image_get_n_blocks(image),
+    };
+    SpiceCdAioStats before, after;
+    gint64 start, elapsed;
+    guint i;
+
+    for (i = 0; i < n_devices; i++) {
+        devs[i].state.vendor = "RedHat";
+        devs[i].state.product = "Redir DVD";
+        devs[i].state.loaded = TRUE;
+        devs[i].state.image = image;
+        devs[i].state.aio = aio;
+        devs[i].msd = spice_cd_usb_bulk_msd_new(spice_cd_scsi_target_new(&bench_ops, &devs[i]), 0);
+        if (aio != NULL) {
+            spice_cd_usb_bulk_msd_set_ready_func(devs[i].msd, bench_ready, &devs[i]);
+        }
+    }
+    if (aio != NULL) {
+        spice_cd_aio_get_stats(aio, &before);
+    }
+    current_pass = &pass;
+
+    start = g_get_monotonic_time();
+    if (aio == NULL) {
+        /* one device after the other, every read completes on the spot */
+        for (i = 0; pass.issued < BENCH_READS; i = (i + 1) % n_devices) {
+            bench_issue(&devs[i], &pass);
+        }
+    } else {
+        /* every device starts a read, the completions start the next ones */
+        for (i = 0; i < n_devices && pass.issued < BENCH_READS; i++) {
+            bench_issue(&devs[i], &pass);
+        }
+        while (pass.completed < BENCH_READS) {
+            g_main_context_iteration(NULL, TRUE);
+        }
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_print("%-8s %2u devices: %8.1f MB/s %8.0f reads/s  max stall %7" G_GINT64_FORMAT " us",
+            aio != NULL ? spice_cd_aio_get_backend(aio) : "mapping", n_devices,
+            (double)pass.bytes / elapsed, pass.completed / (elapsed / 1e6), pass.max_stall);
+    if (aio != NULL) {
+        spice_cd_aio_get_stats(aio, &after);
+        g_print("  %5.1f reads/batch, %u in flight",
+                (double)(after.reads - before.reads) / MAX(after.batches - before.batches, 1),
+                after.max_in_flight);
+    }
+    g_print(" (%x)\n", (guint)(pass.sink & 0xff));
+
+    for (i = 0; i < n_devices; i++) {
+        spice_cd_usb_bulk_msd_free(devs[i].msd);
+    }
+    g_free(devs);
+    g_rand_free(pass.rand);
+    spice_cd_image_unref(image);
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    static const guint n_devices[] = { 1, 8, 64 };
+    gchar *tmp_path = NULL;
+    SpiceCdImage *image;
+    SpiceCdAio *aio;
+    GError *err = NULL;
+    guint i;
+
+    if (path == NULL || *path == '\0') {
+        GRand *rand = g_rand_new_with_seed(7);
+
+        path = tmp_path = bench_make_image("bench-cd-aio", 256 * 1024 * 1024,
+                                           fill_random, rand);
+        g_rand_free(rand);
+    }
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_error("%s", err->message);
+    }
+    if (spice_cd_image_get_fd(image) < 0) {
+        g_printerr("%s is packed, its reads are not asynchronous\n", path);
+        return 1;
+    }
+    spice_cd_image_unref(image);
+
+    aio = spice_cd_aio_new(0);
+    for (i = 0; i < G_N_ELEMENTS(n_devices); i++) {
+        run(path, n_devices[i], NULL);
+        run(path, n_devices[i], aio);
+    }
+    spice_cd_aio_free(aio);
+
+    if (tmp_path != NULL) {
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Throughput benchmark for the mapped CD image backing: reads a local
+   image front to back in fixed size requests, as a guest streaming the
+   disc would, and reports MB/s and per-read latency percentiles.
+
+   usage: bench-cd-image [IMAGE [READ_KIB]]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, the benchmark is skipped
+   without one. The first pass drops the image from the page cache.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include "cd-image.h"
+#include "bench-util.h"
+
+static guint64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static void bench_pass(const gchar *name, SpiceCdImage *image, guint32 blocks_per_read)
+{
+    guint64 n_blocks = spice_cd_image_get_n_blocks(image);
+    guint n_reads = (n_blocks + blocks_per_read - 1) / blocks_per_read;
+    guint64 *latency = g_new(guint64, n_reads);
+    guint64 lba, start, elapsed, sum = 0;
+    gsize bytes = 0;
+    guint i = 0;
+
+    start = now_ns();
+    for (lba = 0; lba < n_blocks; lba += blocks_per_read) {
+        guint32 n = MIN(blocks_per_read, n_blocks - lba);
+        const guint64 *data;
+        guint64 t0 = now_ns();
+        gsize j;
+
+        data = (const guint64 *)spice_cd_image_peek_blocks(image, lba, n, NULL);
+        /* a consumer touches every cache line of the data it sends */
+        for (j = 0; j < n * SPICE_CD_IMAGE_BLOCK_SIZE / sizeof(guint64); j += 8) {
+            sum += data[j];
+        }
+        latency[i++] = now_ns() - t0;
+        bytes += n * SPICE_CD_IMAGE_BLOCK_SIZE;
+    }
+    elapsed = now_ns() - start;
+
+    qsort(latency, n_reads, sizeof(guint64), bench_compare_u64);
+    g_print("%-5s read:%4u KiB %9.1f MB/s  p50:%8.1f us  p99:%8.1f us  max:%8.1f us  (%02x)\n",
+            name, blocks_per_read * SPICE_CD_IMAGE_BLOCK_SIZE / 1024,
+            bytes / (elapsed / 1e9) / 1e6,
+            latency[n_reads / 2] / 1e3,
+            latency[MIN(n_reads - 1, (guint64)n_reads * 99 / 100)] / 1e3,
+            latency[n_reads - 1] / 1e3,
+            (guint)(sum & 0xff));
+    g_free(latency);
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    guint read_kib = argc > 2 ? atoi(argv[2]) : 64;
+    SpiceCdImage *image;
+    GError *err = NULL;
+
+    if (path == NULL || *path == '\0') {
+        g_print("skipped, no image: bench-cd-image IMAGE [READ_KIB] "
+                "or SPICE_BENCH_CD_IMAGE=IMAGE\n");
+        return 0;
+    }
+    if (read_kib < 2 || read_kib % 2 != 0) {
+        g_printerr("READ_KIB must be a multiple of the 2 KiB block size\n");
+        return 1;
+    }
+
+    bench_drop_cache(path);
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    g_print("%s: %" G_GUINT64_FORMAT " MB\n", path, spice_cd_image_get_size(image) / 1000000);
+
+    bench_pass("cold", image, read_kib * 1024 / SPICE_CD_IMAGE_BLOCK_SIZE);
+    bench_pass("warm", image, read_kib * 1024 / SPICE_CD_IMAGE_BLOCK_SIZE);
+
+    spice_cd_image_unref(image);
+    return 0;
+}
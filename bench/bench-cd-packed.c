@@ -0,0 +1,204 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Packed image benchmark: packs a local image, checks that the packed
+   copy reads back the same, then compares sequential and random read
+   throughput of the plain and the packed image, with the page cache
+   warm so only the inflating and the chunk cache are measured.
+
+   usage: bench-cd-packed [IMAGE [CHUNK_KIB]]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, a 64 MiB image, half of it
+   compressible, is generated without one.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cd-readahead.h"
+#include "bench-util.h"
+
+#define BENCH_SEQ_BLOCKS     32     /* 64 KiB, as a streaming guest */
+#define BENCH_RANDOM_READS   4096
+#define BENCH_RANDOM_MAX     16     /* 2 to 32 KiB, as directory lookups */
+#define BENCH_VERIFY_BLOCKS  512
+
+/* text-like blocks alternating with random ones */
+static void fill_mixed(guint8 *block, guint64 lba, gpointer user_data)
+{
+    static const gchar text[] = "usr/share/doc/package/changelog.Debian.gz ";
+    gsize i;
+
+    for (i = 0; i < SPICE_CD_IMAGE_BLOCK_SIZE; i++) {
+        block[i] = (lba / 16) % 2 ? text[(i + lba) % (sizeof(text) - 1)]
+                                  : (guint8)g_rand_int(user_data);
+    }
+}
+
+static SpiceCdImage *open_image(const gchar *path)
+{
+    GError *err = NULL;
+    SpiceCdImage *image = spice_cd_image_open(path, &err);
+
+    if (image == NULL) {
+        g_error("%s", err->message);
+    }
+    return image;
+}
+
+static void verify(const gchar *path, const gchar *packed_path)
+{
+    SpiceCdImage *image = open_image(path), *packed = open_image(packed_path);
+    guint64 n_blocks = spice_cd_image_get_n_blocks(image), lba;
+    guint8 *a = g_malloc(BENCH_VERIFY_BLOCKS * SPICE_CD_IMAGE_BLOCK_SIZE);
+    guint8 *b = g_malloc(BENCH_VERIFY_BLOCKS * SPICE_CD_IMAGE_BLOCK_SIZE);
+    GError *err = NULL;
+
+    if (spice_cd_image_get_n_blocks(packed) != n_blocks) {
+        g_error("%s: %" G_GUINT64_FORMAT " blocks, %s has %" G_GUINT64_FORMAT,
+                packed_path, spice_cd_image_get_n_blocks(packed), path, n_blocks);
+    }
+    for (lba = 0; lba < n_blocks; lba += BENCH_VERIFY_BLOCKS) {
+        guint32 n = MIN(BENCH_VERIFY_BLOCKS, n_blocks - lba);
+
+        if (!spice_cd_image_read_blocks(image, lba, n, a, &err) ||
+            !spice_cd_image_read_blocks(packed, lba, n, b, &err)) {
+            g_error("%s", err->message);
+        }
+        if (memcmp(a, b, (gsize)n * SPICE_CD_IMAGE_BLOCK_SIZE) != 0) {
+            g_error("%s differs from %s at block %" G_GUINT64_FORMAT,
+                    packed_path, path, lba);
+        }
+    }
+    g_free(a);
+    g_free(b);
+    spice_cd_image_unref(packed);
+    spice_cd_image_unref(image);
+}
+
+/*
+ * sequential front to back, or random when @rand is set, with a fresh
+ * chunk cache, optionally prefetching like a CD LUN would
+ */
+static void bench_pass(const gchar *name, const gchar *path, GRand *rand,
+                       gboolean prefetch)
+{
+    SpiceCdImage *image = open_image(path);
+    SpiceCdReadahead *ra = prefetch ?
+        spice_cd_readahead_new(image, SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE) : NULL;
+    guint64 n_blocks = spice_cd_image_get_n_blocks(image);
+    guint n_reads = rand ? BENCH_RANDOM_READS : n_blocks / BENCH_SEQ_BLOCKS;
+    guint64 *latency = g_new(guint64, n_reads);
+    guint8 *buf = g_malloc(BENCH_SEQ_BLOCKS * SPICE_CD_IMAGE_BLOCK_SIZE);
+    guint64 bytes = 0, lba = 0;
+    gint64 start, elapsed;
+    GError *err = NULL;
+    guint i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n_reads; i++) {
+        guint32 n = BENCH_SEQ_BLOCKS;
+        gint64 t0;
+
+        if (rand != NULL) {
+            n = g_rand_int_range(rand, 1, BENCH_RANDOM_MAX + 1);
+            lba = g_rand_int_range(rand, 0, n_blocks - n);
+        }
+        t0 = g_get_monotonic_time();
+        if (ra != NULL) {
+            spice_cd_readahead_access(ra, lba, n);
+        }
+        if (!spice_cd_image_read_blocks(image, lba, n, buf, &err)) {
+            g_error("%s", err->message);
+        }
+        latency[i] = g_get_monotonic_time() - t0;
+        bytes += (guint64)n * SPICE_CD_IMAGE_BLOCK_SIZE;
+        lba += n;
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    qsort(latency, n_reads, sizeof(guint64), bench_compare_u64);
+    g_print("%-24s %9.1f MB/s %9.0f reads/s  p50:%7" G_GUINT64_FORMAT " us  p99:%7"
+            G_GUINT64_FORMAT " us\n",
+            name, (double)bytes / elapsed, n_reads / (elapsed / 1e6),
+            latency[n_reads / 2], latency[MIN(n_reads - 1, (guint64)n_reads * 99 / 100)]);
+
+    g_free(buf);
+    g_free(latency);
+    spice_cd_readahead_free(ra);
+    spice_cd_image_unref(image);
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    guint chunk_kib = argc > 2 ? atoi(argv[2]) : 0;
+    gchar *tmp_path = NULL, *packed_path;
+    GError *err = NULL;
+    GRand *rand;
+    GStatBuf raw_st, packed_st;
+    gint64 start;
+    gint fd;
+
+    if (path == NULL || *path == '\0') {
+        GRand *rand = g_rand_new_with_seed(42);
+
+        path = tmp_path = bench_make_image("bench-cd-packed", 64 * 1024 * 1024,
+                                           fill_mixed, rand);
+        g_rand_free(rand);
+    }
+    fd = g_file_open_tmp("bench-cd-packed-XXXXXX.pak", &packed_path, &err);
+    if (fd < 0) {
+        g_error("%s", err->message);
+    }
+    close(fd);
+
+    start = g_get_monotonic_time();
+    if (!spice_cd_image_pack(path, packed_path, chunk_kib * 1024, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    if (g_stat(path, &raw_st) < 0 || g_stat(packed_path, &packed_st) < 0) {
+        g_error("%s", g_strerror(errno));
+    }
+    g_print("%s: %.1f MB packed to %.1f MB (%.1f%%) in %.2f s, %u KiB chunks\n",
+            path, raw_st.st_size / 1e6, packed_st.st_size / 1e6,
+            100.0 * packed_st.st_size / raw_st.st_size,
+            (g_get_monotonic_time() - start) / 1e6,
+            chunk_kib ? chunk_kib : SPICE_CD_IMAGE_PACK_DEFAULT_CHUNK_SIZE / 1024);
+    verify(path, packed_path);
+
+    bench_pass("sequential raw", path, NULL, FALSE);
+    bench_pass("sequential packed", packed_path, NULL, FALSE);
+    bench_pass("sequential packed + ra", packed_path, NULL, TRUE);
+    rand = g_rand_new_with_seed(1);
+    bench_pass("random raw", path, rand, FALSE);
+    g_rand_free(rand);
+    rand = g_rand_new_with_seed(1);
+    bench_pass("random packed", packed_path, rand, FALSE);
+    g_rand_free(rand);
+
+    g_unlink(packed_path);
+    g_free(packed_path);
+    if (tmp_path != NULL) {
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Read-ahead benchmark: replays a CD read trace against a local image
+   with a per-request link latency, once without and once with the
+   read-ahead engine, starting from a cold page cache each time.
+
+   usage: bench-cd-readahead IMAGE [TRACE [LATENCY_US]]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, the benchmark is skipped
+   without one. TRACE has one read per line, "LBA BLOCKS" in 2 KiB
+   blocks, '#' starts a comment; without it an install-like trace is
+   generated: packages streamed in 64 KiB reads, with directory lookups
+   near the start of the disc in between.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+#include "cd-readahead.h"
+#include "bench-util.h"
+
+typedef struct {
+    guint64 lba;
+    guint32 n_blocks;
+} BenchRead;
+
+static GArray *load_trace(const gchar *path, guint64 n_blocks)
+{
+    GArray *trace = g_array_new(FALSE, FALSE, sizeof(BenchRead));
+    gchar *contents, **lines, **line;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, &err)) {
+        g_error("%s", err->message);
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        BenchRead read;
+        gchar *end;
+
+        g_strstrip(*line);
+        if (**line == '\0' || **line == '#') {
+            continue;
+        }
+        read.lba = g_ascii_strtoull(*line, &end, 0);
+        read.n_blocks = g_ascii_strtoull(end, NULL, 0);
+        if (read.n_blocks == 0 || read.lba + read.n_blocks > n_blocks) {
+            g_printerr("skipping \"%s\", not in the image\n", *line);
+            continue;
+        }
+        g_array_append_val(trace, read);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return trace;
+}
+
+static GArray *make_trace(guint64 n_blocks)
+{
+    GArray *trace = g_array_new(FALSE, FALSE, sizeof(BenchRead));
+    GRand *rand = g_rand_new_with_seed(0x150);
+    guint64 metadata_blocks = MAX(n_blocks / 20, 64);
+    guint64 budget = n_blocks / 2; /* read about half of the disc */
+
+    while (budget > 0) {
+        guint lookups = g_rand_int_range(rand, 2, 9), i;
+        guint64 lba, len;
+
+        /* directory and package metadata lookups */
+        for (i = 0; i < lookups; i++) {
+            BenchRead read = { g_rand_int_range(rand, 16, metadata_blocks - 4),
+                               g_rand_int_range(rand, 1, 5) };
+            g_array_append_val(trace, read);
+        }
+
+        /* one package, 32 KiB to 16 MiB */
+        len = MIN((guint64)g_rand_int_range(rand, 16, 8192), budget);
+        lba = metadata_blocks + g_rand_double(rand) * (n_blocks - metadata_blocks - len);
+        budget -= len;
+        while (len > 0) {
+            BenchRead read = { lba, MIN(len, 32) };
+            g_array_append_val(trace, read);
+            lba += read.n_blocks;
+            len -= read.n_blocks;
+        }
+    }
+    g_rand_free(rand);
+    return trace;
+}
+
+static void replay(const gchar *path, SpiceCdImage *image, GArray *trace,
+                   guint latency_us, gboolean prefetch)
+{
+    SpiceCdReadahead *ra = NULL;
+    SpiceCdReadaheadStats stats;
+    guint64 bytes = 0, sum = 0;
+    gint64 start, elapsed;
+    guint i;
+
+    bench_drop_cache(path);
+    if (prefetch) {
+        ra = spice_cd_readahead_new(image, SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE);
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < trace->len; i++) {
+        const BenchRead *read = &g_array_index(trace, BenchRead, i);
+        const guint8 *data;
+        gsize j, len = (gsize)read->n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+
+        /* the request crossing the USB link */
+        if (latency_us > 0) {
+            g_usleep(latency_us);
+        }
+        if (ra != NULL) {
+            spice_cd_readahead_access(ra, read->lba, read->n_blocks);
+        }
+        data = spice_cd_image_peek_blocks(image, read->lba, read->n_blocks, NULL);
+        for (j = 0; j < len; j += 64) {
+            sum += data[j];
+        }
+        bytes += len;
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_print("%-11s %8.1f MB/s %8.1f ms", prefetch ? "prefetch" : "no prefetch",
+            bytes / (elapsed / 1e6) / 1e6, elapsed / 1e3);
+    if (ra != NULL) {
+        spice_cd_readahead_get_stats(ra, &stats);
+        g_print("  hit ratio:%5.1f%%  prefetched:%7.1f MB  wasted:%6.1f MB  window:%u",
+                stats.reads ? 100.0 * stats.hits / stats.reads : 0.0,
+                stats.prefetched / 1e6, stats.wasted / 1e6, stats.window);
+        spice_cd_readahead_free(ra);
+    }
+    g_print("%s\n", sum == 0 ? " (empty)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    guint latency_us = argc > 3 ? atoi(argv[3]) : 250;
+    SpiceCdImage *image;
+    GError *err = NULL;
+    GArray *trace;
+    guint64 bytes = 0;
+    guint i;
+
+    if (path == NULL || *path == '\0') {
+        g_print("skipped, no image: bench-cd-readahead IMAGE [TRACE [LATENCY_US]] "
+                "or SPICE_BENCH_CD_IMAGE=IMAGE\n");
+        return 0;
+    }
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+
+    if (argc > 2) {
+        trace = load_trace(argv[2], spice_cd_image_get_n_blocks(image));
+    } else {
+        trace = make_trace(spice_cd_image_get_n_blocks(image));
+    }
+    for (i = 0; i < trace->len; i++) {
+        bytes += g_array_index(trace, BenchRead, i).n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+    }
+    g_print("%s: %u reads, %.1f MB, link latency %u us\n",
+            argc > 2 ? argv[2] : "generated trace", trace->len, bytes / 1e6, latency_us);
+
+    replay(path, image, trace, latency_us, FALSE);
+    replay(path, image, trace, latency_us, TRUE);
+
+    g_array_unref(trace);
+    spice_cd_image_unref(image);
+    return 0;
+}
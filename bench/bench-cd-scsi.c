@@ -0,0 +1,412 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   In-process initiator for the CD mass storage emulation: drives the
+   bulk-only transport the way a guest driver does, checks the answers to
+   the commands a guest sends at attach and media change time, then
+   measures READ(10)/READ(12)/READ(16) throughput through the read path.
+
+   usage: bench-cd-scsi [IMAGE]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, or to a generated 64 MiB image.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cd-usb-bulk-msd.h"
+#include "bench-util.h"
+
+/* usbredir bulk IN transfers as issued by Linux and Windows guests */
+#define TRANSFER_SIZE (64 * 1024)
+
+/* data that is not copied out is still read, as sending it would */
+static guint64 sink;
+
+typedef struct {
+    SpiceCdScsiLunState state;
+    gint lock_calls;
+} BenchLun;
+
+static inline guint32 get_be32(const guint8 *p)
+{
+    return (guint32)p[0] << 24 | (guint32)p[1] << 16 | (guint32)p[2] << 8 | p[3];
+}
+
+static inline guint32 get_le32(const guint8 *p)
+{
+    return (guint32)p[3] << 24 | (guint32)p[2] << 16 | (guint32)p[1] << 8 | p[0];
+}
+
+static inline void put_le32(guint8 *p, guint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static gboolean bench_get_lun(gpointer user_data, guint lun, SpiceCdScsiLunState *state)
+{
+    BenchLun *l = user_data;
+
+    if (lun != 0) {
+        return FALSE;
+    }
+    *state = l->state;
+    return TRUE;
+}
+
+static void bench_set_locked(gpointer user_data, guint lun, gboolean locked)
+{
+    BenchLun *l = user_data;
+
+    l->state.locked = locked;
+    l->lock_calls++;
+}
+
+static const SpiceCdScsiTargetOps bench_ops = {
+    .get_lun = bench_get_lun,
+    .set_locked = bench_set_locked,
+};
+
+/*
+ * One command through the bulk-only transport, data-in is copied to @buf
+ * when it is not NULL. Returns the CSW status.
+ */
+static guint8 command(SpiceCdUsbBulkMsd *msd, guint8 lun, guint32 host_len,
+                      const guint8 *cdb, guint8 cdb_len,
+                      guint8 *buf, gsize *data_len)
+{
+    static guint32 tag;
+    guint8 cbw[SPICE_CD_USB_BULK_MSD_CBW_SIZE] = { 'U', 'S', 'B', 'C' };
+    GOutputVector vector;
+    GError *err = NULL;
+    gsize total = 0;
+    const guint8 *csw;
+
+    tag++;
+    put_le32(cbw + 4, tag);
+    put_le32(cbw + 8, host_len);
+    cbw[12] = 0x80; /* data-in */
+    cbw[13] = lun;
+    cbw[14] = cdb_len;
+    memcpy(cbw + 15, cdb, cdb_len);
+    if (!spice_cd_usb_bulk_msd_write(msd, cbw, sizeof(cbw), &err)) {
+        g_error("CBW rejected: %s", err->message);
+    }
+
+    /* data phase, ends on a short transfer or when host_len is reached */
+    while (total < host_len) {
+        if (!spice_cd_usb_bulk_msd_read(msd, TRANSFER_SIZE, &vector)) {
+            g_error("no data phase for opcode 0x%02x", cdb[0]);
+        }
+        if (buf != NULL) {
+            memcpy(buf + total, vector.buffer, vector.size);
+        } else {
+            const guint8 *p = vector.buffer;
+            gsize i;
+
+            for (i = 0; i < vector.size; i += 64) {
+                sink += p[i];
+            }
+        }
+        total += vector.size;
+        if (vector.size < TRANSFER_SIZE) {
+            break;
+        }
+    }
+    if (data_len != NULL) {
+        *data_len = total;
+    }
+
+    if (!spice_cd_usb_bulk_msd_read(msd, TRANSFER_SIZE, &vector) ||
+        vector.size != SPICE_CD_USB_BULK_MSD_CSW_SIZE ||
+        memcmp(vector.buffer, "USBS", 4) != 0) {
+        g_error("no CSW for opcode 0x%02x", cdb[0]);
+    }
+    csw = vector.buffer;
+    if (get_le32(csw + 4) != tag || get_le32(csw + 8) != host_len - total) {
+        g_error("bad CSW tag/residue for opcode 0x%02x", cdb[0]);
+    }
+    return csw[12];
+}
+
+static void expect_sense(SpiceCdUsbBulkMsd *msd, guint8 key, guint8 asc)
+{
+    const guint8 cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+    guint8 sense[18];
+
+    if (command(msd, 0, sizeof(sense), cdb, sizeof(cdb), sense, NULL) != 0 ||
+        (sense[2] & 0x0f) != key || sense[12] != asc) {
+        g_error("expected sense %x/%02x, got %x/%02x",
+                (guint)key, (guint)asc, (guint)(sense[2] & 0x0f), (guint)sense[12]);
+    }
+}
+
+/* FALSE if a CBW for @lun is taken */
+static gboolean check_cbw_lun(SpiceCdUsbBulkMsd *msd, guint8 lun)
+{
+    guint8 cbw[SPICE_CD_USB_BULK_MSD_CBW_SIZE] = { 'U', 'S', 'B', 'C' };
+    GError *err = NULL;
+
+    put_le32(cbw + 4, 0xbad);
+    cbw[13] = lun;
+    cbw[14] = 6; /* TEST UNIT READY */
+    if (spice_cd_usb_bulk_msd_write(msd, cbw, sizeof(cbw), &err)) {
+        return FALSE;
+    }
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA)) {
+        g_error("CBW of LUN %u: %s", (guint)lun, err->message);
+    }
+    g_error_free(err);
+    return TRUE;
+}
+
+static void read_cdb(guint8 *cdb, guint8 *cdb_len, guint8 opcode, guint32 lba, guint32 n)
+{
+    memset(cdb, 0, 16);
+    cdb[0] = opcode;
+    switch (opcode) {
+    case 0x28: /* READ(10) */
+        cdb[2] = lba >> 24; cdb[3] = lba >> 16; cdb[4] = lba >> 8; cdb[5] = lba;
+        cdb[7] = n >> 8; cdb[8] = n;
+        *cdb_len = 10;
+        break;
+    case 0xa8: /* READ(12) */
+        cdb[2] = lba >> 24; cdb[3] = lba >> 16; cdb[4] = lba >> 8; cdb[5] = lba;
+        cdb[6] = n >> 24; cdb[7] = n >> 16; cdb[8] = n >> 8; cdb[9] = n;
+        *cdb_len = 12;
+        break;
+    default: /* READ(16) */
+        cdb[6] = lba >> 24; cdb[7] = lba >> 16; cdb[8] = lba >> 8; cdb[9] = lba;
+        cdb[10] = n >> 24; cdb[11] = n >> 16; cdb[12] = n >> 8; cdb[13] = n;
+        *cdb_len = 16;
+        break;
+    }
+}
+
+static void check_commands(SpiceCdUsbBulkMsd *msd, BenchLun *lun, const gchar *path)
+{
+    static const guint8 opcodes[] = { 0x28, 0xa8, 0x88 };
+    guint64 n_blocks = spice_cd_image_get_n_blocks(lun->state.image);
+    guint8 buf[32 * SPICE_CD_IMAGE_BLOCK_SIZE], expected[sizeof(buf)], cdb[16], cdb_len;
+    GRand *rand = g_rand_new_with_seed(0xcd);
+    gsize len;
+    guint i;
+    int fd;
+
+    /* INQUIRY */
+    memcpy(cdb, (guint8[]){ 0x12, 0, 0, 0, 36, 0 }, 6);
+    if (command(msd, 0, 36, cdb, 6, buf, &len) != 0 || len != 36 ||
+        buf[0] != 0x05 || memcmp(buf + 8, "RedHat  ", 8) != 0 ||
+        memcmp(buf + 16, "Redir DVD       ", 16) != 0) {
+        g_error("INQUIRY");
+    }
+    /* a LUN that is not there */
+    if (command(msd, 1, 36, cdb, 6, buf, &len) != 0 || buf[0] != 0x7f) {
+        g_error("INQUIRY of a missing LUN");
+    }
+
+    /* a CBW for a LUN past the last one is refused, the transport goes on */
+    if (!check_cbw_lun(msd, spice_cd_usb_bulk_msd_get_max_lun(msd) + 1)) {
+        g_error("CBW of a LUN past the last one");
+    }
+
+    /* TEST UNIT READY, READ CAPACITY */
+    memset(cdb, 0, 10);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 0) {
+        g_error("TEST UNIT READY");
+    }
+    cdb[0] = 0x25;
+    if (command(msd, 0, 8, cdb, 10, buf, &len) != 0 || len != 8 ||
+        get_be32(buf) != n_blocks - 1 || get_be32(buf + 4) != SPICE_CD_IMAGE_BLOCK_SIZE) {
+        g_error("READ CAPACITY");
+    }
+
+    /* READ TOC: track 1 and the lead-out */
+    memcpy(cdb, (guint8[]){ 0x43, 0, 0, 0, 0, 0, 0, 0, 0xfe, 0 }, 10);
+    if (command(msd, 0, 0xfe, cdb, 10, buf, &len) != 0 || len != 20 ||
+        buf[6] != 1 || buf[14] != 0xaa ||
+        get_be32(buf + 16) != n_blocks) {
+        g_error("READ TOC");
+    }
+
+    /* GET EVENT STATUS NOTIFICATION: the medium is new once */
+    memcpy(cdb, (guint8[]){ 0x4a, 1, 0, 0, 0x10, 0, 0, 0, 8, 0 }, 10);
+    if (command(msd, 0, 8, cdb, 10, buf, &len) != 0 || len != 8 ||
+        buf[4] != 2 || buf[5] != 0x02) {
+        g_error("GET EVENT STATUS, new media");
+    }
+    if (command(msd, 0, 8, cdb, 10, buf, &len) != 0 || buf[4] != 0) {
+        g_error("GET EVENT STATUS, no change");
+    }
+
+    /* PREVENT/ALLOW MEDIUM REMOVAL */
+    memcpy(cdb, (guint8[]){ 0x1e, 0, 0, 0, 1, 0 }, 6);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 0 || !lun->state.locked) {
+        g_error("PREVENT MEDIUM REMOVAL");
+    }
+    cdb[4] = 0;
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 0 || lun->state.locked ||
+        lun->lock_calls != 2) {
+        g_error("ALLOW MEDIUM REMOVAL");
+    }
+
+    /* errors leave sense data */
+    memset(cdb, 0, 16);
+    cdb[0] = 0xff;
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 1) {
+        g_error("unknown opcode");
+    }
+    expect_sense(msd, 0x05, 0x20);
+    read_cdb(cdb, &cdb_len, 0x28, n_blocks, 1);
+    if (command(msd, 0, SPICE_CD_IMAGE_BLOCK_SIZE, cdb, cdb_len, NULL, &len) != 1 || len != 0) {
+        g_error("READ past the end");
+    }
+    expect_sense(msd, 0x05, 0x21);
+
+    /* random reads through each READ flavour against the file */
+    fd = g_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        g_error("%s: %s", path, g_strerror(errno));
+    }
+    for (i = 0; i < 300; i++) {
+        guint32 n = g_rand_int_range(rand, 1, 33);
+        guint32 lba = g_rand_int_range(rand, 0, n_blocks - n + 1);
+
+        read_cdb(cdb, &cdb_len, opcodes[i % G_N_ELEMENTS(opcodes)], lba, n);
+        if (command(msd, 0, n * SPICE_CD_IMAGE_BLOCK_SIZE, cdb, cdb_len, buf, &len) != 0 ||
+            len != n * SPICE_CD_IMAGE_BLOCK_SIZE) {
+            g_error("READ opcode 0x%02x lba %u n %u", cdb[0], lba, n);
+        }
+        /* a packed image can only be checked against itself */
+        if (spice_cd_image_is_packed(lun->state.image) ?
+            !spice_cd_image_read_blocks(lun->state.image, lba, n, expected, NULL) :
+            pread(fd, expected, len, (off_t)lba * SPICE_CD_IMAGE_BLOCK_SIZE) != (gssize)len) {
+            g_error("%s: reading back lba %u n %u", path, lba, n);
+        }
+        if (memcmp(buf, expected, len) != 0) {
+            g_error("READ opcode 0x%02x lba %u n %u", cdb[0], lba, n);
+        }
+    }
+    close(fd);
+    g_rand_free(rand);
+
+    /* medium swapped in place: a unit attention, then a new medium event */
+    spice_cd_scsi_target_media_changed(spice_cd_usb_bulk_msd_get_target(msd), 0);
+    memcpy(cdb, (guint8[]){ 0x4a, 1, 0, 0, 0x10, 0, 0, 0, 8, 0 }, 10);
+    if (command(msd, 0, 8, cdb, 10, buf, &len) != 0 || buf[4] != 2) {
+        g_error("GET EVENT STATUS, swapped media");
+    }
+    memset(cdb, 0, 6);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 1) {
+        g_error("TEST UNIT READY after a media change");
+    }
+    expect_sense(msd, 0x06, 0x28);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 0) {
+        g_error("TEST UNIT READY after the unit attention");
+    }
+
+    /* and swapped again: REQUEST SENSE reports and clears the unit attention */
+    spice_cd_scsi_target_media_changed(spice_cd_usb_bulk_msd_get_target(msd), 0);
+    expect_sense(msd, 0x06, 0x28);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 0) {
+        g_error("TEST UNIT READY after REQUEST SENSE of the unit attention");
+    }
+
+    /* eject: the medium goes away */
+    lun->state.image = NULL;
+    lun->state.loaded = FALSE;
+    memset(cdb, 0, 6);
+    if (command(msd, 0, 0, cdb, 6, NULL, NULL) != 1) {
+        g_error("TEST UNIT READY without medium");
+    }
+    expect_sense(msd, 0x02, 0x3a);
+
+    g_print("commands: ok\n");
+}
+
+static void bench_reads(SpiceCdUsbBulkMsd *msd, guint8 opcode, guint32 blocks_per_read,
+                        guint64 n_blocks)
+{
+    guint8 cdb[16], cdb_len;
+    guint64 lba, bytes = 0, commands = 0;
+    gint64 start, elapsed;
+    gsize len;
+
+    start = g_get_monotonic_time();
+    for (lba = 0; lba + blocks_per_read <= n_blocks; lba += blocks_per_read) {
+        read_cdb(cdb, &cdb_len, opcode, lba, blocks_per_read);
+        if (command(msd, 0, blocks_per_read * SPICE_CD_IMAGE_BLOCK_SIZE,
+                    cdb, cdb_len, NULL, &len) != 0) {
+            g_error("READ opcode 0x%02x lba %" G_GUINT64_FORMAT, opcode, lba);
+        }
+        bytes += len;
+        commands++;
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_print("READ(%-2u) %5u KiB: %9.1f MB/s %9.0f cmd/s\n",
+            cdb_len, blocks_per_read * SPICE_CD_IMAGE_BLOCK_SIZE / 1024,
+            bytes / (elapsed / 1e6) / 1e6, commands / (elapsed / 1e6));
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    gchar *tmp_path = NULL;
+    BenchLun lun = {
+        .state = { .vendor = "RedHat", .product = "Redir DVD", .revision = "1223",
+                   .loaded = TRUE },
+    };
+    SpiceCdUsbBulkMsd *msd;
+    SpiceCdImage *image;
+    GError *err = NULL;
+    guint64 n_blocks;
+
+    if (path == NULL || *path == '\0') {
+        path = tmp_path = bench_make_image("bench-cd-scsi", 64 * 1024 * 1024, NULL, NULL);
+    }
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_error("%s", err->message);
+    }
+    n_blocks = spice_cd_image_get_n_blocks(image);
+    lun.state.image = image;
+
+    msd = spice_cd_usb_bulk_msd_new(spice_cd_scsi_target_new(&bench_ops, &lun), 0);
+    check_commands(msd, &lun, path);
+
+    lun.state.image = image;
+    lun.state.loaded = TRUE;
+    bench_reads(msd, 0x28, 32, n_blocks);
+    bench_reads(msd, 0xa8, 512, n_blocks);
+    bench_reads(msd, 0x88, 512, n_blocks);
+
+    spice_cd_usb_bulk_msd_free(msd);
+    spice_cd_image_unref(image);
+    if (sink == 0) {
+        g_print("(empty image)\n");
+    }
+    if (tmp_path != NULL) {
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+    }
+    return 0;
+}
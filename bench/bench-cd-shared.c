@@ -0,0 +1,167 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Shared image benchmark: attaches one image to 1, 8 and 64 LUNs, each
+   with its own read-ahead, streams it through all of them in turn and
+   reports the mappings of the file, the worker threads and the resident
+   size of the process, which should not grow with the number of LUNs.
+
+   usage: bench-cd-shared [IMAGE]
+   IMAGE defaults to $SPICE_BENCH_CD_IMAGE, a 64 MiB image is generated
+   without one.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cd-readahead.h"
+#include "bench-util.h"
+
+/* streamed by every LUN */
+#define BENCH_STREAM_SIZE (32 * 1024 * 1024)
+#define BENCH_READ_BLOCKS 32
+
+/* value of a "Key:   value kB" line of /proc/self/status */
+static guint64 proc_status(const gchar *key)
+{
+    gchar *contents, *line;
+    guint64 value = 0;
+
+    if (!g_file_get_contents("/proc/self/status", &contents, NULL, NULL)) {
+        return 0;
+    }
+    line = strstr(contents, key);
+    if (line != NULL) {
+        value = g_ascii_strtoull(line + strlen(key) + 1, NULL, 10);
+    }
+    g_free(contents);
+    return value;
+}
+
+/* mappings of @path in the address space */
+static guint count_mappings(const gchar *path)
+{
+    gchar *contents, **lines, **line;
+    guint n = 0;
+
+    if (!g_file_get_contents("/proc/self/maps", &contents, NULL, NULL)) {
+        return 0;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        if (g_str_has_suffix(*line, path)) {
+            n++;
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return n;
+}
+
+static void run(const gchar *path, guint n_luns, guint64 rss_base)
+{
+    SpiceCdImage **images = g_new0(SpiceCdImage *, n_luns);
+    SpiceCdReadahead **ras = g_new0(SpiceCdReadahead *, n_luns);
+    SpiceCdReadaheadStats stats;
+    guint64 reads = 0, hits = 0, prefetched = 0, n_blocks, lba;
+    GError *err = NULL;
+    guint distinct = 0, mappings, threads, i;
+    guint32 sum = 0;
+    gint64 start, elapsed;
+
+    for (i = 0; i < n_luns; i++) {
+        images[i] = spice_cd_image_open(path, &err);
+        if (images[i] == NULL) {
+            g_error("%s", err->message);
+        }
+        if (i == 0 || images[i] != images[0]) {
+            distinct++;
+        }
+        ras[i] = spice_cd_readahead_new(images[i], SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE);
+    }
+    n_blocks = MIN(spice_cd_image_get_n_blocks(images[0]),
+                   BENCH_STREAM_SIZE / SPICE_CD_IMAGE_BLOCK_SIZE);
+
+    /* the LUNs take turns, as guests installing from the same disc would */
+    start = g_get_monotonic_time();
+    for (lba = 0; lba + BENCH_READ_BLOCKS <= n_blocks; lba += BENCH_READ_BLOCKS) {
+        for (i = 0; i < n_luns; i++) {
+            const guint8 *data;
+            guint off;
+
+            spice_cd_readahead_access(ras[i], lba, BENCH_READ_BLOCKS);
+            data = spice_cd_image_peek_blocks(images[i], lba, BENCH_READ_BLOCKS, NULL);
+            for (off = 0; off < BENCH_READ_BLOCKS * SPICE_CD_IMAGE_BLOCK_SIZE; off += 4096) {
+                sum += data[off];
+            }
+        }
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    mappings = count_mappings(path);
+    threads = proc_status("Threads:");
+    for (i = 0; i < n_luns; i++) {
+        spice_cd_readahead_get_stats(ras[i], &stats);
+        reads += stats.reads;
+        hits += stats.hits;
+        prefetched += stats.prefetched;
+    }
+    g_print("%3u LUNs: %u image, %u mappings, %u threads, rss +%6" G_GUINT64_FORMAT
+            " kB, %.1f MB prefetched, %5.1f%% hits, %.1f MB/s (%x)\n",
+            n_luns, distinct, mappings, threads,
+            proc_status("VmRSS:") - MIN(rss_base, proc_status("VmRSS:")),
+            prefetched / 1e6, reads ? 100.0 * hits / reads : 0.0,
+            elapsed ? (double)n_luns * n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE / elapsed : 0.0,
+            sum & 0xff);
+
+    for (i = 0; i < n_luns; i++) {
+        spice_cd_readahead_free(ras[i]);
+        spice_cd_image_unref(images[i]);
+    }
+    g_free(ras);
+    g_free(images);
+    if (count_mappings(path) != 0) {
+        g_printerr("%s still mapped after the last LUN was released\n", path);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *path = argc > 1 ? argv[1] : g_getenv("SPICE_BENCH_CD_IMAGE");
+    static const guint n_luns[] = { 1, 8, 64 };
+    gchar *tmp_path = NULL;
+    guint64 rss_base;
+    guint i;
+
+    if (path == NULL || *path == '\0') {
+        path = tmp_path = bench_make_image("bench-cd-shared", 64 * 1024 * 1024, NULL, NULL);
+    }
+
+    rss_base = proc_status("VmRSS:");
+    for (i = 0; i < G_N_ELEMENTS(n_luns); i++) {
+        run(path, n_luns[i], rss_base);
+    }
+
+    if (tmp_path != NULL) {
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Memory benchmark for LUN records: one g_malloc per record plus
+   g_strdup'd vendor/product/revision (as before), against pooled records
+   with interned strings.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <malloc.h>
+#include <string.h>
+#include <glib.h>
+#include "spice-pool.h"
+
+/* same layout as SpiceUsbDeviceLunInfo */
+typedef struct {
+    const gchar *file_path;
+    const gchar *vendor;
+    const gchar *product;
+    const gchar *revision;
+    gboolean started;
+    gboolean loaded;
+    gboolean locked;
+} BenchLun;
+
+static gsize heap_in_use(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static gsize rss_bytes(void)
+{
+    gchar *statm = NULL;
+    gsize rss = 0;
+
+    if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+        gchar *p = strchr(statm, ' ');
+        if (p != NULL) {
+            rss = g_ascii_strtoull(p + 1, NULL, 10) * 4096;
+        }
+        g_free(statm);
+    }
+    return rss;
+}
+
+static void report(const gchar *name, guint n, gsize heap, gssize rss, guint64 allocs)
+{
+    g_print("%-8s luns:%-7u heap:%10" G_GSIZE_FORMAT " B (%6.1f B/lun) "
+            "rss:%+10" G_GSSIZE_FORMAT " B allocs:%-8" G_GUINT64_FORMAT " (%.2f/lun)\n",
+            name, n, heap, (gdouble)heap / n, rss, allocs, (gdouble)allocs / n);
+}
+
+static void bench_malloc(guint n)
+{
+    BenchLun **luns = g_new(BenchLun *, n);
+    gsize heap0, rss0;
+    guint i;
+
+    heap0 = heap_in_use();
+    rss0 = rss_bytes();
+    for (i = 0; i < n; i++) {
+        BenchLun *lun = g_malloc(sizeof(*lun));
+
+        lun->file_path = g_strdup_printf("/srv/iso/image-%06u.iso", i);
+        lun->vendor = g_strdup("RedHat");
+        lun->product = g_strdup("Redir DVD");
+        lun->revision = g_strdup("1223");
+        luns[i] = lun;
+    }
+    report("malloc", n, heap_in_use() - heap0, (gssize)(rss_bytes() - rss0), 5 * (guint64)n);
+
+    for (i = 0; i < n; i++) {
+        g_free((gpointer)luns[i]->file_path);
+        g_free((gpointer)luns[i]->vendor);
+        g_free((gpointer)luns[i]->product);
+        g_free((gpointer)luns[i]->revision);
+        g_free(luns[i]);
+    }
+    g_free(luns);
+}
+
+static void bench_pool(guint n)
+{
+    BenchLun **luns = g_new(BenchLun *, n);
+    SpicePool *pool = spice_pool_new(sizeof(BenchLun), 256);
+    SpiceStringPool *strings = spice_string_pool_new();
+    gsize heap0, rss0;
+    guint i, chunks;
+
+    heap0 = heap_in_use();
+    rss0 = rss_bytes();
+    for (i = 0; i < n; i++) {
+        BenchLun *lun = spice_pool_alloc0(pool);
+
+        lun->file_path = g_strdup_printf("/srv/iso/image-%06u.iso", i);
+        lun->vendor = spice_string_pool_intern(strings, "RedHat");
+        lun->product = spice_string_pool_intern(strings, "Redir DVD");
+        lun->revision = spice_string_pool_intern(strings, "1223");
+        luns[i] = lun;
+    }
+    spice_pool_get_stats(pool, NULL, &chunks);
+    /* chunks, file paths and one copy of each distinct string */
+    report("pool", n, heap_in_use() - heap0, (gssize)(rss_bytes() - rss0),
+           (guint64)chunks + n + spice_string_pool_size(strings));
+
+    for (i = 0; i < n; i++) {
+        g_free((gpointer)luns[i]->file_path);
+        spice_string_pool_release(strings, luns[i]->vendor);
+        spice_string_pool_release(strings, luns[i]->product);
+        spice_string_pool_release(strings, luns[i]->revision);
+        spice_pool_free1(pool, luns[i]);
+    }
+    spice_string_pool_destroy(strings);
+    spice_pool_destroy(pool);
+    g_free(luns);
+}
+
+int main(int argc, char **argv)
+{
+    static const guint sizes[] = { 1000, 10000, 100000 };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        bench_malloc(sizes[i]);
+        bench_pool(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Microbenchmark for the compiled USB filter rules: cost of parsing a
+   filter string and of matching one rule set against many devices.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <glib.h>
+#include "usb-filter.h"
+
+typedef struct {
+    guint8  device_class;
+    guint16 vid;
+    guint16 pid;
+    guint16 bcd;
+} BenchDevice;
+
+static const gchar *filters[] = {
+    /* the auto-connect-filter default */
+    "0x03,-1,-1,-1,0|-1,-1,-1,-1,1",
+    /* a longer admin policy, most devices fall through to the last rule */
+    "0x03,-1,-1,-1,0|0x09,-1,-1,-1,0|0x0e,-1,-1,-1,0|-1,0x046d,-1,-1,0|"
+    "-1,0x0781,0x5567,-1,1|-1,0x090c,-1,0x1100,1|0x08,0x05e3,-1,-1,1|"
+    "0x01,-1,-1,-1,0|0xe0,-1,-1,-1,0|-1,0x1d6b,-1,-1,0|-1,-1,-1,-1,1",
+};
+
+static BenchDevice *make_devices(guint n)
+{
+    static const guint8 classes[] = { 0x00, 0x03, 0x08, 0x09, 0x0e, 0xe0, 0xff };
+    BenchDevice *devices = g_new(BenchDevice, n);
+    GRand *rand = g_rand_new_with_seed(0x5ee);
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        devices[i].device_class = classes[g_rand_int_range(rand, 0, G_N_ELEMENTS(classes))];
+        devices[i].vid = g_rand_int_range(rand, 0, 0x10000);
+        devices[i].pid = g_rand_int_range(rand, 0, 0x10000);
+        devices[i].bcd = g_rand_int_range(rand, 0, 0x10000);
+    }
+    g_rand_free(rand);
+    return devices;
+}
+
+static void bench_parse(const gchar *filter)
+{
+    SpiceUsbFilterRule *rules;
+    guint count, iter, iterations = 100000;
+    gint64 start, elapsed;
+
+    start = g_get_monotonic_time();
+    for (iter = 0; iter < iterations; iter++) {
+        if (!spice_usb_filter_parse(filter, &rules, &count, NULL)) {
+            g_error("filter does not parse: %s", filter);
+        }
+        g_free(rules);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_print("parse   rules:%-3u %10.1f ns/parse\n",
+            count, elapsed * 1000.0 / iterations);
+}
+
+static void bench_check(const gchar *filter, const BenchDevice *devices, guint n)
+{
+    SpiceUsbFilterRule *rules;
+    guint count, i, iter, iterations, allowed = 0;
+    gint64 start, elapsed;
+
+    if (!spice_usb_filter_parse(filter, &rules, &count, NULL)) {
+        g_error("filter does not parse: %s", filter);
+    }
+
+    /* roughly 10M checks per measurement */
+    iterations = MAX(1, 10000000 / n);
+    start = g_get_monotonic_time();
+    for (iter = 0; iter < iterations; iter++) {
+        for (i = 0; i < n; i++) {
+            allowed += spice_usb_filter_check(rules, count, devices[i].device_class,
+                                              devices[i].vid, devices[i].pid,
+                                              devices[i].bcd);
+        }
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_print("check   rules:%-3u devices:%-7u %8.2f ns/device %10.1f us/scan (allowed %u)\n",
+            count, n, elapsed * 1000.0 / ((gdouble)iterations * n),
+            (gdouble)elapsed / iterations, allowed / iterations);
+    g_free(rules);
+}
+
+int main(int argc, char **argv)
+{
+    static const guint sizes[] = { 1000, 10000, 100000 };
+    BenchDevice *devices;
+    guint f, s;
+
+    devices = make_devices(sizes[G_N_ELEMENTS(sizes) - 1]);
+    for (f = 0; f < G_N_ELEMENTS(filters); f++) {
+        bench_parse(filters[f]);
+        for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+            bench_check(filters[f], devices, sizes[s]);
+        }
+    }
+    g_free(devices);
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Hotplug benchmark: times the parsing of uevents, then replays storms
+   of devices plugged in and out repeatedly through a local socket, as
+   the kernel would send them, and checks that once debounced each
+   device is reported once, in its final state, that a storm longer
+   than the maximum delay does not hold the events back until its end,
+   and that a device flapping does not hold back the others.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include "usb-hotplug.h"
+
+#define PARSE_RUNS      1000000
+#define STORM_FLAPS     5       /* add/remove pairs of each device in a storm */
+#define QUIET_MS        20
+#define MAX_DELAY_MS    200
+#define STORM_MAX_DELAY_MS 60000 /* the storm is only reported once settled */
+
+typedef struct {
+    guint n_devices;
+    guint8 *state;          /* per device: 0 not reported, 1 added, 2 removed */
+    guint n_reports;
+    guint n_reported;
+    guint n_twice;          /* devices reported more than once */
+    gint64 last_report;
+} BenchResult;
+
+/* a uevent as the kernel sends it, @interface for the one of its interface */
+static gsize make_uevent(gchar *buf, gsize size, gboolean add, guint index,
+                         gboolean interface)
+{
+    guint busnum = 1 + index / 100, devnum = 2 + index % 100;
+    gchar devpath[128];
+    gsize len;
+    gint n;
+
+    g_snprintf(devpath, sizeof(devpath), "/devices/pci0000:00/0000:00:14.0/usb%u/%u-%u%s",
+               busnum, busnum, devnum, interface ? "/1-1:1.0" : "");
+    n = g_snprintf(buf, size, "%s@%s", add ? "add" : "remove", devpath);
+    len = n + 1;
+    n = g_snprintf(buf + len, size - len,
+                   "ACTION=%s%cDEVPATH=%s%cSUBSYSTEM=usb%cDEVTYPE=%s%c"
+                   "PRODUCT=%x/%x/100%cTYPE=%u/0/0%cBUSNUM=%03u%cDEVNUM=%03u%cSEQNUM=%u",
+                   add ? "add" : "remove", 0, devpath, 0, 0,
+                   interface ? "usb_interface" : "usb_device", 0,
+                   0x1000 + index % 4096, index % 65536, 0, interface ? 8u : 0u, 0,
+                   busnum, 0, devnum, 0, index);
+    return len + n + 1;
+}
+
+static void bench_parse(void)
+{
+    SpiceUsbHotplugEvent event;
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+    gsize len = make_uevent(buf, sizeof(buf), TRUE, 1234, FALSE);
+    gint64 start;
+    guint i, n = 0;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PARSE_RUNS; i++) {
+        n += spice_usb_uevent_parse(buf, len, &event);
+    }
+    start = g_get_monotonic_time() - start;
+    if (n != PARSE_RUNS || event.desc.vid != 0x1000 + 1234 || event.desc.pid != 1234 ||
+        event.desc.busnum != 13 || event.desc.devaddr != 36 || strcmp(event.name, "13-36")) {
+        g_error("the uevent was not parsed as sent");
+    }
+    g_print("parse: %.1f ns/uevent\n", start * 1000.0 / PARSE_RUNS);
+}
+
+static void reported(const SpiceUsbHotplugEvent *events, guint n_events, gpointer user_data)
+{
+    BenchResult *result = user_data;
+    guint i;
+
+    result->n_reports++;
+    result->n_reported += n_events;
+    result->last_report = g_get_monotonic_time();
+    for (i = 0; i < n_events; i++) {
+        const SpiceUsbHotplugEvent *e = &events[i];
+        guint index = (e->desc.busnum - 1) * 100 + e->desc.devaddr - 2;
+
+        g_assert(index < result->n_devices);
+        if (result->state[index] != 0) {
+            result->n_twice++;
+        }
+        result->state[index] = e->action == SPICE_USB_HOTPLUG_ADD ? 1 : 2;
+    }
+}
+
+/* send without blocking the main loop, which is the one draining the socket */
+static void send_uevent(gint fd, const gchar *buf, gsize len)
+{
+    while (send(fd, buf, len, MSG_DONTWAIT) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            g_error("send: %s", g_strerror(errno));
+        }
+        g_main_context_iteration(NULL, FALSE);
+    }
+}
+
+static GSource *replay_source(guint max_delay_ms, gint *fd, BenchResult *result)
+{
+    GSource *source;
+    gint fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        g_error("socketpair: %s", g_strerror(errno));
+    }
+    source = spice_usb_hotplug_source_new(fds[0]);
+    spice_usb_hotplug_source_set_func(source, reported, result);
+    spice_usb_hotplug_source_set_debounce(source, QUIET_MS, max_delay_ms);
+    g_source_attach(source, NULL);
+    *fd = fds[1];
+    return source;
+}
+
+/*
+ * Each device flaps, its interface with it, and ends up plugged in when
+ * its index is even, one device after the other. Each must be reported
+ * once, once it settled.
+ */
+static void bench_storm(guint n_devices)
+{
+    BenchResult result = { .n_devices = n_devices };
+    SpiceUsbHotplugStats stats;
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+    GSource *source;
+    gint64 start, sent, settled;
+    guint i, flap, n_sent = 0;
+    gint fd;
+
+    result.state = g_new0(guint8, n_devices);
+    source = replay_source(STORM_MAX_DELAY_MS, &fd, &result);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n_devices; i++) {
+        for (flap = 0; flap < STORM_FLAPS; flap++) {
+            gboolean last = flap == STORM_FLAPS - 1;
+
+            send_uevent(fd, buf, make_uevent(buf, sizeof(buf), TRUE, i, FALSE));
+            send_uevent(fd, buf, make_uevent(buf, sizeof(buf), TRUE, i, TRUE));
+            n_sent += 2;
+            if (!last || i % 2 == 1) {
+                send_uevent(fd, buf, make_uevent(buf, sizeof(buf), FALSE, i, TRUE));
+                send_uevent(fd, buf, make_uevent(buf, sizeof(buf), FALSE, i, FALSE));
+                n_sent += 2;
+            }
+        }
+    }
+    sent = g_get_monotonic_time();
+    while (result.n_reported < n_devices) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    settled = result.last_report;
+
+    for (i = 0; i < n_devices; i++) {
+        if (result.state[i] != (i % 2 == 0 ? 1 : 2)) {
+            g_error("device %u was reported in the wrong state", i);
+        }
+    }
+    spice_usb_hotplug_source_get_stats(source, &stats);
+    if (stats.uevents != n_sent || stats.reported != n_devices ||
+        stats.merged != stats.events - stats.reported) {
+        g_error("%u devices: %" G_GUINT64_FORMAT " uevents, %" G_GUINT64_FORMAT
+                " reported, %" G_GUINT64_FORMAT " merged", n_devices, stats.uevents,
+                stats.reported, stats.merged);
+    }
+    g_print("storm %6u devices: %7u uevents %6.0f ms %10.0f uevents/s, %u reports, "
+            "%" G_GUINT64_FORMAT " merged, %u twice, settled %3" G_GINT64_FORMAT
+            " ms after the last\n",
+            n_devices, n_sent, (sent - start) / 1000.0,
+            n_sent / (MAX(sent - start, 1) / 1e6), result.n_reports, stats.merged,
+            result.n_twice, (settled - sent) / 1000);
+
+    close(fd);
+    g_source_destroy(source);
+    g_source_unref(source);
+    g_free(result.state);
+}
+
+/*
+ * a device flapping for twice the maximum delay must be reported before it
+ * stops, and one plugged in once meanwhile when it settles
+ */
+static void bench_max_delay(void)
+{
+    BenchResult result = { .n_devices = 2 };
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+    GSource *source;
+    gint64 start, first = 0, quiet = 0;
+    guint flap = 0;
+    gint fd;
+
+    result.state = g_new0(guint8, 2);
+    source = replay_source(MAX_DELAY_MS, &fd, &result);
+
+    start = g_get_monotonic_time();
+    send_uevent(fd, buf, make_uevent(buf, sizeof(buf), TRUE, 1, FALSE));
+    while (g_get_monotonic_time() - start < 2 * MAX_DELAY_MS * 1000) {
+        send_uevent(fd, buf, make_uevent(buf, sizeof(buf), flap++ % 2 == 0, 0, FALSE));
+        g_usleep(QUIET_MS * 1000 / 4);
+        g_main_context_iteration(NULL, FALSE);
+        if (quiet == 0 && result.state[1] != 0) {
+            quiet = result.last_report - start;
+        }
+        if (first == 0 && result.state[0] != 0) {
+            first = result.last_report - start;
+        }
+    }
+    if (first == 0 || first > (MAX_DELAY_MS + QUIET_MS) * 1000) {
+        g_error("a flapping device was held back %" G_GINT64_FORMAT " ms", first / 1000);
+    }
+    if (quiet == 0 || quiet > 2 * QUIET_MS * 1000) {
+        g_error("a quiet device was held back %" G_GINT64_FORMAT " ms by a flapping one",
+                quiet / 1000);
+    }
+    g_print("max delay: first report after %" G_GINT64_FORMAT " ms of flapping, "
+            "the quiet device after %" G_GINT64_FORMAT " ms, %u reports\n",
+            first / 1000, quiet / 1000, result.n_reports);
+
+    close(fd);
+    g_source_destroy(source);
+    g_source_unref(source);
+    g_free(result.state);
+}
+
+int main(void)
+{
+    static const guint n_devices[] = { 10, 100, 1000, 10000 };
+    guint i;
+
+    bench_parse();
+    for (i = 0; i < G_N_ELEMENTS(n_devices); i++) {
+        bench_storm(n_devices[i]);
+    }
+    bench_max_delay();
+    return 0;
+}
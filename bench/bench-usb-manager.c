@@ -0,0 +1,509 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Device manager benchmark: the manager without any widget, its list
+   filled with 10 to 30000 devices plugged in through replayed uevents,
+   and the calls the widget and the session make timed at each size: the
+   device lists, the descriptions, the CD LUN calls in cycles leaving the
+   LUN as it was, and the device-changed signal with 0 to 100 handlers.
+   30000 is about as many devices as the 8-bit bus and device numbers
+   leave room for.
+
+   Each result is a line of JSON on stdout, to compare one build with
+   another:
+   {"bench":"get_devices","devices":1000,"iterations":65536,"ns_per_op":41.2,"allocs_per_op":0.00}
+   Allocations are counted with glibc only, elsewhere allocs_per_op is
+   null. Run with G_SLICE=always-malloc for GSlice allocations to count.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include "spice-client.h"
+#include "usb-device-manager-priv.h"
+#include "usb-hotplug.h"
+
+#define BENCH_MIN_US    50000   /* each measure runs at least this long */
+#define ADD_LUNS        64      /* added at once by the add_cd_lun measure */
+/* addresses of a bus, as the uevents lay the devices out */
+#define BUS_DEVICES     120
+#define MAX_DEVICES     (255 * BUS_DEVICES)
+#define IMAGE_SIZE      (64 * 1024)
+#define FILTER          "0x03,-1,-1,-1,0|-1,-1,-1,-1,1"
+
+typedef struct {
+    SpiceUsbDeviceManager *manager;
+    GPtrArray *devices;         /* the list at the size being measured */
+    guint next;                 /* round robin over it */
+    SpiceUsbDevice *cd;         /* the device of the LUNs below */
+    guint load_lun;             /* loaded with the image */
+    guint media_lun;            /* not loaded, its media changed */
+    gchar *image;
+    gchar *other_image;
+    guint signal_id;
+    guint n_devices;
+} Bench;
+
+typedef void (*BenchFunc)(Bench *bench);
+
+#ifdef __GLIBC__
+/* every allocation of the process goes through these */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 n_allocs;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS_COUNTED TRUE
+#define allocs() __atomic_load_n(&n_allocs, __ATOMIC_RELAXED)
+#else
+#define ALLOCS_COUNTED FALSE
+#define allocs() G_GUINT64_CONSTANT(0)
+#endif
+
+/* the manager tells about each LUN and device it adds */
+static void quiet(const gchar *string)
+{
+}
+
+static void report(const gchar *name, guint n_devices, gint n_handlers, guint iterations,
+                   gint64 us, guint64 n)
+{
+    printf("{\"bench\":\"%s\",\"devices\":%u,", name, n_devices);
+    if (n_handlers >= 0) {
+        printf("\"handlers\":%d,", n_handlers);
+    }
+    printf("\"iterations\":%u,\"ns_per_op\":%.1f,", iterations, us * 1000.0 / iterations);
+    if (ALLOCS_COUNTED) {
+        printf("\"allocs_per_op\":%.2f}\n", (gdouble)n / iterations);
+    } else {
+        printf("\"allocs_per_op\":null}\n");
+    }
+    fflush(stdout);
+}
+
+/* as many iterations as it takes to run for BENCH_MIN_US, the last run is the one reported */
+static void measure(Bench *bench, const gchar *name, gint n_handlers, BenchFunc func)
+{
+    guint iterations, i;
+    guint64 n;
+    gint64 us;
+
+    for (iterations = 1; ; iterations *= 2) {
+        n = allocs();
+        us = g_get_monotonic_time();
+        for (i = 0; i < iterations; i++) {
+            func(bench);
+        }
+        us = g_get_monotonic_time() - us;
+        n = allocs() - n;
+        if (us >= BENCH_MIN_US || iterations >= G_MAXUINT / 2) {
+            break;
+        }
+    }
+    report(name, bench->n_devices, n_handlers, iterations, us, n);
+}
+
+static SpiceUsbDevice *next_device(Bench *bench)
+{
+    SpiceUsbDevice *device = g_ptr_array_index(bench->devices, bench->next);
+
+    bench->next = (bench->next + 1) % bench->devices->len;
+    return device;
+}
+
+static void bench_get_devices(Bench *bench)
+{
+    g_ptr_array_unref(spice_usb_device_manager_get_devices(bench->manager));
+}
+
+static void bench_get_devices_with_filter(Bench *bench)
+{
+    g_ptr_array_unref(spice_usb_device_manager_get_devices_with_filter(bench->manager, FILTER));
+}
+
+static void bench_get_description(Bench *bench)
+{
+    g_free(spice_usb_device_get_description(next_device(bench), NULL));
+}
+
+static void bench_lun_get_info(Bench *bench)
+{
+    SpiceUsbDeviceLunInfo info;
+
+    spice_usb_device_manager_device_lun_get_info(bench->manager, bench->cd, bench->load_lun,
+                                                 &info);
+    g_free((gchar *)info.file_path);
+    g_free((gchar *)info.vendor);
+    g_free((gchar *)info.product);
+    g_free((gchar *)info.revision);
+}
+
+static void bench_lun_lock(Bench *bench)
+{
+    spice_usb_device_manager_device_lun_lock(bench->manager, bench->cd, bench->load_lun, TRUE);
+    spice_usb_device_manager_device_lun_lock(bench->manager, bench->cd, bench->load_lun, FALSE);
+    spice_usb_device_manager_flush_changes(bench->manager);
+}
+
+static void bench_lun_loaded(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_device_lun_load_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                         res, &err)) {
+        g_error("the LUN was not loaded again: %s", err->message);
+    }
+    *(gboolean *)user_data = TRUE;
+}
+
+/* the load the list view does, its image opened on a thread */
+static void bench_lun_load(Bench *bench)
+{
+    gboolean loaded = FALSE;
+
+    if (!spice_usb_device_manager_device_lun_load(bench->manager, bench->cd,
+                                                  bench->load_lun, FALSE)) {
+        g_error("the LUN was not ejected");
+    }
+    spice_usb_device_manager_device_lun_load_async(bench->manager, bench->cd, bench->load_lun,
+                                                   NULL, bench_lun_loaded, &loaded);
+    while (!loaded) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    spice_usb_device_manager_flush_changes(bench->manager);
+}
+
+static void bench_lun_change_media(Bench *bench)
+{
+    SpiceUsbDeviceLunInfo info = { .file_path = bench->other_image };
+
+    spice_usb_device_manager_device_lun_change_media(bench->manager, bench->cd,
+                                                     bench->media_lun, &info);
+    info.file_path = bench->image;
+    spice_usb_device_manager_device_lun_change_media(bench->manager, bench->cd,
+                                                     bench->media_lun, &info);
+    spice_usb_device_manager_flush_changes(bench->manager);
+}
+
+/* the device of a LUN alone goes into the list and out of it again, LUNs spread */
+static void bench_lun_add_remove(Bench *bench)
+{
+    SpiceUsbDeviceLunInfo info = {
+        .file_path = bench->image, .vendor = "Bench", .product = "add-remove",
+        .revision = "0001", .started = TRUE,
+    };
+    SpiceUsbDevice *device;
+    GPtrArray *devices;
+
+    spice_usb_device_manager_add_cd_lun(bench->manager, &info);
+    /* a new device goes last */
+    devices = spice_usb_device_manager_get_devices(bench->manager);
+    device = g_ptr_array_index(devices, devices->len - 1);
+    if (!spice_usb_device_manager_device_lun_remove(bench->manager, device, 0)) {
+        g_error("the LUN added was not the only one of a new device");
+    }
+    g_ptr_array_unref(devices);
+}
+
+static void bench_emit(Bench *bench)
+{
+    g_signal_emit(bench->manager, bench->signal_id, 0, bench->cd);
+}
+
+static void device_changed(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                           gpointer user_data)
+{
+    (*(guint *)user_data)++;
+}
+
+/* the device of the first LUN of @product, or NULL */
+static SpiceUsbDevice *find_lun(Bench *bench, GPtrArray *devices, const gchar *product,
+                                guint *lun)
+{
+    guint i;
+
+    for (i = 0; i < devices->len; i++) {
+        SpiceUsbDevice *device = g_ptr_array_index(devices, i);
+        const SpiceUsbDeviceLunInfo *info;
+        SpiceUsbDeviceLunIter iter;
+
+        if (!spice_usb_device_manager_is_device_cd(bench->manager, device)) {
+            continue;
+        }
+        spice_usb_device_lun_iter_init(&iter, device);
+        while (spice_usb_device_lun_iter_next(&iter, lun, &info)) {
+            if (g_strcmp0(info->product, product) == 0) {
+                return device;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* adds of ADD_LUNS LUNs, each to a device with room or to a new one */
+static void bench_add_cd_lun(Bench *bench)
+{
+    SpiceUsbDeviceLunInfo info = {
+        .file_path = bench->image, .vendor = "Bench", .product = "add",
+        .revision = "0001", .started = TRUE,
+    };
+    SpiceUsbDevice *device;
+    GPtrArray *devices;
+    guint64 n;
+    gint64 us;
+    guint i, lun;
+
+    n = allocs();
+    us = g_get_monotonic_time();
+    for (i = 0; i < ADD_LUNS; i++) {
+        spice_usb_device_manager_add_cd_lun(bench->manager, &info);
+    }
+    us = g_get_monotonic_time() - us;
+    n = allocs() - n;
+    report("add_cd_lun", bench->n_devices, -1, ADD_LUNS, us, n);
+
+    for (i = 0; i < ADD_LUNS; i++) {
+        devices = spice_usb_device_manager_get_devices(bench->manager);
+        device = find_lun(bench, devices, "add", &lun);
+        if (device == NULL) {
+            g_error("%u of the LUNs added are missing", ADD_LUNS - i);
+        }
+        spice_usb_device_manager_device_lun_remove(bench->manager, device, lun);
+        g_ptr_array_unref(devices);
+    }
+    spice_usb_device_manager_flush_changes(bench->manager);
+}
+
+static void bench_signal(Bench *bench)
+{
+    static const guint n_handlers[] = { 0, 1, 10, 100 };
+    gulong *ids = g_new0(gulong, n_handlers[G_N_ELEMENTS(n_handlers) - 1]);
+    guint i, connected = 0, calls = 0;
+
+    for (i = 0; i < G_N_ELEMENTS(n_handlers); i++) {
+        for (; connected < n_handlers[i]; connected++) {
+            ids[connected] = g_signal_connect(bench->manager, "device-changed",
+                                              G_CALLBACK(device_changed), &calls);
+        }
+        measure(bench, "emit_device_changed", n_handlers[i], bench_emit);
+    }
+    for (i = 0; i < connected; i++) {
+        g_signal_handler_disconnect(bench->manager, ids[i]);
+    }
+    g_free(ids);
+}
+
+/* the uevent of device @index plugged in, its address one the CD devices left free */
+static gboolean make_uevent(Bench *bench, guint index, guint seqnum, gchar *buf, gsize *len)
+{
+    SpiceUsbHotplugEvent event = { .action = SPICE_USB_HOTPLUG_ADD };
+    static const guint8 classes[] = { 0x03, 0x0e, 0xe0, 0xff };
+
+    event.desc.busnum = 1 + index / BUS_DEVICES;
+    event.desc.devaddr = 2 + index % BUS_DEVICES;
+    if (spice_usb_device_manager_find_device_by_address(bench->manager, event.desc.busnum,
+                                                        event.desc.devaddr) != NULL) {
+        return FALSE;
+    }
+    event.desc.vid = 0x1000 + index % 4096;
+    event.desc.pid = index % 65536;
+    event.desc.device_class = classes[index % G_N_ELEMENTS(classes)];
+    event.desc.bcd_device = 0x100;
+    g_snprintf(event.name, sizeof(event.name), "%u-%u", event.desc.busnum, event.desc.devaddr);
+    *len = spice_usb_uevent_format(&event, seqnum, buf, SPICE_USB_UEVENT_BUF_SIZE);
+    return TRUE;
+}
+
+static guint count_devices(Bench *bench)
+{
+    GPtrArray *devices = spice_usb_device_manager_get_devices(bench->manager);
+    guint n = devices->len;
+
+    g_ptr_array_unref(devices);
+    return n;
+}
+
+/* plug devices in until there are @n_devices, as the kernel would tell about them */
+static void grow(Bench *bench, gint fd, const struct sockaddr_un *addr, guint *index,
+                 guint n_devices)
+{
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+    guint n_sent = count_devices(bench);
+    gsize len;
+
+    for (; n_sent < n_devices && *index < MAX_DEVICES; (*index)++) {
+        if (!make_uevent(bench, *index, *index + 1, buf, &len)) {
+            continue;
+        }
+        while (sendto(fd, buf, len, MSG_DONTWAIT, (const struct sockaddr *)addr,
+                      sizeof(*addr)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+                g_error("sendto %s: %s", addr->sun_path, g_strerror(errno));
+            }
+            g_main_context_iteration(NULL, FALSE);
+        }
+        n_sent++;
+    }
+    while (count_devices(bench) < n_sent) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    while (g_main_context_iteration(NULL, FALSE)) {
+        /* the changes of the last devices */
+    }
+}
+
+static void run(Bench *bench, guint n_devices)
+{
+    bench->n_devices = n_devices;
+    bench->devices = spice_usb_device_manager_get_devices(bench->manager);
+    bench->next = 0;
+
+    measure(bench, "get_devices", -1, bench_get_devices);
+    measure(bench, "get_devices_with_filter", -1, bench_get_devices_with_filter);
+    measure(bench, "get_description", -1, bench_get_description);
+    bench_add_cd_lun(bench);
+    measure(bench, "lun_get_info", -1, bench_lun_get_info);
+    measure(bench, "lun_lock_cycle", -1, bench_lun_lock);
+    measure(bench, "lun_load_cycle", -1, bench_lun_load);
+    measure(bench, "lun_change_media_cycle", -1, bench_lun_change_media);
+    g_object_set(bench->manager, "cd-lun-placement", SPICE_USB_CD_LUN_PLACEMENT_SPREAD, NULL);
+    measure(bench, "lun_add_remove_cycle", -1, bench_lun_add_remove);
+    g_object_set(bench->manager, "cd-lun-placement", SPICE_USB_CD_LUN_PLACEMENT_PACK, NULL);
+
+    g_ptr_array_unref(bench->devices);
+}
+
+/* the LUNs of the cycles, on whatever device they end up */
+static void add_bench_luns(Bench *bench)
+{
+    SpiceUsbDeviceLunInfo info = {
+        .file_path = bench->image, .vendor = "Bench", .product = "load",
+        .revision = "0001", .started = TRUE, .loaded = TRUE,
+    };
+    SpiceUsbDevice *media_cd;
+    GPtrArray *devices;
+
+    spice_usb_device_manager_add_cd_lun(bench->manager, &info);
+    info.product = "media";
+    info.loaded = FALSE;
+    spice_usb_device_manager_add_cd_lun(bench->manager, &info);
+
+    devices = spice_usb_device_manager_get_devices(bench->manager);
+    bench->cd = find_lun(bench, devices, "load", &bench->load_lun);
+    media_cd = find_lun(bench, devices, "media", &bench->media_lun);
+    if (bench->cd == NULL || media_cd != bench->cd) {
+        g_error("the LUNs of the benchmark are not on the same CD device");
+    }
+    g_ptr_array_unref(devices);
+    spice_usb_device_manager_flush_changes(bench->manager);
+}
+
+static gchar *make_image(const gchar *dir, const gchar *name)
+{
+    gchar *path = g_build_filename(dir, name, NULL);
+    gchar *data = g_malloc0(IMAGE_SIZE);
+    GError *err = NULL;
+
+    if (!g_file_set_contents(path, data, IMAGE_SIZE, &err)) {
+        g_error("%s", err->message);
+    }
+    g_free(data);
+    return path;
+}
+
+int main(void)
+{
+    static const guint n_devices[] = { 10, 100, 1000, 10000, MAX_DEVICES - 600 };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    Bench bench = { NULL, };
+    GError *err = NULL;
+    gchar *dir, *sysfs, *socket_path;
+    guint i, index = 0;
+    gint fd;
+
+    /* no device of this machine, only the ones plugged in through the socket */
+    dir = g_dir_make_tmp("bench-usb-manager-XXXXXX", &err);
+    if (dir == NULL) {
+        g_error("%s", err->message);
+    }
+    sysfs = g_build_filename(dir, "sysfs", NULL);
+    socket_path = g_build_filename(dir, "uevents", NULL);
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        g_error("%s: name too long", socket_path);
+    }
+    strcpy(addr.sun_path, socket_path);
+    g_mkdir(sysfs, 0700);
+    g_setenv(SPICE_USB_SOURCE_ENV, "sysfs", TRUE);
+    g_setenv("SPICE_USB_SYSFS_ROOT", sysfs, TRUE);
+    g_setenv("SPICE_USB_UEVENT_SOCKET", socket_path, TRUE);
+    bench.image = make_image(dir, "a.iso");
+    bench.other_image = make_image(dir, "b.iso");
+
+    g_set_print_handler(quiet);
+    bench.manager = spice_usb_device_manager_get(g_object_new(SPICE_TYPE_SESSION, NULL), &err);
+    if (bench.manager == NULL) {
+        g_error("%s", err->message);
+    }
+    bench.signal_id = g_signal_lookup("device-changed", SPICE_TYPE_USB_DEVICE_MANAGER);
+    add_bench_luns(&bench);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        g_error("socket: %s", g_strerror(errno));
+    }
+    for (i = 0; i < G_N_ELEMENTS(n_devices); i++) {
+        grow(&bench, fd, &addr, &index, n_devices[i]);
+        run(&bench, n_devices[i]);
+    }
+    bench_signal(&bench);
+    close(fd);
+
+    g_unlink(bench.image);
+    g_unlink(bench.other_image);
+    g_unlink(socket_path);
+    g_rmdir(sysfs);
+    g_rmdir(dir);
+    g_free(bench.image);
+    g_free(bench.other_image);
+    g_free(socket_path);
+    g_free(sysfs);
+    g_free(dir);
+    return 0;
+}
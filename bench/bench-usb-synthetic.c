@@ -0,0 +1,226 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Synthetic source benchmark: enumerates 1000 to 30000 generated
+   devices, then lets the source plug devices in and out in bursts for
+   a while and reads its uevents through the hotplug source, as the
+   manager does. Checks that the devices are the same from one source
+   to the next with the same seed, and that each device plugged in is
+   reported as the one of its address.
+
+   usage: bench-usb-synthetic [OPTIONS]
+   With OPTIONS, as for $SPICE_USB_SOURCE=synthetic:OPTIONS, only that
+   configuration is run.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "usb-device-source.h"
+#include "usb-hotplug.h"
+
+#define RUN_MS  1000
+/* addresses of a bus, as the source lays its devices out */
+#define BUS_DEVICES 120
+#define MAX_SLOTS   (255 * BUS_DEVICES)
+
+typedef struct {
+    SpiceUsbDeviceDesc *slots;  /* what each address holds, from a reference source */
+    guint8 *present;
+    guint n_present;
+    guint n_adds;
+    guint n_removes;
+    guint n_wrong;
+} BenchResult;
+
+static inline guint slot_of(const SpiceUsbDeviceDesc *desc)
+{
+    return (desc->busnum - 1) * BUS_DEVICES + desc->devaddr - 2;
+}
+
+static void found(const SpiceUsbDeviceDesc *descs, guint n_descs, gpointer user_data)
+{
+    BenchResult *result = user_data;
+    guint i;
+
+    for (i = 0; i < n_descs; i++) {
+        guint slot = slot_of(&descs[i]);
+
+        if (result->slots != NULL) {
+            if (memcmp(&result->slots[slot], &descs[i], sizeof(descs[i])) != 0) {
+                result->n_wrong++;
+            }
+            if (!result->present[slot]) {
+                result->present[slot] = TRUE;
+                result->n_present++;
+            }
+        }
+    }
+}
+
+/* every address, as a source with all of them plugged in sees them */
+static void record_slots(const SpiceUsbDeviceDesc *descs, guint n_descs, gpointer user_data)
+{
+    SpiceUsbDeviceDesc *slots = user_data;
+    guint i;
+
+    for (i = 0; i < n_descs; i++) {
+        slots[slot_of(&descs[i])] = descs[i];
+    }
+}
+
+static void reported(const SpiceUsbHotplugEvent *events, guint n_events, gpointer user_data)
+{
+    BenchResult *result = user_data;
+    guint i;
+
+    for (i = 0; i < n_events; i++) {
+        const SpiceUsbHotplugEvent *e = &events[i];
+        const SpiceUsbDeviceDesc *slot = &result->slots[slot_of(&e->desc)];
+        gboolean add = e->action == SPICE_USB_HOTPLUG_ADD;
+
+        if (add && (slot->vid != e->desc.vid || slot->pid != e->desc.pid ||
+                    slot->device_class != e->desc.device_class)) {
+            result->n_wrong++;
+        }
+        if (result->present[slot_of(&e->desc)] != add) {
+            result->n_present += add ? 1 : -1;
+        }
+        result->present[slot_of(&e->desc)] = add;
+        if (add) {
+            result->n_adds++;
+        } else {
+            result->n_removes++;
+        }
+    }
+}
+
+static void run(const SpiceUsbSyntheticConfig *config)
+{
+    SpiceUsbSyntheticConfig all = *config;
+    BenchResult result = { NULL, };
+    SpiceUsbHotplugStats stats;
+    SpiceUsbDeviceSource *source;
+    GSource *hotplug;
+    GError *err = NULL;
+    gint64 start, enumerated;
+    gint fd;
+
+    result.slots = g_new0(SpiceUsbDeviceDesc, MAX_SLOTS);
+    result.present = g_new0(guint8, MAX_SLOTS);
+    all.n_devices = MAX_SLOTS;
+    source = spice_usb_device_source_new_synthetic(&all);
+    spice_usb_device_source_enumerate(source, record_slots, result.slots, NULL);
+    spice_usb_device_source_free(source);
+
+    source = spice_usb_device_source_new_synthetic(config);
+    start = g_get_monotonic_time();
+    if (!spice_usb_device_source_enumerate(source, found, &result, &err)) {
+        g_error("%s", err->message);
+    }
+    enumerated = g_get_monotonic_time() - start;
+    if (result.n_present != config->n_devices || result.n_wrong > 0) {
+        g_error("%u devices enumerated, %u not as expected, instead of %u",
+                result.n_present, result.n_wrong, config->n_devices);
+    }
+
+    fd = spice_usb_device_source_open_uevents(source, &err);
+    if (fd < 0) {
+        g_error("%s", err->message);
+    }
+    hotplug = spice_usb_hotplug_source_new(fd);
+    spice_usb_hotplug_source_set_func(hotplug, reported, &result);
+    spice_usb_hotplug_source_set_debounce(hotplug, 5, 50);
+    g_source_attach(hotplug, NULL);
+    start = g_get_monotonic_time();
+    while (g_get_monotonic_time() - start < RUN_MS * 1000) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    spice_usb_device_source_free(source);
+    spice_usb_hotplug_source_flush(hotplug);
+    spice_usb_hotplug_source_get_stats(hotplug, &stats);
+    if (result.n_wrong > 0) {
+        g_error("%u devices were not reported as the ones of their address", result.n_wrong);
+    }
+
+    g_print("%6u devices: enumerated in %6" G_GINT64_FORMAT " us %9.0f devices/s, "
+            "%7" G_GUINT64_FORMAT " uevents/s, %6u added %6u removed "
+            "(%" G_GUINT64_FORMAT " merged), %6u present\n",
+            config->n_devices, enumerated, config->n_devices / (MAX(enumerated, 1) / 1e6),
+            stats.uevents * 1000 / RUN_MS, result.n_adds, result.n_removes, stats.merged,
+            result.n_present);
+
+    g_source_destroy(hotplug);
+    g_source_unref(hotplug);
+    g_free(result.present);
+    g_free(result.slots);
+}
+
+static void check_parse(void)
+{
+    static const gchar *invalid[] = {
+        "devices", "devices=-1", "devices=1000000", "hotplug=fast", "nodes=10",
+    };
+    SpiceUsbSyntheticConfig config;
+    GError *err = NULL;
+    guint i;
+
+    if (!spice_usb_synthetic_config_parse("devices=10,luns=2,hotplug=0.5,burst=4,connect=1,"
+                                          "media=2,seed=7,image=/tmp/a.iso", &config, &err)) {
+        g_error("%s", err->message);
+    }
+    if (config.n_devices != 10 || config.n_luns != 2 || config.hotplug_rate != 0.5 ||
+        config.hotplug_burst != 4 || config.connect_rate != 1 || config.media_rate != 2 ||
+        config.seed != 7 || g_strcmp0(config.image, "/tmp/a.iso") != 0) {
+        g_error("the synthetic options were not parsed as given");
+    }
+    spice_usb_synthetic_config_clear(&config);
+    for (i = 0; i < G_N_ELEMENTS(invalid); i++) {
+        if (spice_usb_synthetic_config_parse(invalid[i], &config, &err)) {
+            g_error("\"%s\" was accepted", invalid[i]);
+        }
+        g_clear_error(&err);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const guint n_devices[] = { 1000, 10000, 30000 };
+    SpiceUsbSyntheticConfig config;
+    GError *err = NULL;
+    guint i;
+
+    check_parse();
+    if (argc > 1) {
+        if (!spice_usb_synthetic_config_parse(argv[1], &config, &err)) {
+            g_error("%s", err->message);
+        }
+        run(&config);
+        spice_usb_synthetic_config_clear(&config);
+        return 0;
+    }
+    for (i = 0; i < G_N_ELEMENTS(n_devices); i++) {
+        gchar *options = g_strdup_printf("devices=%u,hotplug=2000,burst=50", n_devices[i]);
+
+        if (!spice_usb_synthetic_config_parse(options, &config, &err)) {
+            g_error("%s", err->message);
+        }
+        run(&config);
+        spice_usb_synthetic_config_clear(&config);
+        g_free(options);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   sysfs enumeration benchmark: generates sysfs-like trees of 100 to
+   10000 devices, each with an interface entry and one hub in 16, checks
+   that enumerating them finds every device with its attributes, and
+   times the enumeration with one thread and with the default threads.
+
+   usage: bench-usb-sysfs [ROOT]
+   With ROOT, as /sys/bus/usb/devices, only that tree is enumerated and
+   its devices listed.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "usb-device-source.h"
+
+#define BENCH_RUNS 5
+
+typedef struct {
+    GMutex lock;
+    guint n_devices;
+    guint n_batches;
+    guint64 sum;        /* of what the fixture wrote, whatever the order */
+    gboolean print;
+} BenchResult;
+
+static void write_attr(const gchar *dir, const gchar *attr, const gchar *value)
+{
+    gchar *path = g_build_filename(dir, attr, NULL);
+    GError *err = NULL;
+
+    if (!g_file_set_contents(path, value, -1, &err)) {
+        g_error("%s", err->message);
+    }
+    g_free(path);
+}
+
+static guint64 device_sum(guint vid, guint pid, guint busnum, guint devnum, guint32 speed,
+                          const gchar *serial)
+{
+    return ((guint64)vid << 40) + ((guint64)pid << 24) + (busnum << 16) + (devnum << 8) +
+           speed + strlen(serial);
+}
+
+/* @n_devices spread over buses of 100, each device with an interface entry */
+static gchar *make_tree(guint n_devices, guint64 *sum)
+{
+    static const gchar *speeds[] = { "1.5", "12", "480", "5000" };
+    static const guint32 kbps[] = { 1500, 12000, 480000, 5000000 };
+    GError *err = NULL;
+    gchar *root, *dir;
+    gchar value[64], serial[16];
+    guint i;
+
+    root = g_dir_make_tmp("bench-usb-sysfs-XXXXXX", &err);
+    if (root == NULL) {
+        g_error("%s", err->message);
+    }
+    *sum = 0;
+    for (i = 0; i < n_devices; i++) {
+        guint busnum = 1 + i / 100, devnum = 2 + i % 100;
+        guint vid = 0x1000 + i % 4096, pid = i % 65536;
+        gboolean hub = i % 16 == 15;
+        gchar *name = g_strdup_printf("%u-%u", busnum, devnum);
+
+        dir = g_build_filename(root, name, NULL);
+        if (g_mkdir(dir, 0755) < 0) {
+            g_error("%s: %s", dir, g_strerror(errno));
+        }
+        g_snprintf(value, sizeof(value), "%04x\n", vid);
+        write_attr(dir, "idVendor", value);
+        g_snprintf(value, sizeof(value), "%04x\n", pid);
+        write_attr(dir, "idProduct", value);
+        g_snprintf(value, sizeof(value), "%02x\n", hub ? 0x09u : 0x00u);
+        write_attr(dir, "bDeviceClass", value);
+        write_attr(dir, "bcdDevice", "0100\n");
+        g_snprintf(value, sizeof(value), "%u\n", busnum);
+        write_attr(dir, "busnum", value);
+        g_snprintf(value, sizeof(value), "%u\n", devnum);
+        write_attr(dir, "devnum", value);
+        write_attr(dir, "speed", speeds[i % G_N_ELEMENTS(speeds)]);
+        serial[0] = '\0';
+        if (i % 2 == 0) {
+            g_snprintf(serial, sizeof(serial), "SN%08u", i);
+            g_snprintf(value, sizeof(value), "%s\n", serial);
+            write_attr(dir, "serial", value);
+        }
+        g_free(dir);
+
+        /* interfaces are listed next to the devices */
+        dir = g_strdup_printf("%s/%s:1.0", root, name);
+        if (g_mkdir(dir, 0755) < 0) {
+            g_error("%s: %s", dir, g_strerror(errno));
+        }
+        write_attr(dir, "bInterfaceClass", "08\n");
+        g_free(dir);
+        g_free(name);
+
+        if (!hub) {
+            *sum += device_sum(vid, pid, busnum, devnum, kbps[i % G_N_ELEMENTS(kbps)], serial);
+        }
+    }
+    return root;
+}
+
+static void remove_tree(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+
+    if (dir != NULL) {
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            gchar *child = g_build_filename(path, name, NULL);
+
+            remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_remove(path);
+}
+
+static void found(const SpiceUsbDeviceDesc *descs, guint n_descs, gpointer user_data)
+{
+    BenchResult *result = user_data;
+    guint i;
+
+    g_mutex_lock(&result->lock);
+    result->n_batches++;
+    for (i = 0; i < n_descs; i++) {
+        const SpiceUsbDeviceDesc *d = &descs[i];
+
+        result->n_devices++;
+        result->sum += device_sum(d->vid, d->pid, d->busnum, d->devaddr, d->speed, d->serial);
+        if (result->print) {
+            g_print("%03u:%03u %04x:%04x class %02x bcd %04x %6.1f Mbit/s %s\n",
+                    d->busnum, d->devaddr, d->vid, d->pid, d->device_class,
+                    d->bcd_device, d->speed / 1000.0, d->serial);
+        }
+    }
+    g_mutex_unlock(&result->lock);
+}
+
+static gint64 enumerate(const gchar *root, guint max_threads, BenchResult *result)
+{
+    SpiceUsbDeviceSource *source = spice_usb_device_source_new_sysfs(root, max_threads);
+    GError *err = NULL;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    if (!spice_usb_device_source_enumerate(source, found, result, &err)) {
+        g_error("%s", err->message);
+    }
+    start = g_get_monotonic_time() - start;
+    spice_usb_device_source_free(source);
+    return start;
+}
+
+static void bench(guint n_devices)
+{
+    static const guint threads[] = { 1, 0 };
+    guint64 sum;
+    gchar *root = make_tree(n_devices, &sum);
+    guint t, run;
+
+    for (t = 0; t < G_N_ELEMENTS(threads); t++) {
+        gint64 best = G_MAXINT64;
+        BenchResult result;
+
+        g_mutex_init(&result.lock);
+        for (run = 0; run < BENCH_RUNS; run++) {
+            gint64 elapsed;
+
+            result.n_devices = result.n_batches = 0;
+            result.sum = 0;
+            result.print = FALSE;
+            elapsed = enumerate(root, threads[t], &result);
+            best = MIN(best, elapsed);
+            if (result.sum != sum) {
+                g_error("%s: %u devices do not match the tree", root, result.n_devices);
+            }
+        }
+        g_mutex_clear(&result.lock);
+        g_print("%6u entries, %s: %6u devices in %3u batches %9" G_GINT64_FORMAT
+                " us %10.0f devices/s\n",
+                n_devices, threads[t] == 1 ? "1 thread " : "threads  ", result.n_devices,
+                result.n_batches, best, result.n_devices / (MAX(best, 1) / 1e6));
+    }
+    remove_tree(root);
+    g_free(root);
+}
+
+int main(int argc, char *argv[])
+{
+    static const guint n_devices[] = { 100, 1000, 10000 };
+    guint i;
+
+    if (argc > 1) {
+        BenchResult result = { .print = TRUE };
+        gint64 elapsed;
+
+        g_mutex_init(&result.lock);
+        elapsed = enumerate(argv[1], 0, &result);
+
+        g_print("%u devices in %" G_GINT64_FORMAT " us\n", result.n_devices, elapsed);
+        return 0;
+    }
+    for (i = 0; i < G_N_ELEMENTS(n_devices); i++) {
+        bench(n_devices[i]);
+    }
+    return 0;
+}
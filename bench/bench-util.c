@@ -0,0 +1,84 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Helpers shared by the benchmarks.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "cd-image.h"
+#include "bench-util.h"
+
+void bench_fill_lba(guint8 *block, guint64 lba, gpointer user_data)
+{
+    memset(block, 0xcd, SPICE_CD_IMAGE_BLOCK_SIZE);
+    memcpy(block, &lba, sizeof(lba));
+}
+
+/*
+ * a temporary "@prefix-XXXXXX.iso" of @size bytes, block by block from
+ * @fill, or bench_fill_lba() if %NULL
+ */
+gchar *bench_make_image(const gchar *prefix, gsize size, BenchBlockFunc fill,
+                        gpointer user_data)
+{
+    guint8 block[SPICE_CD_IMAGE_BLOCK_SIZE];
+    gchar *tmpl = g_strdup_printf("%s-XXXXXX.iso", prefix);
+    GError *err = NULL;
+    gchar *path;
+    guint64 lba;
+    gint fd;
+
+    fd = g_file_open_tmp(tmpl, &path, &err);
+    g_free(tmpl);
+    if (fd < 0) {
+        g_error("%s", err->message);
+    }
+    if (fill == NULL) {
+        fill = bench_fill_lba;
+    }
+    for (lba = 0; lba < size / sizeof(block); lba++) {
+        fill(block, lba, user_data);
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            g_error("%s: %s", path, g_strerror(errno));
+        }
+    }
+    fsync(fd);
+    close(fd);
+    return path;
+}
+
+/* evict the clean pages of the file, works without privileges */
+void bench_drop_cache(const gchar *path)
+{
+    gint fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* for qsort() of latencies */
+gint bench_compare_u64(gconstpointer a, gconstpointer b)
+{
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return x < y ? -1 : x > y;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Helpers shared by the benchmarks.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_BENCH_UTIL_H__
+#define __SPICE_BENCH_UTIL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* fills the block at @lba of a generated image */
+typedef void (*BenchBlockFunc)(guint8 *block, guint64 lba, gpointer user_data);
+
+/* every block starts with its LBA, so misplaced reads show */
+void bench_fill_lba(guint8 *block, guint64 lba, gpointer user_data);
+
+gchar *bench_make_image(const gchar *prefix, gsize size, BenchBlockFunc fill,
+                        gpointer user_data);
+void bench_drop_cache(const gchar *path);
+gint bench_compare_u64(gconstpointer a, gconstpointer b);
+
+G_END_DECLS
+
+#endif /* __SPICE_BENCH_UTIL_H__ */
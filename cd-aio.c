@@ -0,0 +1,514 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+#include "cd-aio.h"
+
+/* pread() workers of the fallback, reads beyond that wait in the pool */
+#define AIO_MAX_THREADS 4
+
+/* before submitting again entries the kernel had no room for, if nothing completes */
+#define AIO_RETRY_MS 1
+
+#ifndef G_SOURCE_FUNC
+#define G_SOURCE_FUNC(f) ((GSourceFunc) (void (*)(void)) (f))
+#endif
+
+typedef struct _SpiceCdAioOp {
+    GList link;         /* in aio->queued, or aio->done once read */
+    gint fd;
+    guint64 offset;
+    guint8 *buf;
+    gsize len;
+    gsize done;         /* bytes read so far */
+    gssize result;      /* -errno, or the bytes read once complete */
+    SpiceCdAioFunc func;
+    gpointer user_data;
+} SpiceCdAioOp;
+
+struct _SpiceCdAio {
+    GMainContext *context;
+    guint queue_depth;
+    GQueue queued;          /* not submitted yet */
+    GSource *submit_source; /* pending batch submission */
+    SpiceCdAioStats stats;
+
+#ifdef HAVE_LIBURING
+    gboolean uring;         /* reads go through the ring, until a submission fails for good */
+    gboolean ring_open;
+    struct io_uring ring;
+    gint event_fd;          /* signalled by the ring on completions */
+    GSource *uring_source;
+    GQueue unsubmitted;     /* prepared in the ring, not taken by the kernel yet */
+    guint ring_in_flight;   /* taken by the kernel, not complete yet */
+    GSource *retry_source;
+#endif
+
+    /* pread() fallback */
+    GThreadPool *workers;
+    GSource *threads_source;
+    GMutex lock;            /* protects done */
+    GQueue done;
+    gint wakeup[2];         /* written to when done stops being empty */
+};
+
+static void aio_complete(SpiceCdAio *aio, SpiceCdAioOp *op)
+{
+    aio->stats.reads++;
+    if (op->result > 0) {
+        aio->stats.bytes += op->result;
+    }
+    op->func(op->result, op->user_data);
+    g_free(op);
+}
+
+static void aio_schedule_submit(SpiceCdAio *aio);
+static void aio_threads_init(SpiceCdAio *aio);
+
+#ifdef HAVE_LIBURING
+static gboolean aio_retry_cb(gpointer user_data);
+
+/* the completions that are coming submit again, otherwise a timer does */
+static void aio_schedule_retry(SpiceCdAio *aio)
+{
+    if (aio->ring_in_flight > 0 || aio->retry_source != NULL) {
+        return;
+    }
+    aio->retry_source = g_timeout_source_new(AIO_RETRY_MS);
+    g_source_set_callback(aio->retry_source, aio_retry_cb, aio, NULL);
+    g_source_attach(aio->retry_source, aio->context);
+    g_source_unref(aio->retry_source);
+}
+
+/* the ring is no use, the reads it did not take go to the pread() workers */
+static void aio_uring_fail(SpiceCdAio *aio)
+{
+    GList *link;
+
+    aio->uring = FALSE;
+    while ((link = g_queue_pop_tail_link(&aio->unsubmitted)) != NULL) {
+        g_queue_push_head_link(&aio->queued, link);
+        aio->stats.in_flight--;
+    }
+    if (aio->workers == NULL) {
+        aio_threads_init(aio);
+    }
+    aio_schedule_submit(aio);
+}
+
+/* pass the prepared entries to the kernel, in order, the ones it did not take wait */
+static void aio_uring_submit(SpiceCdAio *aio)
+{
+    gint ret = io_uring_submit(&aio->ring);
+
+    if (ret >= 0) {
+        aio->ring_in_flight += ret;
+        for (; ret > 0; ret--) {
+            g_queue_pop_head_link(&aio->unsubmitted);
+        }
+        if (!g_queue_is_empty(&aio->unsubmitted)) {
+            aio_schedule_retry(aio);
+        }
+        return;
+    }
+    /* short of memory for now, or completions to reap first */
+    if (ret == -EAGAIN || ret == -EBUSY || ret == -EINTR) {
+        aio_schedule_retry(aio);
+        return;
+    }
+    g_warning("io_uring submission failed, reading with threads: %s", g_strerror(-ret));
+    aio_uring_fail(aio);
+}
+#endif
+
+/* hand the queued reads over, as many as the queue depth allows */
+static void aio_submit(SpiceCdAio *aio)
+{
+    guint n = 0;
+
+    while (aio->stats.in_flight < aio->queue_depth && !g_queue_is_empty(&aio->queued)) {
+        SpiceCdAioOp *op = g_queue_peek_head(&aio->queued);
+
+#ifdef HAVE_LIBURING
+        if (aio->uring) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&aio->ring);
+
+            if (sqe == NULL) {
+                break;
+            }
+            io_uring_prep_read(sqe, op->fd, op->buf + op->done,
+                               MIN(op->len - op->done, G_MAXINT), op->offset + op->done);
+            io_uring_sqe_set_data(sqe, op);
+        }
+#endif
+        /* unlinked first, a worker may queue it as done right away */
+        g_queue_unlink(&aio->queued, &op->link);
+#ifdef HAVE_LIBURING
+        if (aio->uring) {
+            g_queue_push_tail_link(&aio->unsubmitted, &op->link);
+        } else
+#endif
+        {
+            g_thread_pool_push(aio->workers, op, NULL);
+        }
+        aio->stats.in_flight++;
+        n++;
+    }
+
+#ifdef HAVE_LIBURING
+    /* with the entries left over by an earlier submission */
+    if (aio->uring && !g_queue_is_empty(&aio->unsubmitted)) {
+        aio_uring_submit(aio);
+    }
+#endif
+    if (n == 0) {
+        return;
+    }
+    aio->stats.batches++;
+    aio->stats.max_in_flight = MAX(aio->stats.max_in_flight, aio->stats.in_flight);
+}
+
+static gboolean aio_submit_cb(gpointer user_data)
+{
+    SpiceCdAio *aio = user_data;
+
+    aio->submit_source = NULL;
+    aio_submit(aio);
+    return G_SOURCE_REMOVE;
+}
+
+/* everything queued until the main loop gets back here goes in one batch */
+static void aio_schedule_submit(SpiceCdAio *aio)
+{
+    GSource *source;
+
+    if (aio->submit_source != NULL) {
+        return;
+    }
+    source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+    g_source_set_callback(source, aio_submit_cb, aio, NULL);
+    g_source_attach(source, aio->context);
+    aio->submit_source = source;
+    g_source_unref(source);
+}
+
+/* deliver the completed reads, once the queue has been refilled */
+static void aio_dispatch(SpiceCdAio *aio, GQueue *complete)
+{
+    GList *link;
+
+    aio_submit(aio);
+    while ((link = g_queue_pop_head_link(complete)) != NULL) {
+        aio_complete(aio, link->data);
+    }
+}
+
+#ifdef HAVE_LIBURING
+static gboolean aio_retry_cb(gpointer user_data)
+{
+    SpiceCdAio *aio = user_data;
+
+    aio->retry_source = NULL;
+    aio_submit(aio);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean aio_uring_ready(gint fd, GIOCondition condition, gpointer user_data)
+{
+    SpiceCdAio *aio = user_data;
+    GQueue complete = G_QUEUE_INIT;
+    struct io_uring_cqe *cqe;
+    eventfd_t count;
+
+    eventfd_read(fd, &count);
+    while (io_uring_peek_cqe(&aio->ring, &cqe) == 0) {
+        SpiceCdAioOp *op = io_uring_cqe_get_data(cqe);
+        gint res = cqe->res;
+
+        io_uring_cqe_seen(&aio->ring, cqe);
+        aio->ring_in_flight--;
+        aio->stats.in_flight--;
+        if (res > 0) {
+            op->done += res;
+        }
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && op->done < op->len)) {
+            /* the rest goes again, ahead of the newer reads */
+            g_queue_push_head_link(&aio->queued, &op->link);
+            continue;
+        }
+        op->result = res < 0 ? res : (gssize)op->done;
+        g_queue_push_tail_link(&complete, &op->link);
+    }
+    aio_dispatch(aio, &complete);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean aio_uring_init(SpiceCdAio *aio)
+{
+    gint ret;
+
+    ret = io_uring_queue_init(aio->queue_depth, &aio->ring, 0);
+    if (ret < 0) {
+        SPICE_DEBUG("io_uring is not available: %s", g_strerror(-ret));
+        return FALSE;
+    }
+    aio->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (aio->event_fd < 0 || io_uring_register_eventfd(&aio->ring, aio->event_fd) < 0) {
+        SPICE_DEBUG("io_uring completions can not be signalled");
+        if (aio->event_fd >= 0) {
+            close(aio->event_fd);
+        }
+        io_uring_queue_exit(&aio->ring);
+        return FALSE;
+    }
+    aio->uring = TRUE;
+    aio->ring_open = TRUE;
+    aio->uring_source = g_unix_fd_source_new(aio->event_fd, G_IO_IN);
+    g_source_set_callback(aio->uring_source, G_SOURCE_FUNC(aio_uring_ready), aio, NULL);
+    g_source_attach(aio->uring_source, aio->context);
+    return TRUE;
+}
+#endif
+
+/* pread() the whole range in a worker thread */
+static void aio_worker(gpointer data, gpointer user_data)
+{
+    SpiceCdAioOp *op = data;
+    SpiceCdAio *aio = user_data;
+    gboolean wake;
+    guint8 byte = 0;
+
+    while (op->done < op->len) {
+        gssize n = pread(op->fd, op->buf + op->done, op->len - op->done,
+                         op->offset + op->done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            op->result = -errno;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        op->done += n;
+    }
+    if (op->result == 0) {
+        op->result = op->done;
+    }
+
+    g_mutex_lock(&aio->lock);
+    wake = g_queue_is_empty(&aio->done);
+    g_queue_push_tail_link(&aio->done, &op->link);
+    g_mutex_unlock(&aio->lock);
+
+    /* a full pipe already has the main loop coming */
+    if (wake && write(aio->wakeup[1], &byte, 1) < 0 && errno != EAGAIN) {
+        g_warning("CD read completion lost: %s", g_strerror(errno));
+    }
+}
+
+static gboolean aio_threads_ready(gint fd, GIOCondition condition, gpointer user_data)
+{
+    SpiceCdAio *aio = user_data;
+    GQueue complete;
+    guint8 buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    g_mutex_lock(&aio->lock);
+    complete = aio->done;
+    g_queue_init(&aio->done);
+    g_mutex_unlock(&aio->lock);
+
+    aio->stats.in_flight -= g_queue_get_length(&complete);
+    aio_dispatch(aio, &complete);
+    return G_SOURCE_CONTINUE;
+}
+
+static void aio_threads_init(SpiceCdAio *aio)
+{
+    GError *err = NULL;
+
+    /* like the wakeup pipe of a GMainContext, there is no going on without */
+    if (!g_unix_open_pipe(aio->wakeup, FD_CLOEXEC, &err) ||
+        !g_unix_set_fd_nonblocking(aio->wakeup[0], TRUE, &err) ||
+        !g_unix_set_fd_nonblocking(aio->wakeup[1], TRUE, &err)) {
+        g_error("CD read completion pipe: %s", err->message);
+    }
+    aio->workers = g_thread_pool_new(aio_worker, aio, AIO_MAX_THREADS, FALSE, NULL);
+    aio->threads_source = g_unix_fd_source_new(aio->wakeup[0], G_IO_IN);
+    g_source_set_callback(aio->threads_source, G_SOURCE_FUNC(aio_threads_ready), aio, NULL);
+    g_source_attach(aio->threads_source, aio->context);
+}
+
+/**
+ * spice_cd_aio_new:
+ * @queue_depth: the most reads in flight, 0 for the default
+ *
+ * Create a read context completing in the thread default main context.
+ * io_uring is used when the kernel allows it, unless
+ * $SPICE_CD_AIO_THREADS is set, which forces the pread() fallback.
+ *
+ * Returns: a new #SpiceCdAio
+ */
+SpiceCdAio *spice_cd_aio_new(guint queue_depth)
+{
+    SpiceCdAio *aio = g_new0(SpiceCdAio, 1);
+
+    aio->context = g_main_context_ref_thread_default();
+    aio->queue_depth = queue_depth ? queue_depth : SPICE_CD_AIO_DEFAULT_QUEUE_DEPTH;
+    g_queue_init(&aio->queued);
+    g_queue_init(&aio->done);
+    g_mutex_init(&aio->lock);
+    aio->wakeup[0] = aio->wakeup[1] = -1;
+
+#ifdef HAVE_LIBURING
+    g_queue_init(&aio->unsubmitted);
+    if (g_getenv("SPICE_CD_AIO_THREADS") != NULL || !aio_uring_init(aio))
+#endif
+    {
+        aio_threads_init(aio);
+    }
+    return aio;
+}
+
+/**
+ * spice_cd_aio_free:
+ * @aio: a #SpiceCdAio
+ *
+ * Wait for the reads in flight, their buffers must stay valid until
+ * then, and drop them with the queued ones without calling back.
+ */
+void spice_cd_aio_free(SpiceCdAio *aio)
+{
+    GList *link;
+
+    if (aio == NULL) {
+        return;
+    }
+
+    if (aio->submit_source != NULL) {
+        g_source_destroy(aio->submit_source);
+    }
+
+#ifdef HAVE_LIBURING
+    if (aio->ring_open) {
+        struct io_uring_cqe *cqe;
+
+        if (aio->retry_source != NULL) {
+            g_source_destroy(aio->retry_source);
+        }
+        g_source_destroy(aio->uring_source);
+        g_source_unref(aio->uring_source);
+        while (aio->ring_in_flight > 0 && io_uring_wait_cqe(&aio->ring, &cqe) == 0) {
+            g_free(io_uring_cqe_get_data(cqe));
+            io_uring_cqe_seen(&aio->ring, cqe);
+            aio->ring_in_flight--;
+        }
+        io_uring_queue_exit(&aio->ring);
+        close(aio->event_fd);
+        while ((link = g_queue_pop_head_link(&aio->unsubmitted)) != NULL) {
+            g_free(link->data);
+        }
+    }
+#endif
+    if (aio->workers != NULL) {
+        g_source_destroy(aio->threads_source);
+        g_source_unref(aio->threads_source);
+        g_thread_pool_free(aio->workers, FALSE, TRUE);
+        close(aio->wakeup[0]);
+        close(aio->wakeup[1]);
+    }
+
+    while ((link = g_queue_pop_head_link(&aio->done)) != NULL) {
+        g_free(link->data);
+    }
+    while ((link = g_queue_pop_head_link(&aio->queued)) != NULL) {
+        g_free(link->data);
+    }
+    g_mutex_clear(&aio->lock);
+    g_main_context_unref(aio->context);
+    g_free(aio);
+}
+
+/* "io_uring" or "threads" */
+const gchar *spice_cd_aio_get_backend(SpiceCdAio *aio)
+{
+#ifdef HAVE_LIBURING
+    if (aio->uring) {
+        return "io_uring";
+    }
+#endif
+    return "threads";
+}
+
+/**
+ * spice_cd_aio_read:
+ * @aio: a #SpiceCdAio
+ * @fd: the file to read
+ * @offset: where to read from
+ * @buf: where to read to, valid until @func is called
+ * @len: the number of bytes to read
+ * @func: called in the main context of @aio once the read is complete
+ * @user_data: data for @func
+ *
+ * Queue a read for the next batch. @func is never called from here, nor
+ * from another thread.
+ */
+void spice_cd_aio_read(SpiceCdAio *aio, gint fd, guint64 offset,
+                       gpointer buf, gsize len,
+                       SpiceCdAioFunc func, gpointer user_data)
+{
+    SpiceCdAioOp *op;
+
+    g_return_if_fail(fd >= 0);
+    g_return_if_fail(buf != NULL || len == 0);
+    g_return_if_fail(func != NULL);
+
+    op = g_new0(SpiceCdAioOp, 1);
+    op->link.data = op;
+    op->fd = fd;
+    op->offset = offset;
+    op->buf = buf;
+    op->len = len;
+    op->func = func;
+    op->user_data = user_data;
+    g_queue_push_tail_link(&aio->queued, &op->link);
+    aio_schedule_submit(aio);
+}
+
+/* submit the queued reads now rather than at the end of the iteration */
+void spice_cd_aio_flush(SpiceCdAio *aio)
+{
+    aio_submit(aio);
+}
+
+void spice_cd_aio_get_stats(SpiceCdAio *aio, SpiceCdAioStats *stats)
+{
+    *stats = aio->stats;
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CD_AIO_H__
+#define __SPICE_CD_AIO_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* reads in flight at once, for all the LUNs sharing a context */
+#define SPICE_CD_AIO_DEFAULT_QUEUE_DEPTH 128
+
+/* @result: the bytes read, short only at the end of the file, or -errno */
+typedef void (*SpiceCdAioFunc)(gssize result, gpointer user_data);
+
+typedef struct _SpiceCdAioStats {
+    guint64 reads;          /* reads completed */
+    guint64 bytes;          /* bytes read */
+    guint64 batches;        /* submissions, each carrying one or more reads */
+    guint32 in_flight;      /* reads submitted and not completed */
+    guint32 max_in_flight;
+} SpiceCdAioStats;
+
+/*
+ * Asynchronous reads of LUN backing files, completed in the main context
+ * of the thread that created the #SpiceCdAio. Reads queued during one
+ * main loop iteration are submitted together, through io_uring when it
+ * is available and a small thread pool doing pread() otherwise, or
+ * once the ring refuses a submission for good, so any number of LUNs is
+ * served without a thread of its own.
+ */
+typedef struct _SpiceCdAio SpiceCdAio;
+
+SpiceCdAio *spice_cd_aio_new(guint queue_depth);
+void spice_cd_aio_free(SpiceCdAio *aio);
+const gchar *spice_cd_aio_get_backend(SpiceCdAio *aio);
+
+void spice_cd_aio_read(SpiceCdAio *aio, gint fd, guint64 offset,
+                       gpointer buf, gsize len,
+                       SpiceCdAioFunc func, gpointer user_data);
+void spice_cd_aio_flush(SpiceCdAio *aio);
+void spice_cd_aio_get_stats(SpiceCdAio *aio, SpiceCdAioStats *stats);
+
+G_END_DECLS
+
+#endif /* __SPICE_CD_AIO_H__ */
@@ -0,0 +1,72 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   cd-image-pack: write a packed copy of an ISO image, which a CD LUN can
+   use as its file_path in place of the ISO.
+
+   usage: cd-image-pack IMAGE.iso PACKED [CHUNK_KIB]
+   CHUNK_KIB defaults to 64, smaller chunks make random reads cheaper and
+   compress worse.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cd-image.h"
+
+int main(int argc, char **argv)
+{
+    SpiceCdImage *image;
+    GError *err = NULL;
+    guint64 chunk_kib = 0;
+    GStatBuf st;
+
+    if (argc < 3 || argc > 4) {
+        g_printerr("usage: %s IMAGE.iso PACKED [CHUNK_KIB]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 4) {
+        chunk_kib = g_ascii_strtoull(argv[3], NULL, 10);
+        if (chunk_kib == 0 || chunk_kib % (SPICE_CD_IMAGE_BLOCK_SIZE / 1024) != 0 ||
+            chunk_kib * 1024 > SPICE_CD_IMAGE_PACK_MAX_CHUNK_SIZE) {
+            g_printerr("chunk size must be a multiple of %u KiB, up to %u KiB\n",
+                       (guint)(SPICE_CD_IMAGE_BLOCK_SIZE / 1024),
+                       (guint)(SPICE_CD_IMAGE_PACK_MAX_CHUNK_SIZE / 1024));
+            return 1;
+        }
+    }
+
+    if (!spice_cd_image_pack(argv[1], argv[2], chunk_kib * 1024, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+
+    /* read it back the way a LUN would */
+    image = spice_cd_image_open(argv[2], &err);
+    if (image == NULL) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    if (g_stat(argv[2], &st) == 0) {
+        g_print("%s: %" G_GUINT64_FORMAT " blocks, %" G_GUINT64_FORMAT " -> %"
+                G_GUINT64_FORMAT " bytes (%.1f%%)\n",
+                argv[2], spice_cd_image_get_n_blocks(image), spice_cd_image_get_size(image),
+                (guint64)st.st_size, 100.0 * st.st_size / spice_cd_image_get_size(image));
+    }
+    spice_cd_image_unref(image);
+    return 0;
+}
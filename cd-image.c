@@ -0,0 +1,884 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#endif
+#include "cd-image.h"
+
+/* stride of the loads faulting a mapping in */
+#define PREFETCH_PAGE_SIZE 4096
+
+/* ISO 9660 volume descriptors, from the end of the system area */
+#define ISO9660_DESCRIPTOR_LBA   16
+#define ISO9660_MAX_DESCRIPTORS  32
+#define ISO9660_TYPE_BOOT        0
+#define ISO9660_TYPE_PRIMARY     1
+#define ISO9660_TYPE_SUPPLEMENTARY 2
+#define ISO9660_TYPE_TERMINATOR  255
+#define ELTORITO_SYSTEM_ID       "EL TORITO SPECIFICATION"
+
+/* most blocks of a path table or root directory brought in by a warm-up */
+#define WARM_MAX_BLOCKS 64
+
+/* identifies the file behind a path, and its version */
+typedef struct _SpiceCdImageKey {
+    guint64 dev;
+    guint64 ino;
+    gint64 mtime_ns;
+} SpiceCdImageKey;
+
+/* an inflated chunk of a packed image */
+typedef struct _SpiceCdImageChunk {
+    GList link;     /* in image->chunk_lru once ready, least recently used first */
+    guint32 index;
+    guint32 len;
+    gboolean ready; /* inflated, until then other readers wait for it */
+    guint8 data[];
+} SpiceCdImageChunk;
+
+struct _SpiceCdImage {
+    gint ref; /* atomic, an image at 0 is being closed and is not reused */
+    SpiceCdImageKey key;
+    gchar *path;
+    GMappedFile *file;
+    gint fd;            /* kept for asynchronous reads, -1 for a packed image */
+    const guint8 *data; /* NULL for a packed image */
+    guint64 size;       /* of the original image */
+
+    /* packed images only */
+    const guint8 *packed;
+    const guint64 *chunk_index;
+    guint32 chunk_size;
+    guint32 n_chunks;
+    GMutex chunk_lock; /* protects the cache, the chunks are inflated outside */
+    GCond chunk_ready;
+    GHashTable *chunks; /* index -> SpiceCdImageChunk, ready or being inflated */
+    GQueue chunk_lru;
+    guint max_chunks;
+    GQueue inflaters; /* idle ones, reset and reused */
+};
+
+/*
+ * Process wide registry of the open images: every LUN and session using
+ * the same file shares one mapping, whatever path it was given.
+ */
+G_LOCK_DEFINE_STATIC(images);
+static GHashTable *_images = NULL; /* SpiceCdImageKey -> SpiceCdImage */
+
+static guint spice_cd_image_key_hash(gconstpointer data)
+{
+    const SpiceCdImageKey *key = data;
+    guint64 h = key->ino * 31 + key->dev;
+
+    return (guint)(h ^ (h >> 32) ^ key->mtime_ns);
+}
+
+static gboolean spice_cd_image_key_equal(gconstpointer a, gconstpointer b)
+{
+    const SpiceCdImageKey *ka = a, *kb = b;
+
+    return ka->dev == kb->dev && ka->ino == kb->ino && ka->mtime_ns == kb->mtime_ns;
+}
+
+/* uncompressed length of a chunk, the last one may be short */
+static inline guint32 spice_cd_image_chunk_len(const SpiceCdImage *image, guint32 index)
+{
+    return MIN(image->chunk_size, image->size - (guint64)index * image->chunk_size);
+}
+
+/* check the header and the index of a packed image once, reads trust them */
+static gboolean spice_cd_image_open_packed(SpiceCdImage *image, const guint8 *contents,
+                                           gsize file_size, GError **err)
+{
+    const SpiceCdImagePackHeader *header = (const SpiceCdImagePackHeader *)contents;
+    guint64 index_end, prev, offset;
+    guint32 i;
+
+    image->chunk_size = GUINT32_FROM_LE(header->chunk_size);
+    image->n_chunks = GUINT32_FROM_LE(header->n_chunks);
+    image->size = GUINT64_FROM_LE(header->image_size);
+    index_end = sizeof(*header) + ((guint64)image->n_chunks + 1) * sizeof(guint64);
+
+    if (image->chunk_size == 0 ||
+        image->chunk_size % SPICE_CD_IMAGE_BLOCK_SIZE != 0 ||
+        image->chunk_size > SPICE_CD_IMAGE_PACK_MAX_CHUNK_SIZE ||
+        image->size < SPICE_CD_IMAGE_BLOCK_SIZE ||
+        image->n_chunks != (image->size + image->chunk_size - 1) / image->chunk_size ||
+        index_end > file_size) {
+        goto corrupt;
+    }
+
+    image->packed = contents;
+    image->chunk_index = (const guint64 *)(contents + sizeof(*header));
+    prev = index_end;
+    for (i = 0; i <= image->n_chunks; i++) {
+        offset = GUINT64_FROM_LE(image->chunk_index[i]);
+        if (offset < prev || offset > file_size ||
+            (i > 0 && offset - prev > spice_cd_image_chunk_len(image, i - 1))) {
+            goto corrupt;
+        }
+        prev = offset;
+    }
+
+    g_mutex_init(&image->chunk_lock);
+    g_cond_init(&image->chunk_ready);
+    image->chunks = g_hash_table_new(NULL, NULL);
+    g_queue_init(&image->chunk_lru);
+    g_queue_init(&image->inflaters);
+    image->max_chunks = MAX(SPICE_CD_IMAGE_CHUNK_CACHE_SIZE / image->chunk_size, 4);
+    return TRUE;
+
+corrupt:
+    g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                "%s is not a valid packed CD image", image->path);
+    return FALSE;
+}
+
+static void spice_cd_image_free(SpiceCdImage *image)
+{
+    GList *link;
+
+    if (image->chunks != NULL) {
+        while ((link = g_queue_pop_head_link(&image->chunk_lru)) != NULL) {
+            g_free(link->data);
+        }
+        g_hash_table_unref(image->chunks);
+        while (!g_queue_is_empty(&image->inflaters)) {
+            g_object_unref(g_queue_pop_head(&image->inflaters));
+        }
+        g_cond_clear(&image->chunk_ready);
+        g_mutex_clear(&image->chunk_lock);
+    }
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+    g_mapped_file_unref(image->file);
+    g_free(image->path);
+    g_free(image);
+}
+
+static SpiceCdImage *spice_cd_image_map(const gchar *path, int fd,
+                                        const SpiceCdImageKey *key, GError **err)
+{
+    SpiceCdImage *image;
+    GMappedFile *file;
+    const guint8 *contents;
+    gsize size;
+
+    file = g_mapped_file_new_from_fd(fd, FALSE, err);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    size = g_mapped_file_get_length(file);
+    if (size < SPICE_CD_IMAGE_BLOCK_SIZE) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is too small for a CD image", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    contents = (const guint8 *)g_mapped_file_get_contents(file);
+
+    image = g_new0(SpiceCdImage, 1);
+    image->ref = 1;
+    image->key = *key;
+    image->path = g_strdup(path);
+    image->file = file;
+    image->fd = -1;
+
+    /* an ISO starts with 32 KiB of zeroes, it cannot look packed */
+    if (memcmp(contents, SPICE_CD_IMAGE_PACK_MAGIC,
+               sizeof(((SpiceCdImagePackHeader *)NULL)->magic)) == 0) {
+        if (!spice_cd_image_open_packed(image, contents, size, err)) {
+            spice_cd_image_free(image);
+            return NULL;
+        }
+        return image;
+    }
+
+    image->data = contents;
+    image->size = size;
+    image->fd = fd;
+
+#ifdef MADV_SEQUENTIAL
+    /* only a hint, reads work the same if it is refused */
+    madvise((void *)image->data, size, MADV_SEQUENTIAL);
+#endif
+
+    return image;
+}
+
+/* take a reference unless the last one is being dropped */
+static gboolean spice_cd_image_try_ref(SpiceCdImage *image)
+{
+    gint ref;
+
+    do {
+        ref = g_atomic_int_get(&image->ref);
+        if (ref == 0) {
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange(&image->ref, ref, ref + 1));
+    return TRUE;
+}
+
+/**
+ * spice_cd_image_open:
+ * @path: the ISO image
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Map the image read-only, or take another reference on the mapping if
+ * the same file is already open. A file modified since it was opened is
+ * mapped again. Nothing is read here, pages are faulted in by the reads
+ * touching them, and the kernel is told to expect sequential access so
+ * it reads ahead aggressively and drops pages behind. @path may also be
+ * a packed image, only its index is checked here. The file of an image
+ * that is not packed stays open, for reads that should not fault pages in.
+ *
+ * Returns: the image with a reference, or %NULL
+ */
+SpiceCdImage *spice_cd_image_open(const gchar *path, GError **err)
+{
+    SpiceCdImageKey key;
+    SpiceCdImage *image;
+    struct stat st;
+    int fd;
+
+    g_return_val_if_fail(path != NULL, NULL);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        int saved_errno = errno;
+
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "%s: %s", path, g_strerror(saved_errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.mtime_ns = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) +
+                   st.st_mtim.tv_nsec;
+
+    G_LOCK(images);
+    if (_images == NULL) {
+        _images = g_hash_table_new(spice_cd_image_key_hash, spice_cd_image_key_equal);
+    }
+    image = g_hash_table_lookup(_images, &key);
+    if (image != NULL && !spice_cd_image_try_ref(image)) {
+        image = NULL;
+    }
+    if (image == NULL) {
+        image = spice_cd_image_map(path, fd, &key, err);
+        if (image != NULL) {
+            /* replaces an image on its way out */
+            g_hash_table_replace(_images, &image->key, image);
+        }
+    }
+    G_UNLOCK(images);
+
+    /* only kept by a new image that is not packed */
+    if (image == NULL || image->fd != fd) {
+        close(fd);
+    }
+    return image;
+}
+
+SpiceCdImage *spice_cd_image_ref(SpiceCdImage *image)
+{
+    g_return_val_if_fail(image != NULL, NULL);
+
+    g_atomic_int_inc(&image->ref);
+    return image;
+}
+
+/* the mapping goes away with the last reference, wherever it was opened */
+void spice_cd_image_unref(SpiceCdImage *image)
+{
+    g_return_if_fail(image != NULL);
+
+    if (!g_atomic_int_dec_and_test(&image->ref)) {
+        return;
+    }
+
+    G_LOCK(images);
+    /* unless it was already replaced by a new mapping of the same file */
+    if (g_hash_table_lookup(_images, &image->key) == image) {
+        g_hash_table_remove(_images, &image->key);
+    }
+    G_UNLOCK(images);
+
+    spice_cd_image_free(image);
+}
+
+/* the path the image was first opened with */
+const gchar *spice_cd_image_get_path(const SpiceCdImage *image)
+{
+    return image->path;
+}
+
+/* packed images can not be peeked, their blocks are read */
+gboolean spice_cd_image_is_packed(const SpiceCdImage *image)
+{
+    return image->data == NULL;
+}
+
+/* the image file for reads bypassing the mapping, -1 for a packed image */
+gint spice_cd_image_get_fd(const SpiceCdImage *image)
+{
+    return image->fd;
+}
+
+/* uncompressed size for a packed image */
+guint64 spice_cd_image_get_size(const SpiceCdImage *image)
+{
+    return image->size;
+}
+
+/* a trailing partial block is not addressable */
+guint64 spice_cd_image_get_n_blocks(const SpiceCdImage *image)
+{
+    return image->size / SPICE_CD_IMAGE_BLOCK_SIZE;
+}
+
+static gboolean spice_cd_image_check_range(const SpiceCdImage *image,
+                                           guint64 lba, guint32 n_blocks, GError **err)
+{
+    guint64 n_image_blocks = spice_cd_image_get_n_blocks(image);
+
+    if (lba > n_image_blocks || n_blocks > n_image_blocks - lba) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "blocks %" G_GUINT64_FORMAT "+%u are past the end of %s",
+                    lba, n_blocks, image->path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * spice_cd_image_peek_blocks:
+ * @image: a #SpiceCdImage
+ * @lba: the first block
+ * @n_blocks: the number of blocks
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Get the blocks without copying them. Touching the returned memory may
+ * block on disk I/O. Only for images that are not packed.
+ *
+ * Returns: (transfer none): @n_blocks * %SPICE_CD_IMAGE_BLOCK_SIZE bytes,
+ * valid while a reference to @image is held, or %NULL if the range is past
+ * the end of the image
+ */
+const guint8 *spice_cd_image_peek_blocks(const SpiceCdImage *image,
+                                         guint64 lba, guint32 n_blocks,
+                                         GError **err)
+{
+    g_return_val_if_fail(!spice_cd_image_is_packed(image), NULL);
+
+    if (!spice_cd_image_check_range(image, lba, n_blocks, err)) {
+        return NULL;
+    }
+    return image->data + lba * SPICE_CD_IMAGE_BLOCK_SIZE;
+}
+
+/* inflate a chunk with @inflater, without the lock */
+static gboolean spice_cd_image_inflate_chunk(SpiceCdImage *image, SpiceCdImageChunk *chunk,
+                                             GConverter *inflater, GError **err)
+{
+    guint64 start = GUINT64_FROM_LE(image->chunk_index[chunk->index]);
+    gsize in_len = GUINT64_FROM_LE(image->chunk_index[chunk->index + 1]) - start;
+    GConverterResult res = G_CONVERTER_CONVERTED;
+    gsize in_done = 0, out_done = 0, n_read, n_written;
+
+    if (in_len == chunk->len) {
+        /* did not shrink, stored as is */
+        memcpy(chunk->data, image->packed + start, in_len);
+        return TRUE;
+    }
+
+    g_converter_reset(inflater);
+    while (res == G_CONVERTER_CONVERTED) {
+        res = g_converter_convert(inflater,
+                                  image->packed + start + in_done, in_len - in_done,
+                                  chunk->data + out_done, chunk->len - out_done,
+                                  G_CONVERTER_INPUT_AT_END, &n_read, &n_written, err);
+        in_done += n_read;
+        out_done += n_written;
+        if (res == G_CONVERTER_CONVERTED && n_read == 0 && n_written == 0) {
+            res = G_CONVERTER_ERROR;
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "truncated");
+        }
+    }
+
+    if (res == G_CONVERTER_FINISHED && out_done != chunk->len) {
+        res = G_CONVERTER_ERROR;
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "short chunk");
+    }
+    if (res == G_CONVERTER_ERROR) {
+        g_prefix_error(err, "%s: chunk %u: ", image->path, chunk->index);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * copy @len bytes at @offset of a chunk to @dst, inflating it if it is not
+ * cached, or only bring it into the cache if @dst is NULL
+ */
+static gboolean spice_cd_image_read_chunk(SpiceCdImage *image, guint32 index,
+                                          guint32 offset, guint32 len,
+                                          guint8 *dst, GError **err)
+{
+    SpiceCdImageChunk *chunk;
+
+    g_mutex_lock(&image->chunk_lock);
+    while ((chunk = g_hash_table_lookup(image->chunks, GUINT_TO_POINTER(index))) != NULL &&
+           !chunk->ready) {
+        /* being inflated by another reader, or the read-ahead */
+        g_cond_wait(&image->chunk_ready, &image->chunk_lock);
+    }
+    if (chunk == NULL) {
+        GConverter *inflater = NULL;
+        gboolean inflated;
+
+        chunk = g_malloc(sizeof(*chunk) + spice_cd_image_chunk_len(image, index));
+        chunk->link.data = chunk;
+        chunk->index = index;
+        chunk->len = spice_cd_image_chunk_len(image, index);
+        chunk->ready = FALSE;
+        g_hash_table_insert(image->chunks, GUINT_TO_POINTER(index), chunk);
+        inflater = g_queue_pop_head(&image->inflaters);
+
+        /* other chunks can be read while this one inflates */
+        g_mutex_unlock(&image->chunk_lock);
+        if (inflater == NULL) {
+            inflater = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+        }
+        inflated = spice_cd_image_inflate_chunk(image, chunk, inflater, err);
+        g_mutex_lock(&image->chunk_lock);
+
+        g_queue_push_head(&image->inflaters, inflater);
+        g_cond_broadcast(&image->chunk_ready);
+        if (!inflated) {
+            /* the waiters try again, and get the error themselves */
+            g_hash_table_remove(image->chunks, GUINT_TO_POINTER(index));
+            g_mutex_unlock(&image->chunk_lock);
+            g_free(chunk);
+            return FALSE;
+        }
+        chunk->ready = TRUE;
+        while (g_queue_get_length(&image->chunk_lru) >= image->max_chunks) {
+            SpiceCdImageChunk *old = g_queue_peek_head(&image->chunk_lru);
+
+            g_queue_unlink(&image->chunk_lru, &old->link);
+            g_hash_table_remove(image->chunks, GUINT_TO_POINTER(old->index));
+            g_free(old);
+        }
+    } else {
+        g_queue_unlink(&image->chunk_lru, &chunk->link);
+    }
+    /* most recently used last */
+    g_queue_push_tail_link(&image->chunk_lru, &chunk->link);
+    if (dst != NULL) {
+        memcpy(dst, chunk->data + offset, len);
+    }
+    g_mutex_unlock(&image->chunk_lock);
+    return TRUE;
+}
+
+/* go through the chunks of a range of a packed image */
+static gboolean spice_cd_image_read_packed(SpiceCdImage *image, guint64 lba,
+                                           guint32 n_blocks, guint8 *buf, GError **err)
+{
+    guint64 offset = lba * SPICE_CD_IMAGE_BLOCK_SIZE;
+    guint64 end = offset + (guint64)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+
+    while (offset < end) {
+        guint32 index = offset / image->chunk_size;
+        guint32 in_chunk = offset % image->chunk_size;
+        guint32 len = MIN(spice_cd_image_chunk_len(image, index) - in_chunk, end - offset);
+
+        if (!spice_cd_image_read_chunk(image, index, in_chunk, len, buf, err)) {
+            return FALSE;
+        }
+        offset += len;
+        if (buf != NULL) {
+            buf += len;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * spice_cd_image_read_blocks:
+ * @image: a #SpiceCdImage
+ * @lba: the first block
+ * @n_blocks: the number of blocks
+ * @buf: where to copy the blocks, @n_blocks * %SPICE_CD_IMAGE_BLOCK_SIZE
+ * bytes
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Copy the blocks out of any image. A packed image only inflates the
+ * chunks that are not in its cache, which all its readers share.
+ *
+ * Returns: %FALSE if the range is past the end of the image, or a chunk
+ * could not be inflated
+ */
+gboolean spice_cd_image_read_blocks(SpiceCdImage *image,
+                                    guint64 lba, guint32 n_blocks,
+                                    guint8 *buf, GError **err)
+{
+    g_return_val_if_fail(buf != NULL, FALSE);
+
+    if (!spice_cd_image_check_range(image, lba, n_blocks, err)) {
+        return FALSE;
+    }
+    if (spice_cd_image_is_packed(image)) {
+        return spice_cd_image_read_packed(image, lba, n_blocks, buf, err);
+    }
+    memcpy(buf, image->data + lba * SPICE_CD_IMAGE_BLOCK_SIZE,
+           (gsize)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE);
+    return TRUE;
+}
+
+/**
+ * spice_cd_image_prefetch_blocks:
+ * @image: a #SpiceCdImage
+ * @lba: the first block
+ * @n_blocks: the number of blocks
+ *
+ * Bring the blocks in memory ahead of the reads, faulting the pages of
+ * the mapping in or inflating the chunks of a packed image. Meant for a
+ * worker thread, errors are left for the reads to report.
+ */
+void spice_cd_image_prefetch_blocks(SpiceCdImage *image,
+                                    guint64 lba, guint32 n_blocks)
+{
+    const volatile guint8 *p;
+    gsize off, len;
+
+    if (!spice_cd_image_check_range(image, lba, n_blocks, NULL)) {
+        return;
+    }
+    if (spice_cd_image_is_packed(image)) {
+        spice_cd_image_read_packed(image, lba, n_blocks, NULL, NULL);
+        return;
+    }
+    p = image->data + lba * SPICE_CD_IMAGE_BLOCK_SIZE;
+    len = (gsize)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+    for (off = 0; off < len; off += PREFETCH_PAGE_SIZE) {
+        (void)p[off];
+    }
+}
+
+/**
+ * spice_cd_image_release_blocks:
+ * @image: a #SpiceCdImage
+ * @lba: the first block
+ * @n_blocks: the number of blocks
+ *
+ * Let the memory of blocks brought in by spice_cd_image_prefetch_blocks()
+ * go: the pages wholly inside the range leave the mapping and the page
+ * cache, reads fault them back in. A packed image keeps its chunk cache,
+ * which has its own bound.
+ */
+void spice_cd_image_release_blocks(SpiceCdImage *image,
+                                   guint64 lba, guint32 n_blocks)
+{
+#ifdef G_OS_UNIX
+    guint64 page_size = sysconf(_SC_PAGESIZE);
+    guint64 start, end;
+
+    if (spice_cd_image_is_packed(image) ||
+        !spice_cd_image_check_range(image, lba, n_blocks, NULL)) {
+        return;
+    }
+    /* the pages at either end may hold blocks of a neighbour */
+    start = (lba * SPICE_CD_IMAGE_BLOCK_SIZE + page_size - 1) / page_size * page_size;
+    end = (lba + n_blocks) * SPICE_CD_IMAGE_BLOCK_SIZE / page_size * page_size;
+    if (start >= end) {
+        return;
+    }
+    /* only hints, the data is read-only and comes back from the file */
+#ifdef MADV_DONTNEED
+    madvise((void *)(image->data + start), end - start, MADV_DONTNEED);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(image->fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+static inline guint32 get_le32(const guint8 *p)
+{
+    return (guint32)p[3] << 24 | (guint32)p[2] << 16 | (guint32)p[1] << 8 | p[0];
+}
+
+/* prefetch @n_bytes at @lba, as much of it as is in the image */
+static guint spice_cd_image_warm_range(SpiceCdImage *image, guint64 lba, guint64 n_bytes)
+{
+    guint64 n_image_blocks = spice_cd_image_get_n_blocks(image);
+    guint32 n_blocks;
+
+    if (lba >= n_image_blocks || n_bytes == 0) {
+        return 0;
+    }
+    n_blocks = MIN((n_bytes + SPICE_CD_IMAGE_BLOCK_SIZE - 1) / SPICE_CD_IMAGE_BLOCK_SIZE,
+                   MIN(n_image_blocks - lba, WARM_MAX_BLOCKS));
+    spice_cd_image_prefetch_blocks(image, lba, n_blocks);
+    return n_blocks;
+}
+
+/**
+ * spice_cd_image_warm:
+ * @image: a #SpiceCdImage
+ *
+ * Bring in the blocks a guest reads first from a new medium: the ISO 9660
+ * volume descriptors, the path tables and root directories they point to
+ * and the El Torito boot catalog. Meant for a worker thread, like
+ * spice_cd_image_prefetch_blocks(), an image that is not ISO 9660 only
+ * has its first descriptor read.
+ *
+ * Returns: the number of blocks brought in
+ */
+guint spice_cd_image_warm(SpiceCdImage *image)
+{
+    guint8 vd[SPICE_CD_IMAGE_BLOCK_SIZE];
+    guint64 lba;
+    guint n = 0;
+
+    for (lba = ISO9660_DESCRIPTOR_LBA;
+         lba < ISO9660_DESCRIPTOR_LBA + ISO9660_MAX_DESCRIPTORS; lba++) {
+        if (!spice_cd_image_read_blocks(image, lba, 1, vd, NULL) ||
+            memcmp(vd + 1, "CD001", 5) != 0) {
+            break;
+        }
+        n++;
+        switch (vd[0]) {
+        case ISO9660_TYPE_BOOT:
+            if (strncmp((const gchar *)vd + 7, ELTORITO_SYSTEM_ID,
+                        sizeof(ELTORITO_SYSTEM_ID) - 1) == 0) {
+                n += spice_cd_image_warm_range(image, get_le32(vd + 71),
+                                               SPICE_CD_IMAGE_BLOCK_SIZE);
+            }
+            break;
+        case ISO9660_TYPE_PRIMARY:
+        case ISO9660_TYPE_SUPPLEMENTARY:
+            /* the little endian path table, then the root directory record */
+            n += spice_cd_image_warm_range(image, get_le32(vd + 140), get_le32(vd + 132));
+            n += spice_cd_image_warm_range(image, get_le32(vd + 156 + 2),
+                                           get_le32(vd + 156 + 10));
+            break;
+        case ISO9660_TYPE_TERMINATOR:
+            return n;
+        }
+    }
+    return n;
+}
+
+static gboolean spice_cd_image_pack_write(int fd, const gchar *path, gconstpointer data,
+                                          gsize len, guint64 offset, GError **err)
+{
+    const guint8 *p = data;
+
+    while (len > 0) {
+        gssize n = pwrite(fd, p, len, offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved_errno = errno;
+
+            g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                        "%s: %s", path, g_strerror(saved_errno));
+            return FALSE;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+/*
+ * deflate @len bytes to @out, which has room for as many, FALSE with no
+ * error if they do not shrink
+ */
+static gboolean spice_cd_image_deflate_chunk(GConverter *deflater, const guint8 *in,
+                                             gsize len, guint8 *out, gsize *out_len,
+                                             GError **err)
+{
+    GConverterResult res = G_CONVERTER_CONVERTED;
+    gsize in_done = 0, out_done = 0, n_read, n_written;
+    GError *error = NULL;
+
+    g_converter_reset(deflater);
+    while (res == G_CONVERTER_CONVERTED && out_done < len) {
+        res = g_converter_convert(deflater, in + in_done, len - in_done,
+                                  out + out_done, len - out_done,
+                                  G_CONVERTER_INPUT_AT_END, &n_read, &n_written, &error);
+        in_done += n_read;
+        out_done += n_written;
+    }
+    if (res == G_CONVERTER_ERROR) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+            g_error_free(error);
+            return FALSE;
+        }
+        g_propagate_error(err, error);
+        return FALSE;
+    }
+    *out_len = out_done;
+    return res == G_CONVERTER_FINISHED && out_done < len;
+}
+
+/**
+ * spice_cd_image_pack:
+ * @path: the ISO image
+ * @packed_path: the packed image to write
+ * @chunk_size: the uncompressed size of a chunk, a multiple of
+ * %SPICE_CD_IMAGE_BLOCK_SIZE, or 0 for the default
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Write a packed copy of an image, see #SpiceCdImagePackHeader. The
+ * copy is written next to @packed_path and renamed over it once done,
+ * so an image being read is never replaced by a partial one.
+ *
+ * Returns: %FALSE on error
+ */
+gboolean spice_cd_image_pack(const gchar *path, const gchar *packed_path,
+                             guint32 chunk_size, GError **err)
+{
+    SpiceCdImagePackHeader header;
+    GMappedFile *file;
+    GZlibCompressor *deflater;
+    const guint8 *contents;
+    guint64 size, *index, offset;
+    guint32 n_chunks, i;
+    gchar *tmp_path;
+    guint8 *out;
+    gboolean ok = FALSE;
+    int fd;
+
+    if (chunk_size == 0) {
+        chunk_size = SPICE_CD_IMAGE_PACK_DEFAULT_CHUNK_SIZE;
+    }
+    g_return_val_if_fail(chunk_size % SPICE_CD_IMAGE_BLOCK_SIZE == 0 &&
+                         chunk_size <= SPICE_CD_IMAGE_PACK_MAX_CHUNK_SIZE, FALSE);
+
+    file = g_mapped_file_new(path, FALSE, err);
+    if (file == NULL) {
+        return FALSE;
+    }
+    contents = (const guint8 *)g_mapped_file_get_contents(file);
+    size = g_mapped_file_get_length(file);
+    if (size < SPICE_CD_IMAGE_BLOCK_SIZE ||
+        memcmp(contents, SPICE_CD_IMAGE_PACK_MAGIC, sizeof(header.magic)) == 0) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is not a plain CD image", path);
+        g_mapped_file_unref(file);
+        return FALSE;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise((void *)contents, size, MADV_SEQUENTIAL);
+#endif
+
+    tmp_path = g_strconcat(packed_path, ".tmp", NULL);
+    fd = g_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int saved_errno = errno;
+
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "%s: %s", tmp_path, g_strerror(saved_errno));
+        g_free(tmp_path);
+        g_mapped_file_unref(file);
+        return FALSE;
+    }
+
+    n_chunks = (size + chunk_size - 1) / chunk_size;
+    index = g_new(guint64, n_chunks + 1);
+    out = g_malloc(chunk_size);
+    deflater = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, -1);
+
+    /* the header and the index go in front once the chunks are written */
+    offset = sizeof(header) + ((guint64)n_chunks + 1) * sizeof(guint64);
+    for (i = 0; i < n_chunks; i++) {
+        const guint8 *in = contents + (guint64)i * chunk_size;
+        gsize len = MIN(chunk_size, size - (guint64)i * chunk_size);
+        GError *error = NULL;
+        gsize out_len;
+
+        index[i] = GUINT64_TO_LE(offset);
+        if (spice_cd_image_deflate_chunk(G_CONVERTER(deflater), in, len, out, &out_len,
+                                         &error)) {
+            in = out;
+            len = out_len;
+        } else if (error != NULL) {
+            g_propagate_prefixed_error(err, error, "%s: ", path);
+            goto end;
+        }
+        if (!spice_cd_image_pack_write(fd, tmp_path, in, len, offset, err)) {
+            goto end;
+        }
+        offset += len;
+    }
+    index[n_chunks] = GUINT64_TO_LE(offset);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPICE_CD_IMAGE_PACK_MAGIC, sizeof(header.magic));
+    header.chunk_size = GUINT32_TO_LE(chunk_size);
+    header.n_chunks = GUINT32_TO_LE(n_chunks);
+    header.image_size = GUINT64_TO_LE(size);
+    if (!spice_cd_image_pack_write(fd, tmp_path, &header, sizeof(header), 0, err) ||
+        !spice_cd_image_pack_write(fd, tmp_path, index,
+                                   ((gsize)n_chunks + 1) * sizeof(guint64),
+                                   sizeof(header), err)) {
+        goto end;
+    }
+    if (g_rename(tmp_path, packed_path) < 0) {
+        int saved_errno = errno;
+
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "%s: %s", packed_path, g_strerror(saved_errno));
+        goto end;
+    }
+    ok = TRUE;
+
+end:
+    close(fd);
+    if (!ok) {
+        g_unlink(tmp_path);
+    }
+    g_object_unref(deflater);
+    g_free(out);
+    g_free(index);
+    g_free(tmp_path);
+    g_mapped_file_unref(file);
+    return ok;
+}
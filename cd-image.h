@@ -0,0 +1,87 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CD_IMAGE_H__
+#define __SPICE_CD_IMAGE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* logical block size of CD/DVD media */
+#define SPICE_CD_IMAGE_BLOCK_SIZE 2048
+
+/*
+ * Packed image, written by cd-image-pack for images kept on slow storage:
+ * the image is cut in chunks of chunk_size bytes, each deflated on its own
+ * (raw deflate) so that a read only inflates the chunks it touches. All
+ * integers are little endian, offsets are from the start of the file:
+ *
+ *   SpiceCdImagePackHeader
+ *   guint64 index[n_chunks + 1]   offset of each chunk, the last entry is
+ *                                 the end of the chunk data
+ *   chunk data                    a chunk that did not shrink is stored
+ *                                 as is, with its uncompressed length
+ */
+#define SPICE_CD_IMAGE_PACK_MAGIC "SPCDPAK1"
+#define SPICE_CD_IMAGE_PACK_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define SPICE_CD_IMAGE_PACK_MAX_CHUNK_SIZE (1024 * 1024)
+
+typedef struct _SpiceCdImagePackHeader {
+    gchar   magic[8];
+    guint32 chunk_size;     /* a multiple of SPICE_CD_IMAGE_BLOCK_SIZE */
+    guint32 n_chunks;
+    guint64 image_size;     /* of the original image */
+} SpiceCdImagePackHeader;
+
+/* inflated chunks kept per packed image */
+#define SPICE_CD_IMAGE_CHUNK_CACHE_SIZE (16 * 1024 * 1024)
+
+/*
+ * Read-only backing store of a CD LUN: the image file is mapped once per
+ * process, however many LUNs use it, and block reads are served straight
+ * from the mapping. Packed images are recognized by their magic and read
+ * through a cache of inflated chunks shared the same way.
+ */
+typedef struct _SpiceCdImage SpiceCdImage;
+
+SpiceCdImage *spice_cd_image_open(const gchar *path, GError **err);
+SpiceCdImage *spice_cd_image_ref(SpiceCdImage *image);
+void spice_cd_image_unref(SpiceCdImage *image);
+
+const gchar *spice_cd_image_get_path(const SpiceCdImage *image);
+gboolean spice_cd_image_is_packed(const SpiceCdImage *image);
+gint spice_cd_image_get_fd(const SpiceCdImage *image);
+guint64 spice_cd_image_get_size(const SpiceCdImage *image);
+guint64 spice_cd_image_get_n_blocks(const SpiceCdImage *image);
+
+const guint8 *spice_cd_image_peek_blocks(const SpiceCdImage *image,
+                                         guint64 lba, guint32 n_blocks,
+                                         GError **err);
+gboolean spice_cd_image_read_blocks(SpiceCdImage *image,
+                                    guint64 lba, guint32 n_blocks,
+                                    guint8 *buf, GError **err);
+void spice_cd_image_prefetch_blocks(SpiceCdImage *image,
+                                    guint64 lba, guint32 n_blocks);
+void spice_cd_image_release_blocks(SpiceCdImage *image,
+                                   guint64 lba, guint32 n_blocks);
+guint spice_cd_image_warm(SpiceCdImage *image);
+
+gboolean spice_cd_image_pack(const gchar *path, const gchar *packed_path,
+                             guint32 chunk_size, GError **err);
+
+G_END_DECLS
+
+#endif /* __SPICE_CD_IMAGE_H__ */
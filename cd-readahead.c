@@ -0,0 +1,459 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <glib.h>
+#include "cd-readahead.h"
+
+/* window bounds, in blocks */
+#define RA_MIN_WINDOW    16    /* 32 KiB */
+#define RA_INIT_WINDOW   64
+#define RA_MAX_WINDOW    1024  /* 2 MiB */
+/* strides fetched ahead of a strided reader */
+#define RA_MAX_STRIDES   8
+
+/*
+ * A prefetched range. Reads stay zero-copy from the image mapping, so the
+ * data itself lives in the page cache, or in the chunk cache of a packed
+ * image; the extents account for what was brought in, and an evicted one
+ * gives its pages back, so that they bound how much is kept ahead of the
+ * reader.
+ */
+typedef struct _SpiceCdReadaheadExtent {
+    GList link;        /* in cache->extents, least recently used first */
+    guint64 lba;
+    guint32 n_blocks;
+    guint32 consumed;  /* blocks read since the prefetch */
+    gboolean ready;    /* faulted in by the worker */
+    gboolean evicted;  /* dropped while queued, the worker frees it */
+} SpiceCdReadaheadExtent;
+
+/*
+ * The prefetched extents of one image, shared by every LUN reading it so
+ * that N attachments of an image keep one bounded cache and one worker.
+ */
+typedef struct _SpiceCdBlockCache {
+    gint ref; /* under the registry lock */
+    SpiceCdImage *image;
+    guint64 n_image_blocks;
+    GThreadPool *worker;
+
+    GMutex lock; /* protects the extents, and the stats of the LUNs */
+    GQueue extents;
+    guint32 cache_blocks;
+    guint32 cached_blocks;
+    guint64 wasted; /* of all the LUNs */
+    gboolean closing;
+} SpiceCdBlockCache;
+
+/* image -> cache, an image is mapped once per process */
+G_LOCK_DEFINE_STATIC(caches);
+static GHashTable *_caches = NULL;
+
+struct _SpiceCdReadahead {
+    SpiceCdBlockCache *cache;
+    SpiceCdReadaheadStats stats; /* under cache->lock */
+
+    /* access pattern, only used by the reader */
+    guint64 last_lba;
+    guint32 last_n;
+    gint64 stride;
+    guint64 next_lba;        /* end of the sequential prefetch */
+    guint64 next_stride_lba; /* next stride not prefetched yet */
+    guint32 window;
+};
+
+static void readahead_release(SpiceCdBlockCache *cache, guint64 lba, guint64 end);
+
+/* bring the extent in, the reader thread never waits for this */
+static void readahead_worker(gpointer data, gpointer user_data)
+{
+    SpiceCdReadaheadExtent *extent = data;
+    SpiceCdBlockCache *cache = user_data;
+    gboolean closing;
+
+    g_mutex_lock(&cache->lock);
+    closing = cache->closing || extent->evicted;
+    g_mutex_unlock(&cache->lock);
+
+    if (!closing) {
+        spice_cd_image_prefetch_blocks(cache->image, extent->lba, extent->n_blocks);
+    }
+
+    g_mutex_lock(&cache->lock);
+    if (extent->evicted) {
+        /* evicted while it was being fetched */
+        if (!closing && !cache->closing) {
+            readahead_release(cache, extent->lba, extent->lba + extent->n_blocks);
+        }
+        g_free(extent);
+    } else {
+        extent->ready = TRUE;
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+static SpiceCdBlockCache *block_cache_acquire(SpiceCdImage *image, guint32 cache_blocks)
+{
+    SpiceCdBlockCache *cache;
+
+    G_LOCK(caches);
+    if (_caches == NULL) {
+        _caches = g_hash_table_new(NULL, NULL);
+    }
+    cache = g_hash_table_lookup(_caches, image);
+    if (cache != NULL) {
+        cache->ref++;
+        g_mutex_lock(&cache->lock);
+        /* the largest bound asked for wins, it is not multiplied */
+        cache->cache_blocks = MAX(cache->cache_blocks, cache_blocks);
+        g_mutex_unlock(&cache->lock);
+    } else {
+        cache = g_new0(SpiceCdBlockCache, 1);
+        cache->ref = 1;
+        cache->image = spice_cd_image_ref(image);
+        cache->n_image_blocks = spice_cd_image_get_n_blocks(image);
+        cache->cache_blocks = cache_blocks;
+        g_mutex_init(&cache->lock);
+        g_queue_init(&cache->extents);
+        /* one thread keeps the prefetches of an image in order */
+        cache->worker = g_thread_pool_new(readahead_worker, cache, 1, FALSE, NULL);
+        g_hash_table_insert(_caches, image, cache);
+    }
+    G_UNLOCK(caches);
+    return cache;
+}
+
+static void block_cache_release(SpiceCdBlockCache *cache)
+{
+    GList *link;
+    gboolean last;
+
+    G_LOCK(caches);
+    last = --cache->ref == 0;
+    if (last) {
+        g_hash_table_remove(_caches, cache->image);
+    }
+    G_UNLOCK(caches);
+
+    if (!last) {
+        return;
+    }
+
+    /* queued prefetches finish without touching the image */
+    g_mutex_lock(&cache->lock);
+    cache->closing = TRUE;
+    g_mutex_unlock(&cache->lock);
+    g_thread_pool_free(cache->worker, FALSE, TRUE);
+
+    while ((link = g_queue_pop_head_link(&cache->extents)) != NULL) {
+        g_free(link->data);
+    }
+    g_mutex_clear(&cache->lock);
+    spice_cd_image_unref(cache->image);
+    g_free(cache);
+}
+
+/**
+ * spice_cd_readahead_new:
+ * @image: the image read by the LUN
+ * @cache_size: the most prefetched data to keep, in bytes
+ *
+ * The read-aheads of an image share one cache, bounded by the largest
+ * @cache_size they were created with.
+ *
+ * Returns: a new #SpiceCdReadahead
+ */
+SpiceCdReadahead *spice_cd_readahead_new(SpiceCdImage *image, gsize cache_size)
+{
+    SpiceCdReadahead *ra;
+
+    g_return_val_if_fail(image != NULL, NULL);
+
+    ra = g_new0(SpiceCdReadahead, 1);
+    ra->cache = block_cache_acquire(image,
+                                    MAX(cache_size / SPICE_CD_IMAGE_BLOCK_SIZE,
+                                        2 * RA_MIN_WINDOW));
+    ra->window = RA_INIT_WINDOW;
+    return ra;
+}
+
+void spice_cd_readahead_free(SpiceCdReadahead *ra)
+{
+    if (ra == NULL) {
+        return;
+    }
+
+    block_cache_release(ra->cache);
+    g_free(ra);
+}
+
+/* with the lock held, gives back the blocks of [@lba, @end) no extent holds */
+static void readahead_release(SpiceCdBlockCache *cache, guint64 lba, guint64 end)
+{
+    guint64 cursor = lba;
+
+    while (cursor < end) {
+        guint64 reach = cursor, next_start = end;
+        GList *link;
+
+        for (link = g_queue_peek_head_link(&cache->extents); link != NULL; link = link->next) {
+            SpiceCdReadaheadExtent *extent = link->data;
+            guint64 stop = extent->lba + extent->n_blocks;
+
+            if (stop <= cursor) {
+                continue;
+            }
+            if (extent->lba <= cursor) {
+                reach = MAX(reach, MIN(stop, end));
+            } else {
+                next_start = MIN(next_start, extent->lba);
+            }
+        }
+        if (reach > cursor) {
+            cursor = reach;
+        } else {
+            spice_cd_image_release_blocks(cache->image, cursor, next_start - cursor);
+            cursor = next_start;
+        }
+    }
+}
+
+static void readahead_evict(SpiceCdBlockCache *cache, SpiceCdReadaheadExtent *extent)
+{
+    g_queue_unlink(&cache->extents, &extent->link);
+    cache->cached_blocks -= extent->n_blocks;
+    cache->wasted += (guint64)(extent->n_blocks - extent->consumed) *
+                     SPICE_CD_IMAGE_BLOCK_SIZE;
+    if (extent->ready) {
+        readahead_release(cache, extent->lba, extent->lba + extent->n_blocks);
+        g_free(extent);
+    } else {
+        extent->evicted = TRUE;
+    }
+}
+
+/*
+ * with the lock held, trims [*lba, *lba + *n_blocks) to what no extent
+ * holds or is fetching at either end, another LUN may have asked for it
+ */
+static void readahead_trim(SpiceCdBlockCache *cache, guint64 *lba, guint32 *n_blocks)
+{
+    guint64 start = *lba, end = *lba + *n_blocks;
+    gboolean trimmed;
+    GList *link;
+
+    do {
+        trimmed = FALSE;
+        for (link = g_queue_peek_head_link(&cache->extents);
+             link != NULL && start < end; link = link->next) {
+            SpiceCdReadaheadExtent *extent = link->data;
+            guint64 ext_end = extent->lba + extent->n_blocks;
+
+            if (extent->lba <= start && start < ext_end) {
+                start = MIN(ext_end, end);
+                trimmed = TRUE;
+            } else if (extent->lba < end && end <= ext_end) {
+                end = MAX(extent->lba, start);
+                trimmed = TRUE;
+            }
+        }
+    } while (trimmed && start < end);
+
+    *lba = start;
+    *n_blocks = end - start;
+}
+
+/* with the lock held */
+static void readahead_schedule(SpiceCdReadahead *ra, guint64 lba, guint32 n_blocks)
+{
+    SpiceCdBlockCache *cache = ra->cache;
+    SpiceCdReadaheadExtent *extent;
+
+    if (lba >= cache->n_image_blocks) {
+        return;
+    }
+    n_blocks = MIN(n_blocks, cache->n_image_blocks - lba);
+    readahead_trim(cache, &lba, &n_blocks);
+    if (n_blocks == 0) {
+        return;
+    }
+    while (cache->cached_blocks + n_blocks > cache->cache_blocks &&
+           !g_queue_is_empty(&cache->extents)) {
+        readahead_evict(cache, g_queue_peek_head(&cache->extents));
+    }
+
+    extent = g_new0(SpiceCdReadaheadExtent, 1);
+    extent->link.data = extent;
+    extent->lba = lba;
+    extent->n_blocks = n_blocks;
+    g_queue_push_tail_link(&cache->extents, &extent->link);
+    cache->cached_blocks += n_blocks;
+    ra->stats.prefetched += (guint64)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+    g_thread_pool_push(cache->worker, extent, NULL);
+}
+
+/* with the lock held, blocks of [@lba, @end) in ready extents, each counted once */
+static guint32 readahead_covered(SpiceCdBlockCache *cache, guint64 lba, guint64 end)
+{
+    guint64 cursor = lba;
+    guint32 covered = 0;
+
+    /* extents may overlap: extend the covered run at the cursor, or skip the gap */
+    while (cursor < end) {
+        guint64 reach = cursor, next_start = end;
+        GList *link;
+
+        for (link = g_queue_peek_head_link(&cache->extents); link != NULL; link = link->next) {
+            SpiceCdReadaheadExtent *extent = link->data;
+            guint64 stop = extent->lba + extent->n_blocks;
+
+            if (!extent->ready || stop <= cursor) {
+                continue;
+            }
+            if (extent->lba <= cursor) {
+                reach = MAX(reach, MIN(stop, end));
+            } else {
+                next_start = MIN(next_start, extent->lba);
+            }
+        }
+        if (reach > cursor) {
+            covered += reach - cursor;
+            cursor = reach;
+        } else {
+            cursor = next_start;
+        }
+    }
+    return covered;
+}
+
+/* with the lock held, returns the number of blocks that were prefetched */
+static guint32 readahead_consume(SpiceCdBlockCache *cache, guint64 lba, guint32 n_blocks)
+{
+    guint64 end = lba + n_blocks;
+    guint i, n = g_queue_get_length(&cache->extents);
+    GList *link = g_queue_peek_head_link(&cache->extents);
+
+    for (i = 0; i < n; i++) {
+        SpiceCdReadaheadExtent *extent = link->data;
+        GList *next = link->next;
+        guint64 start = MAX(lba, extent->lba);
+        guint64 stop = MIN(end, extent->lba + extent->n_blocks);
+
+        if (extent->ready && start < stop) {
+            extent->consumed = MIN(extent->n_blocks, extent->consumed + (stop - start));
+            /* most recently used last */
+            g_queue_unlink(&cache->extents, link);
+            g_queue_push_tail_link(&cache->extents, link);
+        }
+        link = next;
+    }
+    return readahead_covered(cache, lba, end);
+}
+
+/* keep a window ahead of a sequential reader, growing it while it pays off */
+static void readahead_sequential(SpiceCdReadahead *ra, guint64 lba, guint32 n_blocks,
+                                 gboolean hit)
+{
+    guint32 max_window = MIN(RA_MAX_WINDOW, ra->cache->cache_blocks / 2);
+    guint64 end = lba + n_blocks;
+
+    /* never less than a couple of reads ahead */
+    ra->window = MIN(MAX(ra->window, 2 * n_blocks), max_window);
+
+    if (ra->next_lba < end) {
+        /* the reader caught up, or just started */
+        ra->next_lba = end;
+    }
+    if (ra->next_lba - end > ra->window / 2) {
+        return;
+    }
+    readahead_schedule(ra, ra->next_lba, ra->window);
+    ra->next_lba += ra->window;
+    if (hit) {
+        ra->window = MIN(ra->window * 2, max_window);
+    }
+}
+
+/* fetch the next few strides of a reader skipping over data */
+static void readahead_strided(SpiceCdReadahead *ra, guint64 lba, guint32 n_blocks)
+{
+    guint32 n_strides = CLAMP(ra->window / n_blocks, 1, RA_MAX_STRIDES);
+    guint64 last = lba + (guint64)ra->stride * n_strides;
+    guint64 next = MAX(ra->next_stride_lba, lba + ra->stride);
+
+    for (; next <= last; next += ra->stride) {
+        readahead_schedule(ra, next, n_blocks);
+    }
+    ra->next_stride_lba = next;
+}
+
+/**
+ * spice_cd_readahead_access:
+ * @ra: a #SpiceCdReadahead
+ * @lba: the first block read
+ * @n_blocks: the number of blocks read
+ *
+ * Account a read about to be served from the image and prefetch what the
+ * access pattern says comes next. Random access shrinks the window.
+ * Data prefetched for another LUN of the same image counts as a hit.
+ *
+ * Returns: %TRUE if all the blocks were prefetched, reading them will not
+ * wait for the disk
+ */
+gboolean spice_cd_readahead_access(SpiceCdReadahead *ra, guint64 lba, guint32 n_blocks)
+{
+    gint64 stride = (gint64)lba - (gint64)ra->last_lba;
+    gboolean hit;
+
+    if (n_blocks == 0) {
+        return TRUE;
+    }
+
+    g_mutex_lock(&ra->cache->lock);
+    ra->stats.reads++;
+    hit = readahead_consume(ra->cache, lba, n_blocks) == n_blocks;
+    if (hit) {
+        ra->stats.hits++;
+    }
+
+    if (ra->stats.reads > 1 && lba == ra->last_lba + ra->last_n) {
+        ra->next_stride_lba = 0;
+        readahead_sequential(ra, lba, n_blocks, hit);
+    } else if (stride > ra->last_n && stride == ra->stride && n_blocks == ra->last_n) {
+        ra->next_lba = 0;
+        readahead_strided(ra, lba, n_blocks);
+    } else if (ra->stats.reads > 1) {
+        ra->window = MAX(ra->window / 4, RA_MIN_WINDOW);
+        ra->next_lba = 0;
+        ra->next_stride_lba = 0;
+    }
+    g_mutex_unlock(&ra->cache->lock);
+
+    ra->stride = stride;
+    ra->last_lba = lba;
+    ra->last_n = n_blocks;
+    return hit;
+}
+
+void spice_cd_readahead_get_stats(SpiceCdReadahead *ra, SpiceCdReadaheadStats *stats)
+{
+    g_mutex_lock(&ra->cache->lock);
+    *stats = ra->stats;
+    stats->wasted = ra->cache->wasted;
+    stats->window = ra->window;
+    g_mutex_unlock(&ra->cache->lock);
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CD_READAHEAD_H__
+#define __SPICE_CD_READAHEAD_H__
+
+#include <glib.h>
+#include "cd-image.h"
+
+G_BEGIN_DECLS
+
+/* most prefetched data kept resident per image by default */
+#define SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE (32 * 1024 * 1024)
+
+typedef struct _SpiceCdReadaheadStats {
+    guint64 reads;           /* reads seen */
+    guint64 hits;            /* reads entirely served from prefetched data */
+    guint64 prefetched;      /* bytes prefetched */
+    guint64 wasted;          /* prefetched bytes dropped unread, by all the
+                              * LUNs of the image */
+    guint32 window;          /* current window, in blocks */
+} SpiceCdReadaheadStats;
+
+/*
+ * Per LUN read-ahead: watches the reads of one image for sequential or
+ * strided access and faults the next window of the mapping in on a
+ * background thread, so the reads that follow find it in memory. The
+ * prefetched blocks are kept in a cache shared by all the LUNs of the
+ * image, whatever device or session they belong to.
+ */
+typedef struct _SpiceCdReadahead SpiceCdReadahead;
+
+SpiceCdReadahead *spice_cd_readahead_new(SpiceCdImage *image, gsize cache_size);
+void spice_cd_readahead_free(SpiceCdReadahead *ra);
+
+gboolean spice_cd_readahead_access(SpiceCdReadahead *ra, guint64 lba, guint32 n_blocks);
+void spice_cd_readahead_get_stats(SpiceCdReadahead *ra, SpiceCdReadaheadStats *stats);
+
+G_END_DECLS
+
+#endif /* __SPICE_CD_READAHEAD_H__ */
@@ -0,0 +1,755 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "cd-scsi.h"
+
+/* SPC/MMC operation codes */
+#define SCSI_TEST_UNIT_READY         0x00
+#define SCSI_REQUEST_SENSE           0x03
+#define SCSI_INQUIRY                 0x12
+#define SCSI_MODE_SENSE_6            0x1a
+#define SCSI_START_STOP_UNIT         0x1b
+#define SCSI_PREVENT_ALLOW_REMOVAL   0x1e
+#define SCSI_READ_CAPACITY_10        0x25
+#define SCSI_READ_10                 0x28
+#define SCSI_READ_TOC                0x43
+#define SCSI_GET_EVENT_STATUS        0x4a
+#define SCSI_MODE_SENSE_10           0x5a
+#define SCSI_READ_16                 0x88
+#define SCSI_READ_12                 0xa8
+
+/* additional sense codes, ASC << 8 | ASCQ */
+#define SCSI_ASC_NONE                0x0000
+#define SCSI_ASC_UNRECOVERED_READ    0x1100
+#define SCSI_ASC_INVALID_OPCODE      0x2000
+#define SCSI_ASC_LBA_OUT_OF_RANGE    0x2100
+#define SCSI_ASC_INVALID_FIELD       0x2400
+#define SCSI_ASC_LUN_NOT_SUPPORTED   0x2500
+#define SCSI_ASC_MEDIUM_CHANGED      0x2800
+#define SCSI_ASC_MEDIUM_NOT_PRESENT  0x3a00
+
+/* MMC GET EVENT STATUS NOTIFICATION, media class */
+#define EVENT_CLASS_MEDIA            4
+#define MEDIA_EVENT_NO_CHANGE        0
+#define MEDIA_EVENT_NEW_MEDIA        2
+#define MEDIA_EVENT_MEDIA_REMOVAL    3
+
+/* blocks of a packed image inflated at once by a read off the main loop */
+#define INFLATE_PIECE_BLOCKS (SPICE_CD_IMAGE_PACK_DEFAULT_CHUNK_SIZE / SPICE_CD_IMAGE_BLOCK_SIZE)
+
+/* a read in flight on the #SpiceCdAio of its LUN, or inflating on a thread */
+struct _SpiceCdScsiRead {
+    GList link;                 /* in target->reads */
+    SpiceCdScsiTarget *target;  /* NULL once the target is freed */
+    SpiceCdScsiRequest *req;    /* NULL once the request is cleared */
+    guint lun;
+    SpiceCdImage *image;        /* keeps the file open */
+    guint64 lba;
+    guint32 n_blocks;
+    guint8 *buf;
+    gsize len;
+    GCancellable *cancellable;  /* stops the inflation of an abandoned read */
+};
+
+typedef struct _SpiceCdScsiLun {
+    guint8 sense_key;
+    guint16 asc;
+    gboolean media_reported; /* medium presence last seen by GET EVENT STATUS */
+    gboolean unit_attention; /* the medium changed, the next command is told */
+} SpiceCdScsiLun;
+
+struct _SpiceCdScsiTarget {
+    const SpiceCdScsiTargetOps *ops;
+    gpointer user_data;
+    SpiceCdScsiLun luns[SPICE_CD_SCSI_MAX_LUNS];
+    GQueue reads;   /* in flight */
+};
+
+static inline guint16 get_be16(const guint8 *p)
+{
+    return (guint16)p[0] << 8 | p[1];
+}
+
+static inline guint32 get_be32(const guint8 *p)
+{
+    return (guint32)p[0] << 24 | (guint32)p[1] << 16 | (guint32)p[2] << 8 | p[3];
+}
+
+static inline guint64 get_be64(const guint8 *p)
+{
+    return (guint64)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static inline void put_be16(guint8 *p, guint16 v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_be32(guint8 *p, guint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* space padded, not NUL terminated */
+static void put_string(guint8 *p, gsize size, const gchar *s)
+{
+    gsize len = s != NULL ? MIN(strlen(s), size) : 0;
+
+    memcpy(p, s, len);
+    memset(p + len, ' ', size - len);
+}
+
+SpiceCdScsiTarget *spice_cd_scsi_target_new(const SpiceCdScsiTargetOps *ops,
+                                            gpointer user_data)
+{
+    SpiceCdScsiTarget *target;
+
+    g_return_val_if_fail(ops != NULL && ops->get_lun != NULL, NULL);
+
+    target = g_new0(SpiceCdScsiTarget, 1);
+    target->ops = ops;
+    target->user_data = user_data;
+    g_queue_init(&target->reads);
+    return target;
+}
+
+/* the reads in flight complete into nothing */
+static void cd_scsi_read_orphan(SpiceCdScsiRead *read)
+{
+    if (read->cancellable != NULL) {
+        g_cancellable_cancel(read->cancellable);
+    }
+    if (read->req != NULL) {
+        read->req->read = NULL;
+        read->req->pending = FALSE;
+        read->req = NULL;
+    }
+}
+
+void spice_cd_scsi_target_free(SpiceCdScsiTarget *target)
+{
+    GList *link;
+
+    while ((link = g_queue_pop_head_link(&target->reads)) != NULL) {
+        SpiceCdScsiRead *read = link->data;
+
+        cd_scsi_read_orphan(read);
+        read->target = NULL;
+    }
+    g_free(target);
+}
+
+/* forget pending sense data, as after a bus reset */
+void spice_cd_scsi_target_reset(SpiceCdScsiTarget *target)
+{
+    guint i;
+
+    for (i = 0; i < SPICE_CD_SCSI_MAX_LUNS; i++) {
+        target->luns[i].sense_key = SPICE_CD_SCSI_SENSE_NO_SENSE;
+        target->luns[i].asc = SCSI_ASC_NONE;
+    }
+}
+
+/**
+ * spice_cd_scsi_target_media_changed:
+ * @target: a #SpiceCdScsiTarget
+ * @lun: the LUN whose medium was replaced
+ *
+ * Report a medium swapped without going through an empty tray: the next
+ * command but INQUIRY, REQUEST SENSE and GET EVENT STATUS NOTIFICATION
+ * fails with a unit attention, and the media events report a new medium.
+ */
+void spice_cd_scsi_target_media_changed(SpiceCdScsiTarget *target, guint lun)
+{
+    g_return_if_fail(lun < SPICE_CD_SCSI_MAX_LUNS);
+
+    target->luns[lun].unit_attention = TRUE;
+    target->luns[lun].media_reported = FALSE;
+}
+
+/*
+ * drop the image reference or the copy held for the data-in phase, a
+ * pending read is abandoned
+ */
+void spice_cd_scsi_request_clear(SpiceCdScsiRequest *req)
+{
+    if (req->read != NULL) {
+        cd_scsi_read_orphan(req->read);
+    }
+    g_clear_pointer(&req->image, spice_cd_image_unref);
+    g_clear_pointer(&req->copy, g_free);
+    req->data = NULL;
+    req->data_len = 0;
+}
+
+static void cd_scsi_check_condition(SpiceCdScsiTarget *target, guint lun,
+                                    SpiceCdScsiRequest *req,
+                                    guint8 sense_key, guint16 asc)
+{
+    if (lun < SPICE_CD_SCSI_MAX_LUNS) {
+        target->luns[lun].sense_key = sense_key;
+        target->luns[lun].asc = asc;
+    }
+    req->status = SPICE_CD_SCSI_STATUS_CHECK_CONDITION;
+}
+
+/* data-in from @buf, truncated to the allocation length */
+static void cd_scsi_reply(SpiceCdScsiRequest *req, gsize len, gsize alloc_len)
+{
+    req->status = SPICE_CD_SCSI_STATUS_GOOD;
+    req->data = req->buf;
+    req->data_len = MIN(len, alloc_len);
+}
+
+/* @error says why the read failed, NULL if it did not */
+static void cd_scsi_read_finish(SpiceCdScsiRead *read, const gchar *error)
+{
+    SpiceCdScsiRequest *req = read->req;
+
+    if (read->target != NULL) {
+        g_queue_unlink(&read->target->reads, &read->link);
+    }
+    if (req != NULL) {
+        req->read = NULL;
+        req->pending = FALSE;
+        if (error == NULL) {
+            req->status = SPICE_CD_SCSI_STATUS_GOOD;
+            req->copy = read->buf;
+            req->data = read->buf;
+            req->data_len = read->len;
+            read->buf = NULL;
+        } else {
+            g_warning("%s: %s", spice_cd_image_get_path(read->image), error);
+            cd_scsi_check_condition(read->target, read->lun, req,
+                                    SPICE_CD_SCSI_SENSE_MEDIUM_ERROR,
+                                    SCSI_ASC_UNRECOVERED_READ);
+        }
+    }
+    g_free(read->buf);
+    g_clear_object(&read->cancellable);
+    spice_cd_image_unref(read->image);
+    g_free(read);
+
+    if (req != NULL) {
+        req->ready(req, req->ready_data);
+    }
+}
+
+static void cd_scsi_read_done(gssize result, gpointer user_data)
+{
+    SpiceCdScsiRead *read = user_data;
+
+    cd_scsi_read_finish(read, result == (gssize)read->len ? NULL :
+                              result < 0 ? g_strerror(-result) : "short read");
+}
+
+/* inflate the blocks of a packed image a piece at a time, until abandoned */
+static void cd_scsi_inflate_thread(GTask *task, gpointer source_object,
+                                   gpointer task_data, GCancellable *cancellable)
+{
+    SpiceCdScsiRead *read = task_data;
+    GError *err = NULL;
+    guint32 done, n;
+
+    for (done = 0; done < read->n_blocks; done += n) {
+        if (g_task_return_error_if_cancelled(task)) {
+            return;
+        }
+        n = MIN(read->n_blocks - done, INFLATE_PIECE_BLOCKS);
+        if (!spice_cd_image_read_blocks(read->image, read->lba + done, n,
+                                        read->buf + (gsize)done * SPICE_CD_IMAGE_BLOCK_SIZE,
+                                        &err)) {
+            g_task_return_error(task, err);
+            return;
+        }
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void cd_scsi_inflated(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GError *err = NULL;
+
+    g_task_propagate_boolean(G_TASK(res), &err);
+    cd_scsi_read_finish(user_data, err != NULL ? err->message : NULL);
+    g_clear_error(&err);
+}
+
+/*
+ * read the blocks into a copy on @aio, or inflate them on a thread for a
+ * packed image, the request is pending until then
+ */
+static void cd_scsi_read_async(SpiceCdScsiTarget *target, guint lun,
+                               const SpiceCdScsiLunState *state, guint64 lba,
+                               guint32 n_blocks, gsize len, SpiceCdScsiRequest *req)
+{
+    SpiceCdScsiRead *read = g_new0(SpiceCdScsiRead, 1);
+    gboolean packed = spice_cd_image_is_packed(state->image);
+
+    read->link.data = read;
+    read->target = target;
+    read->req = req;
+    read->lun = lun;
+    read->image = spice_cd_image_ref(state->image);
+    read->lba = lba;
+    read->n_blocks = n_blocks;
+    /* blocks are inflated whole, a truncated read still takes the last one */
+    read->buf = g_malloc(packed ? (gsize)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE : len);
+    read->len = len;
+    g_queue_push_tail_link(&target->reads, &read->link);
+
+    req->read = read;
+    req->pending = TRUE;
+    if (packed) {
+        GTask *task;
+
+        read->cancellable = g_cancellable_new();
+        task = g_task_new(NULL, read->cancellable, cd_scsi_inflated, read);
+        g_task_set_task_data(task, read, NULL);
+        g_task_run_in_thread(task, cd_scsi_inflate_thread);
+        g_object_unref(task);
+        return;
+    }
+    spice_cd_aio_read(state->aio, spice_cd_image_get_fd(state->image),
+                      lba * SPICE_CD_IMAGE_BLOCK_SIZE, read->buf, len,
+                      cd_scsi_read_done, read);
+}
+
+/*
+ * READ(10), READ(12) and READ(16): the data-in phase points straight into
+ * the mapped image, nothing is copied here. A packed image has no blocks
+ * to point at, they are inflated into a copy held by the request. Blocks
+ * the read-ahead did not bring in would fault the mapping in on the main
+ * loop, they are read on the LUN's #SpiceCdAio instead when the request
+ * can wait for them, and a packed image inflates them on a thread. The
+ * transfer length comes from the guest, no more
+ * than the @max_len bytes the host takes is read, nor allocated.
+ */
+static void cd_scsi_read(SpiceCdScsiTarget *target, guint lun,
+                         const SpiceCdScsiLunState *state,
+                         guint64 lba, guint32 n_blocks, gsize max_len,
+                         SpiceCdScsiRequest *req)
+{
+    gboolean prefetched = FALSE;
+    guint64 n_image_blocks;
+    const guint8 *data;
+    gsize len;
+
+    if (state->image == NULL) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_NOT_READY,
+                                SCSI_ASC_MEDIUM_NOT_PRESENT);
+        return;
+    }
+    n_image_blocks = spice_cd_image_get_n_blocks(state->image);
+    if (lba > n_image_blocks || n_blocks > n_image_blocks - lba) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_LBA_OUT_OF_RANGE);
+        return;
+    }
+    if ((guint64)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE > max_len) {
+        /* the host gets what it asked for, and a phase error */
+        req->truncated = TRUE;
+        len = max_len;
+        n_blocks = (len + SPICE_CD_IMAGE_BLOCK_SIZE - 1) / SPICE_CD_IMAGE_BLOCK_SIZE;
+    } else {
+        len = (gsize)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE;
+    }
+    if (state->readahead != NULL) {
+        prefetched = spice_cd_readahead_access(state->readahead, lba, n_blocks);
+    }
+    if (!prefetched && req->ready != NULL && n_blocks != 0 &&
+        (spice_cd_image_is_packed(state->image) ||
+         (state->aio != NULL && spice_cd_image_get_fd(state->image) >= 0))) {
+        cd_scsi_read_async(target, lun, state, lba, n_blocks, len, req);
+        return;
+    }
+    if (!spice_cd_image_is_packed(state->image)) {
+        data = spice_cd_image_peek_blocks(state->image, lba, n_blocks, NULL);
+        if (n_blocks != 0) {
+            req->image = spice_cd_image_ref(state->image);
+        }
+    } else if (n_blocks != 0) {
+        GError *err = NULL;
+
+        req->copy = g_malloc((gsize)n_blocks * SPICE_CD_IMAGE_BLOCK_SIZE);
+        if (!spice_cd_image_read_blocks(state->image, lba, n_blocks, req->copy, &err)) {
+            g_warning("%s", err->message);
+            g_error_free(err);
+            g_clear_pointer(&req->copy, g_free);
+            cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_MEDIUM_ERROR,
+                                    SCSI_ASC_UNRECOVERED_READ);
+            return;
+        }
+        data = req->copy;
+    } else {
+        data = NULL;
+    }
+    req->status = SPICE_CD_SCSI_STATUS_GOOD;
+    req->data = data;
+    req->data_len = len;
+}
+
+static void cd_scsi_inquiry(const SpiceCdScsiLunState *state, gboolean present,
+                            const guint8 *cdb, SpiceCdScsiRequest *req)
+{
+    guint8 *buf = req->buf;
+
+    memset(buf, 0, 36);
+    if (!present) {
+        buf[0] = 0x7f; /* peripheral qualifier 3: no LUN here */
+    } else {
+        buf[0] = 0x05; /* CD/DVD device */
+        buf[1] = 0x80; /* removable medium */
+        buf[2] = 0x05; /* SPC-3 */
+        buf[3] = 0x02; /* response data format */
+        buf[4] = 36 - 5;
+        put_string(buf + 8, 8, state->vendor);
+        put_string(buf + 16, 16, state->product);
+        put_string(buf + 32, 4, state->revision);
+    }
+    cd_scsi_reply(req, 36, get_be16(cdb + 3));
+}
+
+static void cd_scsi_request_sense(SpiceCdScsiLun *l, const guint8 *cdb,
+                                  SpiceCdScsiRequest *req)
+{
+    guint8 *buf = req->buf;
+
+    if (l->unit_attention && l->sense_key == SPICE_CD_SCSI_SENSE_NO_SENSE) {
+        /* a pending unit attention is reported, and cleared, as the sense */
+        l->unit_attention = FALSE;
+        l->sense_key = SPICE_CD_SCSI_SENSE_UNIT_ATTENTION;
+        l->asc = SCSI_ASC_MEDIUM_CHANGED;
+    }
+
+    /* fixed format, current error */
+    memset(buf, 0, 18);
+    buf[0] = 0x70;
+    buf[2] = l->sense_key;
+    buf[7] = 18 - 8;
+    buf[12] = l->asc >> 8;
+    buf[13] = l->asc & 0xff;
+    cd_scsi_reply(req, 18, cdb[4]);
+
+    l->sense_key = SPICE_CD_SCSI_SENSE_NO_SENSE;
+    l->asc = SCSI_ASC_NONE;
+}
+
+static void put_toc_address(guint8 *p, guint64 lba, gboolean msf)
+{
+    if (msf) {
+        guint64 frames = lba + 150; /* 2 second pregap */
+        p[0] = 0;
+        p[1] = frames / (75 * 60);
+        p[2] = (frames / 75) % 60;
+        p[3] = frames % 75;
+    } else {
+        put_be32(p, lba);
+    }
+}
+
+/* a single data track covering the whole image */
+static void cd_scsi_read_toc(SpiceCdScsiTarget *target, guint lun,
+                             const SpiceCdScsiLunState *state,
+                             const guint8 *cdb, SpiceCdScsiRequest *req)
+{
+    gboolean msf = (cdb[1] & 0x02) != 0;
+    guint8 format = cdb[2] & 0x0f;
+    guint8 start_track = cdb[6];
+    guint8 *buf = req->buf;
+    gsize len = 4;
+
+    if (state->image == NULL) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_NOT_READY,
+                                SCSI_ASC_MEDIUM_NOT_PRESENT);
+        return;
+    }
+
+    switch (format) {
+    case 0: /* TOC */
+        if (start_track > 1 && start_track != 0xaa) {
+            cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                    SCSI_ASC_INVALID_FIELD);
+            return;
+        }
+        buf[2] = 1; /* first track */
+        buf[3] = 1; /* last track */
+        if (start_track <= 1) {
+            memset(buf + len, 0, 8);
+            buf[len + 1] = 0x14; /* ADR 1, data track */
+            buf[len + 2] = 1;
+            put_toc_address(buf + len + 4, 0, msf);
+            len += 8;
+        }
+        memset(buf + len, 0, 8);
+        buf[len + 1] = 0x14;
+        buf[len + 2] = 0xaa; /* lead-out */
+        put_toc_address(buf + len + 4, spice_cd_image_get_n_blocks(state->image), msf);
+        len += 8;
+        break;
+    case 1: /* session info */
+        buf[2] = 1; /* first session */
+        buf[3] = 1; /* last session */
+        memset(buf + len, 0, 8);
+        buf[len + 1] = 0x14;
+        buf[len + 2] = 1; /* first track of the last session */
+        put_toc_address(buf + len + 4, 0, msf);
+        len += 8;
+        break;
+    default:
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_INVALID_FIELD);
+        return;
+    }
+    put_be16(buf, len - 2);
+    cd_scsi_reply(req, len, get_be16(cdb + 7));
+}
+
+/* polled media class events, reports each insertion and removal once */
+static void cd_scsi_get_event_status(SpiceCdScsiTarget *target, guint lun,
+                                     const SpiceCdScsiLunState *state,
+                                     const guint8 *cdb, SpiceCdScsiRequest *req)
+{
+    SpiceCdScsiLun *l = &target->luns[lun];
+    gboolean present = state->image != NULL;
+    guint8 *buf = req->buf;
+
+    if (!(cdb[1] & 0x01)) {
+        /* asynchronous notification is not supported */
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_INVALID_FIELD);
+        return;
+    }
+
+    buf[3] = 1 << EVENT_CLASS_MEDIA; /* supported classes */
+    if (!(cdb[4] & (1 << EVENT_CLASS_MEDIA))) {
+        put_be16(buf, 2);
+        buf[2] = 0x80; /* no event available */
+        cd_scsi_reply(req, 4, get_be16(cdb + 7));
+        return;
+    }
+
+    put_be16(buf, 6);
+    buf[2] = EVENT_CLASS_MEDIA;
+    if (present == l->media_reported) {
+        buf[4] = MEDIA_EVENT_NO_CHANGE;
+    } else {
+        buf[4] = present ? MEDIA_EVENT_NEW_MEDIA : MEDIA_EVENT_MEDIA_REMOVAL;
+        l->media_reported = present;
+    }
+    buf[5] = present ? 0x02 : 0x01; /* medium present, or tray open */
+    buf[6] = 0;
+    buf[7] = 0;
+    cd_scsi_reply(req, 8, get_be16(cdb + 7));
+}
+
+static void cd_scsi_read_capacity(SpiceCdScsiTarget *target, guint lun,
+                                  const SpiceCdScsiLunState *state,
+                                  SpiceCdScsiRequest *req)
+{
+    guint64 n_blocks;
+
+    if (state->image == NULL) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_NOT_READY,
+                                SCSI_ASC_MEDIUM_NOT_PRESENT);
+        return;
+    }
+    n_blocks = spice_cd_image_get_n_blocks(state->image);
+    put_be32(req->buf, MIN(n_blocks - 1, G_MAXUINT32));
+    put_be32(req->buf + 4, SPICE_CD_IMAGE_BLOCK_SIZE);
+    cd_scsi_reply(req, 8, 8);
+}
+
+/* the commands that are not on the read path */
+static void cd_scsi_execute_generic(SpiceCdScsiTarget *target, guint lun,
+                                    const SpiceCdScsiLunState *state,
+                                    const guint8 *cdb, gsize cdb_len,
+                                    SpiceCdScsiRequest *req)
+{
+    SpiceCdScsiLun *l = &target->luns[lun];
+
+    switch (cdb[0]) {
+    case SCSI_TEST_UNIT_READY:
+        if (state->image == NULL) {
+            cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_NOT_READY,
+                                    SCSI_ASC_MEDIUM_NOT_PRESENT);
+        } else {
+            cd_scsi_reply(req, 0, 0);
+        }
+        break;
+    case SCSI_REQUEST_SENSE:
+        cd_scsi_request_sense(l, cdb, req);
+        break;
+    case SCSI_INQUIRY:
+        if (cdb_len < 6 || (cdb[1] & 0x01)) {
+            /* no vital product data pages */
+            cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                    SCSI_ASC_INVALID_FIELD);
+        } else {
+            cd_scsi_inquiry(state, TRUE, cdb, req);
+        }
+        break;
+    case SCSI_MODE_SENSE_6:
+        /* header only, no block descriptors or pages */
+        memset(req->buf, 0, 4);
+        req->buf[0] = 4 - 1;
+        cd_scsi_reply(req, 4, cdb[4]);
+        break;
+    case SCSI_MODE_SENSE_10:
+        if (cdb_len < 10) {
+            goto invalid_opcode;
+        }
+        memset(req->buf, 0, 8);
+        put_be16(req->buf, 8 - 2);
+        cd_scsi_reply(req, 8, get_be16(cdb + 7));
+        break;
+    case SCSI_START_STOP_UNIT:
+        /* the medium is only loaded and ejected from the client side */
+        cd_scsi_reply(req, 0, 0);
+        break;
+    case SCSI_PREVENT_ALLOW_REMOVAL:
+        if (target->ops->set_locked != NULL) {
+            target->ops->set_locked(target->user_data, lun, (cdb[4] & 0x01) != 0);
+        }
+        cd_scsi_reply(req, 0, 0);
+        break;
+    case SCSI_READ_CAPACITY_10:
+        cd_scsi_read_capacity(target, lun, state, req);
+        break;
+    case SCSI_READ_TOC:
+        if (cdb_len < 10) {
+            goto invalid_opcode;
+        }
+        cd_scsi_read_toc(target, lun, state, cdb, req);
+        break;
+    case SCSI_GET_EVENT_STATUS:
+        if (cdb_len < 10) {
+            goto invalid_opcode;
+        }
+        cd_scsi_get_event_status(target, lun, state, cdb, req);
+        break;
+    default:
+    invalid_opcode:
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_INVALID_OPCODE);
+        break;
+    }
+}
+
+/**
+ * spice_cd_scsi_target_execute:
+ * @target: a #SpiceCdScsiTarget
+ * @lun: the LUN addressed by the command
+ * @cdb: the command descriptor block
+ * @cdb_len: the length of @cdb
+ * @max_data_len: the data-in bytes the host takes, 0 if it expects none
+ * @req: the request to fill, call spice_cd_scsi_request_clear() once its
+ * data has been sent
+ *
+ * Run one command. Reads are decoded first and never touch @req->buf,
+ * everything else takes the generic path. A read may leave @req pending,
+ * its @ready function is called once it is filled.
+ */
+void spice_cd_scsi_target_execute(SpiceCdScsiTarget *target, guint lun,
+                                  const guint8 *cdb, gsize cdb_len,
+                                  gsize max_data_len, SpiceCdScsiRequest *req)
+{
+    SpiceCdScsiLunState state = { 0, };
+    gboolean present;
+
+    req->status = SPICE_CD_SCSI_STATUS_GOOD;
+    req->data = NULL;
+    req->data_len = 0;
+    req->truncated = FALSE;
+    req->image = NULL;
+    req->copy = NULL;
+    req->pending = FALSE;
+    req->read = NULL;
+
+    if (cdb_len < 6) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_INVALID_OPCODE);
+        return;
+    }
+
+    present = lun < SPICE_CD_SCSI_MAX_LUNS &&
+              target->ops->get_lun(target->user_data, lun, &state);
+    /* an empty image has no last block to tell, it is no medium */
+    if (present && state.image != NULL && spice_cd_image_get_n_blocks(state.image) == 0) {
+        state.image = NULL;
+        state.readahead = NULL;
+        state.aio = NULL;
+    }
+
+    if (present && target->luns[lun].unit_attention &&
+        cdb[0] != SCSI_INQUIRY && cdb[0] != SCSI_REQUEST_SENSE &&
+        cdb[0] != SCSI_GET_EVENT_STATUS) {
+        /* reported once, with the read or TEST UNIT READY that follows */
+        target->luns[lun].unit_attention = FALSE;
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_UNIT_ATTENTION,
+                                SCSI_ASC_MEDIUM_CHANGED);
+        return;
+    }
+
+    switch (cdb[0]) {
+    case SCSI_READ_10:
+        if (present && cdb_len >= 10) {
+            cd_scsi_read(target, lun, &state, get_be32(cdb + 2), get_be16(cdb + 7),
+                         max_data_len, req);
+            return;
+        }
+        break;
+    case SCSI_READ_12:
+        if (present && cdb_len >= 12) {
+            cd_scsi_read(target, lun, &state, get_be32(cdb + 2), get_be32(cdb + 6),
+                         max_data_len, req);
+            return;
+        }
+        break;
+    case SCSI_READ_16:
+        if (present && cdb_len >= 16) {
+            cd_scsi_read(target, lun, &state, get_be64(cdb + 2), get_be32(cdb + 10),
+                         max_data_len, req);
+            return;
+        }
+        break;
+    case SCSI_INQUIRY:
+        /* answered for absent LUNs too, so hosts can probe them */
+        if (!present && !(cdb[1] & 0x01)) {
+            cd_scsi_inquiry(&state, FALSE, cdb, req);
+            return;
+        }
+        break;
+    }
+
+    if (!present) {
+        cd_scsi_check_condition(target, lun, req, SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST,
+                                SCSI_ASC_LUN_NOT_SUPPORTED);
+        if (cdb[0] == SCSI_REQUEST_SENSE && lun < SPICE_CD_SCSI_MAX_LUNS) {
+            /* the sense data is the answer */
+            cd_scsi_request_sense(&target->luns[lun], cdb, req);
+        }
+        return;
+    }
+    cd_scsi_execute_generic(target, lun, &state, cdb, cdb_len, req);
+}
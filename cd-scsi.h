@@ -0,0 +1,114 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CD_SCSI_H__
+#define __SPICE_CD_SCSI_H__
+
+#include <glib.h>
+#include "cd-aio.h"
+#include "cd-image.h"
+#include "cd-readahead.h"
+
+G_BEGIN_DECLS
+
+/* LUNs addressable through bulk-only transport */
+#define SPICE_CD_SCSI_MAX_LUNS 16
+
+/* room for the response of any command but the reads */
+#define SPICE_CD_SCSI_BUF_SIZE 256
+
+typedef enum {
+    SPICE_CD_SCSI_STATUS_GOOD            = 0x00,
+    SPICE_CD_SCSI_STATUS_CHECK_CONDITION = 0x02,
+} SpiceCdScsiStatus;
+
+/* sense keys */
+#define SPICE_CD_SCSI_SENSE_NO_SENSE        0x00
+#define SPICE_CD_SCSI_SENSE_NOT_READY       0x02
+#define SPICE_CD_SCSI_SENSE_MEDIUM_ERROR    0x03
+#define SPICE_CD_SCSI_SENSE_ILLEGAL_REQUEST 0x05
+#define SPICE_CD_SCSI_SENSE_UNIT_ATTENTION  0x06
+
+/*
+ * LUN state as seen by the target. The strings and @image are borrowed,
+ * the target takes a reference on the image for the reads it serves.
+ */
+typedef struct _SpiceCdScsiLunState {
+    const gchar *vendor;
+    const gchar *product;
+    const gchar *revision;
+    gboolean loaded;
+    gboolean locked;
+    SpiceCdImage *image; /* NULL without a medium */
+    SpiceCdReadahead *readahead; /* told about the reads, if not NULL */
+    SpiceCdAio *aio; /* reads that were not prefetched go through it, if not NULL */
+} SpiceCdScsiLunState;
+
+typedef struct _SpiceCdScsiTargetOps {
+    /* fill @state, FALSE if there is no such LUN */
+    gboolean (*get_lun)(gpointer user_data, guint lun, SpiceCdScsiLunState *state);
+    /* PREVENT ALLOW MEDIUM REMOVAL */
+    void (*set_locked)(gpointer user_data, guint lun, gboolean locked);
+} SpiceCdScsiTargetOps;
+
+typedef struct _SpiceCdScsiRequest SpiceCdScsiRequest;
+typedef struct _SpiceCdScsiRead SpiceCdScsiRead;
+
+/* called from the main loop once a pending request has its outcome */
+typedef void (*SpiceCdScsiReadyFunc)(SpiceCdScsiRequest *req, gpointer user_data);
+
+/*
+ * Outcome of one command. The data-in phase is @data_len bytes at @data,
+ * which points into the mapped image for reads, into @copy for reads of a
+ * packed image or read asynchronously and into @buf otherwise.
+ *
+ * A read with more data than the host takes is cut to that length and
+ * @truncated, the transport reports the phase error.
+ *
+ * With a @ready function set, a read may be left @pending on the LUN's
+ * #SpiceCdAio, or inflating a packed image on a thread, the other fields
+ * are only valid once @ready was called.
+ */
+struct _SpiceCdScsiRequest {
+    SpiceCdScsiStatus status;
+    const guint8 *data;
+    gsize data_len;
+    gboolean truncated;  /* the command had more data-in than @data_len */
+    SpiceCdImage *image; /* held while @data points into it */
+    guint8 *copy;        /* blocks inflated from a packed image, or read */
+    guint8 buf[SPICE_CD_SCSI_BUF_SIZE];
+
+    gboolean pending;
+    SpiceCdScsiReadyFunc ready;
+    gpointer ready_data;
+    SpiceCdScsiRead *read; /* private */
+};
+
+typedef struct _SpiceCdScsiTarget SpiceCdScsiTarget;
+
+SpiceCdScsiTarget *spice_cd_scsi_target_new(const SpiceCdScsiTargetOps *ops,
+                                            gpointer user_data);
+void spice_cd_scsi_target_free(SpiceCdScsiTarget *target);
+void spice_cd_scsi_target_reset(SpiceCdScsiTarget *target);
+void spice_cd_scsi_target_media_changed(SpiceCdScsiTarget *target, guint lun);
+
+void spice_cd_scsi_target_execute(SpiceCdScsiTarget *target, guint lun,
+                                  const guint8 *cdb, gsize cdb_len,
+                                  gsize max_data_len, SpiceCdScsiRequest *req);
+void spice_cd_scsi_request_clear(SpiceCdScsiRequest *req);
+
+G_END_DECLS
+
+#endif /* __SPICE_CD_SCSI_H__ */
@@ -0,0 +1,305 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "cd-usb-bulk-msd.h"
+
+#define CBW_SIGNATURE 0x43425355 /* "USBC" */
+#define CSW_SIGNATURE 0x53425355 /* "USBS" */
+
+#define CSW_STATUS_PASSED      0
+#define CSW_STATUS_FAILED      1
+#define CSW_STATUS_PHASE_ERROR 2
+
+typedef enum {
+    MSD_STATE_CBW,      /* waiting for a command */
+    MSD_STATE_PENDING,  /* waiting for the data of a read */
+    MSD_STATE_DATA_IN,
+    MSD_STATE_DATA_OUT, /* draining data the host sends, CD LUNs take none */
+    MSD_STATE_CSW,
+} SpiceCdUsbBulkMsdState;
+
+struct _SpiceCdUsbBulkMsd {
+    SpiceCdScsiTarget *target;
+    guint8 max_lun;
+
+    SpiceCdUsbBulkMsdState state;
+    guint32 tag;
+    guint32 host_len;  /* dCBWDataTransferLength */
+    gsize data_len;    /* data-in bytes the device sends, <= host_len */
+    gsize done;        /* data bytes transferred so far */
+    gboolean need_zlp; /* a short data phase ended on a packet boundary */
+    gboolean host_in;  /* direction of the data phase the host expects */
+    guint8 csw_status;
+    SpiceCdScsiRequest req;
+    guint8 csw[SPICE_CD_USB_BULK_MSD_CSW_SIZE];
+
+    SpiceCdUsbBulkMsdReadyFunc ready_func;
+    gpointer ready_data;
+};
+
+/* takes ownership of @target */
+SpiceCdUsbBulkMsd *spice_cd_usb_bulk_msd_new(SpiceCdScsiTarget *target, guint8 max_lun)
+{
+    SpiceCdUsbBulkMsd *msd;
+
+    g_return_val_if_fail(target != NULL, NULL);
+    g_return_val_if_fail(max_lun < SPICE_CD_SCSI_MAX_LUNS, NULL);
+
+    msd = g_new0(SpiceCdUsbBulkMsd, 1);
+    msd->target = target;
+    msd->max_lun = max_lun;
+    msd->state = MSD_STATE_CBW;
+    return msd;
+}
+
+void spice_cd_usb_bulk_msd_free(SpiceCdUsbBulkMsd *msd)
+{
+    if (msd == NULL) {
+        return;
+    }
+    spice_cd_scsi_request_clear(&msd->req);
+    spice_cd_scsi_target_free(msd->target);
+    g_free(msd);
+}
+
+SpiceCdScsiTarget *spice_cd_usb_bulk_msd_get_target(SpiceCdUsbBulkMsd *msd)
+{
+    return msd->target;
+}
+
+/* Bulk-Only Mass Storage Reset: drop the command in progress */
+void spice_cd_usb_bulk_msd_reset(SpiceCdUsbBulkMsd *msd)
+{
+    spice_cd_scsi_request_clear(&msd->req);
+    msd->state = MSD_STATE_CBW;
+}
+
+guint8 spice_cd_usb_bulk_msd_get_max_lun(SpiceCdUsbBulkMsd *msd)
+{
+    return msd->max_lun;
+}
+
+static inline guint32 get_le32(const guint8 *p)
+{
+    return (guint32)p[3] << 24 | (guint32)p[2] << 16 | (guint32)p[1] << 8 | p[0];
+}
+
+static inline void put_le32(guint8 *p, guint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void msd_finish(SpiceCdUsbBulkMsd *msd)
+{
+    put_le32(msd->csw, CSW_SIGNATURE);
+    put_le32(msd->csw + 4, msd->tag);
+    put_le32(msd->csw + 8, msd->host_len - MIN(msd->done, msd->host_len));
+    msd->csw[12] = msd->csw_status;
+    msd->state = MSD_STATE_CSW;
+}
+
+/* match the data phase of the command against what the host expects */
+static void msd_complete(SpiceCdUsbBulkMsd *msd)
+{
+    SpiceCdScsiRequest *req = &msd->req;
+
+    msd->csw_status = req->status == SPICE_CD_SCSI_STATUS_GOOD ?
+        CSW_STATUS_PASSED : CSW_STATUS_FAILED;
+    msd->done = 0;
+    msd->need_zlp = FALSE;
+
+    if (msd->host_len == 0) {
+        msd->data_len = 0;
+        if (req->data_len != 0 || req->truncated) {
+            msd->csw_status = CSW_STATUS_PHASE_ERROR;
+        }
+        msd_finish(msd);
+    } else if (!msd->host_in) {
+        msd->data_len = 0;
+        msd->csw_status = CSW_STATUS_PHASE_ERROR;
+        msd->state = MSD_STATE_DATA_OUT;
+    } else {
+        if (req->data_len > msd->host_len || req->truncated) {
+            /* case 7, the device had more to send than the host takes */
+            msd->csw_status = CSW_STATUS_PHASE_ERROR;
+        }
+        msd->data_len = MIN(req->data_len, msd->host_len);
+        /* nothing to send still takes a zero length packet */
+        msd->need_zlp = msd->data_len == 0;
+        msd->state = MSD_STATE_DATA_IN;
+    }
+}
+
+/* a read left pending by msd_execute() got its data */
+static void msd_request_ready(SpiceCdScsiRequest *req, gpointer user_data)
+{
+    SpiceCdUsbBulkMsd *msd = user_data;
+
+    g_return_if_fail(msd->state == MSD_STATE_PENDING);
+
+    msd_complete(msd);
+    msd->ready_func(msd, msd->ready_data);
+}
+
+/* run the command, reads may complete later */
+static void msd_execute(SpiceCdUsbBulkMsd *msd, guint lun, gboolean host_in,
+                        const guint8 *cdb, gsize cdb_len)
+{
+    SpiceCdScsiRequest *req = &msd->req;
+
+    /* the last data-in of the previous command has been sent by now */
+    spice_cd_scsi_request_clear(req);
+    msd->host_in = host_in;
+    /* the guest's transfer length is not trusted past what the host takes */
+    spice_cd_scsi_target_execute(msd->target, lun, cdb, cdb_len,
+                                 host_in ? msd->host_len : 0, req);
+    if (req->pending) {
+        msd->state = MSD_STATE_PENDING;
+        return;
+    }
+    msd_complete(msd);
+}
+
+/**
+ * spice_cd_usb_bulk_msd_set_ready_func:
+ * @msd: a #SpiceCdUsbBulkMsd
+ * @func: (nullable): called once a pending command can be read from
+ * @user_data: data for @func
+ *
+ * Let reads wait for their data off the main loop: with @func set, a
+ * command may leave spice_cd_usb_bulk_msd_read() with nothing to send
+ * until @func is called. Without it, reads always complete right away.
+ */
+void spice_cd_usb_bulk_msd_set_ready_func(SpiceCdUsbBulkMsd *msd,
+                                          SpiceCdUsbBulkMsdReadyFunc func,
+                                          gpointer user_data)
+{
+    msd->ready_func = func;
+    msd->ready_data = user_data;
+    msd->req.ready = func != NULL ? msd_request_ready : NULL;
+    msd->req.ready_data = msd;
+}
+
+/**
+ * spice_cd_usb_bulk_msd_write:
+ * @msd: a #SpiceCdUsbBulkMsd
+ * @data: a bulk OUT transfer
+ * @len: the length of @data
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Returns: %FALSE if @data is not a valid command block wrapper or comes
+ * while the previous command is not complete, the host recovers with a
+ * reset.
+ */
+gboolean spice_cd_usb_bulk_msd_write(SpiceCdUsbBulkMsd *msd,
+                                     const guint8 *data, gsize len,
+                                     GError **err)
+{
+    guint8 lun, cdb_len;
+
+    if (msd->state == MSD_STATE_DATA_OUT) {
+        msd->done += len;
+        if (msd->done >= msd->host_len) {
+            msd_finish(msd);
+        }
+        return TRUE;
+    }
+    if (msd->state != MSD_STATE_CBW) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_BUSY,
+                    "command %u is still in progress", msd->tag);
+        return FALSE;
+    }
+    if (len != SPICE_CD_USB_BULK_MSD_CBW_SIZE) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "invalid CBW size %" G_GSIZE_FORMAT, len);
+        return FALSE;
+    }
+
+    lun = data[13] & 0x0f;
+    cdb_len = data[14] & 0x1f;
+    if (get_le32(data) != CBW_SIGNATURE ||
+        lun > msd->max_lun || cdb_len == 0 || cdb_len > 16) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "invalid CBW");
+        return FALSE;
+    }
+
+    msd->tag = get_le32(data + 4);
+    msd->host_len = get_le32(data + 8);
+
+    msd_execute(msd, lun, (data[12] & 0x80) != 0, data + 15, cdb_len);
+    return TRUE;
+}
+
+/**
+ * spice_cd_usb_bulk_msd_read:
+ * @msd: a #SpiceCdUsbBulkMsd
+ * @max_len: the length of the bulk IN transfer
+ * @vector: (out): the data to complete the transfer with
+ *
+ * Get the next bulk IN transfer: a piece of the data-in phase, or the
+ * command status wrapper. Read data points into the mapped CD image and
+ * is meant to be sent as is, behind the packet header; @vector is valid
+ * until the next call on @msd.
+ *
+ * Returns: %FALSE if there is nothing to send until the next command, or
+ * until the ready function is called for a pending read
+ */
+gboolean spice_cd_usb_bulk_msd_read(SpiceCdUsbBulkMsd *msd, gsize max_len,
+                                    GOutputVector *vector)
+{
+    gsize len;
+
+    switch (msd->state) {
+    case MSD_STATE_DATA_IN:
+        if (msd->done < msd->data_len) {
+            len = MIN(msd->data_len - msd->done, max_len);
+            vector->buffer = msd->req.data + msd->done;
+            vector->size = len;
+            msd->done += len;
+            /* a transfer shorter than asked for ends the data phase */
+            msd->need_zlp = msd->done == msd->data_len &&
+                            msd->data_len < msd->host_len && len == max_len;
+            if (msd->done == msd->data_len && !msd->need_zlp) {
+                msd_finish(msd);
+            }
+            return TRUE;
+        }
+        if (msd->need_zlp) {
+            vector->buffer = NULL;
+            vector->size = 0;
+            msd_finish(msd);
+            return TRUE;
+        }
+        msd_finish(msd);
+        /* fall through */
+    case MSD_STATE_CSW:
+        if (max_len < SPICE_CD_USB_BULK_MSD_CSW_SIZE) {
+            return FALSE;
+        }
+        vector->buffer = msd->csw;
+        vector->size = SPICE_CD_USB_BULK_MSD_CSW_SIZE;
+        msd->state = MSD_STATE_CBW;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CD_USB_BULK_MSD_H__
+#define __SPICE_CD_USB_BULK_MSD_H__
+
+#include <gio/gio.h>
+#include "cd-scsi.h"
+
+G_BEGIN_DECLS
+
+/* command block and command status wrappers, USB mass storage BOT 1.0 */
+#define SPICE_CD_USB_BULK_MSD_CBW_SIZE 31
+#define SPICE_CD_USB_BULK_MSD_CSW_SIZE 13
+
+/*
+ * USB mass storage bulk-only transport in front of a #SpiceCdScsiTarget.
+ * The bulk OUT endpoint feeds spice_cd_usb_bulk_msd_write(), each bulk IN
+ * transfer is answered by spice_cd_usb_bulk_msd_read().
+ */
+typedef struct _SpiceCdUsbBulkMsd SpiceCdUsbBulkMsd;
+
+/* a pending command has data or status to send */
+typedef void (*SpiceCdUsbBulkMsdReadyFunc)(SpiceCdUsbBulkMsd *msd, gpointer user_data);
+
+SpiceCdUsbBulkMsd *spice_cd_usb_bulk_msd_new(SpiceCdScsiTarget *target, guint8 max_lun);
+void spice_cd_usb_bulk_msd_free(SpiceCdUsbBulkMsd *msd);
+SpiceCdScsiTarget *spice_cd_usb_bulk_msd_get_target(SpiceCdUsbBulkMsd *msd);
+void spice_cd_usb_bulk_msd_set_ready_func(SpiceCdUsbBulkMsd *msd,
+                                          SpiceCdUsbBulkMsdReadyFunc func,
+                                          gpointer user_data);
+
+/* class requests on the control endpoint */
+void spice_cd_usb_bulk_msd_reset(SpiceCdUsbBulkMsd *msd);
+guint8 spice_cd_usb_bulk_msd_get_max_lun(SpiceCdUsbBulkMsd *msd);
+
+gboolean spice_cd_usb_bulk_msd_write(SpiceCdUsbBulkMsd *msd,
+                                     const guint8 *data, gsize len,
+                                     GError **err);
+gboolean spice_cd_usb_bulk_msd_read(SpiceCdUsbBulkMsd *msd, gsize max_len,
+                                    GOutputVector *vector);
+
+G_END_DECLS
+
+#endif /* __SPICE_CD_USB_BULK_MSD_H__ */
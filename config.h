@@ -6,6 +6,14 @@
 #define USE_NEW_USB_WIDGET
 #define USE_CD_SHARING
 
+/* the data files, the Makefile passes its $(PKGDATADIR) */
+#ifndef PKGDATADIR
+#define PKGDATADIR "/usr/local/share/usb-widget"
+#endif
+
+/* generated by "make usb.ids.bin", SPICE_USB_IDS_DB overrides it */
+#define USB_IDS_DB_PATH PKGDATADIR "/usb.ids.bin"
+
 #define _(x) x
 #define ngettext(x,y,z) ((z) == 1 ? (x) : (y))
 #define SPICE_DEBUG(fmt, ...) g_print(fmt "\n", ##__VA_ARGS__)
@@ -1,38 +1,189 @@
 #include "config.h"
+#include <stdlib.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include "usb-device-manager.h"
 #include "usb-device-widget.h"
+#include "usb-device-manager-priv.h"
+#include "usb-device-list-store.h"
+#include "usb-device-source.h"
+#include "usb-script.h"
 
-static void spice_session_initable_iface_init(GInitableIface *iface);
+/*
+ * $SPICE_USB_WIDGET_LIST shows all the devices and LUNs in a list view
+ * instead of the widget. $SPICE_USB_WIDGET_FRAME_TIMES=SECONDS keeps the
+ * dialog redrawing for that long while synthetic devices come and go,
+ * unless $SPICE_USB_SOURCE says otherwise, then reports the frame times
+ * and closes it.
+ */
+#define FRAME_TIMES_SOURCE "synthetic:devices=500,luns=200,hotplug=200,burst=20,media=100"
+#define FRAME_BUDGET_US    16667
 
-G_DEFINE_TYPE_WITH_CODE(SpiceSession, spice_session, G_TYPE_OBJECT,
-    G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, spice_session_initable_iface_init));
+typedef struct {
+    GtkWidget *dialog;
+    SpiceUsbDeviceListStore *store;     /* NULL with the widget */
+    GdkFrameClock *clock;
+    gulong before_paint_id;
+    gulong after_paint_id;
+    guint tick_id;
+    guint report_id;        /* 0 once the report ran */
+    gint64 start;
+    gint64 frame_start;
+    gint64 last_frame;
+    GArray *paint_us;       /* per frame, from before-paint to after-paint */
+    GArray *interval_us;    /* from one frame to the next */
+} FrameTimes;
 
-static void spice_session_init(SpiceSession *self)
+static void frame_before_paint(GdkFrameClock *clock, gpointer user_data)
 {
+    FrameTimes *ft = user_data;
+
+    ft->frame_start = g_get_monotonic_time();
+    if (ft->last_frame != 0) {
+        gint64 interval = ft->frame_start - ft->last_frame;
+
+        g_array_append_val(ft->interval_us, interval);
+    }
+    ft->last_frame = ft->frame_start;
+}
+
+static void frame_after_paint(GdkFrameClock *clock, gpointer user_data)
+{
+    FrameTimes *ft = user_data;
+    gint64 paint = g_get_monotonic_time() - ft->frame_start;
+
+    g_array_append_val(ft->paint_us, paint);
+}
+
+/* frames keep coming when nothing changes, to see the ones that come late */
+static gboolean frame_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+static gint compare_us(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gdouble percentile_ms(GArray *us, guint percent)
+{
+    if (us->len == 0) {
+        return 0;
+    }
+    return g_array_index(us, gint64, MIN(us->len - 1, us->len * percent / 100)) / 1000.0;
 }
 
-static gboolean spice_session_initable_init(GInitable  *initable,
-                                                       GCancellable  *cancellable,
-                                                       GError        **err)
+static guint frames_over(GArray *us, gint64 budget)
 {
-    return TRUE;
+    guint i, n = 0;
+
+    for (i = 0; i < us->len; i++) {
+        n += g_array_index(us, gint64, i) > budget;
+    }
+    return n;
+}
+
+static gboolean frame_times_report(gpointer user_data)
+{
+    FrameTimes *ft = user_data;
+    SpiceUsbDeviceListStoreStats stats;
+    gdouble seconds = (g_get_monotonic_time() - ft->start) / 1e6;
+
+    ft->report_id = 0;
+    g_array_sort(ft->paint_us, compare_us);
+    g_array_sort(ft->interval_us, compare_us);
+    g_print("%u frames in %.1f s, redraws: median %.2f ms, p99 %.2f ms, max %.2f ms, "
+            "%u over %.1f ms; frame intervals: p99 %.2f ms, max %.2f ms, %u over twice that\n",
+            ft->paint_us->len, seconds, percentile_ms(ft->paint_us, 50),
+            percentile_ms(ft->paint_us, 99), percentile_ms(ft->paint_us, 100),
+            frames_over(ft->paint_us, FRAME_BUDGET_US), FRAME_BUDGET_US / 1000.0,
+            percentile_ms(ft->interval_us, 99), percentile_ms(ft->interval_us, 100),
+            frames_over(ft->interval_us, 2 * FRAME_BUDGET_US));
+    if (ft->store != NULL) {
+        spice_usb_device_list_store_get_stats(ft->store, &stats);
+        g_print("list rows: %" G_GUINT64_FORMAT " inserted, %" G_GUINT64_FORMAT " removed, %"
+                G_GUINT64_FORMAT " updated, longest update %" G_GINT64_FORMAT " us\n",
+                stats.inserted, stats.removed, stats.updated, stats.max_update_us);
+    }
+    gtk_dialog_response(GTK_DIALOG(ft->dialog), GTK_RESPONSE_ACCEPT);
+    return G_SOURCE_REMOVE;
+}
+
+static FrameTimes *frame_times_start(GtkWidget *dialog, SpiceUsbDeviceListStore *store,
+                                     guint seconds)
+{
+    FrameTimes *ft = g_new0(FrameTimes, 1);
+
+    ft->dialog = dialog;
+    ft->store = store;
+    ft->clock = g_object_ref(gtk_widget_get_frame_clock(dialog));
+    ft->start = g_get_monotonic_time();
+    ft->paint_us = g_array_new(FALSE, FALSE, sizeof(gint64));
+    ft->interval_us = g_array_new(FALSE, FALSE, sizeof(gint64));
+    ft->before_paint_id = g_signal_connect(ft->clock, "before-paint",
+                                           G_CALLBACK(frame_before_paint), ft);
+    ft->after_paint_id = g_signal_connect(ft->clock, "after-paint",
+                                          G_CALLBACK(frame_after_paint), ft);
+    ft->tick_id = gtk_widget_add_tick_callback(dialog, frame_tick, NULL, NULL);
+    ft->report_id = g_timeout_add_seconds(seconds, frame_times_report, ft);
+    return ft;
+}
+
+/* stop timing before the dialog goes, it may be closed before the report */
+static void frame_times_free(FrameTimes *ft)
+{
+    if (ft->report_id != 0) {
+        g_source_remove(ft->report_id);
+    }
+    gtk_widget_remove_tick_callback(ft->dialog, ft->tick_id);
+    g_signal_handler_disconnect(ft->clock, ft->before_paint_id);
+    g_signal_handler_disconnect(ft->clock, ft->after_paint_id);
+    g_object_unref(ft->clock);
+    g_array_unref(ft->paint_us);
+    g_array_unref(ft->interval_us);
+    g_free(ft);
 }
 
-static void spice_session_initable_iface_init(GInitableIface *iface)
+static void device_added(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                         gpointer user_data)
 {
-    iface->init = spice_session_initable_init;
+    SpiceUsbDeviceManagerStartupStats stats;
+
+    spice_usb_device_manager_get_startup_stats(manager, &stats);
+    g_print("first USB device after %.1f ms\n", stats.first_device_us / 1000.0);
+    g_signal_handlers_disconnect_by_func(manager, device_added, user_data);
 }
 
-static void spice_session_class_init(SpiceSessionClass *klass)
+static void devices_enumerated(GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
+    SpiceUsbDeviceManagerStartupStats stats;
+    SpiceUsbDeviceManager *manager;
+    GError *err = NULL;
+
+    manager = spice_usb_device_manager_get_finish(res, &err);
+    if (manager == NULL) {
+        g_warning("USB devices not enumerated: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+    spice_usb_device_manager_get_startup_stats(manager, &stats);
+    g_print("%u USB devices after %.1f ms, the first after %.1f ms\n", stats.n_devices,
+            stats.enumerated_us / 1000.0, stats.first_device_us / 1000.0);
 }
 
 static void activate(GtkApplication *app, gpointer data)
 {
     GtkWidget *window, *win_label;
     GtkWidget *dialog, *area, *usb_device_widget;
+    SpiceUsbDeviceManager *manager;
+    SpiceUsbDeviceListStore *store = NULL;
+    FrameTimes *ft = NULL;
     SpiceSession *session;
+    const gchar *frame_times = g_getenv("SPICE_USB_WIDGET_FRAME_TIMES");
+    guint frame_seconds = frame_times != NULL ? atoi(frame_times) : 0;
     GError *err;
 
     window = gtk_application_window_new(app);
@@ -59,7 +210,21 @@ static void activate(GtkApplication *app, gpointer data)
                                           &err, /* error */
                                           NULL);;
 
-    usb_device_widget = spice_usb_device_widget_new(session, "%s %s");
+    if (frame_seconds > 0) {
+        g_setenv(SPICE_USB_SOURCE_ENV, FRAME_TIMES_SOURCE, FALSE);
+    }
+    /* the widget gets the manager as it is, devices show up as they are found */
+    manager = spice_usb_device_manager_get_async(session, NULL, devices_enumerated, NULL);
+    if (manager != NULL) {
+        g_signal_connect(manager, "device-added", G_CALLBACK(device_added), NULL);
+    }
+
+    if (manager != NULL && g_getenv("SPICE_USB_WIDGET_LIST") != NULL) {
+        store = spice_usb_device_list_store_new(manager, NULL);
+        usb_device_widget = spice_usb_device_list_view_new(store);
+    } else {
+        usb_device_widget = spice_usb_device_widget_new(session, "%s %s");
+    }
 
     area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
     gtk_box_pack_start(GTK_BOX(area), usb_device_widget, TRUE, TRUE, 0);
@@ -67,8 +232,17 @@ static void activate(GtkApplication *app, gpointer data)
     gtk_widget_show_all(window);
 
     gtk_widget_show_all(dialog);
+    if (frame_seconds > 0) {
+        ft = frame_times_start(dialog, store, frame_seconds);
+    }
     gtk_dialog_run(GTK_DIALOG(dialog));
+    if (ft != NULL) {
+        frame_times_free(ft);
+    }
     gtk_widget_destroy(dialog);
+    if (store != NULL) {
+        g_object_unref(store);
+    }
 
     gtk_widget_destroy(window);
 }
@@ -79,6 +253,11 @@ int main (int argc, char **argv)
     GtkApplication *app;
     int status;
 
+    /* commands from a file or stdin, without a display nor GTK */
+    if (argc > 1 && strcmp(argv[1], "--script") == 0) {
+        return spice_usb_script_run(argc > 2 ? argv[2] : NULL);
+    }
+
     //gtk_init(&argc, &argv);
 
     app = gtk_application_new(NULL, G_APPLICATION_FLAGS_NONE);
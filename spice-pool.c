@@ -0,0 +1,199 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "spice-pool.h"
+
+struct _SpicePool {
+    GMutex lock;
+    gsize record_size;
+    guint records_per_chunk;
+    GSList *chunks;
+    gpointer free_list; /* free records are linked through their first word */
+    guint in_use;
+    guint n_chunks;
+};
+
+/**
+ * spice_pool_new:
+ * @record_size: size of the records
+ * @records_per_chunk: number of records allocated at once
+ *
+ * Records are never given back to the system before spice_pool_destroy(),
+ * freed ones are reused by the next allocations. The pool is thread-safe.
+ */
+SpicePool *spice_pool_new(gsize record_size, guint records_per_chunk)
+{
+    SpicePool *pool = g_new0(SpicePool, 1);
+
+    g_mutex_init(&pool->lock);
+    /* keep the records pointer aligned */
+    pool->record_size = (MAX(record_size, sizeof(gpointer)) + sizeof(gpointer) - 1) &
+        ~(sizeof(gpointer) - 1);
+    pool->records_per_chunk = MAX(records_per_chunk, 1);
+    return pool;
+}
+
+void spice_pool_destroy(SpicePool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    g_slist_free_full(pool->chunks, g_free);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+gpointer spice_pool_alloc0(SpicePool *pool)
+{
+    gpointer record;
+
+    g_mutex_lock(&pool->lock);
+    if (pool->free_list == NULL) {
+        guint8 *chunk = g_malloc(pool->record_size * pool->records_per_chunk);
+        guint i;
+
+        /* thread the new records on the free list */
+        for (i = 0; i < pool->records_per_chunk; i++) {
+            gpointer *r = (gpointer *)(chunk + i * pool->record_size);
+            *r = pool->free_list;
+            pool->free_list = r;
+        }
+        pool->chunks = g_slist_prepend(pool->chunks, chunk);
+        pool->n_chunks++;
+    }
+    record = pool->free_list;
+    pool->free_list = *(gpointer *)record;
+    pool->in_use++;
+    g_mutex_unlock(&pool->lock);
+
+    memset(record, 0, pool->record_size);
+    return record;
+}
+
+void spice_pool_free1(SpicePool *pool, gpointer record)
+{
+    if (record == NULL) {
+        return;
+    }
+    g_mutex_lock(&pool->lock);
+    *(gpointer *)record = pool->free_list;
+    pool->free_list = record;
+    pool->in_use--;
+    g_mutex_unlock(&pool->lock);
+}
+
+void spice_pool_get_stats(SpicePool *pool, guint *in_use, guint *chunks)
+{
+    g_mutex_lock(&pool->lock);
+    if (in_use != NULL) {
+        *in_use = pool->in_use;
+    }
+    if (chunks != NULL) {
+        *chunks = pool->n_chunks;
+    }
+    g_mutex_unlock(&pool->lock);
+}
+
+typedef struct _SpiceInternedString {
+    guint ref;
+    gchar str[];
+} SpiceInternedString;
+
+struct _SpiceStringPool {
+    GMutex lock;
+    GHashTable *strings; /* str -> SpiceInternedString, keyed by its own str */
+};
+
+SpiceStringPool *spice_string_pool_new(void)
+{
+    SpiceStringPool *pool = g_new0(SpiceStringPool, 1);
+
+    g_mutex_init(&pool->lock);
+    pool->strings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    return pool;
+}
+
+void spice_string_pool_destroy(SpiceStringPool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    g_hash_table_unref(pool->strings);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+/**
+ * spice_string_pool_intern:
+ * @pool: a #SpiceStringPool
+ * @str: (allow-none): string to intern
+ *
+ * Returns: (transfer full): the shared copy of @str, to be given back
+ * with spice_string_pool_release()
+ */
+const gchar *spice_string_pool_intern(SpiceStringPool *pool, const gchar *str)
+{
+    SpiceInternedString *interned;
+
+    if (str == NULL) {
+        return NULL;
+    }
+
+    g_mutex_lock(&pool->lock);
+    interned = g_hash_table_lookup(pool->strings, str);
+    if (interned == NULL) {
+        gsize len = strlen(str);
+
+        interned = g_malloc(sizeof(SpiceInternedString) + len + 1);
+        interned->ref = 0;
+        memcpy(interned->str, str, len + 1);
+        g_hash_table_insert(pool->strings, interned->str, interned);
+    }
+    interned->ref++;
+    g_mutex_unlock(&pool->lock);
+
+    return interned->str;
+}
+
+/* @str must come from spice_string_pool_intern() */
+void spice_string_pool_release(SpiceStringPool *pool, const gchar *str)
+{
+    SpiceInternedString *interned;
+
+    if (str == NULL) {
+        return;
+    }
+
+    interned = (SpiceInternedString *)(str - G_STRUCT_OFFSET(SpiceInternedString, str));
+    g_mutex_lock(&pool->lock);
+    if (--interned->ref == 0) {
+        g_hash_table_remove(pool->strings, interned->str);
+    }
+    g_mutex_unlock(&pool->lock);
+}
+
+guint spice_string_pool_size(SpiceStringPool *pool)
+{
+    guint size;
+
+    g_mutex_lock(&pool->lock);
+    size = g_hash_table_size(pool->strings);
+    g_mutex_unlock(&pool->lock);
+    return size;
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_POOL_H__
+#define __SPICE_POOL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* fixed size records carved out of larger chunks, with a free list */
+typedef struct _SpicePool SpicePool;
+
+SpicePool *spice_pool_new(gsize record_size, guint records_per_chunk);
+void spice_pool_destroy(SpicePool *pool);
+gpointer spice_pool_alloc0(SpicePool *pool);
+void spice_pool_free1(SpicePool *pool, gpointer record);
+void spice_pool_get_stats(SpicePool *pool, guint *in_use, guint *chunks);
+
+/* refcounted interned strings */
+typedef struct _SpiceStringPool SpiceStringPool;
+
+SpiceStringPool *spice_string_pool_new(void);
+void spice_string_pool_destroy(SpiceStringPool *pool);
+const gchar *spice_string_pool_intern(SpiceStringPool *pool, const gchar *str);
+void spice_string_pool_release(SpiceStringPool *pool, const gchar *str);
+guint spice_string_pool_size(SpiceStringPool *pool);
+
+G_END_DECLS
+
+#endif /* __SPICE_POOL_H__ */
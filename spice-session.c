@@ -0,0 +1,46 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* the session the manager is made for, a stand-in for the one of spice-gtk */
+
+#include <config.h>
+#include <gio/gio.h>
+#include "spice-client.h"
+
+static void spice_session_initable_iface_init(GInitableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(SpiceSession, spice_session, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, spice_session_initable_iface_init));
+
+static void spice_session_init(SpiceSession *self)
+{
+}
+
+static gboolean spice_session_initable_init(GInitable  *initable,
+                                                       GCancellable  *cancellable,
+                                                       GError        **err)
+{
+    return TRUE;
+}
+
+static void spice_session_initable_iface_init(GInitableIface *iface)
+{
+    iface->init = spice_session_initable_init;
+}
+
+static void spice_session_class_init(SpiceSessionClass *klass)
+{
+}
@@ -0,0 +1,497 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <gtk/gtk.h>
+#include "usb-device-manager-priv.h"
+#include "usb-device-list-store.h"
+
+#define VIEW_TOGGLE_WIDTH       80
+#define VIEW_DESCRIPTION_WIDTH  600
+
+struct _SpiceUsbDeviceListStore {
+    GtkTreeStore parent;
+    SpiceUsbDeviceManager *manager;
+    gchar *format;
+    GHashTable *rows;           /* device -> GtkTreeIter of its row */
+    SpiceUsbDeviceListStoreStats stats;
+};
+
+struct _SpiceUsbDeviceListStoreClass {
+    GtkTreeStoreClass parent_class;
+};
+
+G_DEFINE_TYPE(SpiceUsbDeviceListStore, spice_usb_device_list_store, GTK_TYPE_TREE_STORE)
+
+static void spice_usb_device_list_store_init(SpiceUsbDeviceListStore *self)
+{
+    GType types[SPICE_USB_DEVICE_LIST_N_COLUMNS] = {
+        [SPICE_USB_DEVICE_LIST_COLUMN_DEVICE] = SPICE_TYPE_USB_DEVICE,
+        [SPICE_USB_DEVICE_LIST_COLUMN_LUN] = G_TYPE_INT,
+        [SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION] = G_TYPE_STRING,
+        [SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED] = G_TYPE_BOOLEAN,
+        [SPICE_USB_DEVICE_LIST_COLUMN_LOADED] = G_TYPE_BOOLEAN,
+        [SPICE_USB_DEVICE_LIST_COLUMN_LOCKED] = G_TYPE_BOOLEAN,
+    };
+
+    gtk_tree_store_set_column_types(GTK_TREE_STORE(self), G_N_ELEMENTS(types), types);
+    /* tree store iters persist, the ones of the device rows are kept */
+    self->rows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+}
+
+static void spice_usb_device_list_store_dispose(GObject *gobject)
+{
+    SpiceUsbDeviceListStore *self = SPICE_USB_DEVICE_LIST_STORE(gobject);
+
+    if (self->manager != NULL) {
+        g_signal_handlers_disconnect_by_data(self->manager, self);
+        g_clear_object(&self->manager);
+    }
+    G_OBJECT_CLASS(spice_usb_device_list_store_parent_class)->dispose(gobject);
+}
+
+static void spice_usb_device_list_store_finalize(GObject *gobject)
+{
+    SpiceUsbDeviceListStore *self = SPICE_USB_DEVICE_LIST_STORE(gobject);
+
+    g_hash_table_destroy(self->rows);
+    g_free(self->format);
+    G_OBJECT_CLASS(spice_usb_device_list_store_parent_class)->finalize(gobject);
+}
+
+static void spice_usb_device_list_store_class_init(SpiceUsbDeviceListStoreClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->dispose = spice_usb_device_list_store_dispose;
+    gobject_class->finalize = spice_usb_device_list_store_finalize;
+}
+
+/* set the columns that differ, a row set the same is not redrawn */
+static void list_store_set_row(SpiceUsbDeviceListStore *self, GtkTreeIter *iter,
+                               const gchar *description, gboolean connected,
+                               gboolean loaded, gboolean locked)
+{
+    gboolean old_connected, old_loaded, old_locked;
+    gchar *old_description;
+
+    gtk_tree_model_get(GTK_TREE_MODEL(self), iter,
+                       SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION, &old_description,
+                       SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED, &old_connected,
+                       SPICE_USB_DEVICE_LIST_COLUMN_LOADED, &old_loaded,
+                       SPICE_USB_DEVICE_LIST_COLUMN_LOCKED, &old_locked,
+                       -1);
+    if (g_strcmp0(old_description, description) != 0 || old_connected != connected ||
+        old_loaded != loaded || old_locked != locked) {
+        gtk_tree_store_set(GTK_TREE_STORE(self), iter,
+                           SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION, description,
+                           SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED, connected,
+                           SPICE_USB_DEVICE_LIST_COLUMN_LOADED, loaded,
+                           SPICE_USB_DEVICE_LIST_COLUMN_LOCKED, locked,
+                           -1);
+        self->stats.updated++;
+    }
+    g_free(old_description);
+}
+
+static void list_store_set_lun(SpiceUsbDeviceListStore *self, GtkTreeIter *iter,
+                               const SpiceUsbDeviceLunInfo *lun_info)
+{
+    gchar *description;
+
+    description = g_strdup_printf("%s %s - %s", lun_info->vendor, lun_info->product,
+                                  lun_info->file_path != NULL ? lun_info->file_path :
+                                                                _("no media"));
+    list_store_set_row(self, iter, description, FALSE, lun_info->loaded, lun_info->locked);
+    g_free(description);
+}
+
+/* the LUN rows follow the LUNs of the device, in LUN order, the others are kept */
+static void list_store_update_luns(SpiceUsbDeviceListStore *self, GtkTreeIter *parent,
+                                   SpiceUsbDevice *device)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(self);
+    GtkTreeStore *store = GTK_TREE_STORE(self);
+    const SpiceUsbDeviceLunInfo *lun_info;
+    SpiceUsbDeviceLunIter luns;
+    GtkTreeIter child, new_child;
+    gboolean valid;
+    guint lun;
+
+    valid = gtk_tree_model_iter_children(model, &child, parent);
+    spice_usb_device_lun_iter_init(&luns, device);
+    while (spice_usb_device_lun_iter_next(&luns, &lun, &lun_info)) {
+        gint row_lun = -1;
+
+        /* rows of LUNs removed since */
+        while (valid) {
+            gtk_tree_model_get(model, &child, SPICE_USB_DEVICE_LIST_COLUMN_LUN, &row_lun, -1);
+            if (row_lun >= (gint)lun) {
+                break;
+            }
+            valid = gtk_tree_store_remove(store, &child);
+            self->stats.removed++;
+        }
+        if (valid && row_lun == (gint)lun) {
+            list_store_set_lun(self, &child, lun_info);
+            valid = gtk_tree_model_iter_next(model, &child);
+            continue;
+        }
+        gtk_tree_store_insert_before(store, &new_child, parent, valid ? &child : NULL);
+        gtk_tree_store_set(store, &new_child,
+                           SPICE_USB_DEVICE_LIST_COLUMN_DEVICE, device,
+                           SPICE_USB_DEVICE_LIST_COLUMN_LUN, (gint)lun,
+                           -1);
+        list_store_set_lun(self, &new_child, lun_info);
+        self->stats.inserted++;
+    }
+    while (valid) {
+        valid = gtk_tree_store_remove(store, &child);
+        self->stats.removed++;
+    }
+}
+
+static void list_store_update_device(SpiceUsbDeviceListStore *self, GtkTreeIter *iter,
+                                     SpiceUsbDevice *device)
+{
+    list_store_set_row(self, iter, spice_usb_device_peek_description(device, self->format),
+                       spice_usb_device_manager_is_device_connected(self->manager, device),
+                       FALSE, FALSE);
+    if (spice_usb_device_manager_is_device_cd(self->manager, device)) {
+        list_store_update_luns(self, iter, device);
+    }
+}
+
+static void list_store_account(SpiceUsbDeviceListStore *self, gint64 start)
+{
+    self->stats.max_update_us = MAX(self->stats.max_update_us,
+                                    g_get_monotonic_time() - start);
+}
+
+/* devices found before the store was made may still be announced */
+static void device_added_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                            gpointer user_data)
+{
+    SpiceUsbDeviceListStore *self = user_data;
+    gint64 start = g_get_monotonic_time();
+    GtkTreeIter *iter = g_hash_table_lookup(self->rows, device);
+
+    if (iter == NULL) {
+        iter = g_new(GtkTreeIter, 1);
+        gtk_tree_store_insert_with_values(GTK_TREE_STORE(self), iter, NULL, -1,
+                                          SPICE_USB_DEVICE_LIST_COLUMN_DEVICE, device,
+                                          SPICE_USB_DEVICE_LIST_COLUMN_LUN, -1,
+                                          -1);
+        g_hash_table_insert(self->rows, device, iter);
+        self->stats.inserted++;
+    }
+    list_store_update_device(self, iter, device);
+    list_store_account(self, start);
+}
+
+static void device_removed_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                              gpointer user_data)
+{
+    SpiceUsbDeviceListStore *self = user_data;
+    gint64 start = g_get_monotonic_time();
+    GtkTreeIter *iter = g_hash_table_lookup(self->rows, device);
+
+    if (iter == NULL) {
+        return;
+    }
+    /* its LUN rows go with it */
+    self->stats.removed += 1 + gtk_tree_model_iter_n_children(GTK_TREE_MODEL(self), iter);
+    gtk_tree_store_remove(GTK_TREE_STORE(self), iter);
+    g_hash_table_remove(self->rows, device);
+    list_store_account(self, start);
+}
+
+static void device_changed_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                              gpointer user_data)
+{
+    SpiceUsbDeviceListStore *self = user_data;
+    gint64 start = g_get_monotonic_time();
+    GtkTreeIter *iter = g_hash_table_lookup(self->rows, device);
+
+    if (iter == NULL) {
+        return;
+    }
+    list_store_update_device(self, iter, device);
+    list_store_account(self, start);
+}
+
+/**
+ * spice_usb_device_list_store_new:
+ * @manager: the #SpiceUsbDeviceManager
+ * @device_format_string: (allow-none): the format of the device rows, as
+ * for spice_usb_device_get_description()
+ *
+ * A tree model of the devices of @manager, a row per device and a child
+ * row per CD LUN, kept up to date from the signals of @manager: a device
+ * added inserts its rows, one removed removes them, one changed updates
+ * the rows that differ. The other rows are left alone, so a view of the
+ * store only redraws the rows changed that it shows.
+ *
+ * Returns: (transfer full): a new #SpiceUsbDeviceListStore
+ */
+SpiceUsbDeviceListStore *spice_usb_device_list_store_new(SpiceUsbDeviceManager *manager,
+                                                         const gchar *device_format_string)
+{
+    SpiceUsbDeviceListStore *self;
+    GPtrArray *devices;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+
+    self = g_object_new(SPICE_TYPE_USB_DEVICE_LIST_STORE, NULL);
+    self->manager = g_object_ref(manager);
+    self->format = g_strdup(device_format_string);
+
+    g_signal_connect(manager, "device-added", G_CALLBACK(device_added_cb), self);
+    g_signal_connect(manager, "device-removed", G_CALLBACK(device_removed_cb), self);
+    g_signal_connect(manager, "device-changed", G_CALLBACK(device_changed_cb), self);
+
+    devices = spice_usb_device_manager_get_devices(manager);
+    for (i = 0; i < devices->len; i++) {
+        device_added_cb(manager, g_ptr_array_index(devices, i), self);
+    }
+    g_ptr_array_unref(devices);
+    return self;
+}
+
+void spice_usb_device_list_store_get_stats(SpiceUsbDeviceListStore *store,
+                                           SpiceUsbDeviceListStoreStats *stats)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_LIST_STORE(store));
+    g_return_if_fail(stats != NULL);
+
+    *stats = store->stats;
+}
+
+/* the device and LUN of the row at @path_string, FALSE if it is gone */
+static gboolean view_get_row(SpiceUsbDeviceListStore *store, const gchar *path_string,
+                             SpiceUsbDevice **device, gint *lun, gboolean *active,
+                             gint column)
+{
+    GtkTreeIter iter;
+
+    if (!gtk_tree_model_get_iter_from_string(GTK_TREE_MODEL(store), &iter, path_string)) {
+        return FALSE;
+    }
+    gtk_tree_model_get(GTK_TREE_MODEL(store), &iter,
+                       SPICE_USB_DEVICE_LIST_COLUMN_DEVICE, device,
+                       SPICE_USB_DEVICE_LIST_COLUMN_LUN, lun,
+                       column, active,
+                       -1);
+    return TRUE;
+}
+
+/* a redirection asked from the view, the row is updated once it is done */
+typedef struct {
+    SpiceUsbDeviceListStore *store;
+    SpiceUsbDevice *device;
+} ViewRequest;
+
+static void view_request_done(ViewRequest *request)
+{
+    SpiceUsbDeviceListStore *store = request->store;
+    GtkTreeIter *iter = g_hash_table_lookup(store->rows, request->device);
+
+    if (iter != NULL) {
+        list_store_update_device(store, iter, request->device);
+    }
+    g_boxed_free(SPICE_TYPE_USB_DEVICE, request->device);
+    g_object_unref(store);
+    g_free(request);
+}
+
+static void view_connect_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(source_object);
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_connect_device_finish(manager, res, &err)) {
+        g_warning("USB device not redirected: %s", err->message);
+        g_error_free(err);
+    }
+    view_request_done(user_data);
+}
+
+static void view_disconnect_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(source_object);
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_disconnect_device_finish(manager, res, &err)) {
+        g_warning("USB device still redirected: %s", err->message);
+        g_error_free(err);
+    }
+    view_request_done(user_data);
+}
+
+static void view_connected_toggled(GtkCellRendererToggle *cell, gchar *path_string,
+                                   gpointer user_data)
+{
+    SpiceUsbDeviceListStore *store = user_data;
+    SpiceUsbDevice *device;
+    ViewRequest *request;
+    gboolean connected;
+    gint lun;
+
+    if (!view_get_row(store, path_string, &device, &lun, &connected,
+                      SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED)) {
+        return;
+    }
+    if (lun >= 0) {
+        g_boxed_free(SPICE_TYPE_USB_DEVICE, device);
+        return;
+    }
+    request = g_new(ViewRequest, 1);
+    request->store = g_object_ref(store);
+    request->device = device;
+    if (connected) {
+        spice_usb_device_manager_disconnect_device_async(store->manager, device, NULL,
+                                                         view_disconnect_done, request);
+    } else {
+        spice_usb_device_manager_connect_device_async(store->manager, device, NULL,
+                                                      view_connect_done, request);
+    }
+}
+
+/* the row is updated by the device-changed of the load */
+static void view_load_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(source_object);
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_device_lun_load_finish(manager, res, &err)) {
+        if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_warning("CD LUN not loaded: %s", err->message);
+        }
+        g_error_free(err);
+    }
+}
+
+static void view_loaded_toggled(GtkCellRendererToggle *cell, gchar *path_string,
+                                gpointer user_data)
+{
+    SpiceUsbDeviceListStore *store = user_data;
+    SpiceUsbDevice *device;
+    gboolean loaded;
+    gint lun;
+
+    if (!view_get_row(store, path_string, &device, &lun, &loaded,
+                      SPICE_USB_DEVICE_LIST_COLUMN_LOADED)) {
+        return;
+    }
+    /* the image is opened off the main loop, failures to eject come as a device-error */
+    if (lun >= 0 && loaded) {
+        spice_usb_device_manager_device_lun_load(store->manager, device, lun, FALSE);
+    } else if (lun >= 0) {
+        spice_usb_device_manager_device_lun_load_async(store->manager, device, lun, NULL,
+                                                       view_load_done, NULL);
+    }
+    g_boxed_free(SPICE_TYPE_USB_DEVICE, device);
+}
+
+/* called for the rows shown only: device rows have the redirect toggle, LUN rows the others */
+static void view_toggle_data(GtkTreeViewColumn *column, GtkCellRenderer *cell,
+                             GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+    gint column_id = GPOINTER_TO_INT(data);
+    gboolean active;
+    gint lun;
+
+    gtk_tree_model_get(model, iter,
+                       SPICE_USB_DEVICE_LIST_COLUMN_LUN, &lun,
+                       column_id, &active,
+                       -1);
+    g_object_set(cell,
+                 "visible", (lun < 0) == (column_id == SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED),
+                 "active", active,
+                 NULL);
+}
+
+static void view_add_toggle(GtkTreeView *view, SpiceUsbDeviceListStore *store,
+                            const gchar *title, gint column_id, GCallback toggled)
+{
+    GtkCellRenderer *cell = gtk_cell_renderer_toggle_new();
+    GtkTreeViewColumn *column = gtk_tree_view_column_new();
+
+    gtk_tree_view_column_set_title(column, title);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, VIEW_TOGGLE_WIDTH);
+    gtk_tree_view_column_pack_start(column, cell, FALSE);
+    gtk_tree_view_column_set_cell_data_func(column, cell, view_toggle_data,
+                                            GINT_TO_POINTER(column_id), NULL);
+    if (toggled != NULL) {
+        g_signal_connect_object(cell, "toggled", toggled, store, 0);
+    } else {
+        gtk_cell_renderer_toggle_set_activatable(GTK_CELL_RENDERER_TOGGLE(cell), FALSE);
+    }
+    gtk_tree_view_append_column(view, column);
+}
+
+/**
+ * spice_usb_device_list_view_new:
+ * @store: the #SpiceUsbDeviceListStore to show
+ *
+ * A view of @store in a scrolled window. Its rows all have the same
+ * height and its columns a fixed width, so only the rows scrolled into
+ * sight are measured and drawn, however many devices and LUNs there are.
+ * Device rows redirect their device when toggled, LUN rows load or eject
+ * their media; the locks are the guest's and only shown.
+ *
+ * Returns: (transfer floating): the scrolled window holding the view
+ */
+GtkWidget *spice_usb_device_list_view_new(SpiceUsbDeviceListStore *store)
+{
+    GtkWidget *scrolled, *view;
+    GtkCellRenderer *cell;
+    GtkTreeViewColumn *column;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_LIST_STORE(store), NULL);
+
+    view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+    view_add_toggle(GTK_TREE_VIEW(view), store, _("Redirect"),
+                    SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED, G_CALLBACK(view_connected_toggled));
+
+    cell = gtk_cell_renderer_text_new();
+    g_object_set(cell, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+    column = gtk_tree_view_column_new_with_attributes(_("Device"), cell,
+                                                      "text",
+                                                      SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION,
+                                                      NULL);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, VIEW_DESCRIPTION_WIDTH);
+    gtk_tree_view_column_set_expand(column, TRUE);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(view), column);
+    gtk_tree_view_set_expander_column(GTK_TREE_VIEW(view), column);
+
+    view_add_toggle(GTK_TREE_VIEW(view), store, _("Loaded"),
+                    SPICE_USB_DEVICE_LIST_COLUMN_LOADED, G_CALLBACK(view_loaded_toggled));
+    view_add_toggle(GTK_TREE_VIEW(view), store, _("Locked"),
+                    SPICE_USB_DEVICE_LIST_COLUMN_LOCKED, NULL);
+
+    /* rows are not measured one by one, which is what keeps the unseen ones unrealized */
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(view), TRUE);
+
+    scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled), view);
+    return scrolled;
+}
@@ -0,0 +1,70 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_DEVICE_LIST_STORE_H__
+#define __SPICE_USB_DEVICE_LIST_STORE_H__
+
+#include <gtk/gtk.h>
+#include "usb-device-manager.h"
+
+G_BEGIN_DECLS
+
+#define SPICE_TYPE_USB_DEVICE_LIST_STORE            (spice_usb_device_list_store_get_type ())
+#define SPICE_USB_DEVICE_LIST_STORE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), SPICE_TYPE_USB_DEVICE_LIST_STORE, SpiceUsbDeviceListStore))
+#define SPICE_IS_USB_DEVICE_LIST_STORE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SPICE_TYPE_USB_DEVICE_LIST_STORE))
+
+typedef struct _SpiceUsbDeviceListStore SpiceUsbDeviceListStore;
+typedef struct _SpiceUsbDeviceListStoreClass SpiceUsbDeviceListStoreClass;
+
+/**
+ * SpiceUsbDeviceListColumn:
+ * @SPICE_USB_DEVICE_LIST_COLUMN_DEVICE: the #SpiceUsbDevice of the row
+ * @SPICE_USB_DEVICE_LIST_COLUMN_LUN: the LUN of a CD LUN row, -1 on device rows
+ * @SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION: the text of the row
+ * @SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED: the device is redirected
+ * @SPICE_USB_DEVICE_LIST_COLUMN_LOADED: the LUN has its media loaded
+ * @SPICE_USB_DEVICE_LIST_COLUMN_LOCKED: the LUN is locked by the guest
+ *
+ * Columns of a #SpiceUsbDeviceListStore: a row per device, with a child
+ * row per LUN on CD devices.
+ */
+typedef enum {
+    SPICE_USB_DEVICE_LIST_COLUMN_DEVICE,
+    SPICE_USB_DEVICE_LIST_COLUMN_LUN,
+    SPICE_USB_DEVICE_LIST_COLUMN_DESCRIPTION,
+    SPICE_USB_DEVICE_LIST_COLUMN_CONNECTED,
+    SPICE_USB_DEVICE_LIST_COLUMN_LOADED,
+    SPICE_USB_DEVICE_LIST_COLUMN_LOCKED,
+    SPICE_USB_DEVICE_LIST_N_COLUMNS,
+} SpiceUsbDeviceListColumn;
+
+/* rows changed in place of a whole rebuild, since the store was made */
+typedef struct _SpiceUsbDeviceListStoreStats {
+    guint64 inserted;
+    guint64 removed;
+    guint64 updated;
+    gint64 max_update_us;       /* longest a manager signal took to apply */
+} SpiceUsbDeviceListStoreStats;
+
+GType spice_usb_device_list_store_get_type(void);
+SpiceUsbDeviceListStore *spice_usb_device_list_store_new(SpiceUsbDeviceManager *manager,
+                                                         const gchar *device_format_string);
+void spice_usb_device_list_store_get_stats(SpiceUsbDeviceListStore *store,
+                                           SpiceUsbDeviceListStoreStats *stats);
+GtkWidget *spice_usb_device_list_view_new(SpiceUsbDeviceListStore *store);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_DEVICE_LIST_STORE_H__ */
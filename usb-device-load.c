@@ -0,0 +1,293 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <gio/gio.h>
+#include "usb-device-manager-priv.h"
+#include "usb-device-load.h"
+
+/* random devices tried before giving up on finding one of the right kind */
+#define LOAD_PICK_TRIES 8
+
+struct _SpiceUsbDeviceLoad {
+    gint ref;               /* ours and one per request in flight */
+    SpiceUsbDeviceManager *manager;
+    gdouble connect_rate;
+    gdouble media_rate;
+    gchar *image;
+    GRand *rand;
+    GSource *tick;
+    gint64 last_tick;
+    gint64 last_report;
+    gdouble connects_due;   /* fractions of requests carried to the next tick */
+    gdouble media_due;
+    SpiceUsbDeviceLoadStats stats;
+};
+
+static SpiceUsbDeviceLoad *load_ref(SpiceUsbDeviceLoad *load)
+{
+    load->ref++;
+    return load;
+}
+
+static void load_unref(SpiceUsbDeviceLoad *load)
+{
+    if (--load->ref > 0) {
+        return;
+    }
+    g_rand_free(load->rand);
+    g_free(load->image);
+    g_free(load);
+}
+
+/* a random device, a CD one or not, NULL if none was found */
+static SpiceUsbDevice *load_pick(SpiceUsbDeviceLoad *load, GPtrArray *devices, gboolean cd)
+{
+    guint i;
+
+    for (i = 0; i < LOAD_PICK_TRIES && devices->len > 0; i++) {
+        SpiceUsbDevice *device =
+            g_ptr_array_index(devices, g_rand_int_range(load->rand, 0, devices->len));
+
+        if ((spice_usb_device_manager_is_device_cd(load->manager, device) != 0) == cd) {
+            return device;
+        }
+    }
+    return NULL;
+}
+
+static void load_connected(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceLoad *load = user_data;
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_connect_device_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                        res, &err)) {
+        load->stats.connect_errors++;
+        g_clear_error(&err);
+    }
+    load_unref(load);
+}
+
+static void load_disconnected(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceLoad *load = user_data;
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_disconnect_device_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                           res, &err)) {
+        load->stats.connect_errors++;
+        g_clear_error(&err);
+    }
+    load_unref(load);
+}
+
+/* redirect a random device, or stop redirecting it */
+static void load_connect(SpiceUsbDeviceLoad *load, GPtrArray *devices)
+{
+    SpiceUsbDevice *device = load_pick(load, devices, FALSE);
+
+    if (device == NULL) {
+        return;
+    }
+    if (spice_usb_device_manager_is_device_connected(load->manager, device)) {
+        load->stats.disconnects++;
+        spice_usb_device_manager_disconnect_device_async(load->manager, device, NULL,
+                                                         load_disconnected, load_ref(load));
+    } else {
+        load->stats.connects++;
+        spice_usb_device_manager_connect_device_async(load->manager, device, NULL,
+                                                      load_connected, load_ref(load));
+    }
+}
+
+static void load_media_changed(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbDeviceLoad *load = user_data;
+    GError *err = NULL;
+
+    if (!spice_usb_device_manager_device_lun_change_media_finish(
+            SPICE_USB_DEVICE_MANAGER(source_object), res, &err)) {
+        load->stats.media_errors++;
+        g_clear_error(&err);
+    }
+    load_unref(load);
+}
+
+/*
+ * A random LUN: one time in four its lock is toggled, as the guest
+ * does, otherwise its medium is ejected or changed. Without an image
+ * the locks are all there is to change.
+ */
+static void load_change_media(SpiceUsbDeviceLoad *load, GPtrArray *devices)
+{
+    SpiceUsbDevice *device = load_pick(load, devices, TRUE);
+    const SpiceUsbDeviceLunInfo *lun_info;
+    SpiceUsbDeviceLunInfo new_info = { 0, };
+    SpiceUsbDeviceLunIter iter;
+    guint lun, n_luns = 0, pick;
+
+    if (device == NULL) {
+        return;
+    }
+    spice_usb_device_lun_iter_init(&iter, device);
+    while (spice_usb_device_lun_iter_next(&iter, NULL, NULL)) {
+        n_luns++;
+    }
+    if (n_luns == 0) {
+        return;
+    }
+    pick = g_rand_int_range(load->rand, 0, n_luns);
+    spice_usb_device_lun_iter_init(&iter, device);
+    do {
+        spice_usb_device_lun_iter_next(&iter, &lun, &lun_info);
+    } while (pick-- > 0);
+
+    if (load->image == NULL || g_rand_int_range(load->rand, 0, 4) == 0) {
+        load->stats.locks++;
+        spice_usb_device_manager_device_lun_lock(load->manager, device, lun, !lun_info->locked);
+    } else if (lun_info->loaded) {
+        load->stats.ejects++;
+        if (!spice_usb_device_manager_device_lun_load(load->manager, device, lun, FALSE)) {
+            load->stats.media_errors++;
+        }
+    } else {
+        load->stats.media_changes++;
+        new_info.file_path = load->image;
+        spice_usb_device_manager_device_lun_change_media_async(load->manager, device, lun,
+                                                               &new_info, NULL,
+                                                               load_media_changed,
+                                                               load_ref(load));
+    }
+}
+
+static void load_report(SpiceUsbDeviceLoad *load)
+{
+    const SpiceUsbDeviceLoadStats *stats = &load->stats;
+
+    SPICE_DEBUG("USB load: %" G_GUINT64_FORMAT " connects, %" G_GUINT64_FORMAT
+                " disconnects, %" G_GUINT64_FORMAT " failed, %" G_GUINT64_FORMAT
+                " media changes, %" G_GUINT64_FORMAT " ejects, %" G_GUINT64_FORMAT
+                " locks, %" G_GUINT64_FORMAT " failed, main loop lag up to %"
+                G_GINT64_FORMAT " us",
+                stats->connects, stats->disconnects, stats->connect_errors,
+                stats->media_changes, stats->ejects, stats->locks, stats->media_errors,
+                stats->max_tick_lag_us);
+}
+
+/* the requests due since the last tick, however late it is */
+static gboolean load_tick(gpointer user_data)
+{
+    SpiceUsbDeviceLoad *load = user_data;
+    gint64 now = g_get_monotonic_time();
+    gdouble elapsed = (now - load->last_tick) / 1e6;
+    GPtrArray *devices;
+
+    load->stats.max_tick_lag_us = MAX(load->stats.max_tick_lag_us,
+                                      now - load->last_tick -
+                                      SPICE_USB_DEVICE_LOAD_TICK_MS * 1000);
+    load->last_tick = now;
+    load->connects_due += load->connect_rate * elapsed;
+    load->media_due += load->media_rate * elapsed;
+
+    devices = spice_usb_device_manager_get_devices(load->manager);
+    for (; load->connects_due >= 1; load->connects_due--) {
+        load_connect(load, devices);
+    }
+    for (; load->media_due >= 1; load->media_due--) {
+        load_change_media(load, devices);
+    }
+    g_ptr_array_unref(devices);
+
+    if (now - load->last_report >= SPICE_USB_DEVICE_LOAD_REPORT_MS * 1000) {
+        load->last_report = now;
+        load_report(load);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * spice_usb_device_load_start:
+ * @manager: the #SpiceUsbDeviceManager
+ * @config: the configuration of the synthetic source of @manager
+ * @context: (nullable): the main context of @manager
+ *
+ * Add the CD LUNs of @config, then make requests at its rates until
+ * stopped. Requests failing, as connects without free channels, are
+ * part of the load and only counted.
+ *
+ * Returns: the load, to stop with spice_usb_device_load_stop()
+ */
+SpiceUsbDeviceLoad *spice_usb_device_load_start(SpiceUsbDeviceManager *manager,
+                                                const SpiceUsbSyntheticConfig *config,
+                                                GMainContext *context)
+{
+    SpiceUsbDeviceLoad *load;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+    g_return_val_if_fail(config != NULL, NULL);
+
+    load = g_new0(SpiceUsbDeviceLoad, 1);
+    load->ref = 1;
+    load->manager = manager;
+    load->connect_rate = config->connect_rate;
+    load->media_rate = config->media_rate;
+    load->image = g_strdup(config->image);
+    load->rand = g_rand_new_with_seed(config->seed);
+
+    for (i = 0; i < config->n_luns; i++) {
+        SpiceUsbDeviceLunInfo lun_info = {
+            .file_path = load->image,
+            .vendor = "SPICE", .product = "Synthetic CD", .revision = "0001",
+            .started = TRUE, .loaded = load->image != NULL, .locked = FALSE
+        };
+
+        spice_usb_device_manager_add_cd_lun(manager, &lun_info);
+    }
+    load->stats.n_luns = config->n_luns;
+
+    if (load->connect_rate > 0 || load->media_rate > 0) {
+        load->last_tick = load->last_report = g_get_monotonic_time();
+        load->tick = g_timeout_source_new(SPICE_USB_DEVICE_LOAD_TICK_MS);
+        g_source_set_callback(load->tick, load_tick, load, NULL);
+        g_source_attach(load->tick, context);
+    }
+    return load;
+}
+
+/* requests in flight still complete, without being counted anywhere */
+void spice_usb_device_load_stop(SpiceUsbDeviceLoad *load)
+{
+    if (load == NULL) {
+        return;
+    }
+    if (load->tick != NULL) {
+        g_source_destroy(load->tick);
+        g_source_unref(load->tick);
+        load->tick = NULL;
+        load_report(load);
+    }
+    load_unref(load);
+}
+
+void spice_usb_device_load_get_stats(SpiceUsbDeviceLoad *load, SpiceUsbDeviceLoadStats *stats)
+{
+    g_return_if_fail(load != NULL);
+    g_return_if_fail(stats != NULL);
+
+    *stats = load->stats;
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_DEVICE_LOAD_H__
+#define __SPICE_USB_DEVICE_LOAD_H__
+
+#include <glib.h>
+#include "usb-device-manager.h"
+#include "usb-device-source.h"
+
+G_BEGIN_DECLS
+
+/* how often the requests due are made, and the counters logged */
+#define SPICE_USB_DEVICE_LOAD_TICK_MS   10
+#define SPICE_USB_DEVICE_LOAD_REPORT_MS 5000
+
+typedef struct _SpiceUsbDeviceLoad SpiceUsbDeviceLoad;
+
+typedef struct _SpiceUsbDeviceLoadStats {
+    guint n_luns;               /* added at start */
+    guint64 connects;           /* requested */
+    guint64 disconnects;
+    guint64 connect_errors;     /* connects and disconnects that failed */
+    guint64 media_changes;
+    guint64 ejects;
+    guint64 locks;              /* locks and unlocks */
+    guint64 media_errors;       /* media changes that failed, as on a locked LUN */
+    gint64 max_tick_lag_us;     /* longest the main loop kept a tick waiting */
+} SpiceUsbDeviceLoadStats;
+
+/*
+ * Requests made to the manager from its main context at the rates of
+ * a synthetic source: connects and disconnects of random devices, and
+ * media changes, ejects, locks and unlocks of random CD LUNs.
+ */
+SpiceUsbDeviceLoad *spice_usb_device_load_start(SpiceUsbDeviceManager *manager,
+                                                const SpiceUsbSyntheticConfig *config,
+                                                GMainContext *context);
+void spice_usb_device_load_stop(SpiceUsbDeviceLoad *load);
+void spice_usb_device_load_get_stats(SpiceUsbDeviceLoad *load, SpiceUsbDeviceLoadStats *stats);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_DEVICE_LOAD_H__ */
@@ -0,0 +1,179 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   Red Hat Authors:
+   Hans de Goede <hdegoede@redhat.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_DEVICE_MANAGER_PRIV_H__
+#define __SPICE_USB_DEVICE_MANAGER_PRIV_H__
+
+#include "usb-device-manager.h"
+#include "cd-image.h"
+#include "cd-readahead.h"
+#include "cd-usb-bulk-msd.h"
+#include "usb-hotplug.h"
+#include "usb-device-load.h"
+
+G_BEGIN_DECLS
+
+/* LUNs per CD device, the #SpiceUsbDeviceManager default for max LUNs */
+#define SPICE_USB_DEVICE_MAX_LUNS 4
+
+/**
+ * SpiceUsbDeviceBatchFlags:
+ * @SPICE_USB_DEVICE_BATCH_NONE: connect as many devices as possible
+ * @SPICE_USB_DEVICE_BATCH_ALL_OR_NOTHING: connect either all devices or none
+ */
+typedef enum {
+    SPICE_USB_DEVICE_BATCH_NONE           = 0,
+    SPICE_USB_DEVICE_BATCH_ALL_OR_NOTHING = 1 << 0,
+} SpiceUsbDeviceBatchFlags;
+
+/**
+ * SpiceUsbCdLunPlacement:
+ * @SPICE_USB_CD_LUN_PLACEMENT_PACK: fill CD devices up to max LUNs
+ * @SPICE_USB_CD_LUN_PLACEMENT_SPREAD: one LUN per CD device
+ */
+typedef enum {
+    SPICE_USB_CD_LUN_PLACEMENT_PACK,
+    SPICE_USB_CD_LUN_PLACEMENT_SPREAD,
+} SpiceUsbCdLunPlacement;
+
+GType spice_usb_cd_lun_placement_get_type(void);
+#define SPICE_TYPE_USB_CD_LUN_PLACEMENT (spice_usb_cd_lun_placement_get_type())
+
+/**
+ * SpiceUsbDeviceLunIter:
+ *
+ * Stack allocated iterator over the LUNs of a CD device, see
+ * spice_usb_device_lun_iter_init().
+ */
+typedef struct {
+    /*< private >*/
+    gconstpointer device;
+    guint next;
+} SpiceUsbDeviceLunIter;
+
+/* timings of the startup enumeration, in us from its start, -1 before */
+typedef struct _SpiceUsbDeviceManagerStartupStats {
+    gint64 first_device_us;     /* time to the first device in the list */
+    gint64 enumerated_us;       /* time to the last one */
+    guint n_devices;            /* in the list so far */
+} SpiceUsbDeviceManagerStartupStats;
+
+SpiceUsbDeviceManager *spice_usb_device_manager_get_async(SpiceSession *session,
+                                                          GCancellable *cancellable,
+                                                          GAsyncReadyCallback callback,
+                                                          gpointer user_data);
+SpiceUsbDeviceManager *spice_usb_device_manager_get_finish(GAsyncResult *res, GError **err);
+void spice_usb_device_manager_get_startup_stats(SpiceUsbDeviceManager *self,
+                                                SpiceUsbDeviceManagerStartupStats *stats);
+gboolean spice_usb_device_manager_get_hotplug_stats(SpiceUsbDeviceManager *self,
+                                                    SpiceUsbHotplugStats *stats);
+gboolean spice_usb_device_manager_get_load_stats(SpiceUsbDeviceManager *self,
+                                                 SpiceUsbDeviceLoadStats *stats);
+
+SpiceUsbDevice *
+spice_usb_device_manager_find_device_by_address(SpiceUsbDeviceManager *manager,
+                                                guint8 busnum, guint8 devaddr);
+GPtrArray *spice_usb_device_manager_find_devices_by_id(SpiceUsbDeviceManager *manager,
+                                                       guint16 vid, guint16 pid);
+
+const gchar *spice_usb_device_peek_description(SpiceUsbDevice *device,
+                                               const gchar *format);
+guint32 spice_usb_device_get_speed(const SpiceUsbDevice *device);
+const gchar *spice_usb_device_peek_serial(const SpiceUsbDevice *device);
+
+void spice_usb_device_lun_iter_init(SpiceUsbDeviceLunIter *iter,
+                                    SpiceUsbDevice *device);
+gboolean spice_usb_device_lun_iter_next(SpiceUsbDeviceLunIter *iter,
+                                        guint *lun,
+                                        const SpiceUsbDeviceLunInfo **lun_info);
+const SpiceUsbDeviceLunInfo *
+spice_usb_device_manager_device_lun_peek_info(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              guint lun);
+SpiceCdImage *
+spice_usb_device_manager_device_lun_get_image(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              guint lun);
+gboolean
+spice_usb_device_manager_device_lun_get_readahead_stats(SpiceUsbDeviceManager *self,
+                                                        SpiceUsbDevice *device,
+                                                        guint lun,
+                                                        SpiceCdReadaheadStats *stats);
+gboolean
+spice_usb_device_manager_get_cd_aio_stats(SpiceUsbDeviceManager *self,
+                                          SpiceCdAioStats *stats);
+SpiceCdUsbBulkMsd *
+spice_usb_device_manager_device_get_msd(SpiceUsbDeviceManager *self,
+                                        SpiceUsbDevice *device);
+
+void spice_usb_device_manager_flush_changes(SpiceUsbDeviceManager *manager);
+
+void
+spice_usb_device_manager_device_lun_change_media_async(SpiceUsbDeviceManager *self,
+                                                       SpiceUsbDevice *device,
+                                                       guint lun,
+                                                       const SpiceUsbDeviceLunInfo *lun_info,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data);
+gboolean
+spice_usb_device_manager_device_lun_change_media_finish(SpiceUsbDeviceManager *self,
+                                                        GAsyncResult *res,
+                                                        GError **err);
+void
+spice_usb_device_manager_device_lun_load_async(SpiceUsbDeviceManager *self,
+                                               SpiceUsbDevice *device,
+                                               guint lun,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data);
+gboolean
+spice_usb_device_manager_device_lun_load_finish(SpiceUsbDeviceManager *self,
+                                                GAsyncResult *res,
+                                                GError **err);
+
+gboolean spice_usb_device_manager_should_auto_connect(SpiceUsbDeviceManager *self,
+                                                      SpiceUsbDevice *device);
+gboolean spice_usb_device_manager_should_redirect_on_connect(SpiceUsbDeviceManager *self,
+                                                             SpiceUsbDevice *device);
+
+void spice_usb_device_manager_connect_devices_async(SpiceUsbDeviceManager *self,
+                                                    GPtrArray *devices,
+                                                    SpiceUsbDeviceBatchFlags flags,
+                                                    GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data);
+gboolean spice_usb_device_manager_connect_devices_finish(SpiceUsbDeviceManager *self,
+                                                         GAsyncResult *res,
+                                                         GPtrArray **errors,
+                                                         GError **err);
+void spice_usb_device_manager_disconnect_devices_async(SpiceUsbDeviceManager *self,
+                                                       GPtrArray *devices,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data);
+gboolean spice_usb_device_manager_disconnect_devices_finish(SpiceUsbDeviceManager *self,
+                                                            GAsyncResult *res,
+                                                            GPtrArray **errors,
+                                                            GError **err);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_DEVICE_MANAGER_PRIV_H__ */
@@ -1,9 +1,18 @@
 /* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 
 #include <config.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <string.h>
 #include "spice-client.h"
+#include "usb-device-manager-priv.h"
+#include "usb-filter.h"
+#include "usb-ids.h"
+#include "spice-pool.h"
+#include "cd-image.h"
+#include "cd-usb-bulk-msd.h"
+#include "usb-device-source.h"
+#include "usb-hotplug.h"
+#include "usb-device-load.h"
 
 // this is the structure behind SpiceUsbDevice
 typedef struct _SpiceUsbDeviceInfo {
@@ -13,42 +22,106 @@ typedef struct _SpiceUsbDeviceInfo {
     guint8  devaddr;
     guint16 vid;
     guint16 pid;
+    guint8  device_class;
+    guint16 bcd_device;
+    guint32 speed;  /* kbit/s, 0 if unknown */
+    gchar *serial;
 
     gboolean redirecting;
     gboolean cd;
     gboolean connected;
-
-    GPtrArray *luns_array;
+    gboolean pending; /* connect or disconnect in progress */
+    gboolean changed; /* queued in priv->changed_devices */
+
+    guint index; /* position in _dev_ptr_array */
+    guint64 seq; /* order of insertion, the published lists keep it */
+    /* link in priv->cd_empty or priv->cd_partial while the CD device
+     * has room for more LUNs */
+    GList free_slot_link;
+    GQueue *free_slot_queue;
+
+    /* user visible strings, resolved on first use */
+    gboolean strings_valid;
+    guint64 strings_key;
+    gchar *manufacturer;
+    gchar *product;
+    gchar descriptor[sizeof("[xxxx:xxxx]")];
+    GHashTable *descriptions; /* format -> description */
+
+    /* LUN table, a LUN keeps its index until it is removed */
+    guint32 luns_mask; /* bit n set while luns[n] is in use */
+    guint n_luns;
+    SpiceUsbDeviceLunInfo luns[SPICE_USB_DEVICE_MAX_LUNS];
+    SpiceCdImage *lun_images[SPICE_USB_DEVICE_MAX_LUNS]; /* mapped while loaded */
+    SpiceCdReadahead *lun_readahead[SPICE_USB_DEVICE_MAX_LUNS];
+    guint lun_serial[SPICE_USB_DEVICE_MAX_LUNS]; /* bumped on media change and removal */
+    SpiceCdUsbBulkMsd *msd; /* mass storage emulation, created on first use */
 } SpiceUsbDeviceInfo;
 
+/* max number of devices being claimed or released at the same time */
+#define SPICE_USB_DEVICE_MANAGER_MAX_WORKERS 4
+
 #define SPICE_USB_DEVICE_MANAGER_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), SPICE_TYPE_USB_DEVICE_MANAGER, SpiceUsbDeviceManagerPrivate))
 
 struct _SpiceUsbDeviceManagerPrivate {
     SpiceSession *session;
+    GThreadPool *workers; /* runs device claim/release off the main loop */
     guint max_luns;
+    SpiceUsbCdLunPlacement cd_lun_placement;
+    GQueue cd_empty;   /* registered CD devices without LUNs */
+    GQueue cd_partial; /* registered CD devices with room for more LUNs */
     gint free_channels;
+    gint notified_free_channels; /* as last told, reservations aside */
     gboolean auto_connect;
     gchar *auto_connect_filter;
     gchar *redirect_on_connect;
+    SpiceUsbFilterRule *auto_conn_filter_rules;
+    SpiceUsbFilterRule *redirect_on_connect_rules;
+    guint auto_conn_filter_rules_count;
+    guint redirect_on_connect_rules_count;
+    /* last filter passed to get_devices_with_filter() and its rules */
+    gchar *last_filter;
+    SpiceUsbFilterRule *last_filter_rules;
+    guint last_filter_rules_count;
+
+    /* device registry, kept in sync with _dev_ptr_array */
+    GHashTable *devices_by_address; /* (busnum << 8 | devaddr) -> device */
+    /* emulated CD devices, apart: a device plugged in may get the address of one */
+    GHashTable *cd_devices_by_address;
+    GHashTable *devices_by_id;      /* (vid << 16 | pid) -> GPtrArray of devices */
+
+    /* coalesced "device-changed" notifications */
+    GPtrArray *changed_devices;
+    guint changed_source_id;
+    guint changed_latency; /* ms, 0 for the next idle */
+
+    /* reads of the CD LUNs of all devices, created with the first emulation */
+    SpiceCdAio *cd_aio;
+
+    /* startup enumeration, run at once by get() or in steps by init_async() */
+    SpiceUsbDeviceSource *source;
+    GAsyncQueue *enumerate_batches; /* GArrays of SpiceUsbDeviceDesc found by the source */
+    gint enumerate_drain_pending;   /* an idle adds the batches */
+    guint enumerate_step;       /* next startup LUN to add */
+    gboolean enumerating;
+    gboolean enumerated;
+    GSList *enumerate_tasks;    /* init_async() calls waiting for the end */
+    gint64 enumerate_start;     /* monotonic, us */
+    SpiceUsbDeviceManagerStartupStats startup_stats;
+
+    /* devices plugged in and out, on the context the manager was created in */
+    GMainContext *main_context;
+    GSource *hotplug;
+
+    /* requests made at the rates of a synthetic source, once enumerated */
+    SpiceUsbDeviceLoad *load;
 };
 
-static SpiceUsbDeviceInfo _dev_array[] = {
-    {
-        .vid = 1200, .pid = 12,
-        .redirecting = TRUE, .cd = TRUE, .connected = TRUE,
-        .luns_array = NULL 
-    },
-    {
-        .vid = 1700, .pid = 17,
-        .redirecting = TRUE, .cd = FALSE, .connected = TRUE,
-        .luns_array = NULL
-    },
-    {
-        .vid = 1900, .pid = 19,
-        .redirecting = FALSE, .cd = FALSE, .connected = FALSE,
-        .luns_array = NULL
-    },
+/* emulated CD devices, created for the CD LUNs */
+static const SpiceUsbDeviceInfo _cd_dev_template = {
+    .vid = 1200, .pid = 12, .device_class = 0x08, .bcd_device = 0x0100,
+    .speed = 480000, .redirecting = TRUE, .cd = TRUE, .connected = TRUE
 };
 
 enum {
@@ -58,7 +131,9 @@ enum {
     PROP_AUTO_CONNECT_FILTER,
     PROP_REDIRECT_ON_CONNECT,
     PROP_FREE_CHANNELS,
-    PROP_SHARE_CD
+    PROP_SHARE_CD,
+    PROP_DEVICE_CHANGED_LATENCY,
+    PROP_CD_LUN_PLACEMENT
 };
 
 enum
@@ -68,12 +143,57 @@ enum
     DEVICE_CHANGED,
     //AUTO_CONNECT_FAILED,
     DEVICE_ERROR,
+    DEVICES_CHANGED,
     LAST_SIGNAL,
 };
 
+static void spice_usb_device_manager_worker(gpointer data, gpointer user_data);
+
+/* device records, and the strings shared by LUNs */
+static SpicePool *_dev_pool = NULL;
+static SpiceStringPool *_lun_strings = NULL;
+
 static SpiceUsbDeviceManager *_usb_dev_manager;
-static gboolean _is_initialized = FALSE;
-static GPtrArray *_dev_ptr_array = NULL;
+static GError *_usb_dev_manager_error; /* why the singleton could not be created */
+
+/*
+ * Creation of the singleton, left with MANAGER_ANNOUNCING once the manager
+ * announces the devices it adds with signals, with MANAGER_FAILED if it
+ * could not be created. The startup devices of spice_usb_device_manager_get()
+ * are added before that, unannounced.
+ */
+#define MANAGER_FAILED      1
+#define MANAGER_ANNOUNCING  2
+static gsize _manager_once = 0;
+
+static inline gboolean spice_usb_device_manager_announces(void)
+{
+    return g_atomic_pointer_get(&_manager_once) == MANAGER_ANNOUNCING;
+}
+static GPtrArray *_dev_ptr_array = NULL; /* the registry, changed from the main loop */
+static guint64 _dev_next_seq = 0;
+static gboolean _dev_unordered = FALSE; /* _dev_ptr_array is out of insertion order */
+
+/*
+ * Copy of the registry handed out by spice_usb_device_manager_get_devices(),
+ * replaced as a whole on every change and never modified once published.
+ * Readers of any thread take a reference without a lock: they count
+ * themselves in _dev_snapshot_readers around loading the pointer and
+ * taking the reference, and a replaced snapshot is only released once
+ * no reader was seen in between.
+ */
+static GPtrArray *_dev_snapshot = NULL;
+static gint _dev_snapshot_readers = 0;
+static GSList *_dev_snapshot_retired = NULL; /* replaced, maybe still being referenced */
+/*
+ * The last reference to a device may be dropped by a snapshot reader of
+ * any thread, its teardown goes back to the context the manager was
+ * created in: the record pool and the CD emulation belong there.
+ */
+static GMainContext *_dev_main_context = NULL;
+static GThread *_dev_main_thread = NULL;
+/* the strings and descriptions devices resolve on first use */
+static GMutex _dev_strings_lock;
 static guint signals[LAST_SIGNAL] = { 0, };
 
 static SpiceUsbDevice *spice_usb_device_ref(SpiceUsbDevice *dev_handle)
@@ -85,6 +205,33 @@ static SpiceUsbDevice *spice_usb_device_ref(SpiceUsbDevice *dev_handle)
     return dev_handle;
 }
 
+static void spice_usb_device_lun_clear(SpiceUsbDeviceLunInfo *lun);
+static void spice_usb_device_lun_close_image(SpiceUsbDeviceInfo *device, guint lun);
+
+static gboolean spice_usb_device_free(gpointer user_data)
+{
+    SpiceUsbDeviceInfo *device = user_data;
+
+    device->vid = device->pid = 0;
+    SPICE_DEBUG("%s: deleting %p", __FUNCTION__, device);
+    spice_cd_usb_bulk_msd_free(device->msd);
+    while (device->luns_mask != 0) {
+        gint lun = g_bit_nth_lsf(device->luns_mask, -1);
+        spice_usb_device_lun_clear(&device->luns[lun]);
+        spice_usb_device_lun_close_image(device, lun);
+        device->luns_mask &= ~(1u << lun);
+    }
+    device->n_luns = 0;
+    g_free(device->serial);
+    g_free(device->manufacturer);
+    g_free(device->product);
+    if (device->descriptions != NULL) {
+        g_hash_table_unref(device->descriptions);
+    }
+    spice_pool_free1(_dev_pool, device);
+    return G_SOURCE_REMOVE;
+}
+
 static void spice_usb_device_unref(SpiceUsbDevice *dev_handle)
 {
     SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
@@ -93,28 +240,174 @@ static void spice_usb_device_unref(SpiceUsbDevice *dev_handle)
     g_return_if_fail(device != NULL);
 
     ref_count_is_0 = g_atomic_int_dec_and_test(&device->ref);
-    if (ref_count_is_0) {
-        device->vid = device->pid = 0;
-        SPICE_DEBUG("%s: deleting %p", __FUNCTION__, device);
-        g_free(device);
+    if (!ref_count_is_0) {
+        return;
+    }
+    if (_dev_main_context != NULL && g_thread_self() != _dev_main_thread &&
+        !g_main_context_is_owner(_dev_main_context)) {
+        GSource *source = g_idle_source_new();
+
+        g_source_set_callback(source, spice_usb_device_free, device, NULL);
+        g_source_attach(source, _dev_main_context);
+        g_source_unref(source);
+        return;
+    }
+    spice_usb_device_free(device);
+}
+
+static void spice_usb_device_lun_set(SpiceUsbDeviceLunInfo *lun,
+                                     const SpiceUsbDeviceLunInfo *lun_info)
+{
+    /* vendor/product/revision are the same for almost all LUNs */
+    lun->file_path = g_strdup(lun_info->file_path);
+    lun->vendor = spice_string_pool_intern(_lun_strings, lun_info->vendor);
+    lun->product = spice_string_pool_intern(_lun_strings, lun_info->product);
+    lun->revision = spice_string_pool_intern(_lun_strings, lun_info->revision);
+    lun->started = lun_info->started;
+    lun->loaded = lun_info->loaded;
+    lun->locked = lun_info->locked;
+}
+
+static void spice_usb_device_lun_clear(SpiceUsbDeviceLunInfo *lun)
+{
+    g_free((gpointer)lun->file_path);
+    spice_string_pool_release(_lun_strings, lun->vendor);
+    spice_string_pool_release(_lun_strings, lun->product);
+    spice_string_pool_release(_lun_strings, lun->revision);
+    memset(lun, 0, sizeof(*lun));
+}
+
+/* the LUN at index @lun, or NULL if there is none */
+static inline SpiceUsbDeviceLunInfo *spice_usb_device_get_lun(const SpiceUsbDeviceInfo *device,
+                                                              guint lun)
+{
+    if (lun >= SPICE_USB_DEVICE_MAX_LUNS || !(device->luns_mask & (1u << lun))) {
+        return NULL;
+    }
+    return (SpiceUsbDeviceLunInfo *)&device->luns[lun];
+}
+
+/* back a LUN with @image, opened already, taking the reference */
+static void spice_usb_device_lun_set_image(SpiceUsbDeviceInfo *device, guint lun,
+                                           SpiceCdImage *image)
+{
+    device->lun_images[lun] = image;
+    device->lun_readahead[lun] =
+        spice_cd_readahead_new(image, SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE);
+}
+
+/* map the image of a loaded LUN, a LUN that cannot be backed is unloaded */
+static gboolean spice_usb_device_lun_open_image(SpiceUsbDeviceInfo *device, guint lun,
+                                                GError **err)
+{
+    SpiceUsbDeviceLunInfo *lun_info = &device->luns[lun];
+    SpiceCdImage *image = NULL;
+
+    if (device->lun_images[lun] != NULL) {
+        return TRUE;
+    }
+    if (lun_info->file_path == NULL) {
+        g_set_error_literal(err, G_FILE_ERROR, G_FILE_ERROR_NOENT, "no CD image");
+    } else {
+        image = spice_cd_image_open(lun_info->file_path, err);
+    }
+    if (image == NULL) {
+        lun_info->loaded = FALSE;
+        return FALSE;
     }
+    spice_usb_device_lun_set_image(device, lun, image);
+    return TRUE;
+}
+
+/* on eject, media change and removal */
+static void spice_usb_device_lun_close_image(SpiceUsbDeviceInfo *device, guint lun)
+{
+    g_clear_pointer(&device->lun_readahead[lun], spice_cd_readahead_free);
+    g_clear_pointer(&device->lun_images[lun], spice_cd_image_unref);
+}
+
+/* allocate a new device record from the pool, initialized from @template */
+static SpiceUsbDeviceInfo *spice_usb_device_new(const SpiceUsbDeviceInfo *template)
+{
+    SpiceUsbDeviceInfo *device = spice_pool_alloc0(_dev_pool);
+
+    memcpy(device, template, sizeof(*device));
+    device->ref = 0;
+    device->free_slot_link.data = device;
+    return device;
+}
+
+/* allocate a new device record for a device found by the source */
+static SpiceUsbDeviceInfo *spice_usb_device_new_from_desc(const SpiceUsbDeviceDesc *desc)
+{
+    SpiceUsbDeviceInfo *device = spice_pool_alloc0(_dev_pool);
+
+    device->busnum = desc->busnum;
+    device->devaddr = desc->devaddr;
+    device->vid = desc->vid;
+    device->pid = desc->pid;
+    device->device_class = desc->device_class;
+    device->bcd_device = desc->bcd_device;
+    device->speed = desc->speed;
+    device->serial = desc->serial[0] != '\0' ? g_strdup(desc->serial) : NULL;
+    device->free_slot_link.data = device;
+    return device;
 }
 
 G_DEFINE_BOXED_TYPE(SpiceUsbDevice, spice_usb_device,
                     (GBoxedCopyFunc)spice_usb_device_ref,
                     (GBoxedFreeFunc)spice_usb_device_unref)
 
+GType spice_usb_cd_lun_placement_get_type(void)
+{
+    static gsize type_id = 0;
+
+    if (g_once_init_enter(&type_id)) {
+        static const GEnumValue values[] = {
+            { SPICE_USB_CD_LUN_PLACEMENT_PACK, "SPICE_USB_CD_LUN_PLACEMENT_PACK", "pack" },
+            { SPICE_USB_CD_LUN_PLACEMENT_SPREAD, "SPICE_USB_CD_LUN_PLACEMENT_SPREAD", "spread" },
+            { 0, NULL, NULL }
+        };
+        GType type = g_enum_register_static(g_intern_static_string("SpiceUsbCdLunPlacement"),
+                                            values);
+
+        g_once_init_leave(&type_id, type);
+    }
+    return type_id;
+}
+
 static void spice_usb_device_manager_initable_iface_init(GInitableIface *iface);
+static void spice_usb_device_manager_async_initable_iface_init(GAsyncInitableIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE(SpiceUsbDeviceManager, spice_usb_device_manager, G_TYPE_OBJECT,
-    G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, spice_usb_device_manager_initable_iface_init));
+    G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, spice_usb_device_manager_initable_iface_init)
+    G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE,
+                           spice_usb_device_manager_async_initable_iface_init));
 
 static void spice_usb_device_manager_init(SpiceUsbDeviceManager *self)
 {
     SpiceUsbDeviceManagerPrivate *priv;
     priv = SPICE_USB_DEVICE_MANAGER_GET_PRIVATE(self);
-    priv->max_luns = 4;
+    priv->max_luns = SPICE_USB_DEVICE_MAX_LUNS;
     priv->free_channels = 1;
+    priv->notified_free_channels = 1;
+    g_queue_init(&priv->cd_empty);
+    g_queue_init(&priv->cd_partial);
+    priv->workers = g_thread_pool_new(spice_usb_device_manager_worker, self,
+                                      SPICE_USB_DEVICE_MANAGER_MAX_WORKERS, FALSE, NULL);
+    priv->devices_by_address = g_hash_table_new(g_direct_hash, g_direct_equal);
+    priv->cd_devices_by_address = g_hash_table_new(g_direct_hash, g_direct_equal);
+    priv->devices_by_id = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                                (GDestroyNotify)g_ptr_array_unref);
+    priv->changed_devices =
+        g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    priv->startup_stats.first_device_us = -1;
+    priv->startup_stats.enumerated_us = -1;
+    priv->main_context = g_main_context_ref_thread_default();
+    if (_dev_main_context == NULL) {
+        _dev_main_context = g_main_context_ref(priv->main_context);
+        _dev_main_thread = g_thread_self();
+    }
     self->priv = priv;
 }
 
@@ -122,10 +415,6 @@ static gboolean spice_usb_device_manager_initable_init(GInitable  *initable,
                                                        GCancellable  *cancellable,
                                                        GError        **err)
 {
-    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(initable);
-    SpiceUsbDeviceManagerPrivate *priv = self->priv;
-    g_print("spice_usb_device_manager_initable_init %p max_luns:%u\n", self, priv->max_luns);
-
     return TRUE;
 }
 
@@ -159,6 +448,12 @@ static void spice_usb_device_manager_get_property(GObject     *gobject,
         /* get_property is not needed */
         g_value_set_string(value, "");
         break;
+    case PROP_DEVICE_CHANGED_LATENCY:
+        g_value_set_uint(value, priv->changed_latency);
+        break;
+    case PROP_CD_LUN_PLACEMENT:
+        g_value_set_enum(value, priv->cd_lun_placement);
+        break;
     case PROP_FREE_CHANNELS: {
 #if 0
         int i;
@@ -195,18 +490,58 @@ static void spice_usb_device_manager_set_property(GObject       *gobject,
         break;
     case PROP_AUTO_CONNECT_FILTER: {
         const gchar *filter = g_value_get_string(value);
+        SpiceUsbFilterRule *rules;
+        guint count;
+        GError *err = NULL;
+
+        if (filter == NULL) {
+            /* a NULL filter denies every device */
+            rules = NULL;
+            count = 0;
+        } else if (!spice_usb_filter_parse(filter, &rules, &count, &err)) {
+            g_warning("Error parsing auto-connect-filter string, keeping old filter: %s",
+                      err->message);
+            g_error_free(err);
+            break;
+        }
+
+        g_free(priv->auto_conn_filter_rules);
+        priv->auto_conn_filter_rules = rules;
+        priv->auto_conn_filter_rules_count = count;
+
         g_free(priv->auto_connect_filter);
         priv->auto_connect_filter = g_strdup(filter);
         break;
     }
     case PROP_REDIRECT_ON_CONNECT: {
         const gchar *filter = g_value_get_string(value);
+        SpiceUsbFilterRule *rules = NULL;
+        guint count = 0;
+        GError *err = NULL;
+
+        if (filter != NULL && !spice_usb_filter_parse(filter, &rules, &count, &err)) {
+            g_warning("Error parsing redirect-on-connect string, keeping old filter: %s",
+                      err->message);
+            g_error_free(err);
+            break;
+        }
+
+        g_free(priv->redirect_on_connect_rules);
+        priv->redirect_on_connect_rules = rules;
+        priv->redirect_on_connect_rules_count = count;
+
         g_free(priv->redirect_on_connect);
         priv->redirect_on_connect = g_strdup(filter);
         break;
     }
     case PROP_SHARE_CD:
         break;
+    case PROP_DEVICE_CHANGED_LATENCY:
+        priv->changed_latency = g_value_get_uint(value);
+        break;
+    case PROP_CD_LUN_PLACEMENT:
+        priv->cd_lun_placement = g_value_get_enum(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -270,6 +605,33 @@ static void spice_usb_device_manager_class_init(SpiceUsbDeviceManagerClass *klas
     g_object_class_install_property(gobject_class, PROP_FREE_CHANNELS,
                                     pspec);
 
+    /**
+     * SpiceUsbDeviceManager:device-changed-latency:
+     *
+     * Changes of a device are merged into a single #SpiceUsbDeviceManager::device-changed
+     * emitted at most this many milliseconds after the first one. With 0 the
+     * notification is sent as soon as the main loop is idle.
+     */
+    pspec = g_param_spec_uint("device-changed-latency", "Device changed latency",
+               "Max delay in ms for merging device changes into one notification",
+               0, G_MAXUINT, 0,
+               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+    g_object_class_install_property(gobject_class, PROP_DEVICE_CHANGED_LATENCY,
+                                    pspec);
+
+    /**
+     * SpiceUsbDeviceManager:cd-lun-placement:
+     *
+     * How spice_usb_device_manager_add_cd_lun() places new LUNs, one of
+     * #SpiceUsbCdLunPlacement.
+     */
+    pspec = g_param_spec_enum("cd-lun-placement", "CD LUN placement",
+               "Pack CD LUNs into as few devices as possible or use one device per LUN",
+               SPICE_TYPE_USB_CD_LUN_PLACEMENT, SPICE_USB_CD_LUN_PLACEMENT_PACK,
+               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+    g_object_class_install_property(gobject_class, PROP_CD_LUN_PLACEMENT,
+                                    pspec);
+
     /* Add signals */
     signals[DEVICE_ADDED] =
         g_signal_new("device-added",
@@ -316,276 +678,2173 @@ static void spice_usb_device_manager_class_init(SpiceUsbDeviceManagerClass *klas
                      SPICE_TYPE_USB_DEVICE,
                      G_TYPE_ERROR);
 
-    g_type_class_add_private(klass, sizeof(SpiceUsbDeviceManagerPrivate));
-}
-
-SpiceUsbDeviceManager *spice_usb_device_manager_get(SpiceSession *session,
-                                                    GError **err)
-{
-    if (!_is_initialized) {
-        SpiceUsbDeviceLunInfo lun_info;
-        guint i;
-
-        _usb_dev_manager = g_initable_new(SPICE_TYPE_USB_DEVICE_MANAGER,
-                                          NULL, /* cancellable */
-                                          err, /* error */
-                                          NULL);
+    /**
+     * SpiceUsbDeviceManager::devices-changed:
+     * @manager: the #SpiceUsbDeviceManager that emitted the signal
+     * @devices: (element-type SpiceUsbDevice): the devices which changed
+     *
+     * Emitted once per batch of coalesced changes, after the
+     * #SpiceUsbDeviceManager::device-changed of each device in @devices.
+     */
+    signals[DEVICES_CHANGED] =
+        g_signal_new("devices-changed",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL, /* accumulator */
+                     g_cclosure_marshal_VOID__BOXED,
+                     G_TYPE_NONE, /* return value */
+                     1,
+                     G_TYPE_PTR_ARRAY);
 
-        g_print("alloc mgr:%p\n", _usb_dev_manager);
+    g_type_class_add_private(klass, sizeof(SpiceUsbDeviceManagerPrivate));
 
-        _dev_ptr_array = g_ptr_array_new();
-        for (i = 0; i < G_N_ELEMENTS(_dev_array); i++) {
-            SpiceUsbDeviceInfo *device;
-            /* allocate new usb device and copy the pre-set device */
-            device = g_malloc(sizeof(*device));
-            memcpy(device, &_dev_array[i], sizeof(*device));
-            device->ref = 0;
-            device->busnum = 10 * (i + 1);
-            device->devaddr = i + 1;
-            /* allocate empty lun array */
-            device->luns_array = g_ptr_array_new();
-            /* add usb device to the global list */
-            g_ptr_array_add(_dev_ptr_array, (gpointer)device);
-            spice_usb_device_ref((SpiceUsbDevice *)device);
-        }
-
-        /* add lun 1 */
-        lun_info.file_path = "/home/johnd/iso/fedora-25.iso";
-        lun_info.vendor = "RedHat";
-        lun_info.product = "Redir DVD";
-        lun_info.revision = "1223";
-        lun_info.started = TRUE;
-        lun_info.loaded = TRUE;
-        lun_info.locked = FALSE;
-        
-        spice_usb_device_manager_add_cd_lun(_usb_dev_manager, &lun_info);
-
-        /* add lun 2 */
-        lun_info.file_path = "/home/johnd/iso/ubuntu-18-04.iso";
-        
-        spice_usb_device_manager_add_cd_lun(_usb_dev_manager, &lun_info);
-
-        _is_initialized = TRUE;
-    }
-    return _usb_dev_manager;
+    _dev_pool = spice_pool_new(sizeof(SpiceUsbDeviceInfo), 64);
+    _lun_strings = spice_string_pool_new();
 }
 
-GPtrArray *spice_usb_device_manager_get_devices(SpiceUsbDeviceManager *manager)
+static inline gpointer device_address_key(guint8 busnum, guint8 devaddr)
 {
-    g_ptr_array_ref(_dev_ptr_array);
-    return _dev_ptr_array;
+    return GUINT_TO_POINTER(((guint)busnum << 8) | devaddr);
 }
 
-GPtrArray* spice_usb_device_manager_get_devices_with_filter(
-    SpiceUsbDeviceManager *manager, const gchar *filter)
+static inline gpointer device_id_key(guint16 vid, guint16 pid)
 {
-    return _dev_ptr_array;
+    return GUINT_TO_POINTER(((guint)vid << 16) | pid);
 }
 
-guint8 spice_usb_device_get_busnum(const SpiceUsbDevice *dev_handle)
+/* keep the CD device in the free-slot queue matching its LUN count */
+static void spice_usb_device_manager_update_free_slots(SpiceUsbDeviceManager *self,
+                                                       SpiceUsbDeviceInfo *device,
+                                                       gboolean registered)
 {
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    g_return_val_if_fail(device != NULL, 0);
-    return device->busnum;
-}
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GQueue *queue = NULL;
 
-guint8 spice_usb_device_get_devaddr(const SpiceUsbDevice *dev_handle)
-{
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    g_return_val_if_fail(device != NULL, 0);
-    return device->devaddr;
+    if (registered && device->cd) {
+        if (device->n_luns == 0) {
+            queue = &priv->cd_empty;
+        } else if (device->n_luns < priv->max_luns) {
+            queue = &priv->cd_partial;
+        }
+    }
+    if (queue == device->free_slot_queue) {
+        return;
+    }
+    if (device->free_slot_queue != NULL) {
+        g_queue_unlink(device->free_slot_queue, &device->free_slot_link);
+    }
+    if (queue != NULL) {
+        g_queue_push_tail_link(queue, &device->free_slot_link);
+    }
+    device->free_slot_queue = queue;
 }
 
-guint16 spice_usb_device_get_vid(const SpiceUsbDevice *dev_handle)
+static gint spice_usb_device_compare_seq(gconstpointer a, gconstpointer b)
 {
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    g_return_val_if_fail(device != NULL, 0);
-    return device->vid;
-}
+    const SpiceUsbDeviceInfo *x = *(SpiceUsbDeviceInfo * const *)a;
+    const SpiceUsbDeviceInfo *y = *(SpiceUsbDeviceInfo * const *)b;
 
-guint16 spice_usb_device_get_pid(const SpiceUsbDevice *dev_handle)
-{
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    g_return_val_if_fail(device != NULL, 0);
-    return device->pid;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
 }
 
-void spice_usb_util_get_device_strings(int bus, int address,
-                                       int vendor_id, int product_id,
-                                       gchar **manufacturer, gchar **product)
+/* replace the published snapshot after a change of _dev_ptr_array */
+static void spice_usb_device_manager_publish_devices(void)
 {
-    *manufacturer = g_strdup("RedHat-Spice");
-    *product = g_strdup("Redir-USB");
-}
+    GPtrArray *snapshot;
+    guint i;
 
-void spice_usb_device_get_info(SpiceUsbDeviceManager *manager,
-                               SpiceUsbDevice *dev_handle,
-                               SpiceUsbDeviceDescription *dev_descr)
-{
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    g_return_if_fail(device != NULL);
+    /* removals swapped the last device in, once per batch the order comes back */
+    if (_dev_unordered) {
+        g_ptr_array_sort(_dev_ptr_array, spice_usb_device_compare_seq);
+        for (i = 0; i < _dev_ptr_array->len; i++) {
+            ((SpiceUsbDeviceInfo *)g_ptr_array_index(_dev_ptr_array, i))->index = i;
+        }
+        _dev_unordered = FALSE;
+    }
 
-    dev_descr->bus = spice_usb_device_get_busnum(dev_handle);
-    dev_descr->address = spice_usb_device_get_devaddr(dev_handle);
-    dev_descr->vendor_id = spice_usb_device_get_vid(dev_handle);
-    dev_descr->product_id = spice_usb_device_get_pid(dev_handle);
+    snapshot = g_ptr_array_new_full(_dev_ptr_array->len,
+                                    (GDestroyNotify)spice_usb_device_unref);
+    for (i = 0; i < _dev_ptr_array->len; i++) {
+        g_ptr_array_add(snapshot, spice_usb_device_ref(g_ptr_array_index(_dev_ptr_array, i)));
+    }
 
-    spice_usb_util_get_device_strings(dev_descr->bus, dev_descr->address,
-        dev_descr->vendor_id, dev_descr->product_id, &dev_descr->vendor, &dev_descr->product);
+    if (_dev_snapshot != NULL) {
+        _dev_snapshot_retired = g_slist_prepend(_dev_snapshot_retired, _dev_snapshot);
+    }
+    g_atomic_pointer_set(&_dev_snapshot, snapshot);
+
+    /* a reader coming after this loads the new snapshot */
+    if (g_atomic_int_get(&_dev_snapshot_readers) == 0) {
+        g_slist_free_full(_dev_snapshot_retired, (GDestroyNotify)g_ptr_array_unref);
+        _dev_snapshot_retired = NULL;
+    }
 }
 
-/**
- * spice_usb_device_get_description:
- * @device: #SpiceUsbDeviceInfo to get the description of
- * @format: (allow-none): an optional printf() format string with
- * positional parameters
- *
- * Get a string describing the device which is suitable as a description of
- * the device for the end user. The returned string should be freed with
- * g_free() when no longer needed.
- *
- * The @format positional parameters are the following:
- * - '%%1$s' manufacturer
- * - '%%2$s' product
- * - '%%3$s' descriptor (a [vendor_id:product_id] string)
- * - '%%4$d' bus
- * - '%%5$d' address
- *
- * (the default format string is "%%s %%s %%s at %%d-%%d")
- *
- * Returns: a newly-allocated string holding the description, or %NULL if failed
- */
-gchar *spice_usb_device_get_description(SpiceUsbDevice *dev_handle, const gchar *format)
+/* add the device to _dev_ptr_array and to the lookup tables, takes a reference,
+ * the device is not in the published list yet */
+static void spice_usb_device_manager_insert_device(SpiceUsbDeviceManager *self,
+                                                   SpiceUsbDeviceInfo *device)
 {
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    guint16 bus, address, vid, pid;
-    gchar *description, *descriptor, *manufacturer = NULL, *product = NULL;
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GPtrArray *same_id;
 
-    g_return_val_if_fail(device != NULL, NULL);
+    device->index = _dev_ptr_array->len;
+    device->seq = _dev_next_seq++;
+    g_ptr_array_add(_dev_ptr_array, (gpointer)device);
+    spice_usb_device_ref((SpiceUsbDevice *)device);
 
-    bus     = spice_usb_device_get_busnum(dev_handle);
-    address = spice_usb_device_get_devaddr(dev_handle);
-    vid     = spice_usb_device_get_vid(dev_handle);
-    pid     = spice_usb_device_get_pid(dev_handle);
+    g_hash_table_replace(device->cd ? priv->cd_devices_by_address : priv->devices_by_address,
+                         device_address_key(device->busnum, device->devaddr), device);
 
-    if ((vid > 0) && (pid > 0)) {
-        descriptor = g_strdup_printf("[%04x:%04x]", vid, pid);
-    } else {
-        descriptor = g_strdup("");
+    same_id = g_hash_table_lookup(priv->devices_by_id,
+                                  device_id_key(device->vid, device->pid));
+    if (same_id == NULL) {
+        same_id = g_ptr_array_new();
+        g_hash_table_insert(priv->devices_by_id,
+                            device_id_key(device->vid, device->pid), same_id);
     }
+    g_ptr_array_add(same_id, device);
+
+    spice_usb_device_manager_update_free_slots(self, device, TRUE);
+}
 
-    spice_usb_util_get_device_strings(bus, address, vid, pid,
-                                      &manufacturer, &product);
+static void spice_usb_device_manager_register_device(SpiceUsbDeviceManager *self,
+                                                     SpiceUsbDeviceInfo *device)
+{
+    spice_usb_device_manager_insert_device(self, device);
+    spice_usb_device_manager_publish_devices();
+}
 
-    if (!format)
-        format = _("%s %s %s at %d-%d");
+static gboolean spice_usb_device_manager_is_registered(SpiceUsbDeviceInfo *device);
+
+/* remove the device from _dev_ptr_array and from the lookup tables,
+ * the caller owns the reference held by the array afterwards, the device
+ * is still in the published list */
+static void spice_usb_device_manager_extract_device(SpiceUsbDeviceManager *self,
+                                                    SpiceUsbDeviceInfo *device)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GHashTable *by_address = device->cd ? priv->cd_devices_by_address :
+                                          priv->devices_by_address;
+    SpiceUsbDeviceInfo *moved;
+    GPtrArray *same_id;
+    gpointer key;
+
+    g_return_if_fail(spice_usb_device_manager_is_registered(device));
+
+    /* the last device takes the freed slot, publishing puts it back in order */
+    g_ptr_array_remove_index_fast(_dev_ptr_array, device->index);
+    if (device->index < _dev_ptr_array->len) {
+        moved = g_ptr_array_index(_dev_ptr_array, device->index);
+        moved->index = device->index;
+        _dev_unordered = TRUE;
+    }
 
-    description = g_strdup_printf(format, manufacturer, product, descriptor, bus, address);
+    key = device_address_key(device->busnum, device->devaddr);
+    if (g_hash_table_lookup(by_address, key) == device) {
+        g_hash_table_remove(by_address, key);
+    }
 
-    g_free(descriptor);
+    key = device_id_key(device->vid, device->pid);
+    same_id = g_hash_table_lookup(priv->devices_by_id, key);
+    if (same_id != NULL) {
+        g_ptr_array_remove_fast(same_id, device);
+        if (same_id->len == 0) {
+            g_hash_table_remove(priv->devices_by_id, key);
+        }
+    }
 
-    return description;
+    spice_usb_device_manager_update_free_slots(self, device, FALSE);
 }
 
+static void spice_usb_device_manager_unregister_device(SpiceUsbDeviceManager *self,
+                                                       SpiceUsbDeviceInfo *device)
+{
+    spice_usb_device_manager_extract_device(self, device);
+    spice_usb_device_manager_publish_devices();
+}
 
-gboolean spice_usb_device_manager_is_device_connected(SpiceUsbDeviceManager *manager,
-                                                      SpiceUsbDevice *dev_handle)
+static gboolean spice_usb_device_manager_is_registered(SpiceUsbDeviceInfo *device)
 {
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
-    return device->connected;
+    return device->index < _dev_ptr_array->len &&
+        g_ptr_array_index(_dev_ptr_array, device->index) == device;
 }
 
-gboolean spice_usb_device_manager_connect_device_sync(SpiceUsbDeviceManager *self,
-                                                      SpiceUsbDevice *dev_handle)
+static gboolean spice_usb_device_manager_dispatch_changes(gpointer user_data)
 {
+    SpiceUsbDeviceManager *self = user_data;
     SpiceUsbDeviceManagerPrivate *priv = self->priv;
-    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    GPtrArray *changed, *devices;
+    guint i;
 
-    if (!device->connected) {
-        if (priv->free_channels > 0) {
-            priv->free_channels--;
-            device->connected = TRUE;
-            return TRUE;
+    priv->changed_source_id = 0;
+    if (priv->changed_devices->len == 0) {
+        return G_SOURCE_REMOVE;
+    }
+
+    /* handlers may queue new changes, those go to the next batch */
+    changed = priv->changed_devices;
+    priv->changed_devices =
+        g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+
+    devices = g_ptr_array_new_full(changed->len, NULL);
+    for (i = 0; i < changed->len; i++) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(changed, i);
+
+        device->changed = FALSE;
+        /* changes of removed devices are dropped */
+        if (spice_usb_device_manager_is_registered(device)) {
+            g_ptr_array_add(devices, device);
+            g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
         }
     }
-    return FALSE;
+    if (devices->len > 0) {
+        g_signal_emit(self, signals[DEVICES_CHANGED], 0, devices);
+    }
+
+    g_ptr_array_unref(devices);
+    g_ptr_array_unref(changed);
+    return G_SOURCE_REMOVE;
 }
 
-gboolean spice_usb_device_manager_disconnect_device_sync(SpiceUsbDeviceManager *self,
-                                                         SpiceUsbDevice *dev_handle)
+/* Queue a "device-changed" notification. Notifications of the same device
+ * are merged until the queue is dispatched from the main loop, within
+ * #SpiceUsbDeviceManager:device-changed-latency. */
+static void spice_usb_device_manager_device_changed(SpiceUsbDeviceManager *self,
+                                                    SpiceUsbDeviceInfo *device)
 {
     SpiceUsbDeviceManagerPrivate *priv = self->priv;
-    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
 
-    if (device->connected) {
-        device->connected = FALSE;
-        priv->free_channels++;
-        return TRUE;
-    } else {
-        return FALSE;
+    if (!device->changed) {
+        device->changed = TRUE;
+        g_ptr_array_add(priv->changed_devices,
+                        spice_usb_device_ref((SpiceUsbDevice *)device));
     }
-}
-
-void spice_usb_device_manager_connect_device_async(
-                                             SpiceUsbDeviceManager *self,
-                                             SpiceUsbDevice *dev_handle,
-                                             GCancellable *cancellable,
-                                             GAsyncReadyCallback callback,
-                                             gpointer user_data)
-{
-    GAsyncResult *res = (GAsyncResult *)((gpointer)dev_handle); /* provides device access in x_finish() */
 
-    spice_usb_device_manager_connect_device_sync(self, dev_handle);
-    callback(G_OBJECT(self), res, user_data);
+    if (priv->changed_source_id == 0) {
+        if (priv->changed_latency == 0) {
+            priv->changed_source_id =
+                g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                                spice_usb_device_manager_dispatch_changes,
+                                g_object_ref(self), g_object_unref);
+        } else {
+            priv->changed_source_id =
+                g_timeout_add_full(G_PRIORITY_DEFAULT, priv->changed_latency,
+                                   spice_usb_device_manager_dispatch_changes,
+                                   g_object_ref(self), g_object_unref);
+        }
+    }
 }
 
-void spice_usb_device_manager_disconnect_device_async(
-                                             SpiceUsbDeviceManager *self,
-                                             SpiceUsbDevice *dev_handle,
-                                             GCancellable *cancellable,
-                                             GAsyncReadyCallback callback,
-                                             gpointer user_data)
+/**
+ * spice_usb_device_manager_flush_changes:
+ * @manager: the #SpiceUsbDeviceManager manager
+ *
+ * Emit the pending coalesced change notifications right away.
+ */
+void spice_usb_device_manager_flush_changes(SpiceUsbDeviceManager *manager)
 {
-    GAsyncResult *res = (GAsyncResult *)((gpointer)dev_handle); /* provides device access in x_finish() */
+    SpiceUsbDeviceManagerPrivate *priv;
+
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager));
 
-    spice_usb_device_manager_disconnect_device_sync(self, dev_handle);
-    callback(G_OBJECT(self), res, user_data);
+    priv = manager->priv;
+    if (priv->changed_source_id != 0) {
+        g_source_remove(priv->changed_source_id);
+        priv->changed_source_id = 0;
+    }
+    spice_usb_device_manager_dispatch_changes(manager);
 }
 
-gboolean spice_usb_device_manager_connect_device_finish(
-    SpiceUsbDeviceManager *self, GAsyncResult *res, GError **err)
+/**
+ * spice_usb_device_manager_find_device_by_address:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @busnum: USB bus number
+ * @devaddr: USB device address on the bus
+ *
+ * Returns: (transfer none): the device at @busnum-@devaddr, or %NULL; a
+ * device plugged in is found before an emulated CD device at its address
+ */
+SpiceUsbDevice *
+spice_usb_device_manager_find_device_by_address(SpiceUsbDeviceManager *manager,
+                                                guint8 busnum, guint8 devaddr)
 {
-    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)((gpointer)res);
+    SpiceUsbDevice *device;
 
-    if (device->connected) {
-        if (err) {
-            *err = NULL;
-        }
-        return TRUE;
-    } else {
-        if (err) {
-            *err = g_error_new_literal(g_quark_from_static_string("connect"), 1, "Failed to connect");
-        }
-        return FALSE;
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+
+    device = g_hash_table_lookup(manager->priv->devices_by_address,
+                                 device_address_key(busnum, devaddr));
+    if (device == NULL) {
+        device = g_hash_table_lookup(manager->priv->cd_devices_by_address,
+                                     device_address_key(busnum, devaddr));
     }
+    return device;
 }
 
-gboolean spice_usb_device_manager_disconnect_device_finish(
-    SpiceUsbDeviceManager *self, GAsyncResult *res, GError **err)
+/* the device of the source at the address, emulated CD devices aside */
+static SpiceUsbDeviceInfo *
+spice_usb_device_manager_find_source_device(SpiceUsbDeviceManager *self,
+                                            guint8 busnum, guint8 devaddr)
 {
-    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)((gpointer)res);
+    return g_hash_table_lookup(self->priv->devices_by_address,
+                               device_address_key(busnum, devaddr));
+}
 
-    if (!device->connected) {
-        if (err) {
-            *err = NULL;
-        }
+/**
+ * spice_usb_device_manager_find_devices_by_id:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @vid: USB vendor id
+ * @pid: USB product id
+ *
+ * Returns: (element-type SpiceUsbDevice) (transfer full): a %GPtrArray array
+ * of the devices matching @vid:@pid, possibly empty
+ */
+GPtrArray *spice_usb_device_manager_find_devices_by_id(SpiceUsbDeviceManager *manager,
+                                                       guint16 vid, guint16 pid)
+{
+    GPtrArray *same_id, *devices_copy;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+
+    devices_copy = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    same_id = g_hash_table_lookup(manager->priv->devices_by_id, device_id_key(vid, pid));
+    if (same_id != NULL) {
+        for (i = 0; i < same_id->len; i++) {
+            g_ptr_array_add(devices_copy,
+                            spice_usb_device_ref(g_ptr_array_index(same_id, i)));
+        }
+    }
+    return devices_copy;
+}
+
+/* the CD LUNs present at startup, added once the devices of the source are */
+#define SPICE_USB_STARTUP_CD_IMAGES_ENV "SPICE_USB_STARTUP_CD_IMAGES"
+
+static const SpiceUsbDeviceLunInfo _startup_lun_template = {
+    .vendor = "RedHat", .product = "Redir DVD", .revision = "1223",
+    .started = TRUE, .loaded = TRUE, .locked = FALSE
+};
+
+/* the images of SPICE_USB_STARTUP_CD_IMAGES, separated like PATH, none without it */
+static const gchar * const *spice_usb_device_manager_get_startup_images(void)
+{
+    static gsize images_once = 0;
+    static gchar **images;
+
+    if (g_once_init_enter(&images_once)) {
+        const gchar *env = g_getenv(SPICE_USB_STARTUP_CD_IMAGES_ENV);
+        guint i, n = 0;
+
+        images = g_strsplit(env != NULL ? env : "", G_SEARCHPATH_SEPARATOR_S, -1);
+        /* empty entries are dropped */
+        for (i = 0; images[i] != NULL; i++) {
+            if (images[i][0] != '\0') {
+                images[n++] = images[i];
+            } else {
+                g_free(images[i]);
+            }
+        }
+        images[n] = NULL;
+        g_once_init_leave(&images_once, 1);
+    }
+    return (const gchar * const *)images;
+}
+
+static guint spice_usb_device_manager_get_n_startup_luns(void)
+{
+    return g_strv_length((gchar **)spice_usb_device_manager_get_startup_images());
+}
+
+/* first device of the enumeration, timed from its start */
+static void spice_usb_device_manager_startup_device(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    if (priv->startup_stats.first_device_us < 0) {
+        priv->startup_stats.first_device_us = g_get_monotonic_time() - priv->enumerate_start;
+    }
+    priv->startup_stats.n_devices = _dev_ptr_array->len;
+}
+
+/* register a batch of the source, published at once and then announced */
+static void spice_usb_device_manager_add_startup_devices(SpiceUsbDeviceManager *self,
+                                                         GArray *descs)
+{
+    guint first = _dev_ptr_array->len;
+    guint i;
+
+    for (i = 0; i < descs->len; i++) {
+        const SpiceUsbDeviceDesc *desc = &g_array_index(descs, SpiceUsbDeviceDesc, i);
+
+        /* a device plugged in again during the enumeration may come twice */
+        if (spice_usb_device_manager_find_source_device(self, desc->busnum,
+                                                        desc->devaddr) == NULL) {
+            spice_usb_device_manager_insert_device(self, spice_usb_device_new_from_desc(desc));
+        }
+    }
+    if (_dev_ptr_array->len == first) {
+        return;
+    }
+    spice_usb_device_manager_publish_devices();
+    spice_usb_device_manager_startup_device(self);
+
+    if (spice_usb_device_manager_announces()) {
+        for (i = first; i < _dev_ptr_array->len; i++) {
+            g_signal_emit(self, signals[DEVICE_ADDED], 0, g_ptr_array_index(_dev_ptr_array, i));
+        }
+    }
+}
+
+static gboolean spice_usb_device_manager_add_cd_lun_image(SpiceUsbDeviceManager *self,
+                                                          SpiceUsbDeviceLunInfo *lun_info,
+                                                          SpiceCdImage *image);
+
+/*
+ * add startup CD LUN @i with its @image when it was opened on a thread, it
+ * is not opened again if that failed with @error, only without either
+ */
+static void spice_usb_device_manager_add_startup_lun(SpiceUsbDeviceManager *self, guint i,
+                                                     SpiceCdImage *image,
+                                                     const GError *error)
+{
+    SpiceUsbDeviceLunInfo lun_info = _startup_lun_template;
+
+    lun_info.file_path = spice_usb_device_manager_get_startup_images()[i];
+    if (error != NULL) {
+        g_warning("startup CD LUN %s is not loaded: %s", lun_info.file_path, error->message);
+        lun_info.loaded = FALSE;
+    }
+    spice_usb_device_manager_add_cd_lun_image(self, &lun_info, image);
+    spice_usb_device_manager_startup_device(self);
+}
+
+/* the source reports its batches from its threads */
+static void spice_usb_device_manager_found_devices(const SpiceUsbDeviceDesc *descs,
+                                                   guint n_descs, gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = user_data;
+    GArray *batch = g_array_sized_new(FALSE, FALSE, sizeof(SpiceUsbDeviceDesc), n_descs);
+
+    g_array_append_vals(batch, descs, n_descs);
+    g_async_queue_push(self->priv->enumerate_batches, batch);
+}
+
+static void spice_usb_device_manager_drain_batches(SpiceUsbDeviceManager *self)
+{
+    GArray *batch;
+
+    while ((batch = g_async_queue_try_pop(self->priv->enumerate_batches)) != NULL) {
+        spice_usb_device_manager_add_startup_devices(self, batch);
+        g_array_unref(batch);
+    }
+}
+
+/* one batch per main loop iteration, so each one is drawn as soon as it is added */
+static gboolean spice_usb_device_manager_drain_idle(gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = user_data;
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GArray *batch;
+
+    batch = g_async_queue_try_pop(priv->enumerate_batches);
+    if (batch != NULL) {
+        spice_usb_device_manager_add_startup_devices(self, batch);
+        g_array_unref(batch);
+        return G_SOURCE_CONTINUE;
+    }
+    g_atomic_int_set(&priv->enumerate_drain_pending, FALSE);
+    /* a batch pushed meanwhile did not schedule us again */
+    if (g_async_queue_length(priv->enumerate_batches) > 0 &&
+        g_atomic_int_compare_and_exchange(&priv->enumerate_drain_pending, FALSE, TRUE)) {
+        return G_SOURCE_CONTINUE;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void spice_usb_device_manager_found_devices_async(const SpiceUsbDeviceDesc *descs,
+                                                         guint n_descs, gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = user_data;
+
+    spice_usb_device_manager_found_devices(descs, n_descs, self);
+    if (g_atomic_int_compare_and_exchange(&self->priv->enumerate_drain_pending, FALSE, TRUE)) {
+        /* drained in the context the manager was created in */
+        GSource *source = g_idle_source_new();
+
+        g_source_set_callback(source, spice_usb_device_manager_drain_idle, self, NULL);
+        g_source_attach(source, self->priv->main_context);
+        g_source_unref(source);
+    }
+}
+
+#define USB_CLASS_HUB 0x09
+
+/*
+ * publish the registry after @removed were extracted and the devices from
+ * @first on inserted, then announce them, takes @removed
+ */
+static void spice_usb_device_manager_announce(SpiceUsbDeviceManager *self,
+                                              GPtrArray *removed, guint first)
+{
+    guint i;
+
+    if (removed->len == 0 && _dev_ptr_array->len == first) {
+        g_ptr_array_unref(removed);
+        return;
+    }
+    spice_usb_device_manager_publish_devices();
+    if (spice_usb_device_manager_announces()) {
+        for (i = 0; i < removed->len; i++) {
+            g_signal_emit(self, signals[DEVICE_REMOVED], 0, g_ptr_array_index(removed, i));
+        }
+        for (i = first; i < _dev_ptr_array->len; i++) {
+            g_signal_emit(self, signals[DEVICE_ADDED], 0, g_ptr_array_index(_dev_ptr_array, i));
+        }
+    }
+    g_ptr_array_unref(removed);
+}
+
+/* the devices read again from the source, all of them or those plugged in */
+typedef struct _SpiceUsbDeviceRescan {
+    GMutex lock;
+    GArray *descs;              /* SpiceUsbDeviceDesc */
+    GArray *adds;               /* SpiceUsbHotplugEvent, NULL for a rescan */
+} SpiceUsbDeviceRescan;
+
+static SpiceUsbDeviceRescan *spice_usb_device_rescan_new(void)
+{
+    SpiceUsbDeviceRescan *rescan = g_new0(SpiceUsbDeviceRescan, 1);
+
+    g_mutex_init(&rescan->lock);
+    rescan->descs = g_array_new(FALSE, FALSE, sizeof(SpiceUsbDeviceDesc));
+    return rescan;
+}
+
+static void spice_usb_device_rescan_free(SpiceUsbDeviceRescan *rescan)
+{
+    g_mutex_clear(&rescan->lock);
+    g_array_unref(rescan->descs);
+    if (rescan->adds != NULL) {
+        g_array_unref(rescan->adds);
+    }
+    g_free(rescan);
+}
+
+/* the batches may come from several threads of the source */
+static void spice_usb_device_manager_rescan_found(const SpiceUsbDeviceDesc *descs,
+                                                  guint n_descs, gpointer user_data)
+{
+    SpiceUsbDeviceRescan *rescan = user_data;
+
+    g_mutex_lock(&rescan->lock);
+    g_array_append_vals(rescan->descs, descs, n_descs);
+    g_mutex_unlock(&rescan->lock);
+}
+
+/* the uevent has no serial number nor speed, the source may */
+static void spice_usb_device_manager_read_adds_thread(GTask *task, gpointer source_object,
+                                                      gpointer task_data,
+                                                      GCancellable *cancellable)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceUsbDeviceRescan *rescan = task_data;
+    const gchar **names = g_new(const gchar *, rescan->adds->len);
+    guint i;
+
+    for (i = 0; i < rescan->adds->len; i++) {
+        names[i] = g_array_index(rescan->adds, SpiceUsbHotplugEvent, i).name;
+    }
+    spice_usb_device_source_read_devices(self->priv->source, names, rescan->adds->len,
+                                         spice_usb_device_manager_rescan_found, rescan);
+    g_free(names);
+    g_task_return_boolean(task, TRUE);
+}
+
+/* back in the main loop: the devices plugged in join the registry */
+static void spice_usb_device_manager_adds_read(GObject *source_object, GAsyncResult *res,
+                                               gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceUsbDeviceRescan *rescan = g_task_get_task_data(G_TASK(res));
+    GHashTable *read;
+    guint i, first;
+
+    /* the events that came during the read are newer, they follow it */
+    spice_usb_hotplug_source_set_blocked(self->priv->hotplug, FALSE);
+
+    /* address -> desc */
+    read = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < rescan->descs->len; i++) {
+        SpiceUsbDeviceDesc *desc = &g_array_index(rescan->descs, SpiceUsbDeviceDesc, i);
+
+        g_hash_table_insert(read, device_address_key(desc->busnum, desc->devaddr), desc);
+    }
+
+    first = _dev_ptr_array->len;
+    for (i = 0; i < rescan->adds->len; i++) {
+        const SpiceUsbHotplugEvent *event = &g_array_index(rescan->adds,
+                                                           SpiceUsbHotplugEvent, i);
+        const SpiceUsbDeviceDesc *desc;
+
+        /* a rescan that ran meanwhile may have it already */
+        if (spice_usb_device_manager_find_source_device(self, event->desc.busnum,
+                                                        event->desc.devaddr) != NULL) {
+            continue;
+        }
+        desc = g_hash_table_lookup(read, device_address_key(event->desc.busnum,
+                                                            event->desc.devaddr));
+        if (desc == NULL) {
+            desc = &event->desc;
+        }
+        if (desc->device_class != USB_CLASS_HUB) {
+            spice_usb_device_manager_insert_device(self, spice_usb_device_new_from_desc(desc));
+        }
+    }
+    g_hash_table_unref(read);
+    spice_usb_device_manager_announce(self, g_ptr_array_new(), first);
+}
+
+/*
+ * Settled hotplug events: the devices gone are extracted and announced
+ * at once, the ones plugged in are read on the threads of the source, the
+ * events that follow waiting for them. A device unplugged and plugged
+ * back in the meantime stays as it is.
+ */
+static void spice_usb_device_manager_hotplug(const SpiceUsbHotplugEvent *events,
+                                             guint n_events, gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = user_data;
+    SpiceUsbDeviceRescan *rescan = NULL;
+    GPtrArray *removed;
+    SpiceUsbDeviceInfo *device;
+    GTask *task;
+    guint i;
+
+    removed = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    for (i = 0; i < n_events; i++) {
+        const SpiceUsbHotplugEvent *event = &events[i];
+
+        /* emulated CD devices have no uevents, one at the same address is not it */
+        device = spice_usb_device_manager_find_source_device(self, event->desc.busnum,
+                                                             event->desc.devaddr);
+        if (device == NULL) {
+            continue;
+        }
+        if (event->action == SPICE_USB_HOTPLUG_ADD &&
+            device->vid == event->desc.vid && device->pid == event->desc.pid) {
+            continue;
+        }
+        spice_usb_device_manager_extract_device(self, device);
+        g_ptr_array_add(removed, device);
+    }
+    spice_usb_device_manager_announce(self, removed, _dev_ptr_array->len);
+
+    for (i = 0; i < n_events; i++) {
+        const SpiceUsbHotplugEvent *event = &events[i];
+
+        if (event->action != SPICE_USB_HOTPLUG_ADD ||
+            spice_usb_device_manager_find_source_device(self, event->desc.busnum,
+                                                        event->desc.devaddr) != NULL) {
+            continue;
+        }
+        if (rescan == NULL) {
+            rescan = spice_usb_device_rescan_new();
+            rescan->adds = g_array_new(FALSE, FALSE, sizeof(SpiceUsbHotplugEvent));
+        }
+        g_array_append_val(rescan->adds, *event);
+    }
+    if (rescan == NULL) {
+        return;
+    }
+
+    spice_usb_hotplug_source_set_blocked(self->priv->hotplug, TRUE);
+    task = g_task_new(self, NULL, spice_usb_device_manager_adds_read, NULL);
+    g_task_set_source_tag(task, spice_usb_device_manager_hotplug);
+    g_task_set_task_data(task, rescan, (GDestroyNotify)spice_usb_device_rescan_free);
+    g_task_run_in_thread(task, spice_usb_device_manager_read_adds_thread);
+    g_object_unref(task);
+}
+
+static void spice_usb_device_manager_rescan_thread(GTask *task, gpointer source_object,
+                                                   gpointer task_data,
+                                                   GCancellable *cancellable)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceUsbDeviceRescan *rescan = task_data;
+    GError *err = NULL;
+
+    if (!spice_usb_device_source_enumerate(self->priv->source,
+                                           spice_usb_device_manager_rescan_found,
+                                           rescan, &err)) {
+        g_task_return_error(task, err);
+        return;
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+/* back in the main loop: the registry follows the devices found, CD devices aside */
+static void spice_usb_device_manager_rescanned(GObject *source_object, GAsyncResult *res,
+                                               gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceUsbDeviceRescan *rescan = g_task_get_task_data(G_TASK(res));
+    GHashTable *present;
+    GPtrArray *removed;
+    GError *err = NULL;
+    guint i, first;
+
+    /* the events that came during the rescan are newer, they follow it */
+    spice_usb_hotplug_source_set_blocked(self->priv->hotplug, FALSE);
+    if (!g_task_propagate_boolean(G_TASK(res), &err)) {
+        g_warning("USB devices not rescanned: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    /* address -> desc */
+    present = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < rescan->descs->len; i++) {
+        SpiceUsbDeviceDesc *desc = &g_array_index(rescan->descs, SpiceUsbDeviceDesc, i);
+
+        g_hash_table_insert(present, device_address_key(desc->busnum, desc->devaddr), desc);
+    }
+
+    /*
+     * the removes that were lost, and the devices whose address another
+     * one took since, from the end as extracting moves the last device in
+     */
+    removed = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    for (i = _dev_ptr_array->len; i-- > 0;) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(_dev_ptr_array, i);
+        const SpiceUsbDeviceDesc *desc;
+
+        if (device->cd) {
+            continue;
+        }
+        desc = g_hash_table_lookup(present, device_address_key(device->busnum,
+                                                               device->devaddr));
+        if (desc == NULL || desc->vid != device->vid || desc->pid != device->pid) {
+            spice_usb_device_manager_extract_device(self, device);
+            g_ptr_array_add(removed, device);
+        }
+    }
+    g_hash_table_unref(present);
+
+    /* the adds that were lost, the devices inserted are the ones from @first on */
+    first = _dev_ptr_array->len;
+    for (i = 0; i < rescan->descs->len; i++) {
+        const SpiceUsbDeviceDesc *desc = &g_array_index(rescan->descs, SpiceUsbDeviceDesc, i);
+
+        if (spice_usb_device_manager_find_source_device(self, desc->busnum,
+                                                        desc->devaddr) == NULL) {
+            spice_usb_device_manager_insert_device(self, spice_usb_device_new_from_desc(desc));
+        }
+    }
+    spice_usb_device_manager_announce(self, removed, first);
+}
+
+/* uevents were lost, read the devices again once, the events go on meanwhile */
+static void spice_usb_device_manager_hotplug_overrun(gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = user_data;
+    SpiceUsbDeviceRescan *rescan = spice_usb_device_rescan_new();
+    GTask *task;
+
+    spice_usb_hotplug_source_set_blocked(self->priv->hotplug, TRUE);
+    task = g_task_new(self, NULL, spice_usb_device_manager_rescanned, NULL);
+    g_task_set_source_tag(task, spice_usb_device_manager_hotplug_overrun);
+    g_task_set_task_data(task, rescan, (GDestroyNotify)spice_usb_device_rescan_free);
+    g_task_run_in_thread(task, spice_usb_device_manager_rescan_thread);
+    g_object_unref(task);
+}
+
+/*
+ * Watch uevents from the start of the enumeration, so no device is
+ * missed, they wait for its end. $SPICE_USB_UEVENT_SOCKET names a local
+ * socket to read them from instead of the kernel, for replays.
+ */
+static void spice_usb_device_manager_start_hotplug(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    const gchar *replay = g_getenv("SPICE_USB_UEVENT_SOCKET");
+    GError *err = NULL;
+    gint fd;
+
+    if (priv->hotplug != NULL) {
+        return;
+    }
+    /* a source of devices the kernel does not know has its own uevents */
+    fd = spice_usb_device_source_open_uevents(priv->source, &err);
+    if (fd < 0 && err == NULL) {
+        if (replay != NULL && *replay != '\0') {
+            fd = spice_usb_hotplug_open_replay(replay, &err);
+        } else {
+            fd = spice_usb_hotplug_open_netlink(&err);
+        }
+    }
+    if (fd < 0) {
+        SPICE_DEBUG("USB devices are not watched: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+    priv->hotplug = spice_usb_hotplug_source_new(fd);
+    spice_usb_hotplug_source_set_func(priv->hotplug, spice_usb_device_manager_hotplug, self);
+    spice_usb_hotplug_source_set_overrun_func(priv->hotplug,
+                                              spice_usb_device_manager_hotplug_overrun, self);
+    spice_usb_hotplug_source_set_blocked(priv->hotplug, TRUE);
+    g_source_attach(priv->hotplug, priv->main_context);
+}
+
+static void spice_usb_device_manager_enumerate_done(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    const SpiceUsbSyntheticConfig *config;
+    GSList *tasks = g_slist_reverse(priv->enumerate_tasks);
+    GSList *l;
+
+    priv->enumerating = FALSE;
+    priv->enumerated = TRUE;
+    priv->enumerate_tasks = NULL;
+    priv->startup_stats.enumerated_us = g_get_monotonic_time() - priv->enumerate_start;
+    priv->startup_stats.n_devices = _dev_ptr_array->len;
+    SPICE_DEBUG("USB devices enumerated from %s: %u in %" G_GINT64_FORMAT " us, "
+                "first after %" G_GINT64_FORMAT " us",
+                spice_usb_device_source_get_name(priv->source), priv->startup_stats.n_devices,
+                priv->startup_stats.enumerated_us, priv->startup_stats.first_device_us);
+
+    if (priv->hotplug != NULL) {
+        spice_usb_hotplug_source_set_blocked(priv->hotplug, FALSE);
+    }
+    config = spice_usb_device_source_get_synthetic_config(priv->source);
+    if (config != NULL && priv->load == NULL) {
+        priv->load = spice_usb_device_load_start(self, config, priv->main_context);
+    }
+    for (l = tasks; l != NULL; l = l->next) {
+        g_task_return_boolean(l->data, TRUE);
+        g_object_unref(l->data);
+    }
+    g_slist_free(tasks);
+}
+
+static void spice_usb_device_manager_enumerate_next_lun(SpiceUsbDeviceManager *self);
+
+/* runs on a GTask thread: map the image of a startup LUN and read its first blocks */
+static void spice_usb_device_manager_open_startup_lun(GTask *task, gpointer source_object,
+                                                      gpointer task_data,
+                                                      GCancellable *cancellable)
+{
+    const gchar *path = task_data;
+    SpiceCdImage *image;
+    GError *err = NULL;
+
+    image = spice_cd_image_open(path, &err);
+    if (image == NULL) {
+        g_task_return_error(task, err);
+        return;
+    }
+    spice_cd_image_warm(image);
+    g_task_return_pointer(task, image, (GDestroyNotify)spice_cd_image_unref);
+}
+
+/* back in the main loop: the LUN takes the image opened on the thread */
+static void spice_usb_device_manager_startup_lun_opened(GObject *source_object,
+                                                        GAsyncResult *res,
+                                                        gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceCdImage *image;
+    GError *err = NULL;
+
+    /* an image that could not be opened leaves the LUN unloaded, with a warning */
+    image = g_task_propagate_pointer(G_TASK(res), &err);
+    spice_usb_device_manager_add_startup_lun(self, self->priv->enumerate_step++, image, err);
+    if (image != NULL) {
+        spice_cd_image_unref(image);
+    }
+    g_clear_error(&err);
+    spice_usb_device_manager_enumerate_next_lun(self);
+}
+
+/* the LUNs one after the other, their images are opened on a thread */
+static void spice_usb_device_manager_enumerate_next_lun(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    const gchar *path;
+    GTask *task;
+
+    if (priv->enumerate_step >= spice_usb_device_manager_get_n_startup_luns()) {
+        spice_usb_device_manager_enumerate_done(self);
+        return;
+    }
+    task = g_task_new(self, NULL, spice_usb_device_manager_startup_lun_opened, NULL);
+    g_task_set_source_tag(task, spice_usb_device_manager_enumerate_next_lun);
+    path = spice_usb_device_manager_get_startup_images()[priv->enumerate_step];
+    g_task_set_task_data(task, (gpointer)path, NULL);
+    g_task_run_in_thread(task, spice_usb_device_manager_open_startup_lun);
+    g_object_unref(task);
+}
+
+/* runs on a GTask thread, the batches are added from the main loop as they come */
+static void spice_usb_device_manager_enumerate_thread(GTask *task, gpointer source_object,
+                                                      gpointer task_data,
+                                                      GCancellable *cancellable)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    GError *err = NULL;
+
+    if (!spice_usb_device_source_enumerate(self->priv->source,
+                                           spice_usb_device_manager_found_devices_async,
+                                           self, &err)) {
+        g_task_return_error(task, err);
+        return;
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void spice_usb_device_manager_enumerated(GObject *source_object,
+                                                GAsyncResult *res,
+                                                gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    GError *err = NULL;
+
+    if (!g_task_propagate_boolean(G_TASK(res), &err)) {
+        g_warning("USB devices not enumerated: %s", err->message);
+        g_error_free(err);
+    }
+    /* batches the idle did not get to yet */
+    spice_usb_device_manager_drain_batches(self);
+    spice_usb_device_manager_enumerate_next_lun(self);
+}
+
+static void spice_usb_device_manager_enumerate_start(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    priv->enumerating = TRUE;
+    priv->enumerate_start = g_get_monotonic_time();
+    if (_dev_ptr_array == NULL) {
+        _dev_ptr_array = g_ptr_array_new();
+        /* get_devices() has an empty list to hand out until the first device */
+        spice_usb_device_manager_publish_devices();
+    }
+    if (priv->source == NULL) {
+        priv->source = spice_usb_device_source_new_default();
+    }
+    if (priv->enumerate_batches == NULL) {
+        priv->enumerate_batches = g_async_queue_new_full((GDestroyNotify)g_array_unref);
+    }
+    spice_usb_device_manager_start_hotplug(self);
+}
+
+static void spice_usb_device_manager_enumerate_async(SpiceUsbDeviceManager *self)
+{
+    GTask *task;
+
+    spice_usb_device_manager_enumerate_start(self);
+    task = g_task_new(self, NULL, spice_usb_device_manager_enumerated, NULL);
+    g_task_set_source_tag(task, spice_usb_device_manager_enumerate_async);
+    g_task_run_in_thread(task, spice_usb_device_manager_enumerate_thread);
+    g_object_unref(task);
+}
+
+/* the whole enumeration at once, for callers that want the full list */
+static void spice_usb_device_manager_enumerate_sync(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GError *err = NULL;
+
+    spice_usb_device_manager_enumerate_start(self);
+    if (!spice_usb_device_source_enumerate(priv->source,
+                                           spice_usb_device_manager_found_devices,
+                                           self, &err)) {
+        g_warning("USB devices not enumerated: %s", err->message);
+        g_error_free(err);
+    }
+    spice_usb_device_manager_drain_batches(self);
+    for (; priv->enumerate_step < spice_usb_device_manager_get_n_startup_luns();
+         priv->enumerate_step++) {
+        spice_usb_device_manager_add_startup_lun(self, priv->enumerate_step, NULL, NULL);
+    }
+    spice_usb_device_manager_enumerate_done(self);
+}
+
+/*
+ * Completes once the startup devices are all in, they are added to the
+ * list one by one meanwhile, each with a #SpiceUsbDeviceManager::device-added.
+ * Every call shares the same enumeration, later ones complete at once.
+ */
+static void spice_usb_device_manager_init_async(GAsyncInitable *initable,
+                                                int io_priority,
+                                                GCancellable *cancellable,
+                                                GAsyncReadyCallback callback,
+                                                gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(initable);
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    GTask *task;
+
+    task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, spice_usb_device_manager_init_async);
+    g_task_set_priority(task, io_priority);
+
+    if (priv->enumerated) {
+        g_task_return_boolean(task, TRUE);
+        g_object_unref(task);
+        return;
+    }
+    priv->enumerate_tasks = g_slist_prepend(priv->enumerate_tasks, task);
+    if (!priv->enumerating) {
+        spice_usb_device_manager_enumerate_async(self);
+    }
+}
+
+static gboolean spice_usb_device_manager_init_finish(GAsyncInitable *initable,
+                                                     GAsyncResult *res,
+                                                     GError **err)
+{
+    g_return_val_if_fail(g_task_is_valid(res, initable), FALSE);
+
+    return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+static void spice_usb_device_manager_async_initable_iface_init(GAsyncInitableIface *iface)
+{
+    iface->init_async = spice_usb_device_manager_init_async;
+    iface->init_finish = spice_usb_device_manager_init_finish;
+}
+
+/**
+ * spice_usb_device_manager_get:
+ * @session: #SpiceSession for which to get the #SpiceUsbDeviceManager
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Gets the #SpiceUsbDeviceManager associated with the passed in #SpiceSession.
+ * The manager is created by the first call, whatever thread it comes from,
+ * concurrent callers wait for it and get the same manager. A manager
+ * created by this call has all its startup devices, one created by
+ * spice_usb_device_manager_get_async() may still be adding them.
+ *
+ * Returns: (transfer none): a weak reference to the #SpiceUsbDeviceManager
+ * singleton
+ */
+SpiceUsbDeviceManager *spice_usb_device_manager_get(SpiceSession *session,
+                                                    GError **err)
+{
+    if (g_once_init_enter(&_manager_once)) {
+        _usb_dev_manager = g_initable_new(SPICE_TYPE_USB_DEVICE_MANAGER,
+                                          NULL, /* cancellable */
+                                          &_usb_dev_manager_error,
+                                          NULL);
+        if (_usb_dev_manager == NULL) {
+            g_once_init_leave(&_manager_once, MANAGER_FAILED);
+            g_propagate_error(err, g_error_copy(_usb_dev_manager_error));
+            return NULL;
+        }
+
+        spice_usb_device_manager_enumerate_sync(_usb_dev_manager);
+        g_once_init_leave(&_manager_once, MANAGER_ANNOUNCING);
+    }
+    if (_usb_dev_manager == NULL) {
+        g_propagate_error(err, g_error_copy(_usb_dev_manager_error));
+    }
+    return _usb_dev_manager;
+}
+
+/**
+ * spice_usb_device_manager_get_async:
+ * @session: #SpiceSession for which to get the #SpiceUsbDeviceManager
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called once the startup devices are all in the list
+ * @user_data: data for @callback
+ *
+ * Like spice_usb_device_manager_get(), without waiting for the devices:
+ * the manager this returns starts with an empty list, which fills in from
+ * the main loop, each device with a #SpiceUsbDeviceManager::device-added.
+ * Images of the startup CD LUNs are opened on a thread. Call it from the
+ * main loop thread, before anything else gets the manager, for the list
+ * to fill in this way. A manager that exists already is returned as it
+ * is, @callback runs once its enumeration is over.
+ *
+ * Returns: (transfer none): a weak reference to the #SpiceUsbDeviceManager
+ * singleton, or %NULL if it could not be created, as @callback then reports
+ */
+SpiceUsbDeviceManager *spice_usb_device_manager_get_async(SpiceSession *session,
+                                                          GCancellable *cancellable,
+                                                          GAsyncReadyCallback callback,
+                                                          gpointer user_data)
+{
+    if (g_once_init_enter(&_manager_once)) {
+        _usb_dev_manager = g_initable_new(SPICE_TYPE_USB_DEVICE_MANAGER,
+                                          NULL, /* cancellable */
+                                          &_usb_dev_manager_error,
+                                          NULL);
+        /* devices are announced as they come */
+        g_once_init_leave(&_manager_once,
+                          _usb_dev_manager != NULL ? MANAGER_ANNOUNCING : MANAGER_FAILED);
+    }
+    if (_usb_dev_manager == NULL) {
+        g_task_report_error(NULL, callback, user_data, spice_usb_device_manager_get_async,
+                            g_error_copy(_usb_dev_manager_error));
+        return NULL;
+    }
+    g_async_initable_init_async(G_ASYNC_INITABLE(_usb_dev_manager), G_PRIORITY_DEFAULT,
+                                cancellable, callback, user_data);
+    return _usb_dev_manager;
+}
+
+/**
+ * spice_usb_device_manager_get_finish:
+ * @res: the result passed to the callback of spice_usb_device_manager_get_async()
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Returns: (transfer none): the #SpiceUsbDeviceManager singleton, with all
+ * its startup devices, or %NULL
+ */
+SpiceUsbDeviceManager *spice_usb_device_manager_get_finish(GAsyncResult *res, GError **err)
+{
+    GObject *source_object = g_async_result_get_source_object(res);
+    gboolean ok;
+
+    if (source_object == NULL) {
+        /* reported by get_async() itself */
+        g_task_propagate_boolean(G_TASK(res), err);
+        return NULL;
+    }
+    ok = g_async_initable_init_finish(G_ASYNC_INITABLE(source_object), res, err);
+    g_object_unref(source_object);
+    return ok ? SPICE_USB_DEVICE_MANAGER(source_object) : NULL;
+}
+
+/**
+ * spice_usb_device_manager_get_hotplug_stats:
+ * @self: the #SpiceUsbDeviceManager
+ * @stats: (out): where to store the counters of the uevents
+ *
+ * Returns: %FALSE if the devices plugged in and out are not watched
+ */
+gboolean spice_usb_device_manager_get_hotplug_stats(SpiceUsbDeviceManager *self,
+                                                    SpiceUsbHotplugStats *stats)
+{
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self), FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    if (self->priv->hotplug == NULL) {
+        return FALSE;
+    }
+    spice_usb_hotplug_source_get_stats(self->priv->hotplug, stats);
+    return TRUE;
+}
+
+/**
+ * spice_usb_device_manager_get_load_stats:
+ * @self: the #SpiceUsbDeviceManager
+ * @stats: (out): where to store the counters of the requests made
+ *
+ * Returns: %FALSE unless the devices come from a synthetic source,
+ * see %SPICE_USB_SOURCE_ENV
+ */
+gboolean spice_usb_device_manager_get_load_stats(SpiceUsbDeviceManager *self,
+                                                 SpiceUsbDeviceLoadStats *stats)
+{
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self), FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    if (self->priv->load == NULL) {
+        return FALSE;
+    }
+    spice_usb_device_load_get_stats(self->priv->load, stats);
+    return TRUE;
+}
+
+/**
+ * spice_usb_device_manager_get_startup_stats:
+ * @self: the #SpiceUsbDeviceManager
+ * @stats: (out): where to store the timings of the startup enumeration
+ *
+ * Times are from the start of the enumeration, -1 until they happened.
+ */
+void spice_usb_device_manager_get_startup_stats(SpiceUsbDeviceManager *self,
+                                                SpiceUsbDeviceManagerStartupStats *stats)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(stats != NULL);
+
+    *stats = self->priv->startup_stats;
+}
+
+/**
+ * spice_usb_device_manager_get_devices:
+ * @manager: the #SpiceUsbDeviceManager manager
+ *
+ * Get the devices as they are now. The array is never modified, changes
+ * publish a new one, so it can be iterated from any thread while devices
+ * come and go; get the devices again to see them. What identifies a
+ * device, its bus, address, vendor and product ids, and its descriptions
+ * and spice_usb_device_get_info() can be read from any thread too, a
+ * device released last by another thread is freed in the context the
+ * manager was created in. The LUNs of a CD device are changed in place
+ * by the main loop, their state is only read there.
+ *
+ * Returns: (element-type SpiceUsbDevice) (transfer full): a %GPtrArray
+ * array of %SpiceUsbDevice
+ */
+GPtrArray *spice_usb_device_manager_get_devices(SpiceUsbDeviceManager *manager)
+{
+    GPtrArray *devices;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+
+    g_atomic_int_inc(&_dev_snapshot_readers);
+    devices = g_ptr_array_ref(g_atomic_pointer_get(&_dev_snapshot));
+    g_atomic_int_add(&_dev_snapshot_readers, -1);
+    return devices;
+}
+
+static gboolean spice_usb_device_manager_check_rules(const SpiceUsbFilterRule *rules,
+                                                     guint count,
+                                                     const SpiceUsbDeviceInfo *device)
+{
+    return spice_usb_filter_check(rules, count, device->device_class,
+                                  device->vid, device->pid, device->bcd_device);
+}
+
+gboolean spice_usb_device_manager_should_auto_connect(SpiceUsbDeviceManager *self,
+                                                      SpiceUsbDevice *dev_handle)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    return priv->auto_connect &&
+        spice_usb_device_manager_check_rules(priv->auto_conn_filter_rules,
+                                             priv->auto_conn_filter_rules_count,
+                                             (const SpiceUsbDeviceInfo *)dev_handle);
+}
+
+gboolean spice_usb_device_manager_should_redirect_on_connect(SpiceUsbDeviceManager *self,
+                                                             SpiceUsbDevice *dev_handle)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    return priv->redirect_on_connect != NULL &&
+        spice_usb_device_manager_check_rules(priv->redirect_on_connect_rules,
+                                             priv->redirect_on_connect_rules_count,
+                                             (const SpiceUsbDeviceInfo *)dev_handle);
+}
+
+/**
+ * spice_usb_device_manager_get_devices_with_filter:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @filter: (allow-none): filter string for selecting which devices to return,
+ *      see #SpiceUsbDeviceManager:auto-connect-filter for the filter
+ *      string format
+ *
+ * Finds devices associated with the @manager complying with the @filter.
+ * The compiled rules of the last @filter are kept, so calling this
+ * repeatedly with the same filter does not parse it again.
+ *
+ * Returns: (element-type SpiceUsbDevice) (transfer full): a
+ * %GPtrArray array of %SpiceUsbDevice
+ */
+GPtrArray* spice_usb_device_manager_get_devices_with_filter(
+    SpiceUsbDeviceManager *manager, const gchar *filter)
+{
+    SpiceUsbDeviceManagerPrivate *priv;
+    GPtrArray *devices_copy;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+
+    priv = manager->priv;
+    if (filter != NULL && g_strcmp0(filter, priv->last_filter) != 0) {
+        SpiceUsbFilterRule *rules;
+        guint count;
+        GError *err = NULL;
+
+        if (!spice_usb_filter_parse(filter, &rules, &count, &err)) {
+            g_warning("Error parsing filter string \"%s\": %s", filter, err->message);
+            g_error_free(err);
+            return g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+        }
+        g_free(priv->last_filter_rules);
+        g_free(priv->last_filter);
+        priv->last_filter_rules = rules;
+        priv->last_filter_rules_count = count;
+        priv->last_filter = g_strdup(filter);
+    }
+
+    devices_copy = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    for (i = 0; i < _dev_ptr_array->len; i++) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(_dev_ptr_array, i);
+
+        if (filter != NULL &&
+            !spice_usb_device_manager_check_rules(priv->last_filter_rules,
+                                                  priv->last_filter_rules_count,
+                                                  device)) {
+            continue;
+        }
+        g_ptr_array_add(devices_copy, spice_usb_device_ref((SpiceUsbDevice *)device));
+    }
+
+    return devices_copy;
+}
+
+guint8 spice_usb_device_get_busnum(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, 0);
+    return device->busnum;
+}
+
+guint8 spice_usb_device_get_devaddr(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, 0);
+    return device->devaddr;
+}
+
+/* kbit/s, 0 if unknown */
+guint32 spice_usb_device_get_speed(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, 0);
+    return device->speed;
+}
+
+/* NULL if the device has no serial number */
+const gchar *spice_usb_device_peek_serial(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, NULL);
+    return device->serial;
+}
+
+guint16 spice_usb_device_get_vid(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, 0);
+    return device->vid;
+}
+
+guint16 spice_usb_device_get_pid(const SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    g_return_val_if_fail(device != NULL, 0);
+    return device->pid;
+}
+
+/* the vendor/product names database, mapped on first use */
+static SpiceUsbIds *spice_usb_util_get_ids(void)
+{
+    static gsize ids_once = 0;
+    static SpiceUsbIds *ids = NULL;
+
+    if (g_once_init_enter(&ids_once)) {
+        const gchar *path = g_getenv("SPICE_USB_IDS_DB");
+        GError *err = NULL;
+
+        ids = spice_usb_ids_open(path != NULL && *path != '\0' ? path : USB_IDS_DB_PATH, &err);
+        if (ids == NULL) {
+            SPICE_DEBUG("no USB ids database: %s", err->message);
+            g_error_free(err);
+        }
+        g_once_init_leave(&ids_once, 1);
+    }
+    return ids;
+}
+
+void spice_usb_util_get_device_strings(int bus, int address,
+                                       int vendor_id, int product_id,
+                                       gchar **manufacturer, gchar **product)
+{
+    SpiceUsbIds *ids = spice_usb_util_get_ids();
+    const gchar *vendor_name = NULL, *product_name = NULL;
+
+    if (ids != NULL) {
+        spice_usb_ids_lookup(ids, vendor_id, product_id, &vendor_name, &product_name);
+    }
+
+    *manufacturer = g_strdup(vendor_name != NULL ? vendor_name : "RedHat-Spice");
+    *product = g_strdup(product_name != NULL ? product_name : "Redir-USB");
+}
+
+/* identity the cached strings of a device were resolved for */
+static inline guint64 device_strings_key(const SpiceUsbDeviceInfo *device)
+{
+    return ((guint64)device->busnum << 48) | ((guint64)device->devaddr << 32) |
+        ((guint64)device->vid << 16) | device->pid;
+}
+
+static void spice_usb_device_invalidate_strings(SpiceUsbDeviceInfo *device)
+{
+    g_clear_pointer(&device->manufacturer, g_free);
+    g_clear_pointer(&device->product, g_free);
+    if (device->descriptions != NULL) {
+        g_hash_table_remove_all(device->descriptions);
+    }
+    device->strings_valid = FALSE;
+}
+
+/* resolve the manufacturer/product/descriptor strings once per identity */
+static void spice_usb_device_resolve_strings(SpiceUsbDeviceInfo *device)
+{
+    if (device->strings_valid && device->strings_key == device_strings_key(device)) {
+        return;
+    }
+
+    spice_usb_device_invalidate_strings(device);
+    spice_usb_util_get_device_strings(device->busnum, device->devaddr,
+                                      device->vid, device->pid,
+                                      &device->manufacturer, &device->product);
+    if ((device->vid > 0) && (device->pid > 0)) {
+        g_snprintf(device->descriptor, sizeof(device->descriptor),
+                   "[%04x:%04x]", device->vid, device->pid);
+    } else {
+        device->descriptor[0] = '\0';
+    }
+    device->strings_key = device_strings_key(device);
+    device->strings_valid = TRUE;
+}
+
+void spice_usb_device_get_info(SpiceUsbDeviceManager *manager,
+                               SpiceUsbDevice *dev_handle,
+                               SpiceUsbDeviceDescription *dev_descr)
+{
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    g_return_if_fail(device != NULL);
+
+    dev_descr->bus = spice_usb_device_get_busnum(dev_handle);
+    dev_descr->address = spice_usb_device_get_devaddr(dev_handle);
+    dev_descr->vendor_id = spice_usb_device_get_vid(dev_handle);
+    dev_descr->product_id = spice_usb_device_get_pid(dev_handle);
+
+    g_mutex_lock(&_dev_strings_lock);
+    spice_usb_device_resolve_strings(device);
+    dev_descr->vendor = g_strdup(device->manufacturer);
+    dev_descr->product = g_strdup(device->product);
+    g_mutex_unlock(&_dev_strings_lock);
+}
+
+/* formats whose descriptions a device keeps, the UIs use one or two */
+#define DEVICE_MAX_DESCRIPTIONS 4
+
+/* with _dev_strings_lock held and the strings resolved */
+static gchar *spice_usb_device_format_description(SpiceUsbDeviceInfo *device,
+                                                  const gchar *format)
+{
+    return g_strdup_printf(format, device->manufacturer, device->product,
+                           device->descriptor, device->busnum, device->devaddr);
+}
+
+/*
+ * the description kept for @format, made if there is room for it, with
+ * _dev_strings_lock held
+ */
+static const gchar *spice_usb_device_lookup_description(SpiceUsbDeviceInfo *device,
+                                                        const gchar *format)
+{
+    gchar *description;
+
+    spice_usb_device_resolve_strings(device);
+    if (device->descriptions == NULL) {
+        device->descriptions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+    }
+
+    description = g_hash_table_lookup(device->descriptions, format);
+    if (description == NULL &&
+        g_hash_table_size(device->descriptions) < DEVICE_MAX_DESCRIPTIONS) {
+        description = spice_usb_device_format_description(device, format);
+        g_hash_table_insert(device->descriptions, g_strdup(format), description);
+    }
+    return description;
+}
+
+/**
+ * spice_usb_device_peek_description:
+ * @device: #SpiceUsbDeviceInfo to get the description of
+ * @format: (allow-none): an optional printf() format string with
+ * positional parameters, see spice_usb_device_get_description()
+ *
+ * Like spice_usb_device_get_description(), but the string is owned by the
+ * device: it is formatted once per @format and kept until the identity of
+ * the device changes, so repeated calls do not allocate. A device keeps
+ * the descriptions of its first 4 formats only, other formats are for
+ * spice_usb_device_get_description().
+ *
+ * Returns: (transfer none): the description, or %NULL if failed
+ */
+const gchar *spice_usb_device_peek_description(SpiceUsbDevice *dev_handle,
+                                               const gchar *format)
+{
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    const gchar *description;
+
+    g_return_val_if_fail(device != NULL, NULL);
+
+    if (!format)
+        format = _("%s %s %s at %d-%d");
+
+    /* devices of a snapshot are described from any thread */
+    g_mutex_lock(&_dev_strings_lock);
+    description = spice_usb_device_lookup_description(device, format);
+    g_mutex_unlock(&_dev_strings_lock);
+    return description;
+}
+
+/**
+ * spice_usb_device_get_description:
+ * @device: #SpiceUsbDeviceInfo to get the description of
+ * @format: (allow-none): an optional printf() format string with
+ * positional parameters
+ *
+ * Get a string describing the device which is suitable as a description of
+ * the device for the end user. The returned string should be freed with
+ * g_free() when no longer needed.
+ *
+ * The @format positional parameters are the following:
+ * - '%%1$s' manufacturer
+ * - '%%2$s' product
+ * - '%%3$s' descriptor (a [vendor_id:product_id] string)
+ * - '%%4$d' bus
+ * - '%%5$d' address
+ *
+ * (the default format string is "%%s %%s %%s at %%d-%%d")
+ *
+ * Returns: a newly-allocated string holding the description, or %NULL if failed
+ */
+gchar *spice_usb_device_get_description(SpiceUsbDevice *dev_handle, const gchar *format)
+{
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    const gchar *description;
+    gchar *copy;
+
+    g_return_val_if_fail(device != NULL, NULL);
+
+    if (!format)
+        format = _("%s %s %s at %d-%d");
+
+    g_mutex_lock(&_dev_strings_lock);
+    description = spice_usb_device_lookup_description(device, format);
+    copy = description != NULL ? g_strdup(description) :
+        spice_usb_device_format_description(device, format);
+    g_mutex_unlock(&_dev_strings_lock);
+    return copy;
+}
+
+
+gboolean spice_usb_device_manager_is_device_connected(SpiceUsbDeviceManager *manager,
+                                                      SpiceUsbDevice *dev_handle)
+{
+    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    return device->connected;
+}
+
+/* Claim the device for redirection. This may block (opening the device,
+ * detaching kernel drivers), so outside of the _sync() API it only runs on
+ * a worker thread. */
+static gboolean spice_usb_device_manager_claim(SpiceUsbDeviceManager *self,
+                                               SpiceUsbDeviceInfo *device,
+                                               GCancellable *cancellable,
+                                               GError **err)
+{
+    /* the prototype has no real device to open */
+    return !g_cancellable_set_error_if_cancelled(cancellable, err);
+}
+
+/* Counterpart of spice_usb_device_manager_claim(), may block as well */
+static void spice_usb_device_manager_release(SpiceUsbDeviceManager *self,
+                                             SpiceUsbDeviceInfo *device)
+{
+}
+
+/* free-channels is notified when it ends up changed, not for an op undone */
+static void spice_usb_device_manager_notify_free_channels(SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    if (priv->free_channels != priv->notified_free_channels) {
+        priv->notified_free_channels = priv->free_channels;
+        g_object_notify(G_OBJECT(self), "free-channels");
+    }
+}
+
+gboolean spice_usb_device_manager_connect_device_sync(SpiceUsbDeviceManager *self,
+                                                      SpiceUsbDevice *dev_handle)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+
+    if (!device->connected && !device->pending) {
+        if (priv->free_channels > 0 &&
+            spice_usb_device_manager_claim(self, device, NULL, NULL)) {
+            priv->free_channels--;
+            device->connected = TRUE;
+            spice_usb_device_manager_notify_free_channels(self);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean spice_usb_device_manager_disconnect_device_sync(SpiceUsbDeviceManager *self,
+                                                         SpiceUsbDevice *dev_handle)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+
+    if (device->connected && !device->pending) {
+        spice_usb_device_manager_release(self, device);
+        device->connected = FALSE;
+        priv->free_channels++;
+        spice_usb_device_manager_notify_free_channels(self);
         return TRUE;
     } else {
-        if (err) {
-            *err = g_error_new_literal(g_quark_from_static_string("disconnect"), 1, "Failed to disconnect");
+        return FALSE;
+    }
+}
+
+typedef struct _SpiceUsbDeviceBatch {
+    GPtrArray *devices;     /* the requested devices */
+    GPtrArray *errors;      /* GError per device, NULL on success */
+    SpiceUsbDeviceBatchFlags flags;
+    gboolean connect;
+    gboolean rolling_back;  /* undoing an all-or-nothing connect */
+    guint pending;          /* ops still on the workers */
+} SpiceUsbDeviceBatch;
+
+/* a connect or disconnect of one device, queued on priv->workers */
+typedef struct _SpiceUsbDeviceOp {
+    GTask *task;                /* task to complete, shared by a batch */
+    SpiceUsbDeviceInfo *device;
+    SpiceUsbDeviceBatch *batch; /* NULL for single device requests */
+    guint index;                /* position in batch->devices */
+    gboolean connect;
+    gboolean ok;
+    GError *error;
+} SpiceUsbDeviceOp;
+
+static void spice_usb_device_op_free(SpiceUsbDeviceOp *op)
+{
+    spice_usb_device_unref((SpiceUsbDevice *)op->device);
+    g_object_unref(op->task);
+    g_clear_error(&op->error);
+    g_free(op);
+}
+
+static void spice_usb_device_batch_error_free(gpointer error)
+{
+    if (error != NULL) {
+        g_error_free(error);
+    }
+}
+
+static void spice_usb_device_batch_free(SpiceUsbDeviceBatch *batch)
+{
+    g_ptr_array_unref(batch->devices);
+    g_ptr_array_unref(batch->errors);
+    g_free(batch);
+}
+
+static void spice_usb_device_manager_queue_op(SpiceUsbDeviceManager *self,
+                                              GTask *task,
+                                              SpiceUsbDeviceInfo *device,
+                                              gboolean connect,
+                                              SpiceUsbDeviceBatch *batch,
+                                              guint index);
+
+/* commit the result of the op to the device */
+static void spice_usb_device_manager_commit_op(SpiceUsbDeviceManager *self,
+                                               SpiceUsbDeviceOp *op)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    op->device->pending = FALSE;
+    if (op->connect) {
+        if (op->ok) {
+            op->device->connected = TRUE;
+        } else {
+            /* give back the channel reserved when the op was queued */
+            priv->free_channels++;
+        }
+    } else if (op->ok) {
+        op->device->connected = FALSE;
+        priv->free_channels++;
+    }
+}
+
+/* complete the batch, a failure is summed up in one error, batch->errors has the details */
+static void spice_usb_device_manager_batch_return(GTask *task, SpiceUsbDeviceBatch *batch)
+{
+    GError *cause = NULL;
+    guint i, n_failed = 0;
+
+    for (i = 0; i < batch->errors->len; i++) {
+        GError *error = g_ptr_array_index(batch->errors, i);
+
+        if (error == NULL) {
+            continue;
+        }
+        n_failed++;
+        /* devices disconnected by a rollback did not fail on their own */
+        if (cause == NULL || g_error_matches(cause, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            cause = error;
+        }
+    }
+    if (n_failed == 0) {
+        g_task_return_boolean(task, TRUE);
+        return;
+    }
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "%u of %u devices could not be %s: %s",
+                            n_failed, batch->errors->len,
+                            batch->connect ? "connected" : "disconnected", cause->message);
+}
+
+static void spice_usb_device_manager_batch_op_done(SpiceUsbDeviceManager *self,
+                                                   SpiceUsbDeviceOp *op)
+{
+    SpiceUsbDeviceBatch *batch = op->batch;
+    gboolean all_ok = TRUE;
+    guint i;
+
+    if (!batch->rolling_back) {
+        g_ptr_array_index(batch->errors, op->index) = op->error;
+        op->error = NULL;
+    }
+    if (--batch->pending > 0) {
+        return;
+    }
+
+    for (i = 0; i < batch->errors->len; i++) {
+        if (g_ptr_array_index(batch->errors, i) != NULL) {
+            all_ok = FALSE;
+            break;
+        }
+    }
+
+    if (!all_ok && batch->connect && !batch->rolling_back &&
+        (batch->flags & SPICE_USB_DEVICE_BATCH_ALL_OR_NOTHING)) {
+        batch->rolling_back = TRUE;
+        for (i = 0; i < batch->devices->len; i++) {
+            SpiceUsbDeviceInfo *device = g_ptr_array_index(batch->devices, i);
+
+            if (g_ptr_array_index(batch->errors, i) != NULL) {
+                continue;
+            }
+            g_ptr_array_index(batch->errors, i) =
+                g_error_new(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                            "Device %d-%d disconnected, another device of the batch failed",
+                            device->busnum, device->devaddr);
+            device->pending = TRUE;
+            batch->pending++;
+            spice_usb_device_manager_queue_op(self, op->task, device, FALSE, batch, i);
+        }
+        if (batch->pending > 0) {
+            return;
+        }
+    }
+
+    /* one notification for the whole batch, none if it was rolled back */
+    spice_usb_device_manager_notify_free_channels(self);
+    spice_usb_device_manager_batch_return(op->task, batch);
+}
+
+/* back in the context of the caller: commit the result and complete the task */
+static gboolean spice_usb_device_manager_op_done(gpointer user_data)
+{
+    SpiceUsbDeviceOp *op = user_data;
+    SpiceUsbDeviceManager *self = g_task_get_source_object(op->task);
+
+    spice_usb_device_manager_commit_op(self, op);
+    if (op->batch != NULL) {
+        spice_usb_device_manager_batch_op_done(self, op);
+    } else if (op->ok) {
+        spice_usb_device_manager_notify_free_channels(self);
+        g_task_return_boolean(op->task, TRUE);
+    } else {
+        g_task_return_error(op->task, op->error);
+        op->error = NULL;
+    }
+    spice_usb_device_op_free(op);
+    return G_SOURCE_REMOVE;
+}
+
+/* runs on one of the priv->workers threads, never on the main loop */
+static void spice_usb_device_manager_worker(gpointer data, gpointer user_data)
+{
+    SpiceUsbDeviceOp *op = data;
+    SpiceUsbDeviceManager *self = g_task_get_source_object(op->task);
+    GCancellable *cancellable = g_task_get_cancellable(op->task);
+
+    if (op->batch != NULL && op->batch->rolling_back) {
+        /* a rollback has to complete */
+        cancellable = NULL;
+    }
+
+    if (g_cancellable_set_error_if_cancelled(cancellable, &op->error)) {
+        op->ok = FALSE;
+    } else if (op->connect) {
+        op->ok = spice_usb_device_manager_claim(self, op->device, cancellable, &op->error);
+        if (op->ok && g_cancellable_set_error_if_cancelled(cancellable, &op->error)) {
+            /* cancelled while claiming, undo it */
+            spice_usb_device_manager_release(self, op->device);
+            op->ok = FALSE;
+        }
+    } else {
+        spice_usb_device_manager_release(self, op->device);
+        op->ok = TRUE;
+    }
+
+    g_main_context_invoke_full(g_task_get_context(op->task), G_PRIORITY_DEFAULT,
+                               spice_usb_device_manager_op_done, op, NULL);
+}
+
+/* the device must be marked pending, and for a connect a channel reserved */
+static void spice_usb_device_manager_queue_op(SpiceUsbDeviceManager *self,
+                                              GTask *task,
+                                              SpiceUsbDeviceInfo *device,
+                                              gboolean connect,
+                                              SpiceUsbDeviceBatch *batch,
+                                              guint index)
+{
+    SpiceUsbDeviceOp *op;
+
+    op = g_new0(SpiceUsbDeviceOp, 1);
+    op->task = g_object_ref(task);
+    op->device = (SpiceUsbDeviceInfo *)spice_usb_device_ref((SpiceUsbDevice *)device);
+    op->connect = connect;
+    op->batch = batch;
+    op->index = index;
+
+    if (!g_thread_pool_push(self->priv->workers, op, &op->error)) {
+        op->ok = FALSE;
+        spice_usb_device_manager_op_done(op);
+    }
+}
+
+/* checks whether the device can be connected or disconnected now */
+static gboolean spice_usb_device_manager_check_op(SpiceUsbDeviceInfo *device,
+                                                  gboolean connect,
+                                                  GError **err)
+{
+    if (device->pending) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_PENDING,
+                    "Device %d-%d is already being %s",
+                    device->busnum, device->devaddr,
+                    connect ? "connected" : "disconnected");
+        return FALSE;
+    }
+    if (device->connected == connect) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    connect ? "Device %d-%d is already connected" :
+                              "Device %d-%d is not connected",
+                    device->busnum, device->devaddr);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void spice_usb_device_manager_start_op(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *dev_handle,
+                                              gboolean connect,
+                                              GCancellable *cancellable,
+                                              GAsyncReadyCallback callback,
+                                              gpointer user_data,
+                                              gpointer source_tag)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    GError *err = NULL;
+    GTask *task;
+
+    task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, source_tag);
+    /* report what actually happened to the device, even when cancelled late */
+    g_task_set_check_cancellable(task, FALSE);
+
+    if (g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+    if (!spice_usb_device_manager_check_op(device, connect, &err)) {
+        g_task_return_error(task, err);
+        g_object_unref(task);
+        return;
+    }
+    if (connect) {
+        if (priv->free_channels <= 0) {
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                    "No free USB channel");
+            g_object_unref(task);
+            return;
+        }
+        /* reserve the channel now, so concurrent requests can't overbook */
+        priv->free_channels--;
+    }
+
+    device->pending = TRUE;
+    spice_usb_device_manager_queue_op(self, task, device, connect, NULL, 0);
+    g_object_unref(task);
+}
+
+static void spice_usb_device_manager_start_batch(SpiceUsbDeviceManager *self,
+                                                 GPtrArray *devices,
+                                                 gboolean connect,
+                                                 SpiceUsbDeviceBatchFlags flags,
+                                                 GCancellable *cancellable,
+                                                 GAsyncReadyCallback callback,
+                                                 gpointer user_data,
+                                                 gpointer source_tag)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    SpiceUsbDeviceBatch *batch;
+    GTask *task;
+    guint i, eligible = 0, reserved;
+
+    task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, source_tag);
+    g_task_set_check_cancellable(task, FALSE);
+
+    batch = g_new0(SpiceUsbDeviceBatch, 1);
+    batch->devices = g_ptr_array_new_full(devices->len,
+                                          (GDestroyNotify)spice_usb_device_unref);
+    batch->errors = g_ptr_array_new_full(devices->len, spice_usb_device_batch_error_free);
+    batch->flags = flags;
+    batch->connect = connect;
+    g_task_set_task_data(task, batch, (GDestroyNotify)spice_usb_device_batch_free);
+
+    for (i = 0; i < devices->len; i++) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(devices, i);
+        GError *err = NULL;
+
+        if (g_ptr_array_find(batch->devices, device, NULL)) {
+            g_set_error(&err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Device %d-%d is listed more than once",
+                        device->busnum, device->devaddr);
+        } else if (spice_usb_device_manager_check_op(device, connect, &err)) {
+            eligible++;
+        }
+        g_ptr_array_add(batch->devices, spice_usb_device_ref((SpiceUsbDevice *)device));
+        g_ptr_array_add(batch->errors, err);
+    }
+
+    if (g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+
+    reserved = eligible;
+    if (connect) {
+        /* reserve the channels of the whole batch at once */
+        reserved = MIN(eligible, (guint)MAX(priv->free_channels, 0));
+        if ((flags & SPICE_USB_DEVICE_BATCH_ALL_OR_NOTHING) &&
+            (eligible < devices->len || reserved < eligible)) {
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                    eligible < devices->len ?
+                                    "Some devices of the batch can't be connected" :
+                                    "Not enough free USB channels for the batch");
+            g_object_unref(task);
+            return;
+        }
+        priv->free_channels -= reserved;
+    }
+
+    for (i = 0; i < batch->devices->len; i++) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(batch->devices, i);
+
+        if (g_ptr_array_index(batch->errors, i) != NULL) {
+            continue;
+        }
+        if (reserved == 0) {
+            g_ptr_array_index(batch->errors, i) =
+                g_error_new_literal(G_IO_ERROR, G_IO_ERROR_FAILED, "No free USB channel");
+            continue;
+        }
+        reserved--;
+        device->pending = TRUE;
+        batch->pending++;
+    }
+
+    if (batch->pending == 0) {
+        spice_usb_device_manager_batch_return(task, batch);
+        g_object_unref(task);
+        return;
+    }
+
+    /* queue only once everything is reserved, ops complete asynchronously */
+    for (i = 0; i < batch->devices->len; i++) {
+        SpiceUsbDeviceInfo *device = g_ptr_array_index(batch->devices, i);
+
+        if (g_ptr_array_index(batch->errors, i) == NULL) {
+            spice_usb_device_manager_queue_op(self, task, device, connect, batch, i);
         }
-        return FALSE;
     }
+    g_object_unref(task);
+}
+
+static gboolean spice_usb_device_manager_batch_finish(SpiceUsbDeviceManager *self,
+                                                      GAsyncResult *res,
+                                                      gpointer source_tag,
+                                                      GPtrArray **errors,
+                                                      GError **err)
+{
+    GTask *task = G_TASK(res);
+    SpiceUsbDeviceBatch *batch;
+
+    g_return_val_if_fail(g_task_is_valid(task, self), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(task) == source_tag, FALSE);
+
+    batch = g_task_get_task_data(task);
+    if (errors != NULL) {
+        *errors = g_ptr_array_ref(batch->errors);
+    }
+    return g_task_propagate_boolean(task, err);
+}
+
+/**
+ * spice_usb_device_manager_connect_devices_async:
+ * @self: a #SpiceUsbDeviceManager
+ * @devices: (element-type SpiceUsbDevice): the devices to connect
+ * @flags: #SpiceUsbDeviceBatchFlags
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore
+ * @callback: a callback to call when the whole batch is done
+ * @user_data: the data to pass to callback function
+ *
+ * Connects all @devices concurrently. Channels for the batch are reserved
+ * at once; with %SPICE_USB_DEVICE_BATCH_ALL_OR_NOTHING the batch fails
+ * without touching any device if it can't be reserved entirely, and
+ * devices that did connect are disconnected again if another one fails.
+ * #SpiceUsbDeviceManager:free-channels is notified once for the batch, if
+ * it changed: not after a rollback.
+ */
+void spice_usb_device_manager_connect_devices_async(SpiceUsbDeviceManager *self,
+                                                    GPtrArray *devices,
+                                                    SpiceUsbDeviceBatchFlags flags,
+                                                    GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(devices != NULL);
+
+    spice_usb_device_manager_start_batch(self, devices, TRUE, flags, cancellable,
+                                         callback, user_data,
+                                         spice_usb_device_manager_connect_devices_async);
+}
+
+/**
+ * spice_usb_device_manager_connect_devices_finish:
+ * @self: a #SpiceUsbDeviceManager
+ * @res: a #GAsyncResult
+ * @errors: (out) (optional) (element-type GError) (transfer full): a
+ *     %GPtrArray with one entry per requested device, %NULL for the
+ *     devices which were connected and the #GError of the others
+ * @err: (allow-none): a return location for a #GError, or %NULL.
+ *
+ * Returns: %TRUE if every device of the batch was connected, %FALSE with
+ * @err summing up the failures otherwise
+ */
+gboolean spice_usb_device_manager_connect_devices_finish(SpiceUsbDeviceManager *self,
+                                                         GAsyncResult *res,
+                                                         GPtrArray **errors,
+                                                         GError **err)
+{
+    return spice_usb_device_manager_batch_finish(self, res,
+                                                 spice_usb_device_manager_connect_devices_async,
+                                                 errors, err);
+}
+
+/**
+ * spice_usb_device_manager_disconnect_devices_async:
+ * @self: a #SpiceUsbDeviceManager
+ * @devices: (element-type SpiceUsbDevice): the devices to disconnect
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore
+ * @callback: a callback to call when the whole batch is done
+ * @user_data: the data to pass to callback function
+ *
+ * Disconnects all @devices concurrently, see
+ * spice_usb_device_manager_connect_devices_async().
+ */
+void spice_usb_device_manager_disconnect_devices_async(SpiceUsbDeviceManager *self,
+                                                       GPtrArray *devices,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(devices != NULL);
+
+    spice_usb_device_manager_start_batch(self, devices, FALSE,
+                                         SPICE_USB_DEVICE_BATCH_NONE, cancellable,
+                                         callback, user_data,
+                                         spice_usb_device_manager_disconnect_devices_async);
+}
+
+gboolean spice_usb_device_manager_disconnect_devices_finish(SpiceUsbDeviceManager *self,
+                                                            GAsyncResult *res,
+                                                            GPtrArray **errors,
+                                                            GError **err)
+{
+    return spice_usb_device_manager_batch_finish(self, res,
+                                                 spice_usb_device_manager_disconnect_devices_async,
+                                                 errors, err);
+}
+
+void spice_usb_device_manager_connect_device_async(
+                                             SpiceUsbDeviceManager *self,
+                                             SpiceUsbDevice *dev_handle,
+                                             GCancellable *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(dev_handle != NULL);
+
+    spice_usb_device_manager_start_op(self, dev_handle, TRUE, cancellable,
+                                      callback, user_data,
+                                      spice_usb_device_manager_connect_device_async);
+}
+
+void spice_usb_device_manager_disconnect_device_async(
+                                             SpiceUsbDeviceManager *self,
+                                             SpiceUsbDevice *dev_handle,
+                                             GCancellable *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(dev_handle != NULL);
+
+    spice_usb_device_manager_start_op(self, dev_handle, FALSE, cancellable,
+                                      callback, user_data,
+                                      spice_usb_device_manager_disconnect_device_async);
+}
+
+gboolean spice_usb_device_manager_connect_device_finish(
+    SpiceUsbDeviceManager *self, GAsyncResult *res, GError **err)
+{
+    GTask *task = G_TASK(res);
+
+    g_return_val_if_fail(g_task_is_valid(task, self), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(task) ==
+                         spice_usb_device_manager_connect_device_async, FALSE);
+
+    return g_task_propagate_boolean(task, err);
+}
+
+gboolean spice_usb_device_manager_disconnect_device_finish(
+    SpiceUsbDeviceManager *self, GAsyncResult *res, GError **err)
+{
+    GTask *task = G_TASK(res);
+
+    g_return_val_if_fail(g_task_is_valid(task, self), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(task) ==
+                         spice_usb_device_manager_disconnect_device_async, FALSE);
+
+    return g_task_propagate_boolean(task, err);
 }
 
 gboolean
@@ -622,16 +2881,246 @@ GArray *spice_usb_device_manager_get_device_luns(SpiceUsbDeviceManager *self,
                                                  SpiceUsbDevice *dev_handle)
 {
     SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
-    GArray *lun_array = g_array_new(FALSE, FALSE, sizeof(guint));
-    guint i;
+    GArray *lun_array = g_array_sized_new(FALSE, FALSE, sizeof(guint), device->n_luns);
+    SpiceUsbDeviceLunIter iter;
+    guint lun;
 
-    for (i = 0; i < device->luns_array->len; i++) {
-        g_array_append_val(lun_array, i);
+    spice_usb_device_lun_iter_init(&iter, dev_handle);
+    while (spice_usb_device_lun_iter_next(&iter, &lun, NULL)) {
+        g_array_append_val(lun_array, lun);
     }
 
     return lun_array;
 }
 
+/**
+ * spice_usb_device_lun_iter_init:
+ * @iter: an uninitialized #SpiceUsbDeviceLunIter
+ * @device: a CD #SpiceUsbDevice
+ *
+ * Initializes @iter to enumerate the LUNs of @device in index order,
+ * without allocating.
+ */
+void spice_usb_device_lun_iter_init(SpiceUsbDeviceLunIter *iter,
+                                    SpiceUsbDevice *device)
+{
+    g_return_if_fail(iter != NULL);
+    g_return_if_fail(device != NULL);
+
+    iter->device = device;
+    iter->next = 0;
+}
+
+/**
+ * spice_usb_device_lun_iter_next:
+ * @iter: a #SpiceUsbDeviceLunIter
+ * @lun: (out) (allow-none): the LUN index
+ * @lun_info: (out) (allow-none) (transfer none): the LUN state
+ *
+ * Advances @iter to the next LUN. @lun_info is borrowed from the device
+ * and is valid until the LUN is changed or removed; a LUN removed while
+ * iterating is skipped.
+ *
+ * Returns: %FALSE when there are no more LUNs
+ */
+gboolean spice_usb_device_lun_iter_next(SpiceUsbDeviceLunIter *iter,
+                                        guint *lun,
+                                        const SpiceUsbDeviceLunInfo **lun_info)
+{
+    const SpiceUsbDeviceInfo *device = iter->device;
+    guint32 mask;
+    gint next;
+
+    if (iter->next >= SPICE_USB_DEVICE_MAX_LUNS) {
+        return FALSE;
+    }
+    mask = device->luns_mask & ~((1u << iter->next) - 1);
+    if (mask == 0) {
+        iter->next = SPICE_USB_DEVICE_MAX_LUNS;
+        return FALSE;
+    }
+    next = g_bit_nth_lsf(mask, -1);
+    iter->next = next + 1;
+
+    if (lun != NULL) {
+        *lun = next;
+    }
+    if (lun_info != NULL) {
+        *lun_info = &device->luns[next];
+    }
+    return TRUE;
+}
+
+/**
+ * spice_usb_device_manager_device_lun_get_image:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ * @lun: the LUN index
+ *
+ * Returns: (transfer none): the mapped image backing a loaded LUN, or %NULL
+ * if the LUN is not loaded. Take a reference to keep reading from it after
+ * returning to the main loop, an eject closes the image.
+ */
+SpiceCdImage *
+spice_usb_device_manager_device_lun_get_image(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              guint lun)
+{
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
+    g_return_val_if_fail(device != NULL, NULL);
+
+    if (spice_usb_device_get_lun(info, lun) == NULL) {
+        return NULL;
+    }
+    return info->lun_images[lun];
+}
+
+/**
+ * spice_usb_device_manager_device_lun_get_readahead_stats:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ * @lun: the LUN index
+ * @stats: (out): the read-ahead statistics since the medium was loaded
+ *
+ * The wasted bytes are those of the image, whichever of its LUNs they
+ * were prefetched for.
+ *
+ * Returns: %FALSE if the LUN is not loaded
+ */
+gboolean
+spice_usb_device_manager_device_lun_get_readahead_stats(SpiceUsbDeviceManager *self,
+                                                        SpiceUsbDevice *device,
+                                                        guint lun,
+                                                        SpiceCdReadaheadStats *stats)
+{
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
+    g_return_val_if_fail(device != NULL, FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    if (spice_usb_device_get_lun(info, lun) == NULL || info->lun_readahead[lun] == NULL) {
+        return FALSE;
+    }
+    spice_cd_readahead_get_stats(info->lun_readahead[lun], stats);
+    return TRUE;
+}
+
+static gboolean spice_usb_device_scsi_get_lun(gpointer user_data, guint lun,
+                                              SpiceCdScsiLunState *state)
+{
+    SpiceUsbDeviceInfo *device = user_data;
+    const SpiceUsbDeviceLunInfo *lun_info = spice_usb_device_get_lun(device, lun);
+
+    if (lun_info == NULL) {
+        return FALSE;
+    }
+    state->vendor = lun_info->vendor;
+    state->product = lun_info->product;
+    state->revision = lun_info->revision;
+    state->loaded = lun_info->loaded;
+    state->locked = lun_info->locked;
+    state->image = device->lun_images[lun];
+    state->readahead = device->lun_readahead[lun];
+    state->aio = _usb_dev_manager->priv->cd_aio;
+    return TRUE;
+}
+
+static void spice_usb_device_scsi_set_locked(gpointer user_data, guint lun,
+                                             gboolean locked)
+{
+    /* FALSE when the guest repeats itself, which is fine */
+    spice_usb_device_manager_device_lun_lock(_usb_dev_manager, user_data, lun, locked);
+}
+
+static const SpiceCdScsiTargetOps spice_usb_device_scsi_ops = {
+    .get_lun = spice_usb_device_scsi_get_lun,
+    .set_locked = spice_usb_device_scsi_set_locked,
+};
+
+/**
+ * spice_usb_device_manager_get_cd_aio_stats:
+ * @self: the #SpiceUsbDeviceManager
+ * @stats: (out): where to store the statistics
+ *
+ * Get the statistics of the asynchronous reads shared by the CD LUNs.
+ *
+ * Returns: %FALSE if no CD device was emulated yet
+ */
+gboolean
+spice_usb_device_manager_get_cd_aio_stats(SpiceUsbDeviceManager *self,
+                                          SpiceCdAioStats *stats)
+{
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self), FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    if (self->priv->cd_aio == NULL) {
+        return FALSE;
+    }
+    spice_cd_aio_get_stats(self->priv->cd_aio, stats);
+    return TRUE;
+}
+
+/**
+ * spice_usb_device_manager_device_get_msd:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ *
+ * Get the bulk-only mass storage emulation serving the LUNs of @device to
+ * the guest. It runs in the main loop, like the LUN functions it calls.
+ * The reads of all the emulated devices share one #SpiceCdAio, reads that
+ * were not prefetched wait on it when the redirection path has set a
+ * ready function with spice_cd_usb_bulk_msd_set_ready_func().
+ *
+ * Returns: (transfer none): the emulation, or %NULL if @device is not an
+ * emulated CD device
+ */
+SpiceCdUsbBulkMsd *
+spice_usb_device_manager_device_get_msd(SpiceUsbDeviceManager *self,
+                                        SpiceUsbDevice *device)
+{
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
+    g_return_val_if_fail(device != NULL, NULL);
+
+    if (!info->cd) {
+        return NULL;
+    }
+    if (info->msd == NULL) {
+        SpiceCdScsiTarget *target;
+
+        if (self->priv->cd_aio == NULL) {
+            self->priv->cd_aio = spice_cd_aio_new(0);
+        }
+        target = spice_cd_scsi_target_new(&spice_usb_device_scsi_ops, info);
+        info->msd = spice_cd_usb_bulk_msd_new(target, self->priv->max_luns - 1);
+    }
+    return info->msd;
+}
+
+/**
+ * spice_usb_device_manager_device_lun_peek_info:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ * @lun: the LUN index
+ *
+ * Like spice_usb_device_manager_device_lun_get_info() without copying.
+ * Only from the main loop, which changes the LUNs in place.
+ *
+ * Returns: (transfer none): the LUN state, valid until the LUN is changed
+ * or removed, or %NULL if @device has no LUN @lun
+ */
+const SpiceUsbDeviceLunInfo *
+spice_usb_device_manager_device_lun_peek_info(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              guint lun)
+{
+    g_return_val_if_fail(device != NULL, NULL);
+
+    return spice_usb_device_get_lun((const SpiceUsbDeviceInfo *)device, lun);
+}
+
+/* deep copy for the callers of device_lun_get_info(), who own the strings */
 static void spice_usb_device_manager_copy_lun_info(SpiceUsbDeviceLunInfo *new_lun_info,
                                                    SpiceUsbDeviceLunInfo *lun_info)
 {
@@ -644,75 +3133,121 @@ static void spice_usb_device_manager_copy_lun_info(SpiceUsbDeviceLunInfo *new_lu
     new_lun_info->locked = lun_info->locked;
 }
 
+/*
+ * the device must have a free LUN slot, the new LUN takes the lowest one;
+ * a loaded LUN is backed by @image when it was opened already
+ */
 static void spice_usb_device_manager_add_lun_to_dev(SpiceUsbDevice *dev_handle,
                                                     SpiceUsbDeviceLunInfo *lun_info,
-                                                    gint dev_index, gint lun_index)
+                                                    SpiceCdImage *image)
 {
     SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
-    SpiceUsbDeviceLunInfo *new_lun_info = g_malloc(sizeof(*lun_info));
-    spice_usb_device_manager_copy_lun_info(new_lun_info, lun_info);
-    g_ptr_array_add(device->luns_array, new_lun_info);
-    g_print("add_cd_lun file:%s vendor:%s prod:%s rev:%s  "
-            "started:%d loaded:%d locked:%d - usb dev:%d [%d:%d] as lun:%d\n",
-            lun_info->file_path,
-            lun_info->vendor,
-            lun_info->product,
-            lun_info->revision,
-            lun_info->started,
-            lun_info->loaded,
-            lun_info->locked,
-            dev_index,
-            (gint)spice_usb_device_get_busnum(dev_handle),
-            (gint)spice_usb_device_get_devaddr(dev_handle),
+    gint lun_index = g_bit_nth_lsf(~(gulong)device->luns_mask, -1);
+
+    g_return_if_fail(lun_index < SPICE_USB_DEVICE_MAX_LUNS);
+
+    spice_usb_device_lun_set(&device->luns[lun_index], lun_info);
+    device->luns_mask |= 1u << lun_index;
+    device->n_luns++;
+
+    if (lun_info->loaded && image != NULL) {
+        spice_usb_device_lun_set_image(device, lun_index, spice_cd_image_ref(image));
+    } else if (lun_info->loaded) {
+        GError *err = NULL;
+
+        if (!spice_usb_device_lun_open_image(device, lun_index, &err)) {
+            g_warning("CD LUN %d of [%d:%d] is not loaded: %s", lun_index,
+                      device->busnum, device->devaddr, err->message);
+            g_error_free(err);
+        }
+    }
+    /* per LUN on the startup path, silent unless G_MESSAGES_DEBUG asks */
+    g_debug("add_cd_lun file:%s vendor:%s prod:%s rev:%s "
+            "started:%d loaded:%d locked:%d - usb dev:%u [%d:%d] as lun:%d",
+            lun_info->file_path, lun_info->vendor, lun_info->product,
+            lun_info->revision, lun_info->started, lun_info->loaded,
+            lun_info->locked, device->index, device->busnum, device->devaddr,
             lun_index);
 }
 
 /* CD LUN will be attached to a (possibly new) USB device automatically */
 gboolean spice_usb_device_manager_add_cd_lun(SpiceUsbDeviceManager *self,
                                              SpiceUsbDeviceLunInfo *lun_info)
+{
+    return spice_usb_device_manager_add_cd_lun_image(self, lun_info, NULL);
+}
+
+/* bus and device numbers are both 1..255 */
+#define CD_DEV_ADDRESSES (G_MAXUINT8 * G_MAXUINT8)
+
+/* add_cd_lun() with the image of a loaded LUN opened already, if not NULL */
+static gboolean spice_usb_device_manager_add_cd_lun_image(SpiceUsbDeviceManager *self,
+                                                          SpiceUsbDeviceLunInfo *lun_info,
+                                                          SpiceCdImage *image)
 {
     SpiceUsbDeviceManagerPrivate *priv = self->priv;
     guint num_usb_devs = (_dev_ptr_array != NULL) ? _dev_ptr_array->len : 0;
     SpiceUsbDeviceInfo *device;
-    guint dev_ind, num_luns;
-
-    for (dev_ind = 0; dev_ind < num_usb_devs; dev_ind++) {
-        device = g_ptr_array_index(_dev_ptr_array, dev_ind);
-        if (!spice_usb_device_manager_is_device_cd(self, (SpiceUsbDevice *)device)) {
-            continue;
+    guint8 busnum, devaddr;
+    guint tries;
+    GList *link;
+
+    /* pack fills partially used devices first, spread keeps one LUN per device */
+    link = NULL;
+    if (priv->cd_lun_placement == SPICE_USB_CD_LUN_PLACEMENT_PACK) {
+        link = g_queue_peek_head_link(&priv->cd_partial);
+    }
+    if (link == NULL) {
+        link = g_queue_peek_head_link(&priv->cd_empty);
+    }
+    if (link != NULL) {
+        device = link->data;
+        spice_usb_device_manager_add_lun_to_dev((SpiceUsbDevice *)device, lun_info, image);
+        spice_usb_device_manager_update_free_slots(self, device, TRUE);
+        if (spice_usb_device_manager_announces()) {
+            spice_usb_device_manager_device_changed(self, device);
         }
-        num_luns = device->luns_array->len;
-        if (num_luns < priv->max_luns) {
-            spice_usb_device_manager_add_lun_to_dev((SpiceUsbDevice *)device,
-                                                    lun_info, dev_ind, num_luns);
-            if (_is_initialized) {
-                g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
-            }
-            return TRUE;
+        return TRUE;
+    }
+
+    /*
+     * addresses of removed devices may be reused, skip the ones in use;
+     * from where the number of devices points, each pair of a bus and an
+     * address in 1..255 is tried once, the buses from the highest down,
+     * away from the ones of the host controllers
+     */
+    for (tries = 0; tries < CD_DEV_ADDRESSES; tries++) {
+        guint n = (num_usb_devs + tries) % CD_DEV_ADDRESSES;
+
+        busnum = G_MAXUINT8 - n / G_MAXUINT8;
+        devaddr = 1 + n % G_MAXUINT8;
+        if (spice_usb_device_manager_find_device_by_address(self, busnum, devaddr) == NULL) {
+            break;
         }
     }
-    /* allocate new usb device */
-    device = g_malloc(sizeof(*device));
-    /* generate some usb dev info */
-    memcpy(device, &_dev_array[0], sizeof(*device));
-    device->ref = 0;
-    device->devaddr = num_usb_devs + 1;
-    device->busnum = 10 * device->devaddr;
+    if (tries == CD_DEV_ADDRESSES) {
+        g_warning("no USB address left for a new CD device");
+        return FALSE;
+    }
+
+    /* allocate new usb device, generate some usb dev info */
+    device = spice_usb_device_new(&_cd_dev_template);
+    device->busnum = busnum;
+    device->devaddr = devaddr;
     device->connected = FALSE;
 
-    device->luns_array = g_ptr_array_new();
-    g_ptr_array_add(_dev_ptr_array, (gpointer)device);
-    spice_usb_device_ref((SpiceUsbDevice *)device);
+    spice_usb_device_manager_register_device(self, device);
 
     /* add the new LUN to it */
-    spice_usb_device_manager_add_lun_to_dev((SpiceUsbDevice *)device, lun_info, num_usb_devs, 0);
-    if (_is_initialized) {
+    spice_usb_device_manager_add_lun_to_dev((SpiceUsbDevice *)device, lun_info, image);
+    spice_usb_device_manager_update_free_slots(self, device, TRUE);
+    if (spice_usb_device_manager_announces()) {
         g_signal_emit(self, signals[DEVICE_ADDED], 0, device);
     }
     return TRUE;
 }
 
-/* Get CD LUN info, intended primarily for enumerating LUNs */
+/* Get CD LUN info, intended primarily for enumerating LUNs, from the main loop */
 gboolean
 spice_usb_device_manager_device_lun_get_info(SpiceUsbDeviceManager *self,
                                              SpiceUsbDevice *dev_handle,
@@ -722,10 +3257,10 @@ spice_usb_device_manager_device_lun_get_info(SpiceUsbDeviceManager *self,
     const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
     SpiceUsbDeviceLunInfo *req_lun_info;
 
-    if (lun >= device->luns_array->len) {
+    req_lun_info = spice_usb_device_get_lun(device, lun);
+    if (req_lun_info == NULL) {
         return FALSE;
     }
-    req_lun_info = g_ptr_array_index(device->luns_array, lun);
     spice_usb_device_manager_copy_lun_info(lun_info, req_lun_info);
     return TRUE;
 }
@@ -740,10 +3275,10 @@ spice_usb_device_manager_device_lun_lock(SpiceUsbDeviceManager *self,
     const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
     SpiceUsbDeviceLunInfo *req_lun_info;
 
-    if (lun >= device->luns_array->len) {
+    req_lun_info = spice_usb_device_get_lun(device, lun);
+    if (req_lun_info == NULL) {
         return FALSE;
     }
-    req_lun_info = g_ptr_array_index(device->luns_array, lun);
 
     if (!req_lun_info->locked && lock) {
         req_lun_info->locked = TRUE;
@@ -752,11 +3287,14 @@ spice_usb_device_manager_device_lun_lock(SpiceUsbDeviceManager *self,
     } else {
         return FALSE;
     }
-    g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
+    spice_usb_device_manager_device_changed(self, (SpiceUsbDeviceInfo *)device);
     return TRUE;
 }
 
-/* load or eject device */
+/*
+ * load or eject device, a load opens the image on the calling thread,
+ * device_lun_load_async() does it off the main loop
+ */
 gboolean
 spice_usb_device_manager_device_lun_load(SpiceUsbDeviceManager *self,
                                          SpiceUsbDevice *dev_handle,
@@ -766,20 +3304,30 @@ spice_usb_device_manager_device_lun_load(SpiceUsbDeviceManager *self,
     const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
     SpiceUsbDeviceLunInfo *req_lun_info;
 
-    if (lun >= device->luns_array->len) {
+    req_lun_info = spice_usb_device_get_lun(device, lun);
+    if (req_lun_info == NULL) {
         return FALSE;
     }
-    req_lun_info = g_ptr_array_index(device->luns_array, lun);
  
     if (!req_lun_info->loaded && load) {
+        GError *err = NULL;
+
+        /* supersedes a load or media change on its way */
+        ((SpiceUsbDeviceInfo *)device)->lun_serial[lun]++;
         req_lun_info->loaded = TRUE;
-        g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
+        if (!spice_usb_device_lun_open_image((SpiceUsbDeviceInfo *)device, lun, &err)) {
+            g_signal_emit(self, signals[DEVICE_ERROR], 0, device, err);
+            g_error_free(err);
+            return FALSE;
+        }
     } else if (req_lun_info->loaded && !load) {
+        ((SpiceUsbDeviceInfo *)device)->lun_serial[lun]++;
         req_lun_info->loaded = FALSE;
+        spice_usb_device_lun_close_image((SpiceUsbDeviceInfo *)device, lun);
     } else {
         return FALSE;
     }
-    g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
+    spice_usb_device_manager_device_changed(self, (SpiceUsbDeviceInfo *)device);
     return TRUE;
 }
 
@@ -794,48 +3342,317 @@ spice_usb_device_manager_device_lun_change_media(SpiceUsbDeviceManager *self,
     const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
     SpiceUsbDeviceLunInfo *req_lun_info;
 
-    if (lun >= device->luns_array->len) {
+    req_lun_info = spice_usb_device_get_lun(device, lun);
+    if (req_lun_info == NULL) {
         return FALSE;
     }
-    req_lun_info = g_ptr_array_index(device->luns_array, lun);
 
     if (!req_lun_info->loaded) {
         if (req_lun_info->file_path != NULL) {
             g_free((gpointer)req_lun_info->file_path);
         }
         req_lun_info->file_path = g_strdup(lun_info->file_path);
-        g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
+        ((SpiceUsbDeviceInfo *)device)->lun_serial[lun]++;
+        /* the new image is mapped by the next load */
+        spice_usb_device_lun_close_image((SpiceUsbDeviceInfo *)device, lun);
+        spice_usb_device_manager_device_changed(self, (SpiceUsbDeviceInfo *)device);
         return TRUE;
     } else {
         return FALSE;
     }
 }
 
+/* a media change waiting for its image to be opened */
+typedef struct _SpiceUsbDeviceMediaChange {
+    SpiceUsbDeviceInfo *device;
+    guint lun;
+    guint serial;       /* of the LUN when the change was requested */
+    gchar *file_path;
+} SpiceUsbDeviceMediaChange;
+
+static void spice_usb_device_media_change_free(SpiceUsbDeviceMediaChange *change)
+{
+    spice_usb_device_unref((SpiceUsbDevice *)change->device);
+    g_free(change->file_path);
+    g_free(change);
+}
+
+/* runs on a GTask thread: open the image and bring its first blocks in */
+static void spice_usb_device_manager_open_media(GTask *task, gpointer source_object,
+                                                gpointer task_data,
+                                                GCancellable *cancellable)
+{
+    SpiceUsbDeviceMediaChange *change = task_data;
+    SpiceCdImage *image;
+    GError *err = NULL;
+
+    if (g_task_return_error_if_cancelled(task)) {
+        return;
+    }
+    image = spice_cd_image_open(change->file_path, &err);
+    if (image == NULL) {
+        g_task_return_error(task, err);
+        return;
+    }
+    spice_cd_image_warm(image);
+    g_task_return_pointer(task, image, (GDestroyNotify)spice_cd_image_unref);
+}
+
+/* back in the main loop: swap the warm image in, unless the LUN moved on */
+static void spice_usb_device_manager_media_opened(GObject *source_object,
+                                                  GAsyncResult *res,
+                                                  gpointer user_data)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    GTask *task = user_data;
+    SpiceUsbDeviceMediaChange *change = g_task_get_task_data(G_TASK(res));
+    SpiceUsbDeviceInfo *device = change->device;
+    SpiceUsbDeviceLunInfo *lun_info;
+    SpiceCdImage *image, *old_image;
+    SpiceCdReadahead *old_readahead;
+    GError *err = NULL;
+
+    image = g_task_propagate_pointer(G_TASK(res), &err);
+    if (image == NULL) {
+        g_task_return_error(task, err);
+        g_object_unref(task);
+        return;
+    }
+
+    lun_info = spice_usb_device_get_lun(device, change->lun);
+    if (lun_info == NULL || device->lun_serial[change->lun] != change->serial) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                "LUN %u was changed or removed meanwhile", change->lun);
+    } else if (lun_info->locked) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_BUSY,
+                                "the guest locked the medium of LUN %u", change->lun);
+    } else if (!g_task_return_error_if_cancelled(task)) {
+        old_image = device->lun_images[change->lun];
+        old_readahead = device->lun_readahead[change->lun];
+
+        g_free((gpointer)lun_info->file_path);
+        lun_info->file_path = g_strdup(change->file_path);
+        lun_info->loaded = TRUE;
+        device->lun_serial[change->lun]++;
+        device->lun_images[change->lun] = image;
+        device->lun_readahead[change->lun] =
+            spice_cd_readahead_new(image, SPICE_CD_READAHEAD_DEFAULT_CACHE_SIZE);
+        image = NULL;
+        if (device->msd != NULL) {
+            spice_cd_scsi_target_media_changed(spice_cd_usb_bulk_msd_get_target(device->msd),
+                                               change->lun);
+        }
+        spice_usb_device_manager_device_changed(self, device);
+
+        /* reads in flight keep their own reference to the old image */
+        if (old_readahead != NULL) {
+            spice_cd_readahead_free(old_readahead);
+        }
+        if (old_image != NULL) {
+            spice_cd_image_unref(old_image);
+        }
+        g_task_return_boolean(task, TRUE);
+    }
+    if (image != NULL) {
+        spice_cd_image_unref(image);
+    }
+    g_object_unref(task);
+}
+
+/* open @file_path on a thread and swap it in for LUN @lun, @task takes the outcome */
+static void spice_usb_device_manager_lun_open_async(SpiceUsbDeviceManager *self,
+                                                    SpiceUsbDeviceInfo *device, guint lun,
+                                                    const gchar *file_path, GTask *task)
+{
+    SpiceUsbDeviceMediaChange *change;
+    GTask *open_task;
+
+    change = g_new0(SpiceUsbDeviceMediaChange, 1);
+    change->device = (SpiceUsbDeviceInfo *)spice_usb_device_ref((SpiceUsbDevice *)device);
+    change->lun = lun;
+    change->serial = ++device->lun_serial[lun];
+    change->file_path = g_strdup(file_path);
+
+    open_task = g_task_new(self, g_task_get_cancellable(task),
+                           spice_usb_device_manager_media_opened, task);
+    g_task_set_task_data(open_task, change, (GDestroyNotify)spice_usb_device_media_change_free);
+    g_task_run_in_thread(open_task, spice_usb_device_manager_open_media);
+    g_object_unref(open_task);
+}
+
+/**
+ * spice_usb_device_manager_device_lun_change_media_async:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ * @lun: the LUN index
+ * @lun_info: the new medium, only its file_path is used
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called once the medium is in, or could not be
+ * @user_data: data for @callback
+ *
+ * Replace the medium of a LUN, loaded or not, without blocking the main
+ * loop or the guest: the new image is opened, checked and has its volume
+ * descriptors and boot catalog read on a thread while the guest keeps
+ * reading the old one. The swap itself happens in the main loop, with a
+ * single #SpiceUsbDeviceManager::device-changed, and the guest sees a
+ * unit attention for the new medium. The LUN is loaded afterwards. A
+ * change requested later for the same LUN supersedes this one.
+ */
+void
+spice_usb_device_manager_device_lun_change_media_async(SpiceUsbDeviceManager *self,
+                                                       SpiceUsbDevice *dev_handle,
+                                                       guint lun,
+                                                       const SpiceUsbDeviceLunInfo *lun_info,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data)
+{
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    GTask *task;
+
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(device != NULL);
+    g_return_if_fail(lun_info != NULL);
+
+    task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, spice_usb_device_manager_device_lun_change_media_async);
+    /* report the swap once it happened, even when cancelled late */
+    g_task_set_check_cancellable(task, FALSE);
+
+    if (spice_usb_device_get_lun(device, lun) == NULL) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                "no LUN %u on this device", lun);
+        g_object_unref(task);
+        return;
+    }
+    if (spice_usb_device_get_lun(device, lun)->locked) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_BUSY,
+                                "the guest locked the medium of LUN %u", lun);
+        g_object_unref(task);
+        return;
+    }
+    if (lun_info->file_path == NULL) {
+        g_task_return_new_error(task, G_FILE_ERROR, G_FILE_ERROR_NOENT, "no CD image");
+        g_object_unref(task);
+        return;
+    }
+    spice_usb_device_manager_lun_open_async(self, device, lun, lun_info->file_path, task);
+}
+
+gboolean
+spice_usb_device_manager_device_lun_change_media_finish(SpiceUsbDeviceManager *self,
+                                                        GAsyncResult *res,
+                                                        GError **err)
+{
+    GTask *task = G_TASK(res);
+
+    g_return_val_if_fail(g_task_is_valid(task, self), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(task) ==
+                         spice_usb_device_manager_device_lun_change_media_async, FALSE);
+
+    return g_task_propagate_boolean(task, err);
+}
+
+/**
+ * spice_usb_device_manager_device_lun_load_async:
+ * @self: the #SpiceUsbDeviceManager
+ * @device: a CD #SpiceUsbDevice
+ * @lun: the LUN index, not loaded
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called once the medium is in, or could not be
+ * @user_data: data for @callback
+ *
+ * Load the medium of a LUN the way
+ * spice_usb_device_manager_device_lun_change_media_async() changes it:
+ * its image is opened and warmed on a thread, and the LUN is loaded from
+ * the main loop with a single #SpiceUsbDeviceManager::device-changed. An
+ * eject or media change requested meanwhile supersedes the load.
+ */
+void
+spice_usb_device_manager_device_lun_load_async(SpiceUsbDeviceManager *self,
+                                               SpiceUsbDevice *dev_handle,
+                                               guint lun,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data)
+{
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
+    SpiceUsbDeviceLunInfo *lun_info;
+    GTask *task;
+
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(device != NULL);
+
+    task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, spice_usb_device_manager_device_lun_load_async);
+    g_task_set_check_cancellable(task, FALSE);
+
+    lun_info = spice_usb_device_get_lun(device, lun);
+    if (lun_info == NULL) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                "no LUN %u on this device", lun);
+        g_object_unref(task);
+        return;
+    }
+    if (lun_info->loaded) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                                "LUN %u is loaded already", lun);
+        g_object_unref(task);
+        return;
+    }
+    if (lun_info->file_path == NULL) {
+        g_task_return_new_error(task, G_FILE_ERROR, G_FILE_ERROR_NOENT, "no CD image");
+        g_object_unref(task);
+        return;
+    }
+    spice_usb_device_manager_lun_open_async(self, device, lun, lun_info->file_path, task);
+}
+
+gboolean
+spice_usb_device_manager_device_lun_load_finish(SpiceUsbDeviceManager *self,
+                                                GAsyncResult *res,
+                                                GError **err)
+{
+    GTask *task = G_TASK(res);
+
+    g_return_val_if_fail(g_task_is_valid(task, self), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(task) ==
+                         spice_usb_device_manager_device_lun_load_async, FALSE);
+
+    return g_task_propagate_boolean(task, err);
+}
+
 /* remove lun from the usb device */
 gboolean
 spice_usb_device_manager_device_lun_remove(SpiceUsbDeviceManager *self,
                                            SpiceUsbDevice *dev_handle,
                                            guint lun)
 {
-    const SpiceUsbDeviceInfo *device = (const SpiceUsbDeviceInfo *)dev_handle;
+    SpiceUsbDeviceInfo *device = (SpiceUsbDeviceInfo *)dev_handle;
     SpiceUsbDeviceLunInfo *req_lun_info;
 
-    if (lun >= device->luns_array->len) {
+    req_lun_info = spice_usb_device_get_lun(device, lun);
+    if (req_lun_info == NULL) {
         return FALSE;
     }
 
-    req_lun_info = g_ptr_array_index(device->luns_array, lun);
-    g_ptr_array_remove_index(device->luns_array, lun);
-    g_free(req_lun_info);
+    /* the other LUNs keep their indices */
+    spice_usb_device_lun_clear(req_lun_info);
+    spice_usb_device_lun_close_image(device, lun);
+    device->lun_serial[lun]++;
+    device->luns_mask &= ~(1u << lun);
+    device->n_luns--;
 
-    if (device->luns_array->len == 0) {
-        g_ptr_array_remove(_dev_ptr_array, (gpointer)device);
-        if (_is_initialized) {
+    if (device->n_luns == 0) {
+        spice_usb_device_manager_unregister_device(self, (SpiceUsbDeviceInfo *)device);
+        if (spice_usb_device_manager_announces()) {
             g_signal_emit(self, signals[DEVICE_REMOVED], 0, device);
         }
+        spice_usb_device_unref(dev_handle);
     } else {
-        if (_is_initialized) {
-            g_signal_emit(self, signals[DEVICE_CHANGED], 0, device);
+        spice_usb_device_manager_update_free_slots(self, (SpiceUsbDeviceInfo *)device, TRUE);
+        if (spice_usb_device_manager_announces()) {
+            spice_usb_device_manager_device_changed(self, (SpiceUsbDeviceInfo *)device);
         }
     }
     return TRUE;
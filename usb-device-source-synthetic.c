@@ -0,0 +1,432 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <gio/gio.h>
+#include "usb-device-source.h"
+#include "usb-hotplug.h"
+
+#define SYNTHETIC_BATCH_SIZE        64
+#define SYNTHETIC_DEFAULT_DEVICES   1000
+/* device addresses of a bus, the ones of 1 to 255 buses are used */
+#define SYNTHETIC_BUS_DEVICES       120
+#define SYNTHETIC_MAX_DEVICES       (255 * SYNTHETIC_BUS_DEVICES)
+/* slots tried for one to plug in or out */
+#define SYNTHETIC_PICK_TRIES        16
+
+typedef struct _SpiceUsbDeviceSourceSynthetic {
+    SpiceUsbDeviceSource parent;
+    SpiceUsbSyntheticConfig config;
+    guint n_slots;          /* the devices present and the free addresses to plug into */
+
+    GMutex lock;
+    guint8 *present;        /* per slot, changed by the hotplug thread */
+    GCond wakeup;
+    gboolean stopping;
+
+    GThread *hotplug_thread;
+    gint uevent_fd;         /* our end of the socket of open_uevents() */
+    guint64 sent;
+    guint64 dropped;        /* uevents the reader was too slow for */
+} SpiceUsbDeviceSourceSynthetic;
+
+static gboolean parse_uint(const gchar *key, const gchar *value, guint max, guint *result,
+                           GError **err)
+{
+    gchar *end;
+    guint64 v = g_ascii_strtoull(value, &end, 0);
+
+    if (end == value || *end != '\0' || v > max) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Invalid %s \"%s\", expected 0 to %u", key, value, max);
+        return FALSE;
+    }
+    *result = v;
+    return TRUE;
+}
+
+static gboolean parse_rate(const gchar *key, const gchar *value, gdouble *result,
+                           GError **err)
+{
+    gchar *end;
+    gdouble v = g_ascii_strtod(value, &end);
+
+    if (end == value || *end != '\0' || !(v >= 0 && v <= 1e6)) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Invalid %s \"%s\", expected events per second", key, value);
+        return FALSE;
+    }
+    *result = v;
+    return TRUE;
+}
+
+/**
+ * spice_usb_synthetic_config_parse:
+ * @options: "key=value" pairs separated by ','
+ * @config: (out): the configuration, to clear with spice_usb_synthetic_config_clear()
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Keys not given keep their defaults: 1000 devices, no LUN and no event.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean spice_usb_synthetic_config_parse(const gchar *options,
+                                          SpiceUsbSyntheticConfig *config,
+                                          GError **err)
+{
+    gchar **pairs;
+    gboolean ok = TRUE;
+    guint i, seed;
+
+    g_return_val_if_fail(options != NULL, FALSE);
+    g_return_val_if_fail(config != NULL, FALSE);
+
+    memset(config, 0, sizeof(*config));
+    config->n_devices = SYNTHETIC_DEFAULT_DEVICES;
+    config->hotplug_burst = 1;
+    config->seed = 1;
+
+    pairs = g_strsplit(options, ",", -1);
+    for (i = 0; ok && pairs[i] != NULL; i++) {
+        gchar *key = pairs[i], *value = strchr(key, '=');
+
+        if (*key == '\0') {
+            continue;
+        }
+        if (value == NULL) {
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Invalid synthetic option \"%s\", expected key=value", key);
+            ok = FALSE;
+            break;
+        }
+        *value++ = '\0';
+        if (strcmp(key, "devices") == 0) {
+            ok = parse_uint(key, value, SYNTHETIC_MAX_DEVICES, &config->n_devices, err);
+        } else if (strcmp(key, "luns") == 0) {
+            ok = parse_uint(key, value, G_MAXUINT16, &config->n_luns, err);
+        } else if (strcmp(key, "hotplug") == 0) {
+            ok = parse_rate(key, value, &config->hotplug_rate, err);
+        } else if (strcmp(key, "burst") == 0) {
+            ok = parse_uint(key, value, SYNTHETIC_MAX_DEVICES, &config->hotplug_burst, err);
+            config->hotplug_burst = MAX(config->hotplug_burst, 1);
+        } else if (strcmp(key, "connect") == 0) {
+            ok = parse_rate(key, value, &config->connect_rate, err);
+        } else if (strcmp(key, "media") == 0) {
+            ok = parse_rate(key, value, &config->media_rate, err);
+        } else if (strcmp(key, "seed") == 0) {
+            ok = parse_uint(key, value, G_MAXUINT32, &seed, err);
+            config->seed = seed;
+        } else if (strcmp(key, "image") == 0) {
+            g_free(config->image);
+            config->image = *value != '\0' ? g_strdup(value) : NULL;
+        } else {
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Unknown synthetic option \"%s\"", key);
+            ok = FALSE;
+        }
+    }
+    g_strfreev(pairs);
+    if (!ok) {
+        spice_usb_synthetic_config_clear(config);
+    }
+    return ok;
+}
+
+void spice_usb_synthetic_config_clear(SpiceUsbSyntheticConfig *config)
+{
+    g_clear_pointer(&config->image, g_free);
+}
+
+/* slot @i is the same device from one run to the next with the same seed */
+static void synthetic_desc(const SpiceUsbDeviceSourceSynthetic *synthetic, guint i,
+                           SpiceUsbDeviceDesc *desc)
+{
+    static const guint8 classes[] = { 0x00, 0x03, 0x08, 0x00, 0x0e, 0xe0, 0xef, 0xff };
+    static const guint32 speeds[] = { 1500, 12000, 480000, 5000000 };
+    guint32 h = (i + 1) * 2654435761u ^ synthetic->config.seed * 0x9e3779b9u;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->busnum = 1 + i / SYNTHETIC_BUS_DEVICES;
+    desc->devaddr = 2 + i % SYNTHETIC_BUS_DEVICES;
+    desc->vid = 0x1000 + (h & 0x0fff);
+    desc->pid = h >> 16;
+    desc->device_class = classes[(h >> 12) % G_N_ELEMENTS(classes)];
+    desc->bcd_device = 0x0100 + (i & 0xff);
+    desc->speed = speeds[(h >> 8) % G_N_ELEMENTS(speeds)];
+    /* like real devices, not all of them have a serial number */
+    if (h % 3 != 0) {
+        g_snprintf(desc->serial, sizeof(desc->serial), "SYN%08X%06u", h, i);
+    }
+}
+
+/* "bus-port", as the sysfs entries of devices on root ports */
+static gboolean synthetic_slot_from_name(const gchar *name, guint *slot)
+{
+    guint64 busnum, devaddr;
+    gchar *end;
+
+    busnum = g_ascii_strtoull(name, &end, 10);
+    if (end == name || *end != '-') {
+        return FALSE;
+    }
+    name = end + 1;
+    devaddr = g_ascii_strtoull(name, &end, 10);
+    if (end == name || *end != '\0' || busnum < 1 || devaddr < 2 ||
+        devaddr >= 2 + SYNTHETIC_BUS_DEVICES) {
+        return FALSE;
+    }
+    *slot = (busnum - 1) * SYNTHETIC_BUS_DEVICES + devaddr - 2;
+    return TRUE;
+}
+
+static gboolean synthetic_enumerate(SpiceUsbDeviceSource *source, SpiceUsbDeviceDescFunc func,
+                                    gpointer user_data, GError **err)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = (SpiceUsbDeviceSourceSynthetic *)source;
+    SpiceUsbDeviceDesc descs[SYNTHETIC_BATCH_SIZE];
+    guint i, n = 0;
+
+    for (i = 0; i < synthetic->n_slots; i++) {
+        gboolean present;
+
+        g_mutex_lock(&synthetic->lock);
+        present = synthetic->present[i];
+        g_mutex_unlock(&synthetic->lock);
+        if (!present) {
+            continue;
+        }
+        synthetic_desc(synthetic, i, &descs[n++]);
+        if (n == SYNTHETIC_BATCH_SIZE) {
+            func(descs, n, user_data);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        func(descs, n, user_data);
+    }
+    return TRUE;
+}
+
+static gboolean synthetic_read_device(SpiceUsbDeviceSource *source, const gchar *name,
+                                      SpiceUsbDeviceDesc *desc)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = (SpiceUsbDeviceSourceSynthetic *)source;
+    gboolean present;
+    guint slot;
+
+    if (!synthetic_slot_from_name(name, &slot) || slot >= synthetic->n_slots) {
+        return FALSE;
+    }
+    g_mutex_lock(&synthetic->lock);
+    present = synthetic->present[slot];
+    g_mutex_unlock(&synthetic->lock);
+    if (present) {
+        synthetic_desc(synthetic, slot, desc);
+    }
+    return present;
+}
+
+/*
+ * Plug a device in or out, as likely one as the other so the number of
+ * devices stays around the one at startup, and report it as the kernel
+ * does. A uevent the reader has no room for is dropped, and the device
+ * stays as it was.
+ */
+static void synthetic_toggle(SpiceUsbDeviceSourceSynthetic *synthetic, GRand *rand,
+                             guint seqnum)
+{
+    SpiceUsbHotplugEvent event;
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+    gboolean unplug = g_rand_int_range(rand, 0, 2);
+    gboolean present = FALSE;
+    guint slot = 0, i;
+    gsize len;
+
+    /* a random slot in the state wanted, or the last one tried */
+    g_mutex_lock(&synthetic->lock);
+    for (i = 0; i < SYNTHETIC_PICK_TRIES; i++) {
+        slot = g_rand_int_range(rand, 0, synthetic->n_slots);
+        present = synthetic->present[slot];
+        if (present == unplug) {
+            break;
+        }
+    }
+    g_mutex_unlock(&synthetic->lock);
+
+    event.action = present ? SPICE_USB_HOTPLUG_REMOVE : SPICE_USB_HOTPLUG_ADD;
+    synthetic_desc(synthetic, slot, &event.desc);
+    g_snprintf(event.name, sizeof(event.name), "%u-%u",
+               event.desc.busnum, event.desc.devaddr);
+    len = spice_usb_uevent_format(&event, seqnum, buf, sizeof(buf));
+
+    /* plugged in before the uevent is read, as with sysfs */
+    g_mutex_lock(&synthetic->lock);
+    synthetic->present[slot] = !present;
+    g_mutex_unlock(&synthetic->lock);
+    if (send(synthetic->uevent_fd, buf, len, MSG_DONTWAIT) == (gssize)len) {
+        synthetic->sent++;
+        return;
+    }
+    g_mutex_lock(&synthetic->lock);
+    synthetic->present[slot] = present;
+    g_mutex_unlock(&synthetic->lock);
+    synthetic->dropped++;
+}
+
+/* bursts of uevents, spaced at random to make hotplug_rate on average */
+static gpointer synthetic_hotplug_thread(gpointer data)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = data;
+    const SpiceUsbSyntheticConfig *config = &synthetic->config;
+    GRand *rand = g_rand_new_with_seed(config->seed);
+    gdouble mean_us = 1e6 * config->hotplug_burst / config->hotplug_rate;
+    gint64 deadline = g_get_monotonic_time();
+    guint seqnum = 0, i;
+
+    g_mutex_lock(&synthetic->lock);
+    while (!synthetic->stopping) {
+        deadline += (gint64)(2 * mean_us * g_rand_double(rand));
+        while (!synthetic->stopping &&
+               g_cond_wait_until(&synthetic->wakeup, &synthetic->lock, deadline)) {
+        }
+        if (synthetic->stopping) {
+            break;
+        }
+        g_mutex_unlock(&synthetic->lock);
+        for (i = 0; i < config->hotplug_burst; i++) {
+            synthetic_toggle(synthetic, rand, ++seqnum);
+        }
+        g_mutex_lock(&synthetic->lock);
+    }
+    g_mutex_unlock(&synthetic->lock);
+    g_rand_free(rand);
+    return NULL;
+}
+
+static gint synthetic_open_uevents(SpiceUsbDeviceSource *source, GError **err)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = (SpiceUsbDeviceSourceSynthetic *)source;
+    gint fds[2];
+
+    g_return_val_if_fail(synthetic->uevent_fd < 0, -1);
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        int saved_errno = errno;
+
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "synthetic uevent socket: %s", g_strerror(saved_errno));
+        return -1;
+    }
+    synthetic->uevent_fd = fds[1];
+    if (synthetic->config.hotplug_rate > 0 && synthetic->n_slots > 0) {
+        synthetic->hotplug_thread = g_thread_new("usb-synthetic-hotplug",
+                                                 synthetic_hotplug_thread, synthetic);
+    }
+    return fds[0];
+}
+
+static void synthetic_free(SpiceUsbDeviceSource *source)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = (SpiceUsbDeviceSourceSynthetic *)source;
+
+    if (synthetic->hotplug_thread != NULL) {
+        g_mutex_lock(&synthetic->lock);
+        synthetic->stopping = TRUE;
+        g_cond_signal(&synthetic->wakeup);
+        g_mutex_unlock(&synthetic->lock);
+        g_thread_join(synthetic->hotplug_thread);
+        SPICE_DEBUG("synthetic USB devices: %" G_GUINT64_FORMAT " uevents sent, %"
+                    G_GUINT64_FORMAT " dropped", synthetic->sent, synthetic->dropped);
+    }
+    if (synthetic->uevent_fd >= 0) {
+        close(synthetic->uevent_fd);
+    }
+    spice_usb_synthetic_config_clear(&synthetic->config);
+    g_free(synthetic->present);
+    g_cond_clear(&synthetic->wakeup);
+    g_mutex_clear(&synthetic->lock);
+    g_free(synthetic);
+}
+
+static const SpiceUsbDeviceSourceOps synthetic_ops = {
+    .name = "synthetic",
+    .enumerate = synthetic_enumerate,
+    .read_device = synthetic_read_device,
+    .open_uevents = synthetic_open_uevents,
+    .free = synthetic_free,
+};
+
+/**
+ * spice_usb_device_source_new_synthetic:
+ * @config: the devices to generate and the rate of their events
+ *
+ * Devices made up from the seed, @config->n_devices of them present at
+ * startup, on root ports of as many buses as needed. A quarter more
+ * addresses are left free for the devices plugged in later. Once the
+ * uevent socket is opened, a thread plugs random devices in and out at
+ * @config->hotplug_rate, so the whole hotplug path is exercised.
+ *
+ * Returns: a new source
+ */
+SpiceUsbDeviceSource *spice_usb_device_source_new_synthetic(const SpiceUsbSyntheticConfig *config)
+{
+    SpiceUsbDeviceSourceSynthetic *synthetic = g_new0(SpiceUsbDeviceSourceSynthetic, 1);
+    guint i;
+
+    g_return_val_if_fail(config != NULL, NULL);
+
+    synthetic->parent.ops = &synthetic_ops;
+    synthetic->config = *config;
+    synthetic->config.image = g_strdup(config->image);
+    synthetic->config.n_devices = MIN(config->n_devices, SYNTHETIC_MAX_DEVICES);
+    synthetic->config.hotplug_burst = MAX(config->hotplug_burst, 1);
+    synthetic->n_slots = MIN(synthetic->config.n_devices + MAX(synthetic->config.n_devices / 4, 16),
+                             SYNTHETIC_MAX_DEVICES);
+    synthetic->present = g_new0(guint8, synthetic->n_slots);
+    for (i = 0; i < synthetic->config.n_devices; i++) {
+        synthetic->present[i] = TRUE;
+    }
+    g_mutex_init(&synthetic->lock);
+    g_cond_init(&synthetic->wakeup);
+    synthetic->uevent_fd = -1;
+    return &synthetic->parent;
+}
+
+/**
+ * spice_usb_device_source_get_synthetic_config:
+ * @source: a #SpiceUsbDeviceSource
+ *
+ * Returns: (transfer none) (nullable): the configuration of a synthetic
+ * source, %NULL for the other sources
+ */
+const SpiceUsbSyntheticConfig *
+spice_usb_device_source_get_synthetic_config(SpiceUsbDeviceSource *source)
+{
+    g_return_val_if_fail(source != NULL, NULL);
+
+    if (source->ops != &synthetic_ops) {
+        return NULL;
+    }
+    return &((SpiceUsbDeviceSourceSynthetic *)source)->config;
+}
@@ -0,0 +1,329 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "usb-device-source.h"
+
+#define SYSFS_BATCH_SIZE    64  /* devices read by a thread before reporting them */
+#define SYSFS_MAX_THREADS   8   /* default cap, the reads are mostly syscalls */
+
+#define USB_CLASS_HUB 0x09
+
+typedef struct _SpiceUsbDeviceSourceSysfs {
+    SpiceUsbDeviceSource parent;
+    gchar *root;
+    gint root_fd;       /* for the devices read one by one, opened with the first */
+    guint max_threads;
+} SpiceUsbDeviceSourceSysfs;
+
+/* one enumeration, its batches are the device names from @first on */
+typedef struct _SysfsEnumeration {
+    gint root_fd;
+    GPtrArray *names;
+    SpiceUsbDeviceDescFunc func;
+    gpointer user_data;
+    GMutex lock;
+    GCond done;
+    guint pending;      /* batches not reported yet */
+} SysfsEnumeration;
+
+/* the attribute without its newline, FALSE if there is no such attribute */
+static gboolean read_attr(gint dir_fd, const gchar *attr, gchar *buf, gsize size)
+{
+    gssize len;
+    gint fd;
+
+    fd = openat(dir_fd, attr, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+    do {
+        len = read(fd, buf, size - 1);
+    } while (len < 0 && errno == EINTR);
+    close(fd);
+    if (len < 0) {
+        return FALSE;
+    }
+    while (len > 0 && g_ascii_isspace(buf[len - 1])) {
+        len--;
+    }
+    buf[len] = '\0';
+    return TRUE;
+}
+
+static gboolean read_attr_uint(gint dir_fd, const gchar *attr, guint base,
+                               guint64 max, guint64 *value)
+{
+    gchar buf[32], *end;
+
+    if (!read_attr(dir_fd, attr, buf, sizeof(buf))) {
+        return FALSE;
+    }
+    *value = g_ascii_strtoull(buf, &end, base);
+    return end != buf && *end == '\0' && *value <= max;
+}
+
+/**
+ * spice_usb_device_desc_read_sysfs:
+ * @root_fd: the directory of the USB devices, as /sys/bus/usb/devices
+ * @name: a device entry in it, as "1-1.2"
+ * @desc: (out): the device
+ *
+ * Fill @desc from the attribute files of the device, without opening
+ * the device node. Interfaces and hubs are not devices to redirect.
+ *
+ * Returns: %FALSE if @name is not a device to redirect or is gone
+ */
+gboolean spice_usb_device_desc_read_sysfs(gint root_fd, const gchar *name,
+                                          SpiceUsbDeviceDesc *desc)
+{
+    guint64 vid, pid, busnum, devnum, value;
+    gchar speed[16];
+    gint dir_fd;
+    gboolean ok;
+
+    if (name[0] == '.' || strchr(name, ':') != NULL) {
+        return FALSE;
+    }
+    dir_fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return FALSE;
+    }
+
+    ok = read_attr_uint(dir_fd, "idVendor", 16, G_MAXUINT16, &vid) &&
+         read_attr_uint(dir_fd, "idProduct", 16, G_MAXUINT16, &pid) &&
+         read_attr_uint(dir_fd, "busnum", 10, G_MAXUINT8, &busnum) &&
+         read_attr_uint(dir_fd, "devnum", 10, G_MAXUINT8, &devnum);
+    if (ok) {
+        desc->vid = vid;
+        desc->pid = pid;
+        desc->busnum = busnum;
+        desc->devaddr = devnum;
+        desc->device_class =
+            read_attr_uint(dir_fd, "bDeviceClass", 16, G_MAXUINT8, &value) ? value : 0;
+        desc->bcd_device =
+            read_attr_uint(dir_fd, "bcdDevice", 16, G_MAXUINT16, &value) ? value : 0;
+        /* Mbit/s, "1.5" for low speed */
+        desc->speed = read_attr(dir_fd, "speed", speed, sizeof(speed)) ?
+            (guint32)(g_ascii_strtod(speed, NULL) * 1000) : 0;
+        if (!read_attr(dir_fd, "serial", desc->serial, sizeof(desc->serial))) {
+            desc->serial[0] = '\0';
+        }
+        ok = desc->device_class != USB_CLASS_HUB;
+    }
+    close(dir_fd);
+    return ok;
+}
+
+static void sysfs_read_batch(SysfsEnumeration *e, guint first)
+{
+    SpiceUsbDeviceDesc descs[SYSFS_BATCH_SIZE];
+    guint i, n = 0;
+
+    for (i = first; i < MIN(first + SYSFS_BATCH_SIZE, e->names->len); i++) {
+        if (spice_usb_device_desc_read_sysfs(e->root_fd, g_ptr_array_index(e->names, i),
+                                             &descs[n])) {
+            n++;
+        }
+    }
+    if (n > 0) {
+        e->func(descs, n, e->user_data);
+    }
+}
+
+/* thread pool job, @data is the index of the first name of the batch + 1 */
+static void sysfs_read_batch_job(gpointer data, gpointer user_data)
+{
+    SysfsEnumeration *e = user_data;
+
+    sysfs_read_batch(e, GPOINTER_TO_UINT(data) - 1);
+
+    g_mutex_lock(&e->lock);
+    if (--e->pending == 0) {
+        g_cond_signal(&e->done);
+    }
+    g_mutex_unlock(&e->lock);
+}
+
+static gint sysfs_open_root(SpiceUsbDeviceSourceSysfs *sysfs, GError **err)
+{
+    gint fd = open(sysfs->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        int saved_errno = errno;
+
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "%s: %s", sysfs->root, g_strerror(saved_errno));
+    }
+    return fd;
+}
+
+/* read the devices of @e in batches, on a pool when there are several */
+static void sysfs_read_names(SpiceUsbDeviceSourceSysfs *sysfs, SysfsEnumeration *e)
+{
+    GThreadPool *pool = NULL;
+    guint n_batches, n_threads, first;
+
+    n_batches = (e->names->len + SYSFS_BATCH_SIZE - 1) / SYSFS_BATCH_SIZE;
+    n_threads = sysfs->max_threads ? sysfs->max_threads :
+        MIN(g_get_num_processors(), SYSFS_MAX_THREADS);
+    if (n_batches > 1 && n_threads > 1) {
+        pool = g_thread_pool_new(sysfs_read_batch_job, e, MIN(n_threads, n_batches),
+                                 FALSE, NULL);
+    }
+
+    if (pool == NULL) {
+        for (first = 0; first < e->names->len; first += SYSFS_BATCH_SIZE) {
+            sysfs_read_batch(e, first);
+        }
+        return;
+    }
+    g_mutex_init(&e->lock);
+    g_cond_init(&e->done);
+    e->pending = n_batches;
+    for (first = 0; first < e->names->len; first += SYSFS_BATCH_SIZE) {
+        g_thread_pool_push(pool, GUINT_TO_POINTER(first + 1), NULL);
+    }
+    g_mutex_lock(&e->lock);
+    while (e->pending > 0) {
+        g_cond_wait(&e->done, &e->lock);
+    }
+    g_mutex_unlock(&e->lock);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_cond_clear(&e->done);
+    g_mutex_clear(&e->lock);
+}
+
+static gboolean sysfs_enumerate(SpiceUsbDeviceSource *source, SpiceUsbDeviceDescFunc func,
+                                gpointer user_data, GError **err)
+{
+    SpiceUsbDeviceSourceSysfs *sysfs = (SpiceUsbDeviceSourceSysfs *)source;
+    SysfsEnumeration e = { .func = func, .user_data = user_data };
+    const gchar *name;
+    GDir *dir;
+
+    dir = g_dir_open(sysfs->root, 0, err);
+    if (dir == NULL) {
+        return FALSE;
+    }
+    e.root_fd = sysfs_open_root(sysfs, err);
+    if (e.root_fd < 0) {
+        g_dir_close(dir);
+        return FALSE;
+    }
+    e.names = g_ptr_array_new_with_free_func(g_free);
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (strchr(name, ':') == NULL) {
+            g_ptr_array_add(e.names, g_strdup(name));
+        }
+    }
+    g_dir_close(dir);
+
+    sysfs_read_names(sysfs, &e);
+
+    g_ptr_array_unref(e.names);
+    close(e.root_fd);
+    return TRUE;
+}
+
+/* as an enumeration of @names only, with its own descriptor of the root */
+static void sysfs_read_devices(SpiceUsbDeviceSource *source, const gchar * const *names,
+                               guint n_names, SpiceUsbDeviceDescFunc func,
+                               gpointer user_data)
+{
+    SpiceUsbDeviceSourceSysfs *sysfs = (SpiceUsbDeviceSourceSysfs *)source;
+    SysfsEnumeration e = { .func = func, .user_data = user_data };
+    guint i;
+
+    e.root_fd = sysfs_open_root(sysfs, NULL);
+    if (e.root_fd < 0) {
+        return;
+    }
+    e.names = g_ptr_array_sized_new(n_names);
+    for (i = 0; i < n_names; i++) {
+        g_ptr_array_add(e.names, (gpointer)names[i]);
+    }
+
+    sysfs_read_names(sysfs, &e);
+
+    g_ptr_array_unref(e.names);
+    close(e.root_fd);
+}
+
+static gboolean sysfs_read_device(SpiceUsbDeviceSource *source, const gchar *name,
+                                  SpiceUsbDeviceDesc *desc)
+{
+    SpiceUsbDeviceSourceSysfs *sysfs = (SpiceUsbDeviceSourceSysfs *)source;
+
+    if (sysfs->root_fd < 0) {
+        sysfs->root_fd = open(sysfs->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return sysfs->root_fd >= 0 && spice_usb_device_desc_read_sysfs(sysfs->root_fd, name, desc);
+}
+
+static void sysfs_free(SpiceUsbDeviceSource *source)
+{
+    SpiceUsbDeviceSourceSysfs *sysfs = (SpiceUsbDeviceSourceSysfs *)source;
+
+    if (sysfs->root_fd >= 0) {
+        close(sysfs->root_fd);
+    }
+    g_free(sysfs->root);
+    g_free(sysfs);
+}
+
+static const SpiceUsbDeviceSourceOps sysfs_ops = {
+    .name = "sysfs",
+    .enumerate = sysfs_enumerate,
+    .read_device = sysfs_read_device,
+    .read_devices = sysfs_read_devices,
+    .free = sysfs_free,
+};
+
+/**
+ * spice_usb_device_source_new_sysfs:
+ * @root: (nullable): the directory of the USB devices, $SPICE_USB_SYSFS_ROOT
+ * or %SPICE_USB_SYSFS_DEFAULT_ROOT if %NULL
+ * @max_threads: threads reading the devices in batches, 0 for one per CPU
+ * up to %SYSFS_MAX_THREADS (8)
+ *
+ * Devices as listed by the kernel, read from the attribute files of their
+ * sysfs directories. Any directory laid out the same way will do, which
+ * makes it possible to enumerate a recorded or generated tree.
+ *
+ * Returns: a new source
+ */
+SpiceUsbDeviceSource *spice_usb_device_source_new_sysfs(const gchar *root, guint max_threads)
+{
+    SpiceUsbDeviceSourceSysfs *sysfs = g_new0(SpiceUsbDeviceSourceSysfs, 1);
+
+    if (root == NULL) {
+        root = g_getenv("SPICE_USB_SYSFS_ROOT");
+    }
+    if (root == NULL || *root == '\0') {
+        root = SPICE_USB_SYSFS_DEFAULT_ROOT;
+    }
+    sysfs->parent.ops = &sysfs_ops;
+    sysfs->root = g_strdup(root);
+    sysfs->root_fd = -1;
+    sysfs->max_threads = max_threads;
+    return &sysfs->parent;
+}
@@ -0,0 +1,175 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "usb-device-source.h"
+
+/**
+ * spice_usb_device_source_new_default:
+ *
+ * The source of the devices of this client: the sysfs tree of the USB
+ * bus, at $SPICE_USB_SYSFS_ROOT if set, unless $SPICE_USB_SOURCE asks
+ * for generated devices with "synthetic" and its options.
+ *
+ * Returns: a new source
+ */
+SpiceUsbDeviceSource *spice_usb_device_source_new_default(void)
+{
+    const gchar *name = g_getenv(SPICE_USB_SOURCE_ENV);
+    SpiceUsbSyntheticConfig config;
+    SpiceUsbDeviceSource *source;
+    GError *err = NULL;
+
+    if (name == NULL || *name == '\0' || strcmp(name, "sysfs") == 0) {
+        return spice_usb_device_source_new_sysfs(NULL, 0);
+    }
+    if (g_str_has_prefix(name, "synthetic") &&
+        (name[strlen("synthetic")] == '\0' || name[strlen("synthetic")] == ':')) {
+        name += strlen("synthetic");
+        if (spice_usb_synthetic_config_parse(*name == ':' ? name + 1 : name, &config, &err)) {
+            source = spice_usb_device_source_new_synthetic(&config);
+            spice_usb_synthetic_config_clear(&config);
+            return source;
+        }
+        g_warning("%s: %s", SPICE_USB_SOURCE_ENV, err->message);
+        g_error_free(err);
+    } else {
+        g_warning("%s: unknown USB device source \"%s\"", SPICE_USB_SOURCE_ENV, name);
+    }
+    return spice_usb_device_source_new_sysfs(NULL, 0);
+}
+
+void spice_usb_device_source_free(SpiceUsbDeviceSource *source)
+{
+    if (source != NULL) {
+        source->ops->free(source);
+    }
+}
+
+const gchar *spice_usb_device_source_get_name(SpiceUsbDeviceSource *source)
+{
+    g_return_val_if_fail(source != NULL, NULL);
+
+    return source->ops->name;
+}
+
+/**
+ * spice_usb_device_source_enumerate:
+ * @source: the #SpiceUsbDeviceSource
+ * @func: called with each batch of devices found, maybe from other threads
+ * @user_data: data for @func
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Report the devices present, blocking until all of them were. Batches
+ * may be reported concurrently, @func must take care of its locking.
+ *
+ * Returns: %FALSE if the devices could not be listed
+ */
+gboolean spice_usb_device_source_enumerate(SpiceUsbDeviceSource *source,
+                                           SpiceUsbDeviceDescFunc func,
+                                           gpointer user_data,
+                                           GError **err)
+{
+    g_return_val_if_fail(source != NULL, FALSE);
+    g_return_val_if_fail(func != NULL, FALSE);
+
+    return source->ops->enumerate(source, func, user_data, err);
+}
+
+/**
+ * spice_usb_device_source_read_device:
+ * @source: the #SpiceUsbDeviceSource
+ * @name: the name of a device entry, as in its uevents
+ * @desc: (out): the device
+ *
+ * Read one device again, as the descriptor found by enumerating would be.
+ *
+ * Returns: %FALSE if the source cannot tell or the device is gone
+ */
+gboolean spice_usb_device_source_read_device(SpiceUsbDeviceSource *source,
+                                             const gchar *name,
+                                             SpiceUsbDeviceDesc *desc)
+{
+    g_return_val_if_fail(source != NULL, FALSE);
+    g_return_val_if_fail(name != NULL && desc != NULL, FALSE);
+
+    return source->ops->read_device != NULL && source->ops->read_device(source, name, desc);
+}
+
+#define SOURCE_READ_BATCH_SIZE 64
+
+/**
+ * spice_usb_device_source_read_devices:
+ * @source: the #SpiceUsbDeviceSource
+ * @names: (array length=n_names): names of device entries, as in their uevents
+ * @n_names: the number of @names
+ * @func: called with each batch of devices read, maybe from other threads
+ * @user_data: data for @func
+ *
+ * Read several devices again, blocking until all of them were reported.
+ * The entries that are gone or are no devices to redirect are left out.
+ */
+void spice_usb_device_source_read_devices(SpiceUsbDeviceSource *source,
+                                          const gchar * const *names,
+                                          guint n_names,
+                                          SpiceUsbDeviceDescFunc func,
+                                          gpointer user_data)
+{
+    SpiceUsbDeviceDesc descs[SOURCE_READ_BATCH_SIZE];
+    guint i, n = 0;
+
+    g_return_if_fail(source != NULL);
+    g_return_if_fail(names != NULL || n_names == 0);
+    g_return_if_fail(func != NULL);
+
+    if (source->ops->read_devices != NULL) {
+        source->ops->read_devices(source, names, n_names, func, user_data);
+        return;
+    }
+    for (i = 0; i < n_names; i++) {
+        if (spice_usb_device_source_read_device(source, names[i], &descs[n]) &&
+            ++n == SOURCE_READ_BATCH_SIZE) {
+            func(descs, n, user_data);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        func(descs, n, user_data);
+    }
+}
+
+/**
+ * spice_usb_device_source_open_uevents:
+ * @source: the #SpiceUsbDeviceSource
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * A socket reporting the devices of @source plugged in and out as the
+ * kernel does, for sources whose devices the kernel does not know.
+ *
+ * Returns: a non-blocking socket, or -1 with @err left unset if the
+ * uevents of the kernel are the ones to watch
+ */
+gint spice_usb_device_source_open_uevents(SpiceUsbDeviceSource *source, GError **err)
+{
+    g_return_val_if_fail(source != NULL, -1);
+
+    if (source->ops->open_uevents == NULL) {
+        return -1;
+    }
+    return source->ops->open_uevents(source, err);
+}
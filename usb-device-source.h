@@ -0,0 +1,126 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_DEVICE_SOURCE_H__
+#define __SPICE_USB_DEVICE_SOURCE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* "sysfs" or "synthetic[:OPTIONS]", the source of spice_usb_device_source_new_default() */
+#define SPICE_USB_SOURCE_ENV "SPICE_USB_SOURCE"
+
+/* where the sysfs source looks without a root, $SPICE_USB_SYSFS_ROOT overrides it */
+#define SPICE_USB_SYSFS_DEFAULT_ROOT "/sys/bus/usb/devices"
+
+/* longest serial number kept, the descriptor allows 126 characters */
+#define SPICE_USB_DEVICE_SERIAL_SIZE 128
+
+/* a device as a source found it, fixed size so batches need no allocation */
+typedef struct _SpiceUsbDeviceDesc {
+    guint8  busnum;
+    guint8  devaddr;
+    guint16 vid;
+    guint16 pid;
+    guint8  device_class;
+    guint16 bcd_device;
+    guint32 speed;          /* kbit/s, 0 if unknown */
+    gchar   serial[SPICE_USB_DEVICE_SERIAL_SIZE]; /* empty if there is none */
+} SpiceUsbDeviceDesc;
+
+/* @descs are only valid during the call, which may come from any thread */
+typedef void (*SpiceUsbDeviceDescFunc)(const SpiceUsbDeviceDesc *descs, guint n_descs,
+                                       gpointer user_data);
+
+typedef struct _SpiceUsbDeviceSource SpiceUsbDeviceSource;
+
+typedef struct _SpiceUsbDeviceSourceOps {
+    const gchar *name;
+    /* report every device present, in batches, returns once all were */
+    gboolean (*enumerate)(SpiceUsbDeviceSource *source, SpiceUsbDeviceDescFunc func,
+                          gpointer user_data, GError **err);
+    /* optional: fill @desc with the device entry @name, as named by its uevents */
+    gboolean (*read_device)(SpiceUsbDeviceSource *source, const gchar *name,
+                            SpiceUsbDeviceDesc *desc);
+    /* optional: report the device entries @names that are devices, in batches */
+    void (*read_devices)(SpiceUsbDeviceSource *source, const gchar * const *names,
+                         guint n_names, SpiceUsbDeviceDescFunc func, gpointer user_data);
+    /* optional: a socket the uevents of its devices come from, instead of the kernel */
+    gint (*open_uevents)(SpiceUsbDeviceSource *source, GError **err);
+    void (*free)(SpiceUsbDeviceSource *source);
+} SpiceUsbDeviceSourceOps;
+
+/* first member of the structure of each source */
+struct _SpiceUsbDeviceSource {
+    const SpiceUsbDeviceSourceOps *ops;
+};
+
+/*
+ * Where the #SpiceUsbDeviceManager gets the USB devices of the client
+ * from. Enumerating and reading devices by batch are blocking and meant
+ * for a thread, they do not touch the source otherwise, so they may be
+ * called from any thread.
+ */
+SpiceUsbDeviceSource *spice_usb_device_source_new_default(void);
+void spice_usb_device_source_free(SpiceUsbDeviceSource *source);
+const gchar *spice_usb_device_source_get_name(SpiceUsbDeviceSource *source);
+gboolean spice_usb_device_source_enumerate(SpiceUsbDeviceSource *source,
+                                           SpiceUsbDeviceDescFunc func,
+                                           gpointer user_data,
+                                           GError **err);
+gboolean spice_usb_device_source_read_device(SpiceUsbDeviceSource *source,
+                                             const gchar *name,
+                                             SpiceUsbDeviceDesc *desc);
+void spice_usb_device_source_read_devices(SpiceUsbDeviceSource *source,
+                                          const gchar * const *names,
+                                          guint n_names,
+                                          SpiceUsbDeviceDescFunc func,
+                                          gpointer user_data);
+gint spice_usb_device_source_open_uevents(SpiceUsbDeviceSource *source, GError **err);
+
+/* @root: NULL for the default, @max_threads: 0 for one per CPU, at most 8 */
+SpiceUsbDeviceSource *spice_usb_device_source_new_sysfs(const gchar *root, guint max_threads);
+gboolean spice_usb_device_desc_read_sysfs(gint root_fd, const gchar *name,
+                                          SpiceUsbDeviceDesc *desc);
+
+/*
+ * Generated devices, for measuring the manager and its users at scale.
+ * The options are "key=value" pairs separated by ',': devices, luns,
+ * hotplug, burst, connect, media, seed and image, as in
+ * "synthetic:devices=5000,luns=200,hotplug=100,burst=20,media=5".
+ */
+typedef struct _SpiceUsbSyntheticConfig {
+    guint n_devices;        /* plugged in at startup */
+    guint n_luns;           /* CD LUNs added once the devices are in */
+    gdouble hotplug_rate;   /* devices plugged in or out per second */
+    guint hotplug_burst;    /* of them sent back to back, as a dock does */
+    gdouble connect_rate;   /* redirections started or stopped per second */
+    gdouble media_rate;     /* LUN media changes, ejects and locks per second */
+    guint32 seed;           /* of the devices and of the events */
+    gchar *image;           /* of the LUNs and their media changes, NULL for none */
+} SpiceUsbSyntheticConfig;
+
+gboolean spice_usb_synthetic_config_parse(const gchar *options,
+                                          SpiceUsbSyntheticConfig *config,
+                                          GError **err);
+void spice_usb_synthetic_config_clear(SpiceUsbSyntheticConfig *config);
+SpiceUsbDeviceSource *spice_usb_device_source_new_synthetic(const SpiceUsbSyntheticConfig *config);
+const SpiceUsbSyntheticConfig *
+spice_usb_device_source_get_synthetic_config(SpiceUsbDeviceSource *source);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_DEVICE_SOURCE_H__ */
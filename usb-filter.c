@@ -0,0 +1,123 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <gio/gio.h>
+#include "usb-filter.h"
+
+#define FILTER_FIELDS 5
+
+static gboolean parse_field(const gchar **p, gint *value, gint max)
+{
+    gchar *end;
+    gint64 v;
+
+    v = g_ascii_strtoll(*p, &end, 0);
+    if (end == *p || v < -1 || v > max) {
+        return FALSE;
+    }
+    *value = (gint)v;
+    *p = end;
+    return TRUE;
+}
+
+/**
+ * spice_usb_filter_parse:
+ * @filter: the filter string
+ * @rules: (out): location for the newly-allocated rule table
+ * @count: (out): number of rules in @rules
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Compile @filter into a flat rule table, to be freed with g_free().
+ * An empty string gives an empty table.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean spice_usb_filter_parse(const gchar *filter,
+                                SpiceUsbFilterRule **rules,
+                                guint *count,
+                                GError **err)
+{
+    SpiceUsbFilterRule *table;
+    const gchar *p;
+    guint n, i;
+
+    g_return_val_if_fail(filter != NULL, FALSE);
+    g_return_val_if_fail(rules != NULL && count != NULL, FALSE);
+
+    if (*filter == '\0') {
+        *rules = NULL;
+        *count = 0;
+        return TRUE;
+    }
+
+    n = 1;
+    for (p = filter; *p; p++) {
+        if (*p == '|') {
+            n++;
+        }
+    }
+
+    table = g_new(SpiceUsbFilterRule, n);
+    p = filter;
+    for (i = 0; i < n; i++) {
+        SpiceUsbFilterRule *rule = &table[i];
+
+        if (!parse_field(&p, &rule->device_class, 0xff) || *p++ != ',' ||
+            !parse_field(&p, &rule->vendor_id, 0xffff) || *p++ != ',' ||
+            !parse_field(&p, &rule->product_id, 0xffff) || *p++ != ',' ||
+            !parse_field(&p, &rule->device_version_bcd, 0xffff) || *p++ != ',' ||
+            !parse_field(&p, &rule->allow, 1) || rule->allow < 0 ||
+            (*p != '|' && *p != '\0')) {
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Invalid USB filter rule %u (expected %d fields) in \"%s\"",
+                        i + 1, FILTER_FIELDS, filter);
+            g_free(table);
+            return FALSE;
+        }
+        p++;
+    }
+
+    *rules = table;
+    *count = n;
+    return TRUE;
+}
+
+/**
+ * spice_usb_filter_check:
+ *
+ * Returns: %TRUE if the first rule matching the device allows it,
+ * %FALSE if it is denied or no rule matches
+ */
+gboolean spice_usb_filter_check(const SpiceUsbFilterRule *rules, guint count,
+                                guint8 device_class, guint16 vid, guint16 pid,
+                                guint16 device_version_bcd)
+{
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        const SpiceUsbFilterRule *rule = &rules[i];
+
+        if ((rule->device_class == -1 || rule->device_class == device_class) &&
+            (rule->vendor_id == -1 || rule->vendor_id == vid) &&
+            (rule->product_id == -1 || rule->product_id == pid) &&
+            (rule->device_version_bcd == -1 ||
+             rule->device_version_bcd == device_version_bcd)) {
+            return rule->allow;
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_FILTER_H__
+#define __SPICE_USB_FILTER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A filter string is a '|' separated list of rules, each rule being
+ * "class,vendor,product,version,allow" with -1 matching anything, e.g.
+ * "0x03,-1,-1,-1,0|-1,-1,-1,-1,1". Rules are checked in order and the
+ * first matching one decides.
+ */
+typedef struct _SpiceUsbFilterRule {
+    gint device_class;
+    gint vendor_id;
+    gint product_id;
+    gint device_version_bcd;
+    gint allow;
+} SpiceUsbFilterRule;
+
+gboolean spice_usb_filter_parse(const gchar *filter,
+                                SpiceUsbFilterRule **rules,
+                                guint *count,
+                                GError **err);
+
+gboolean spice_usb_filter_check(const SpiceUsbFilterRule *rules, guint count,
+                                guint8 device_class, guint16 vid, guint16 pid,
+                                guint16 device_version_bcd);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_FILTER_H__ */
@@ -0,0 +1,569 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <glib.h>
+#include "usb-hotplug.h"
+
+/* kernel uevents, as opposed to the ones udev sends again */
+#define UEVENT_GROUP_KERNEL 1
+/* room for the storm of a dock being plugged in, while the main loop is busy */
+#define UEVENT_RCVBUF_SIZE (1024 * 1024)
+
+/* the last event of a device, timed since the device started changing */
+typedef struct _SpiceUsbHotplugPending {
+    SpiceUsbHotplugEvent event;
+    gint64 first_event;         /* monotonic, of the first event merged in */
+    gint64 last_event;
+} SpiceUsbHotplugPending;
+
+typedef struct _SpiceUsbHotplugSource {
+    GSource source;
+    gint fd;
+    gpointer fd_tag;
+    SpiceUsbHotplugFunc func;
+    gpointer user_data;
+    SpiceUsbHotplugOverrunFunc overrun_func;
+    gpointer overrun_data;
+
+    /* pending events, one per device address, reused from one report to the next */
+    GArray *pending;            /* SpiceUsbHotplugPending */
+    GHashTable *pending_index;  /* address -> index in pending + 1 */
+    GArray *settled;            /* the events of a report */
+    guint quiet_ms;
+    guint max_delay_ms;
+    guint blocked;              /* set_blocked() calls not undone yet */
+    gboolean overrun;           /* uevents were lost since the last report */
+    gint64 overrun_first;       /* the storm is timed like the events of a device */
+    gint64 overrun_last;
+
+    SpiceUsbHotplugStats stats;
+    gchar buf[SPICE_USB_UEVENT_BUF_SIZE];
+} SpiceUsbHotplugSource;
+
+static gint socket_error(const gchar *what, gint fd, GError **err)
+{
+    int saved_errno = errno;
+
+    g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "%s: %s", what, g_strerror(saved_errno));
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * spice_usb_hotplug_open_netlink:
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Returns: a non-blocking socket receiving the uevents of the kernel, or -1
+ */
+gint spice_usb_hotplug_open_netlink(GError **err)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = UEVENT_GROUP_KERNEL,
+    };
+    gint size = UEVENT_RCVBUF_SIZE;
+    gint fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return socket_error("uevent socket", -1, err);
+    }
+    /* beyond rmem_max with CAP_NET_ADMIN, as much as allowed otherwise */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return socket_error("uevent socket", fd, err);
+    }
+    return fd;
+}
+
+/**
+ * spice_usb_hotplug_open_replay:
+ * @path: where to bind the socket
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * A local datagram socket standing in for the netlink one, recorded
+ * uevents sent to @path are read as if they came from the kernel.
+ *
+ * Returns: a non-blocking socket, or -1
+ */
+gint spice_usb_hotplug_open_replay(const gchar *path, GError **err)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    gint fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG, "%s: name too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return socket_error(path, -1, err);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return socket_error(path, fd, err);
+    }
+    return fd;
+}
+
+static inline gboolean has_prefix(const gchar *s, const gchar *prefix, gsize len,
+                                  const gchar **value)
+{
+    if (strncmp(s, prefix, len) != 0) {
+        return FALSE;
+    }
+    *value = s + len;
+    return TRUE;
+}
+
+#define HAS_PREFIX(s, prefix, value) has_prefix((s), prefix, sizeof(prefix) - 1, (value))
+
+/* "x/y/z" with numbers in @base, FALSE if there are less than @n of them */
+static gboolean parse_triplet(const gchar *s, guint base, guint64 values[3], guint n)
+{
+    gchar *end;
+    guint i;
+
+    for (i = 0; i < 3; i++) {
+        values[i] = g_ascii_strtoull(s, &end, base);
+        if (end == s) {
+            return i >= n;
+        }
+        if (*end != '/') {
+            return i + 1 >= n;
+        }
+        s = end + 1;
+    }
+    return TRUE;
+}
+
+/**
+ * spice_usb_uevent_parse:
+ * @buf: a uevent as the kernel sends it, a header and NUL separated variables
+ * @len: its length
+ * @event: (out): the event
+ *
+ * Parse the uevent in place, without allocating.
+ *
+ * Returns: %FALSE if it is not the add or the remove of a USB device
+ */
+gboolean spice_usb_uevent_parse(const gchar *buf, gsize len, SpiceUsbHotplugEvent *event)
+{
+    const gchar *end = buf + len, *p, *next;
+    const gchar *action = NULL, *devpath = NULL, *product = NULL, *type = NULL;
+    const gchar *busnum = NULL, *devnum = NULL, *value;
+    gboolean usb = FALSE, usb_device = FALSE;
+    guint64 values[3];
+    gchar *num_end;
+
+    /* the header, "add@/devices/...", is followed by the variables */
+    p = memchr(buf, '\0', len);
+    if (p == NULL || memchr(buf, '@', p - buf) == NULL) {
+        return FALSE;
+    }
+    for (p++; p < end; p = next + 1) {
+        next = memchr(p, '\0', end - p);
+        if (next == NULL) {
+            break;
+        }
+        if (HAS_PREFIX(p, "ACTION=", &value)) {
+            action = value;
+        } else if (HAS_PREFIX(p, "DEVPATH=", &value)) {
+            devpath = value;
+        } else if (HAS_PREFIX(p, "SUBSYSTEM=", &value)) {
+            usb = strcmp(value, "usb") == 0;
+        } else if (HAS_PREFIX(p, "DEVTYPE=", &value)) {
+            usb_device = strcmp(value, "usb_device") == 0;
+        } else if (HAS_PREFIX(p, "PRODUCT=", &value)) {
+            product = value;
+        } else if (HAS_PREFIX(p, "TYPE=", &value)) {
+            type = value;
+        } else if (HAS_PREFIX(p, "BUSNUM=", &value)) {
+            busnum = value;
+        } else if (HAS_PREFIX(p, "DEVNUM=", &value)) {
+            devnum = value;
+        }
+    }
+    if (!usb || !usb_device || action == NULL || devpath == NULL ||
+        busnum == NULL || devnum == NULL) {
+        return FALSE;
+    }
+
+    memset(&event->desc, 0, sizeof(event->desc));
+    if (strcmp(action, "add") == 0) {
+        event->action = SPICE_USB_HOTPLUG_ADD;
+        /* vid/pid/bcdDevice in hex, class/subclass/protocol in decimal */
+        if (product == NULL || !parse_triplet(product, 16, values, 2)) {
+            return FALSE;
+        }
+        event->desc.vid = values[0];
+        event->desc.pid = values[1];
+        event->desc.bcd_device = values[2];
+        if (type != NULL && parse_triplet(type, 10, values, 1)) {
+            event->desc.device_class = values[0];
+        }
+    } else if (strcmp(action, "remove") == 0) {
+        event->action = SPICE_USB_HOTPLUG_REMOVE;
+    } else {
+        return FALSE;
+    }
+    event->desc.busnum = g_ascii_strtoull(busnum, &num_end, 10);
+    event->desc.devaddr = g_ascii_strtoull(devnum, &num_end, 10);
+
+    p = strrchr(devpath, '/');
+    g_strlcpy(event->name, p != NULL ? p + 1 : devpath, sizeof(event->name));
+    return TRUE;
+}
+
+/**
+ * spice_usb_uevent_format:
+ * @event: the add or the remove of a USB device
+ * @seqnum: the sequence number of the uevent
+ * @buf: where to write the uevent
+ * @size: the size of @buf, %SPICE_USB_UEVENT_BUF_SIZE is enough
+ *
+ * Write the uevent the kernel would send for @event, the device being
+ * on a root port of its bus, for replays and generated loads.
+ *
+ * Returns: the length of the uevent, 0 if it does not fit
+ */
+gsize spice_usb_uevent_format(const SpiceUsbHotplugEvent *event, guint seqnum,
+                              gchar *buf, gsize size)
+{
+    const gchar *action = event->action == SPICE_USB_HOTPLUG_ADD ? "add" : "remove";
+    const SpiceUsbDeviceDesc *desc = &event->desc;
+    gchar devpath[96];
+    gsize len;
+    gint n;
+
+    g_snprintf(devpath, sizeof(devpath), "/devices/pci0000:00/0000:00:14.0/usb%u/%s",
+               desc->busnum, event->name);
+    n = g_snprintf(buf, size, "%s@%s", action, devpath);
+    if (n < 0 || (gsize)n >= size) {
+        return 0;
+    }
+    len = n + 1;
+    n = g_snprintf(buf + len, size - len,
+                   "ACTION=%s%cDEVPATH=%s%cSUBSYSTEM=usb%cDEVTYPE=usb_device%c"
+                   "PRODUCT=%x/%x/%x%cTYPE=%u/0/0%cBUSNUM=%03u%cDEVNUM=%03u%cSEQNUM=%u",
+                   action, 0, devpath, 0, 0, 0,
+                   desc->vid, desc->pid, desc->bcd_device, 0, desc->device_class, 0,
+                   desc->busnum, 0, desc->devaddr, 0, seqnum);
+    if (n < 0 || (gsize)n >= size - len) {
+        return 0;
+    }
+    return len + n + 1;
+}
+
+static inline gpointer event_key(const SpiceUsbHotplugEvent *event)
+{
+    return GUINT_TO_POINTER(((guint)event->desc.busnum << 8) | event->desc.devaddr);
+}
+
+/* the last event of a device replaces the pending one and keeps it from settling */
+static void hotplug_queue(SpiceUsbHotplugSource *hotplug, const SpiceUsbHotplugEvent *event,
+                          gint64 now)
+{
+    guint index = GPOINTER_TO_UINT(g_hash_table_lookup(hotplug->pending_index,
+                                                       event_key(event)));
+    SpiceUsbHotplugPending *pending;
+
+    if (index != 0) {
+        pending = &g_array_index(hotplug->pending, SpiceUsbHotplugPending, index - 1);
+        hotplug->stats.merged++;
+    } else {
+        g_array_set_size(hotplug->pending, hotplug->pending->len + 1);
+        pending = &g_array_index(hotplug->pending, SpiceUsbHotplugPending,
+                                 hotplug->pending->len - 1);
+        pending->first_event = now;
+        g_hash_table_insert(hotplug->pending_index, event_key(event),
+                            GUINT_TO_POINTER(hotplug->pending->len));
+    }
+    pending->event = *event;
+    pending->last_event = now;
+}
+
+static void hotplug_receive(SpiceUsbHotplugSource *hotplug)
+{
+    SpiceUsbHotplugEvent event;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    gint64 now = g_get_monotonic_time();
+    gssize len;
+
+    for (;;) {
+        from_len = sizeof(from);
+        len = recvfrom(hotplug->fd, hotplug->buf, sizeof(hotplug->buf), MSG_DONTWAIT,
+                       (struct sockaddr *)&from, &from_len);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                /* the kernel dropped some, the next ones are still there */
+                hotplug->stats.overruns++;
+                SPICE_DEBUG("uevents were lost");
+                if (!hotplug->overrun) {
+                    hotplug->overrun_first = now;
+                }
+                hotplug->overrun_last = now;
+                hotplug->overrun = TRUE;
+                continue;
+            }
+            break;
+        }
+        hotplug->stats.uevents++;
+        /* only the kernel sends on the netlink group */
+        if (from_len >= sizeof(struct sockaddr_nl) && from.ss_family == AF_NETLINK &&
+            ((struct sockaddr_nl *)&from)->nl_pid != 0) {
+            continue;
+        }
+        if (spice_usb_uevent_parse(hotplug->buf, len, &event)) {
+            hotplug->stats.events++;
+            hotplug_queue(hotplug, &event, now);
+        }
+    }
+}
+
+/* when what started changing at @first, and last changed at @last, has settled */
+static inline gint64 hotplug_settle_time(SpiceUsbHotplugSource *hotplug,
+                                         gint64 first, gint64 last)
+{
+    return MIN(last + hotplug->quiet_ms * G_GINT64_CONSTANT(1000),
+               first + hotplug->max_delay_ms * G_GINT64_CONSTANT(1000));
+}
+
+/* pass on the devices settled by @now, or all of them */
+static void hotplug_report(SpiceUsbHotplugSource *hotplug, gint64 now, gboolean all)
+{
+    guint i, kept = 0;
+
+    for (i = 0; i < hotplug->pending->len; i++) {
+        SpiceUsbHotplugPending *pending = &g_array_index(hotplug->pending,
+                                                         SpiceUsbHotplugPending, i);
+
+        if (all || now >= hotplug_settle_time(hotplug, pending->first_event,
+                                              pending->last_event)) {
+            g_array_append_val(hotplug->settled, pending->event);
+            continue;
+        }
+        /* a device still changing waits, in the order it showed up */
+        if (kept != i) {
+            g_array_index(hotplug->pending, SpiceUsbHotplugPending, kept) = *pending;
+        }
+        kept++;
+    }
+    if (hotplug->settled->len > 0) {
+        g_array_set_size(hotplug->pending, kept);
+        g_hash_table_remove_all(hotplug->pending_index);
+        for (i = 0; i < kept; i++) {
+            g_hash_table_insert(hotplug->pending_index,
+                                event_key(&g_array_index(hotplug->pending,
+                                                         SpiceUsbHotplugPending, i).event),
+                                GUINT_TO_POINTER(i + 1));
+        }
+        hotplug->stats.reported += hotplug->settled->len;
+        if (hotplug->func != NULL) {
+            hotplug->func((const SpiceUsbHotplugEvent *)hotplug->settled->data,
+                          hotplug->settled->len, hotplug->user_data);
+        }
+        g_array_set_size(hotplug->settled, 0);
+    }
+    /* after the events that did come, which the rescan then agrees with */
+    if (hotplug->overrun &&
+        (all || now >= hotplug_settle_time(hotplug, hotplug->overrun_first,
+                                           hotplug->overrun_last))) {
+        hotplug->overrun = FALSE;
+        if (hotplug->overrun_func != NULL) {
+            hotplug->overrun_func(hotplug->overrun_data);
+        }
+    }
+}
+
+static inline gboolean hotplug_has_pending(SpiceUsbHotplugSource *hotplug)
+{
+    return hotplug->pending->len > 0 || hotplug->overrun;
+}
+
+/* when the first pending device settles */
+static gint64 hotplug_deadline(SpiceUsbHotplugSource *hotplug)
+{
+    gint64 deadline = G_MAXINT64;
+    guint i;
+
+    for (i = 0; i < hotplug->pending->len; i++) {
+        SpiceUsbHotplugPending *pending = &g_array_index(hotplug->pending,
+                                                         SpiceUsbHotplugPending, i);
+
+        deadline = MIN(deadline, hotplug_settle_time(hotplug, pending->first_event,
+                                                     pending->last_event));
+    }
+    if (hotplug->overrun) {
+        deadline = MIN(deadline, hotplug_settle_time(hotplug, hotplug->overrun_first,
+                                                     hotplug->overrun_last));
+    }
+    return deadline;
+}
+
+/* wake up for the pending events, if they may be reported */
+static void hotplug_update_ready_time(SpiceUsbHotplugSource *hotplug)
+{
+    g_source_set_ready_time(&hotplug->source,
+                            hotplug_has_pending(hotplug) && !hotplug->blocked ?
+                            hotplug_deadline(hotplug) : -1);
+}
+
+static gboolean hotplug_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    if (g_source_query_unix_fd(source, hotplug->fd_tag) & G_IO_IN) {
+        hotplug_receive(hotplug);
+    }
+    if (hotplug_has_pending(hotplug) && !hotplug->blocked) {
+        gint64 now = g_get_monotonic_time();
+
+        if (now >= hotplug_deadline(hotplug)) {
+            hotplug_report(hotplug, now, FALSE);
+        }
+    }
+    hotplug_update_ready_time(hotplug);
+    return G_SOURCE_CONTINUE;
+}
+
+static void hotplug_finalize(GSource *source)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    close(hotplug->fd);
+    g_array_unref(hotplug->pending);
+    g_array_unref(hotplug->settled);
+    g_hash_table_unref(hotplug->pending_index);
+}
+
+static GSourceFuncs hotplug_source_funcs = {
+    .dispatch = hotplug_dispatch,
+    .finalize = hotplug_finalize,
+};
+
+GSource *spice_usb_hotplug_source_new(gint fd)
+{
+    SpiceUsbHotplugSource *hotplug;
+    GSource *source;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+
+    source = g_source_new(&hotplug_source_funcs, sizeof(SpiceUsbHotplugSource));
+    g_source_set_name(source, "usb-hotplug");
+    hotplug = (SpiceUsbHotplugSource *)source;
+    hotplug->fd = fd;
+    hotplug->fd_tag = g_source_add_unix_fd(source, fd, G_IO_IN);
+    hotplug->pending = g_array_sized_new(FALSE, FALSE, sizeof(SpiceUsbHotplugPending), 64);
+    hotplug->settled = g_array_sized_new(FALSE, FALSE, sizeof(SpiceUsbHotplugEvent), 64);
+    hotplug->pending_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    hotplug->quiet_ms = SPICE_USB_HOTPLUG_DEFAULT_QUIET_MS;
+    hotplug->max_delay_ms = SPICE_USB_HOTPLUG_DEFAULT_MAX_DELAY_MS;
+    return source;
+}
+
+void spice_usb_hotplug_source_set_func(GSource *source, SpiceUsbHotplugFunc func,
+                                       gpointer user_data)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+
+    hotplug->func = func;
+    hotplug->user_data = user_data;
+}
+
+void spice_usb_hotplug_source_set_overrun_func(GSource *source, SpiceUsbHotplugOverrunFunc func,
+                                               gpointer user_data)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+
+    hotplug->overrun_func = func;
+    hotplug->overrun_data = user_data;
+}
+
+/* 0 reports the events of each main loop iteration together */
+void spice_usb_hotplug_source_set_debounce(GSource *source, guint quiet_ms,
+                                           guint max_delay_ms)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+
+    hotplug->quiet_ms = quiet_ms;
+    hotplug->max_delay_ms = MAX(max_delay_ms, quiet_ms);
+    hotplug_update_ready_time(hotplug);
+}
+
+/*
+ * while blocked, the events are still read and merged, but kept; the
+ * calls nest, each %TRUE must be undone by a %FALSE
+ */
+void spice_usb_hotplug_source_set_blocked(GSource *source, gboolean blocked)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+
+    if (blocked) {
+        hotplug->blocked++;
+    } else {
+        g_return_if_fail(hotplug->blocked > 0);
+        hotplug->blocked--;
+    }
+    hotplug_update_ready_time(hotplug);
+}
+
+/* read what is queued on the socket and report all pending events now */
+void spice_usb_hotplug_source_flush(GSource *source)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+
+    hotplug_receive(hotplug);
+    hotplug_report(hotplug, 0, TRUE);
+    hotplug_update_ready_time(hotplug);
+}
+
+void spice_usb_hotplug_source_get_stats(GSource *source, SpiceUsbHotplugStats *stats)
+{
+    SpiceUsbHotplugSource *hotplug = (SpiceUsbHotplugSource *)source;
+
+    g_return_if_fail(source != NULL);
+    g_return_if_fail(stats != NULL);
+
+    *stats = hotplug->stats;
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_HOTPLUG_H__
+#define __SPICE_USB_HOTPLUG_H__
+
+#include <glib.h>
+#include "usb-device-source.h"
+
+G_BEGIN_DECLS
+
+/* events of a device are reported once it was quiet that long */
+#define SPICE_USB_HOTPLUG_DEFAULT_QUIET_MS     50
+/* and at the latest that long after its first one, whatever keeps coming */
+#define SPICE_USB_HOTPLUG_DEFAULT_MAX_DELAY_MS 500
+
+/* largest uevent read, the kernel sends at most 2 KiB of variables */
+#define SPICE_USB_UEVENT_BUF_SIZE 8192
+
+typedef enum {
+    SPICE_USB_HOTPLUG_ADD,
+    SPICE_USB_HOTPLUG_REMOVE,
+} SpiceUsbHotplugAction;
+
+typedef struct _SpiceUsbHotplugEvent {
+    SpiceUsbHotplugAction action;
+    gchar name[32];             /* sysfs entry of the device, as "1-1.2" */
+    SpiceUsbDeviceDesc desc;    /* what the uevent tells, only the address on remove */
+} SpiceUsbHotplugEvent;
+
+typedef struct _SpiceUsbHotplugStats {
+    guint64 uevents;            /* messages received */
+    guint64 events;             /* adds and removes of USB devices among them */
+    guint64 merged;             /* events superseded by a later one of the same device */
+    guint64 reported;           /* events passed on */
+    guint64 overruns;           /* times the socket dropped messages */
+} SpiceUsbHotplugStats;
+
+/*
+ * @events: the last event of each device since the previous call, in
+ * the order the devices first showed up, only valid during the call
+ */
+typedef void (*SpiceUsbHotplugFunc)(const SpiceUsbHotplugEvent *events, guint n_events,
+                                    gpointer user_data);
+/*
+ * uevents were dropped by the socket: called once the events that came
+ * after settled too, the devices present are to be read again
+ */
+typedef void (*SpiceUsbHotplugOverrunFunc)(gpointer user_data);
+
+gint spice_usb_hotplug_open_netlink(GError **err);
+gint spice_usb_hotplug_open_replay(const gchar *path, GError **err);
+
+gboolean spice_usb_uevent_parse(const gchar *buf, gsize len, SpiceUsbHotplugEvent *event);
+gsize spice_usb_uevent_format(const SpiceUsbHotplugEvent *event, guint seqnum,
+                              gchar *buf, gsize size);
+
+/*
+ * Main loop source reading uevents from @fd, a netlink or a replay
+ * socket it takes over. Adds and removes of USB devices are merged per
+ * device address until the device settles, each device timed on its own
+ * so that a chatty one holds back no other, then passed to the function
+ * in one call for all the devices that settled together. Lost uevents are
+ * told about once, when the storm that overran the socket is over.
+ */
+GSource *spice_usb_hotplug_source_new(gint fd);
+void spice_usb_hotplug_source_set_func(GSource *source, SpiceUsbHotplugFunc func,
+                                       gpointer user_data);
+void spice_usb_hotplug_source_set_overrun_func(GSource *source, SpiceUsbHotplugOverrunFunc func,
+                                               gpointer user_data);
+void spice_usb_hotplug_source_set_debounce(GSource *source, guint quiet_ms,
+                                           guint max_delay_ms);
+void spice_usb_hotplug_source_set_blocked(GSource *source, gboolean blocked);
+void spice_usb_hotplug_source_flush(GSource *source);
+void spice_usb_hotplug_source_get_stats(GSource *source, SpiceUsbHotplugStats *stats);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_HOTPLUG_H__ */
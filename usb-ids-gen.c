@@ -0,0 +1,201 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   usb-ids-gen: build the binary vendor/product name index read by
+   usb-ids.c from a usb.ids text file.
+
+   usage: usb-ids-gen /usr/share/hwdata/usb.ids usb.ids.bin
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "usb-ids.h"
+
+typedef struct {
+    guint16 id;
+    guint32 name;       /* offset in the string pool */
+    GArray *products;   /* of GenEntry, vendors only */
+} GenEntry;
+
+typedef struct {
+    GString *pool;
+    GHashTable *offsets; /* name -> offset + 1 */
+} GenStrings;
+
+static guint32 gen_string(GenStrings *strings, const gchar *name)
+{
+    gpointer offset = g_hash_table_lookup(strings->offsets, name);
+
+    if (offset == NULL) {
+        guint32 o = strings->pool->len;
+
+        g_string_append_len(strings->pool, name, strlen(name) + 1);
+        g_hash_table_insert(strings->offsets, g_strdup(name), GUINT_TO_POINTER(o + 1));
+        return o;
+    }
+    return GPOINTER_TO_UINT(offset) - 1;
+}
+
+static gint gen_entry_cmp(gconstpointer a, gconstpointer b)
+{
+    const GenEntry *ea = a, *eb = b;
+    return (gint)ea->id - (gint)eb->id;
+}
+
+/* "xxxx  name" -> id, name */
+static gboolean parse_id_line(gchar *line, guint16 *id, const gchar **name)
+{
+    gint i;
+
+    for (i = 0; i < 4; i++) {
+        if (!g_ascii_isxdigit(line[i])) {
+            return FALSE;
+        }
+    }
+    if (line[4] != ' ') {
+        return FALSE;
+    }
+    line[4] = '\0';
+    *id = (guint16)g_ascii_strtoull(line, NULL, 16);
+    *name = g_strstrip(line + 5);
+    return **name != '\0';
+}
+
+static void write_le32(guint32 *dst, guint32 v)
+{
+    *dst = GUINT32_TO_LE(v);
+}
+
+int main(int argc, char **argv)
+{
+    GenStrings strings;
+    GArray *vendors;
+    GenEntry *vendor = NULL;
+    GString *out;
+    SpiceUsbIdsHeader header;
+    gchar *contents, **lines;
+    GError *err = NULL;
+    guint i, j, n_products = 0;
+    guint32 first_product = 0;
+
+    if (argc != 3) {
+        g_printerr("usage: %s usb.ids output.bin\n", argv[0]);
+        return 1;
+    }
+    if (!g_file_get_contents(argv[1], &contents, NULL, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+
+    strings.pool = g_string_new(NULL);
+    strings.offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    /* offset 0 is the empty string, the pool is never empty */
+    gen_string(&strings, "");
+    vendors = g_array_new(FALSE, FALSE, sizeof(GenEntry));
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = lines[i];
+        GenEntry entry = { 0, };
+        const gchar *name;
+
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (line[0] == '\t') {
+            /* products of the current vendor, interfaces are skipped */
+            if (vendor != NULL && line[1] != '\t' &&
+                parse_id_line(line + 1, &entry.id, &name)) {
+                entry.name = gen_string(&strings, name);
+                g_array_append_val(vendor->products, entry);
+            }
+            continue;
+        }
+        if (!parse_id_line(line, &entry.id, &name)) {
+            /* "C xx", "AT xx", ... sections follow the vendor list */
+            vendor = NULL;
+            continue;
+        }
+        entry.name = gen_string(&strings, name);
+        entry.products = g_array_new(FALSE, FALSE, sizeof(GenEntry));
+        g_array_append_val(vendors, entry);
+        vendor = &g_array_index(vendors, GenEntry, vendors->len - 1);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    g_array_sort(vendors, gen_entry_cmp);
+    for (i = 0; i < vendors->len; i++) {
+        GenEntry *v = &g_array_index(vendors, GenEntry, i);
+        g_array_sort(v->products, gen_entry_cmp);
+        n_products += v->products->len;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPICE_USB_IDS_MAGIC, sizeof(header.magic));
+    write_le32(&header.n_vendors, vendors->len);
+    write_le32(&header.n_products, n_products);
+    write_le32(&header.vendors_offset, sizeof(header));
+    write_le32(&header.products_offset,
+               sizeof(header) + vendors->len * sizeof(SpiceUsbIdsVendor));
+    write_le32(&header.strings_offset,
+               sizeof(header) + vendors->len * sizeof(SpiceUsbIdsVendor) +
+               n_products * sizeof(SpiceUsbIdsProduct));
+    write_le32(&header.strings_size, strings.pool->len);
+
+    out = g_string_sized_new(sizeof(header) + strings.pool->len);
+    g_string_append_len(out, (const gchar *)&header, sizeof(header));
+    for (i = 0; i < vendors->len; i++) {
+        GenEntry *v = &g_array_index(vendors, GenEntry, i);
+        SpiceUsbIdsVendor rec = { 0, };
+
+        rec.vid = GUINT16_TO_LE(v->id);
+        write_le32(&rec.name, v->name);
+        write_le32(&rec.first_product, first_product);
+        write_le32(&rec.n_products, v->products->len);
+        g_string_append_len(out, (const gchar *)&rec, sizeof(rec));
+        first_product += v->products->len;
+    }
+    for (i = 0; i < vendors->len; i++) {
+        GenEntry *v = &g_array_index(vendors, GenEntry, i);
+
+        for (j = 0; j < v->products->len; j++) {
+            GenEntry *p = &g_array_index(v->products, GenEntry, j);
+            SpiceUsbIdsProduct rec = { 0, };
+
+            rec.pid = GUINT16_TO_LE(p->id);
+            write_le32(&rec.name, p->name);
+            g_string_append_len(out, (const gchar *)&rec, sizeof(rec));
+        }
+        g_array_unref(v->products);
+    }
+    g_string_append_len(out, strings.pool->str, strings.pool->len);
+
+    if (!g_file_set_contents(argv[2], out->str, out->len, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    g_print("%s: %u vendors, %u products, %" G_GSIZE_FORMAT " bytes\n",
+            argv[2], vendors->len, n_products, out->len);
+
+    g_string_free(out, TRUE);
+    g_string_free(strings.pool, TRUE);
+    g_hash_table_unref(strings.offsets);
+    g_array_unref(vendors);
+    return 0;
+}
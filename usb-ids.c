@@ -0,0 +1,179 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "usb-ids.h"
+
+struct _SpiceUsbIds {
+    GMappedFile *file;
+    const SpiceUsbIdsVendor *vendors;
+    const SpiceUsbIdsProduct *products;
+    const gchar *strings;
+    guint32 n_vendors;
+    guint32 n_products;
+    guint32 strings_size;
+};
+
+static gboolean in_file(gsize file_size, guint32 offset, guint64 size)
+{
+    return offset <= file_size && size <= file_size - offset;
+}
+
+/**
+ * spice_usb_ids_open:
+ * @path: the database generated by usb-ids-gen
+ * @err: a return location for a #GError, or %NULL.
+ *
+ * Map the database read-only. Only the header is read here, the tables and
+ * names are paged in by the lookups touching them.
+ *
+ * Returns: the database, or %NULL if it is missing or malformed
+ */
+SpiceUsbIds *spice_usb_ids_open(const gchar *path, GError **err)
+{
+    GMappedFile *file;
+    const SpiceUsbIdsHeader *header;
+    const gchar *contents;
+    SpiceUsbIds *ids;
+    gsize size;
+
+    file = g_mapped_file_new(path, FALSE, err);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    contents = g_mapped_file_get_contents(file);
+    size = g_mapped_file_get_length(file);
+    header = (const SpiceUsbIdsHeader *)contents;
+
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, SPICE_USB_IDS_MAGIC, sizeof(header->magic)) != 0) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is not a USB ids database", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+
+    ids = g_new0(SpiceUsbIds, 1);
+    ids->file = file;
+    ids->n_vendors = GUINT32_FROM_LE(header->n_vendors);
+    ids->n_products = GUINT32_FROM_LE(header->n_products);
+    ids->strings_size = GUINT32_FROM_LE(header->strings_size);
+
+    if (!in_file(size, GUINT32_FROM_LE(header->vendors_offset),
+                 (guint64)ids->n_vendors * sizeof(SpiceUsbIdsVendor)) ||
+        !in_file(size, GUINT32_FROM_LE(header->products_offset),
+                 (guint64)ids->n_products * sizeof(SpiceUsbIdsProduct)) ||
+        !in_file(size, GUINT32_FROM_LE(header->strings_offset), ids->strings_size) ||
+        GUINT32_FROM_LE(header->vendors_offset) % 4 != 0 ||
+        GUINT32_FROM_LE(header->products_offset) % 4 != 0 ||
+        ids->strings_size == 0 ||
+        contents[GUINT32_FROM_LE(header->strings_offset) + ids->strings_size - 1] != '\0') {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "USB ids database %s is truncated or corrupted", path);
+        spice_usb_ids_close(ids);
+        return NULL;
+    }
+
+    ids->vendors = (const SpiceUsbIdsVendor *)(contents + GUINT32_FROM_LE(header->vendors_offset));
+    ids->products = (const SpiceUsbIdsProduct *)(contents + GUINT32_FROM_LE(header->products_offset));
+    ids->strings = contents + GUINT32_FROM_LE(header->strings_offset);
+    return ids;
+}
+
+void spice_usb_ids_close(SpiceUsbIds *ids)
+{
+    if (ids == NULL) {
+        return;
+    }
+    g_mapped_file_unref(ids->file);
+    g_free(ids);
+}
+
+static const gchar *spice_usb_ids_string(const SpiceUsbIds *ids, guint32 offset)
+{
+    offset = GUINT32_FROM_LE(offset);
+    return offset < ids->strings_size ? ids->strings + offset : NULL;
+}
+
+/**
+ * spice_usb_ids_lookup:
+ * @ids: the database
+ * @vid: vendor id
+ * @pid: product id
+ * @vendor: (out) (transfer none): the vendor name, or %NULL if unknown
+ * @product: (out) (transfer none): the product name, or %NULL if unknown
+ *
+ * Binary search for @vid then for @pid among the products of the vendor.
+ * The names point into the mapping and are valid until
+ * spice_usb_ids_close().
+ *
+ * Returns: %TRUE if the vendor is known
+ */
+gboolean spice_usb_ids_lookup(const SpiceUsbIds *ids, guint16 vid, guint16 pid,
+                              const gchar **vendor, const gchar **product)
+{
+    const SpiceUsbIdsVendor *v = NULL;
+    guint32 lo, hi, first, count;
+
+    *vendor = NULL;
+    *product = NULL;
+
+    lo = 0;
+    hi = ids->n_vendors;
+    while (lo < hi) {
+        guint32 mid = lo + (hi - lo) / 2;
+        guint16 mid_vid = GUINT16_FROM_LE(ids->vendors[mid].vid);
+
+        if (mid_vid == vid) {
+            v = &ids->vendors[mid];
+            break;
+        } else if (mid_vid < vid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (v == NULL) {
+        return FALSE;
+    }
+    *vendor = spice_usb_ids_string(ids, v->name);
+
+    first = GUINT32_FROM_LE(v->first_product);
+    count = GUINT32_FROM_LE(v->n_products);
+    if (first > ids->n_products || count > ids->n_products - first) {
+        return *vendor != NULL;
+    }
+
+    lo = first;
+    hi = first + count;
+    while (lo < hi) {
+        guint32 mid = lo + (hi - lo) / 2;
+        guint16 mid_pid = GUINT16_FROM_LE(ids->products[mid].pid);
+
+        if (mid_pid == pid) {
+            *product = spice_usb_ids_string(ids, ids->products[mid].name);
+            break;
+        } else if (mid_pid < pid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return *vendor != NULL;
+}
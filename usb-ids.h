@@ -0,0 +1,68 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_IDS_H__
+#define __SPICE_USB_IDS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Prebuilt vendor/product name index, generated from usb.ids by
+ * usb-ids-gen. All integers are little endian, offsets are from the
+ * start of the file:
+ *
+ *   SpiceUsbIdsHeader
+ *   SpiceUsbIdsVendor[n_vendors]    sorted by vid
+ *   SpiceUsbIdsProduct[n_products]  grouped by vendor, sorted by pid
+ *   string pool                     NUL terminated names
+ */
+#define SPICE_USB_IDS_MAGIC "SPUSBID1"
+
+typedef struct _SpiceUsbIdsHeader {
+    gchar   magic[8];
+    guint32 n_vendors;
+    guint32 n_products;
+    guint32 vendors_offset;
+    guint32 products_offset;
+    guint32 strings_offset;
+    guint32 strings_size;
+} SpiceUsbIdsHeader;
+
+typedef struct _SpiceUsbIdsVendor {
+    guint16 vid;
+    guint16 reserved;
+    guint32 name;           /* offset in the string pool */
+    guint32 first_product;  /* index in the product table */
+    guint32 n_products;
+} SpiceUsbIdsVendor;
+
+typedef struct _SpiceUsbIdsProduct {
+    guint16 pid;
+    guint16 reserved;
+    guint32 name;
+} SpiceUsbIdsProduct;
+
+typedef struct _SpiceUsbIds SpiceUsbIds;
+
+SpiceUsbIds *spice_usb_ids_open(const gchar *path, GError **err);
+void spice_usb_ids_close(SpiceUsbIds *ids);
+gboolean spice_usb_ids_lookup(const SpiceUsbIds *ids, guint16 vid, guint16 pid,
+                              const gchar **vendor, const gchar **product);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_IDS_H__ */
@@ -0,0 +1,417 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include "spice-client.h"
+#include "usb-device-manager-priv.h"
+#include "usb-script.h"
+
+typedef struct {
+    GMainLoop *loop;
+    SpiceUsbDeviceManager *manager;
+    GIOChannel *input;
+    guint line;
+    gchar *command;             /* the line of the command running */
+    gint64 start;               /* of the command running */
+    GError *device_error;       /* the last one the manager reported */
+    guint n_errors;
+} SpiceUsbScript;
+
+typedef void (*SpiceUsbScriptFunc)(SpiceUsbScript *script, gchar **args);
+
+static void script_read_next(SpiceUsbScript *script);
+
+/* the manager logs with g_print(), stdout is for the results */
+static void script_print(const gchar *string)
+{
+    fputs(string, stderr);
+}
+
+/* the command is over, @err taken if set; the next one is read */
+static void script_done(SpiceUsbScript *script, GError *err)
+{
+    if (err == NULL) {
+        printf("ok %u %s %" G_GINT64_FORMAT " us\n", script->line, script->command,
+               g_get_monotonic_time() - script->start);
+    } else {
+        printf("error %u %s: %s\n", script->line, script->command, err->message);
+        g_error_free(err);
+        script->n_errors++;
+    }
+    fflush(stdout);
+    g_clear_pointer(&script->command, g_free);
+    script_read_next(script);
+}
+
+static SpiceUsbDevice *script_find_device(SpiceUsbScript *script, const gchar *address,
+                                          GError **err)
+{
+    SpiceUsbDevice *device;
+    guint busnum, devaddr;
+    gchar end;
+
+    if (sscanf(address, "%u-%u%c", &busnum, &devaddr, &end) != 2 ||
+        busnum > G_MAXUINT8 || devaddr > G_MAXUINT8) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "\"%s\" is not a BUS-ADDR device address", address);
+        return NULL;
+    }
+    device = spice_usb_device_manager_find_device_by_address(script->manager, busnum, devaddr);
+    if (device == NULL) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no device at %s", address);
+    }
+    return device;
+}
+
+static void script_list(SpiceUsbScript *script, gchar **args)
+{
+    GPtrArray *devices = spice_usb_device_manager_get_devices(script->manager);
+    guint i;
+
+    for (i = 0; i < devices->len; i++) {
+        SpiceUsbDevice *device = g_ptr_array_index(devices, i);
+        const SpiceUsbDeviceLunInfo *lun_info;
+        SpiceUsbDeviceLunIter iter;
+        guint lun;
+
+        printf("%u-%u %04x:%04x %s%s\n", spice_usb_device_get_busnum(device),
+               spice_usb_device_get_devaddr(device), spice_usb_device_get_vid(device),
+               spice_usb_device_get_pid(device),
+               spice_usb_device_peek_description(device, NULL),
+               spice_usb_device_manager_is_device_connected(script->manager, device) ?
+                   " connected" : "");
+        if (!spice_usb_device_manager_is_device_cd(script->manager, device)) {
+            continue;
+        }
+        spice_usb_device_lun_iter_init(&iter, device);
+        while (spice_usb_device_lun_iter_next(&iter, &lun, &lun_info)) {
+            printf("  lun %u %s%s%s\n", lun,
+                   lun_info->file_path != NULL ? lun_info->file_path : "-",
+                   lun_info->loaded ? " loaded" : "", lun_info->locked ? " locked" : "");
+        }
+    }
+    g_ptr_array_unref(devices);
+    script_done(script, NULL);
+}
+
+static void script_connected(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GError *err = NULL;
+
+    spice_usb_device_manager_connect_device_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                   res, &err);
+    script_done(user_data, err);
+}
+
+static void script_disconnected(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GError *err = NULL;
+
+    spice_usb_device_manager_disconnect_device_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                      res, &err);
+    script_done(user_data, err);
+}
+
+static void script_loaded(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GError *err = NULL;
+
+    spice_usb_device_manager_device_lun_load_finish(SPICE_USB_DEVICE_MANAGER(source_object),
+                                                    res, &err);
+    spice_usb_device_manager_flush_changes(SPICE_USB_DEVICE_MANAGER(source_object));
+    script_done(user_data, err);
+}
+
+static void script_connect(SpiceUsbScript *script, gchar **args)
+{
+    GError *err = NULL;
+    SpiceUsbDevice *device = script_find_device(script, args[1], &err);
+
+    if (device == NULL) {
+        script_done(script, err);
+        return;
+    }
+    spice_usb_device_manager_connect_device_async(script->manager, device, NULL,
+                                                  script_connected, script);
+}
+
+static void script_disconnect(SpiceUsbScript *script, gchar **args)
+{
+    GError *err = NULL;
+    SpiceUsbDevice *device = script_find_device(script, args[1], &err);
+
+    if (device == NULL) {
+        script_done(script, err);
+        return;
+    }
+    spice_usb_device_manager_disconnect_device_async(script->manager, device, NULL,
+                                                     script_disconnected, script);
+}
+
+static void script_add_cd(SpiceUsbScript *script, gchar **args)
+{
+    SpiceUsbDeviceLunInfo lun_info = {
+        .file_path = args[1],
+        .vendor = "SPICE", .product = "Script CD", .revision = "0001",
+        .started = TRUE, .loaded = TRUE, .locked = FALSE
+    };
+    GError *err = NULL;
+
+    /* a LUN whose image cannot be opened is still added, unloaded */
+    if (!g_file_test(args[1], G_FILE_TEST_IS_REGULAR)) {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: no such image", args[1]);
+    } else if (!spice_usb_device_manager_add_cd_lun(script->manager, &lun_info)) {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_FAILED, "no room for a new CD LUN");
+    }
+    script_done(script, err);
+}
+
+/* load or eject, lock or unlock the LUN of args[2] of the device of args[1] */
+static void script_lun(SpiceUsbScript *script, gchar **args, gboolean load, gboolean on)
+{
+    SpiceUsbDevice *device;
+    GError *err = NULL;
+    guint64 lun;
+    gboolean ok;
+
+    device = script_find_device(script, args[1], &err);
+    if (device == NULL ||
+        !g_ascii_string_to_unsigned(args[2], 10, 0, SPICE_USB_DEVICE_MAX_LUNS - 1, &lun, &err)) {
+        script_done(script, err);
+        return;
+    }
+    g_clear_error(&script->device_error);
+    if (load && on) {
+        /* like the list view, the image is opened on a thread */
+        spice_usb_device_manager_device_lun_load_async(script->manager, device, lun, NULL,
+                                                       script_loaded, script);
+        return;
+    } else if (load) {
+        ok = spice_usb_device_manager_device_lun_load(script->manager, device, lun, on);
+    } else {
+        ok = spice_usb_device_manager_device_lun_lock(script->manager, device, lun, on);
+    }
+    if (!ok && script->device_error != NULL) {
+        err = g_steal_pointer(&script->device_error);
+    } else if (!ok) {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_FAILED, "LUN %s of %s is missing or %s already",
+                    args[2], args[1],
+                    load ? (on ? "loaded" : "ejected") : (on ? "locked" : "unlocked"));
+    }
+    /* the command is done once the change was announced */
+    spice_usb_device_manager_flush_changes(script->manager);
+    script_done(script, err);
+}
+
+static void script_load(SpiceUsbScript *script, gchar **args)
+{
+    script_lun(script, args, TRUE, TRUE);
+}
+
+static void script_eject(SpiceUsbScript *script, gchar **args)
+{
+    script_lun(script, args, TRUE, FALSE);
+}
+
+static void script_lock(SpiceUsbScript *script, gchar **args)
+{
+    script_lun(script, args, FALSE, TRUE);
+}
+
+static void script_unlock(SpiceUsbScript *script, gchar **args)
+{
+    script_lun(script, args, FALSE, FALSE);
+}
+
+static gboolean script_waited(gpointer user_data)
+{
+    script_done(user_data, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static void script_wait(SpiceUsbScript *script, gchar **args)
+{
+    GError *err = NULL;
+    guint64 ms;
+
+    if (!g_ascii_string_to_unsigned(args[1], 10, 0, G_MAXUINT, &ms, &err)) {
+        script_done(script, err);
+        return;
+    }
+    g_timeout_add(ms, script_waited, script);
+}
+
+static const struct {
+    const gchar *name;
+    const gchar *usage;
+    gint n_args;
+    SpiceUsbScriptFunc func;
+} script_commands[] = {
+    { "list", "list", 0, script_list },
+    { "connect", "connect BUS-ADDR", 1, script_connect },
+    { "disconnect", "disconnect BUS-ADDR", 1, script_disconnect },
+    { "add-cd", "add-cd PATH", 1, script_add_cd },
+    { "load", "load BUS-ADDR LUN", 2, script_load },
+    { "eject", "eject BUS-ADDR LUN", 2, script_eject },
+    { "lock", "lock BUS-ADDR LUN", 2, script_lock },
+    { "unlock", "unlock BUS-ADDR LUN", 2, script_unlock },
+    { "wait", "wait MS", 1, script_wait },
+};
+
+static void script_run_command(SpiceUsbScript *script)
+{
+    GError *err = NULL;
+    gchar **args;
+    gint n_args;
+    guint i;
+
+    script->start = g_get_monotonic_time();
+    if (!g_shell_parse_argv(script->command, &n_args, &args, &err)) {
+        script_done(script, err);
+        return;
+    }
+    for (i = 0; i < G_N_ELEMENTS(script_commands); i++) {
+        if (strcmp(args[0], script_commands[i].name) != 0) {
+            continue;
+        }
+        if (n_args != script_commands[i].n_args + 1) {
+            g_set_error(&err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "usage: %s",
+                        script_commands[i].usage);
+            script_done(script, err);
+        } else {
+            script_commands[i].func(script, args);
+        }
+        g_strfreev(args);
+        return;
+    }
+    g_set_error(&err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "unknown command \"%s\"",
+                args[0]);
+    g_strfreev(args);
+    script_done(script, err);
+}
+
+static gboolean script_readable(GIOChannel *input, GIOCondition condition, gpointer user_data)
+{
+    SpiceUsbScript *script = user_data;
+    GError *err = NULL;
+    GIOStatus status;
+    gchar *line;
+
+    status = g_io_channel_read_line(input, &line, NULL, NULL, &err);
+    if (status == G_IO_STATUS_AGAIN) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (status != G_IO_STATUS_NORMAL) {
+        if (err != NULL) {
+            printf("error %u: %s\n", script->line, err->message);
+            g_error_free(err);
+            script->n_errors++;
+        }
+        g_main_loop_quit(script->loop);
+        return G_SOURCE_REMOVE;
+    }
+    script->line++;
+    g_strstrip(line);
+    if (*line == '\0' || *line == '#') {
+        g_free(line);
+        return G_SOURCE_CONTINUE;
+    }
+    /* the next line is read once this command is done */
+    script->command = line;
+    script_run_command(script);
+    return G_SOURCE_REMOVE;
+}
+
+static void script_read_next(SpiceUsbScript *script)
+{
+    g_io_add_watch(script->input, G_IO_IN | G_IO_HUP | G_IO_ERR, script_readable, script);
+}
+
+static void script_device_error(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
+                                GError *err, gpointer user_data)
+{
+    SpiceUsbScript *script = user_data;
+
+    g_clear_error(&script->device_error);
+    script->device_error = g_error_copy(err);
+}
+
+static void script_manager_ready(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SpiceUsbScript *script = user_data;
+    GError *err = NULL;
+
+    script->manager = spice_usb_device_manager_get_finish(res, &err);
+    if (script->manager == NULL) {
+        printf("error 0 start: %s\n", err->message);
+        g_error_free(err);
+        script->n_errors++;
+        g_main_loop_quit(script->loop);
+        return;
+    }
+    g_signal_connect(script->manager, "device-error", G_CALLBACK(script_device_error), script);
+    script->command = g_strdup("start");
+    script_done(script, NULL);
+}
+
+/**
+ * spice_usb_script_run:
+ * @path: (nullable): the file of the commands, stdin if %NULL or "-"
+ *
+ * Get the manager, then run the commands of @path in order until its
+ * end, see usb-script.h for them. GTK is not initialized.
+ *
+ * Returns: 0 if all the commands succeeded, 1 otherwise
+ */
+gint spice_usb_script_run(const gchar *path)
+{
+    SpiceUsbScript script = { NULL, };
+    SpiceSession *session;
+    GError *err = NULL;
+
+    if (path == NULL || strcmp(path, "-") == 0) {
+        script.input = g_io_channel_unix_new(STDIN_FILENO);
+    } else {
+        script.input = g_io_channel_new_file(path, "r", &err);
+        if (script.input == NULL) {
+            printf("error 0 %s: %s\n", path, err->message);
+            g_error_free(err);
+            return 1;
+        }
+    }
+    /* paths are bytes */
+    g_io_channel_set_encoding(script.input, NULL, NULL);
+    g_set_print_handler(script_print);
+
+    script.loop = g_main_loop_new(NULL, FALSE);
+    script.start = g_get_monotonic_time();
+    session = g_object_new(SPICE_TYPE_SESSION, NULL);
+    spice_usb_device_manager_get_async(session, NULL, script_manager_ready, &script);
+    g_main_loop_run(script.loop);
+
+    if (script.manager != NULL) {
+        g_signal_handlers_disconnect_by_data(script.manager, &script);
+    }
+    g_clear_error(&script.device_error);
+    g_main_loop_unref(script.loop);
+    g_io_channel_unref(script.input);
+    g_object_unref(session);
+    return script.n_errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_USB_SCRIPT_H__
+#define __SPICE_USB_SCRIPT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Drive the manager from commands, one per line, on a plain main loop
+ * without any display:
+ *   list                       the devices and their CD LUNs
+ *   connect BUS-ADDR           redirect a device
+ *   disconnect BUS-ADDR        stop redirecting it
+ *   add-cd PATH                share an image as a new CD LUN
+ *   load BUS-ADDR LUN          load the media of a LUN
+ *   eject BUS-ADDR LUN         eject it
+ *   lock BUS-ADDR LUN          lock the LUN, as the guest does
+ *   unlock BUS-ADDR LUN
+ *   wait MS                    let the main loop run, for hotplug
+ * Each command runs once the one before it is done, and ends with
+ * "ok LINE COMMAND US us" or "error LINE COMMAND: MESSAGE" on stdout.
+ * What the manager logs goes to stderr.
+ */
+gint spice_usb_script_run(const gchar *path);
+
+G_END_DECLS
+
+#endif /* __SPICE_USB_SCRIPT_H__ */